@@ -0,0 +1,184 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <random.h>
+
+#include <tc_mat.h>
+
+#include <vector>
+
+// A vote of nVoters x nDecisions with equal reputation, two thirds binary
+// decisions and 5% NA votes
+static struct tc_vote *MakeVote(uint32_t nVoters, uint32_t nDecisions)
+{
+    FastRandomContext rng(true);
+
+    struct tc_vote *vote = tc_vote_ctr(nVoters, nDecisions);
+    vote->NA = 2016.0;
+    vote->alpha = 0.1;
+    vote->tol = 0.1;
+    for (uint32_t i = 0; i < nVoters; i++)
+        TC_MAT_AT(vote->rvecs[TC_VOTE_OLD_REP], i, 0) = 1.0 / nVoters;
+    for (uint32_t j = 0; j < nDecisions; j++)
+        TC_MAT_AT(vote->cvecs[TC_VOTE_IS_BINARY], 0, j) = (j % 3)? 1.0: 0.0;
+    for (uint32_t i = 0; i < nVoters; i++) {
+        for (uint32_t j = 0; j < nDecisions; j++) {
+            uint32_t r = rng.randrange(100);
+            if (r < 5)
+                TC_MAT_AT(vote->M, i, j) = vote->NA;
+            else if (j % 3)
+                TC_MAT_AT(vote->M, i, j) = (r < 70)? 1.0: 0.0;
+            else
+                TC_MAT_AT(vote->M, i, j) = r / 100.0;
+        }
+    }
+    return vote;
+}
+
+static void TcVoteProc(benchmark::State& state, uint32_t nVoters, uint32_t nDecisions,
+    uint32_t nThreads = 1)
+{
+    struct tc_vote *vote = MakeVote(nVoters, nDecisions);
+    vote->nthreads = nThreads;
+    while (state.KeepRunning()) {
+        int rc = tc_vote_proc(vote);
+        assert(rc == 0);
+    }
+    tc_vote_dtr(vote);
+}
+
+static void TcVoteProcSmall(benchmark::State& state)
+{
+    TcVoteProc(state, 200, 100);
+}
+
+static void TcVoteProcLarge(benchmark::State& state)
+{
+    TcVoteProc(state, 1000, 500);
+}
+
+// One workspace, sized once, for every outcome calculation
+static void TcVoteProcWs(benchmark::State& state)
+{
+    struct tc_vote *vote = MakeVote(200, 100);
+    struct tc_ws *ws = tc_ws_ctr(tc_vote_ws_bytes(200, 100, 1));
+    while (state.KeepRunning()) {
+        int rc = tc_vote_proc_ws(vote, ws);
+        assert(rc == 0);
+    }
+    tc_ws_dtr(ws);
+    tc_vote_dtr(vote);
+}
+
+// Thread scaling on a ballot above TC_VOTE_MT_MIN_CELLS
+static void TcVoteProcThreads1(benchmark::State& state)
+{
+    TcVoteProc(state, 600, 200, 1);
+}
+
+static void TcVoteProcThreads2(benchmark::State& state)
+{
+    TcVoteProc(state, 600, 200, 2);
+}
+
+static void TcVoteProcThreads4(benchmark::State& state)
+{
+    TcVoteProc(state, 600, 200, 4);
+}
+
+static void TcVoteProcThreads8(benchmark::State& state)
+{
+    TcVoteProc(state, 600, 200, 8);
+}
+
+// Square product of the size of the covariance matrix of a large ballot
+static void TcMatMult(benchmark::State& state)
+{
+    FastRandomContext rng(true);
+    const uint32_t n = 300;
+    struct tc_mat *A = tc_mat_ctr(n, n);
+    struct tc_mat *B = tc_mat_ctr(n, n);
+    struct tc_mat *C = tc_mat_ctr(n, n);
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            TC_MAT_AT(A, i, j) = rng.randrange(1000) / 1000.0;
+            TC_MAT_AT(B, i, j) = rng.randrange(1000) / 1000.0;
+        }
+    }
+    while (state.KeepRunning())
+        tc_mat_mult(C, A, B);
+    tc_mat_dtr(C);
+    tc_mat_dtr(B);
+    tc_mat_dtr(A);
+}
+
+// First principal component of a 200x100 ballot with NA votes filled in,
+// by power iteration and by the SVD of the covariance matrix
+static void TcPrinComp(benchmark::State& state, bool fSvd)
+{
+    struct tc_vote *vote = MakeVote(200, 100);
+    struct tc_mat *wgt = vote->rvecs[TC_VOTE_OLD_REP];
+    struct tc_mat *M = vote->M;
+    for (uint32_t i = 0; i < M->nr; i++)
+        for (uint32_t j = 0; j < M->nc; j++)
+            if (TC_MAT_AT(M, i, j) == vote->NA)
+                TC_MAT_AT(M, i, j) = 0.5;
+    struct tc_mat *loadings = tc_mat_ctr(0, 0);
+    struct tc_mat *scores = tc_mat_ctr(0, 0);
+    while (state.KeepRunning()) {
+        int rc = fSvd? tc_wgt_prin_comp_svd(wgt, M, loadings, scores):
+            tc_wgt_prin_comp(wgt, M, loadings, scores);
+        assert(rc == 0);
+    }
+    tc_mat_dtr(scores);
+    tc_mat_dtr(loadings);
+    tc_vote_dtr(vote);
+}
+
+static void TcPrinCompPower(benchmark::State& state)
+{
+    TcPrinComp(state, false);
+}
+
+static void TcPrinCompSvd(benchmark::State& state)
+{
+    TcPrinComp(state, true);
+}
+
+// Weighted medians of 50 scaled decisions over 10k voters with random
+// reputation and 5% NA votes, one scratch buffer for every column
+static void TcWgtMedian(benchmark::State& state)
+{
+    FastRandomContext rng(true);
+    const uint32_t nVoters = 10000, nDecisions = 50;
+    const double NA = 2016.0;
+    struct tc_mat *wgt = tc_mat_ctr(nVoters, 1);
+    struct tc_mat *M = tc_mat_ctr(nVoters, nDecisions);
+    for (uint32_t i = 0; i < nVoters; i++) {
+        TC_MAT_AT(wgt, i, 0) = 1 + rng.randrange(100);
+        for (uint32_t j = 0; j < nDecisions; j++)
+            TC_MAT_AT(M, i, j) = (rng.randrange(100) < 5)? NA: rng.randrange(1000) / 1000.0;
+    }
+    tc_wgt_normalize(wgt);
+    std::vector<struct tc_wgt_value> scratch(nVoters);
+    while (state.KeepRunning()) {
+        for (uint32_t j = 0; j < nDecisions; j++)
+            tc_wgt_median_scratch(wgt, M, j, NA, scratch.data());
+    }
+    tc_mat_dtr(M);
+    tc_mat_dtr(wgt);
+}
+
+BENCHMARK(TcMatMult, 20);
+BENCHMARK(TcWgtMedian, 20);
+BENCHMARK(TcPrinCompPower, 20);
+BENCHMARK(TcPrinCompSvd, 2);
+BENCHMARK(TcVoteProcSmall, 2);
+BENCHMARK(TcVoteProcWs, 2);
+BENCHMARK(TcVoteProcLarge, 1);
+BENCHMARK(TcVoteProcThreads1, 1);
+BENCHMARK(TcVoteProcThreads2, 1);
+BENCHMARK(TcVoteProcThreads4, 1);
+BENCHMARK(TcVoteProcThreads8, 1);
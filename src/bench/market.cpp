@@ -0,0 +1,372 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <clientversion.h>
+#include <miner.h>
+#include <primitives/market.h>
+#include <primitives/transaction.h>
+#include <random.h>
+#include <streams.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+static const size_t nMarketBlockTx = 500;
+
+// A block's worth of transactions, each with one market output (trades,
+// decisions and markets) and one payment output
+static std::vector<CTransactionRef> MarketHeavyBlock()
+{
+    FastRandomContext rng(true);
+
+    marketDecision decision;
+    decision.keyID = CKeyID(uint160(rng.randbytes(20)));
+    decision.branchid = rng.rand256();
+    decision.prompt = "Will the benchmark finish?";
+    decision.eventOverBy = 100;
+    decision.isScaled = 0;
+    decision.min = 0;
+    decision.max = COIN;
+    decision.answerOptionality = 0;
+
+    marketMarket market;
+    market.keyID = decision.keyID;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.title = "Benchmark";
+    market.description = "A market on the benchmark decision";
+    market.tags = "bench";
+    market.maturation = 100;
+    market.branchid = decision.branchid;
+    market.decisionIDs.push_back(decision.GetHash());
+    market.decisionFunctionIDs.push_back(DFID_X1);
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+
+    std::vector<CTransactionRef> vtx;
+    for (size_t i = 0; i < nMarketBlockTx; i++) {
+        CMutableTransaction mtx;
+        mtx.vout.resize(2);
+        if (i % 10 == 0) {
+            mtx.vout[0].scriptPubKey = decision.GetScript();
+        } else if (i % 10 == 1) {
+            mtx.vout[0].scriptPubKey = market.GetScript();
+        } else {
+            marketTrade trade;
+            trade.keyID = decision.keyID;
+            trade.marketid = market.GetHash();
+            trade.isBuy = true;
+            trade.nShares = COIN;
+            trade.price = COIN;
+            trade.decisionState = 1;
+            trade.nonce = i;
+            mtx.vout[0].scriptPubKey = trade.GetScript();
+        }
+        mtx.vout[0].nValue = COIN;
+        mtx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+        mtx.vout[1].nValue = COIN;
+        vtx.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+    return vtx;
+}
+
+// Output value accounting of a market heavy block, as done for every
+// transaction on mempool accept and in ConnectBlock. The market outputs
+// are decoded once per transaction, as the market index needs them anyway
+static void MarketScriptPeek(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vtx = MarketHeavyBlock();
+
+    while (state.KeepRunning()) {
+        CAmount nValue = 0;
+        for (const CTransactionRef& tx : vtx)
+            nValue += tx->GetValueOut() + tx->GetValueOutToMarket();
+        assert(nValue == (CAmount)(2 * nMarketBlockTx) * COIN);
+    }
+}
+
+// Market script classification by deserializing the whole object, as
+// IsMarketScript did before marketObjPeek
+static bool IsMarketScriptDeserialize(const CScript& script)
+{
+    if (script.size() < 2 || script.back() != OP_MARKET)
+        return false;
+    return marketObjCtr(script) != nullptr;
+}
+
+// The same accounting with the previous classification
+static void MarketScriptDeserialize(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vtx = MarketHeavyBlock();
+
+    while (state.KeepRunning()) {
+        CAmount nValue = 0;
+        for (const CTransactionRef& tx : vtx) {
+            for (const CTxOut& txout : tx->vout) {
+                if (!IsMarketScriptDeserialize(txout.scriptPubKey))
+                    nValue += txout.nValue;
+            }
+            for (const CTxOut& txout : tx->vout) {
+                if (IsMarketScriptDeserialize(txout.scriptPubKey))
+                    nValue += txout.nValue;
+            }
+        }
+        assert(nValue == (CAmount)(2 * nMarketBlockTx) * COIN);
+    }
+}
+
+BENCHMARK(MarketScriptPeek, 500);
+BENCHMARK(MarketScriptDeserialize, 500);
+
+static const uint32_t nQuoteStates = 64;
+
+// Shares of a busy market, with the favourite far ahead of the rest
+static std::vector<double> QuoteShares()
+{
+    std::vector<double> nShares(nQuoteStates);
+    for (uint32_t i = 0; i < nQuoteStates; i++)
+        nShares[i] = 10.0 * i;
+    nShares[nQuoteStates - 1] = 1e5;
+    return nShares;
+}
+
+static std::vector<int64_t> QuoteSharesFixed()
+{
+    std::vector<int64_t> nShares;
+    for (double n : QuoteShares())
+        nShares.push_back((int64_t)(n * 1e8));
+    return nShares;
+}
+
+// Buy and sell quotes at three sizes for every state, two fixed-point
+// account values per quote, as getmarketquotes priced them
+static void MarketQuotePairwise(benchmark::State& state)
+{
+    std::vector<int64_t> nShares = QuoteSharesFixed();
+    const int64_t sizes[] = {100000000, 1000000000, 10000000000};
+
+    while (state.KeepRunning()) {
+        int64_t sum = 0;
+        for (uint32_t s = 0; s < nQuoteStates; s++) {
+            for (int64_t size : sizes) {
+                for (int64_t d : {size, -size}) {
+                    int64_t curr = marketAccountValueFixed(0, 5000000000, nQuoteStates, nShares.data());
+                    nShares[s] += d;
+                    sum += std::abs(marketAccountValueFixed(0, 5000000000, nQuoteStates, nShares.data()) - curr);
+                    nShares[s] -= d;
+                }
+            }
+        }
+        assert(sum != 0);
+    }
+}
+
+// The same quotes priced in one batch
+static void MarketQuoteBatch(benchmark::State& state)
+{
+    std::vector<int64_t> nShares = QuoteSharesFixed();
+    const int64_t sizes[] = {100000000, 1000000000, 10000000000};
+
+    std::vector<uint32_t> states;
+    std::vector<int64_t> dShares;
+    for (uint32_t s = 0; s < nQuoteStates; s++) {
+        for (int64_t size : sizes) {
+            states.push_back(s);
+            dShares.push_back(size);
+            states.push_back(s);
+            dShares.push_back(-size);
+        }
+    }
+    std::vector<int64_t> costs(states.size());
+
+    while (state.KeepRunning()) {
+        marketQuoteTradesFixed(0, 5000000000, nQuoteStates, nShares.data(), states.size(),
+            states.data(), dShares.data(), costs.data());
+        int64_t sum = 0;
+        for (int64_t cost : costs)
+            sum += std::abs(cost);
+        assert(sum != 0);
+    }
+}
+
+BENCHMARK(MarketQuotePairwise, 50);
+BENCHMARK(MarketQuoteBatch, 5000);
+
+// Account value of a 64 state market on libm doubles
+static void MarketAccountValueLibm(benchmark::State& state)
+{
+    std::vector<double> nShares = QuoteShares();
+    nShares[nQuoteStates - 1] = 700.0;
+
+    while (state.KeepRunning()) {
+        double value = marketAccountValue(0.0, 50.0, nQuoteStates, nShares.data());
+        assert(value > 0.0);
+    }
+}
+
+// The same account value on deterministic fixed point
+static void MarketAccountValueFixed(benchmark::State& state)
+{
+    std::vector<double> nSharesDouble = QuoteShares();
+    nSharesDouble[nQuoteStates - 1] = 700.0;
+    std::vector<int64_t> nShares;
+    for (double n : nSharesDouble)
+        nShares.push_back((int64_t)(n * 1e8));
+
+    while (state.KeepRunning()) {
+        int64_t value = marketAccountValueFixed(0, 5000000000, nQuoteStates, nShares.data());
+        assert(value > 0);
+    }
+}
+
+BENCHMARK(MarketAccountValueLibm, 20000);
+BENCHMARK(MarketAccountValueFixed, 20000);
+
+static const uint32_t nOutcomeVoters = 1000;
+static const uint32_t nOutcomeDecisions = 500;
+
+// A calculated outcome of nOutcomeVoters x nOutcomeDecisions with two
+// thirds binary decisions and 5% NA votes
+static marketOutcome MakeOutcome()
+{
+    FastRandomContext rng(true);
+
+    marketOutcome outcome;
+    outcome.nHeight = 100;
+    outcome.branchid = rng.rand256();
+    outcome.nVoters = nOutcomeVoters;
+    outcome.nDecisions = nOutcomeDecisions;
+    outcome.NA = 2016;
+    outcome.alpha = 1;
+    outcome.tol = 0;
+    for (uint32_t i = 0; i < nOutcomeVoters; i++) {
+        outcome.voterIDs.push_back(CKeyID(uint160(rng.randbytes(20))));
+        outcome.oldRep.push_back(COIN / nOutcomeVoters);
+    }
+    for (uint32_t j = 0; j < nOutcomeDecisions; j++) {
+        outcome.decisionIDs.push_back(rng.rand256());
+        outcome.isScaled.push_back((j % 3)? 0: 1);
+    }
+    std::vector<uint64_t> voteMatrix;
+    for (uint32_t i = 0; i < nOutcomeVoters; i++) {
+        for (uint32_t j = 0; j < nOutcomeDecisions; j++) {
+            uint32_t r = rng.randrange(100);
+            if (r < 5)
+                voteMatrix.push_back(outcome.NA);
+            else if (j % 3)
+                voteMatrix.push_back((r < 70)? COIN: 0);
+            else
+                voteMatrix.push_back(r * (COIN / 100));
+        }
+    }
+    outcome.SetVoteMatrix(voteMatrix);
+    int rc = outcome.calc();
+    assert(rc == 0);
+    return outcome;
+}
+
+// Decode a 1000 x 500 outcome from its compact encoding. It takes about
+// 860 bytes per voter, against 4130 in the legacy layout below.
+static void MarketOutcomeDecodeCompact(benchmark::State& state)
+{
+    const marketOutcome outcome = MakeOutcome();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << outcome;
+    marketOutcome legacy = outcome;
+    legacy.nEncoding = MARKET_OUTCOME_LEGACY;
+    assert(ss.size() < GetSerializeSize(legacy, SER_DISK, CLIENT_VERSION) / 4);
+
+    while (state.KeepRunning()) {
+        CDataStream ssRead(ss.begin(), ss.end(), SER_DISK, CLIENT_VERSION);
+        marketOutcome outcomeRead;
+        ssRead >> outcomeRead;
+        assert(outcomeRead.voteValues.size() == outcome.voteValues.size());
+    }
+}
+
+// The same outcome from the fixed-width layout of the outcomes on chain
+// from before the compact encoding
+static void MarketOutcomeDecodeLegacy(benchmark::State& state)
+{
+    marketOutcome outcome = MakeOutcome();
+    outcome.nEncoding = MARKET_OUTCOME_LEGACY;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << outcome;
+
+    while (state.KeepRunning()) {
+        CDataStream ssRead(ss.begin(), ss.end(), SER_DISK, CLIENT_VERSION);
+        marketOutcome outcomeRead;
+        ssRead >> outcomeRead;
+        assert(outcomeRead.voteValues.size() == outcome.voteValues.size());
+    }
+}
+
+BENCHMARK(MarketOutcomeDecodeCompact, 50);
+BENCHMARK(MarketOutcomeDecodeLegacy, 50);
+
+static const size_t nSelectionMarkets = 500;
+static const size_t nSelectionTrades = 50000;
+
+// The market stage of block assembly over a mempool of 50k trades spread
+// across 500 markets of 2 to 8 states, one trade per package. Every buy is
+// priced 5% over its cost on the confirmed state, as quoted before any of
+// the others, so the buys that follow several others on the same state no
+// longer cover their cost and are left out.
+static void MarketBlockTradeSelection(benchmark::State& state)
+{
+    FastRandomContext rng(true);
+
+    std::vector<marketMarket> vMarket(nSelectionMarkets);
+    std::vector<uint256> vMarketID;
+    for (marketMarket& market : vMarket) {
+        market.B = 100 * COIN;
+        market.tradingFee = 0;
+        market.maxCommission = 0;
+        market.maturation = 100;
+        market.txPoWh = 0;
+        market.txPoWd = 0;
+        for (uint32_t i = 0; i <= rng.randrange(3); i++)
+            market.decisionIDs.push_back(rng.rand256());
+        vMarketID.push_back(market.GetHash());
+    }
+
+    std::vector<marketTrade> vTrade(nSelectionTrades);
+    for (size_t i = 0; i < vTrade.size(); i++) {
+        marketTrade& trade = vTrade[i];
+        size_t j = rng.randrange(nSelectionMarkets);
+        uint32_t nStates = marketNStates(vMarket[j]);
+        trade.marketid = vMarketID[j];
+        trade.isBuy = rng.randrange(4) != 0;
+        trade.nShares = (1 + rng.randrange(20)) * COIN;
+        trade.decisionState = rng.randrange(nStates);
+        trade.nonce = i;
+
+        std::vector<double> nShares(nStates, 0.0);
+        double curr = marketAccountValue(0.0, 100.0, nStates, nShares.data());
+        nShares[trade.decisionState] += 1e-8 * trade.nShares;
+        double cost = marketAccountValue(0.0, 100.0, nStates, nShares.data()) - curr;
+        trade.price = (uint64_t)(1.05 * cost / (1e-8 * trade.nShares) * COIN);
+    }
+
+    const marketShareState shareState;
+    while (state.KeepRunning()) {
+        BlockMarketState marketState;
+        size_t nAdded = 0;
+        for (const marketTrade& trade : vTrade) {
+            if (!marketState.HasMarket(trade.marketid)) {
+                size_t j = std::find(vMarketID.begin(), vMarketID.end(), trade.marketid) - vMarketID.begin();
+                marketState.SetMarket(trade.marketid, &vMarket[j], shareState);
+            }
+            if (marketState.AddTrades(std::vector<const marketTrade*>(1, &trade)))
+                nAdded++;
+        }
+        assert(nAdded > nSelectionTrades / 4 && marketState.GetSkipped() > 0);
+    }
+}
+
+BENCHMARK(MarketBlockTradeSelection, 5);
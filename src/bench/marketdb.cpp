@@ -0,0 +1,71 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <chainparams.h>
+#include <primitives/market.h>
+#include <random.h>
+#include <txdb.h>
+
+#include <memory>
+#include <vector>
+
+static const size_t nTradesPerMarket = 100;
+
+// Write nTrades trades on marketid into the market index, in batches
+static void WriteTrades(CMarketTreeDB& db, const uint256& marketid, size_t nTrades, uint32_t& nonce)
+{
+    std::vector<marketTrade> vTrade(std::min<size_t>(nTrades, 1000));
+    while (nTrades) {
+        size_t n = std::min(nTrades, vTrade.size());
+        std::vector<std::pair<uint256, const marketObj *> > vObj;
+        for (size_t i = 0; i < n; i++) {
+            marketTrade& trade = vTrade[i];
+            trade.marketid = marketid;
+            trade.isBuy = true;
+            trade.nShares = 1000;
+            trade.price = 100;
+            trade.decisionState = 1;
+            trade.nonce = nonce++;
+            vObj.push_back(std::make_pair(trade.GetHash(), &trade));
+        }
+        db.WriteMarketIndex(vObj);
+        nTrades -= n;
+    }
+}
+
+// List the trades of one market from a market DB that holds nOtherTrades
+// trades on other markets. With prefix-bounded scans the latency should
+// only depend on nTradesPerMarket.
+static void MarketListTrades(benchmark::State& state, size_t nOtherTrades)
+{
+    // CMarketTreeDB resolves its path through the chain params
+    SelectParams(CBaseChainParams::REGTEST);
+    CMarketTreeDB db(1 << 20, true, true);
+    FastRandomContext rng(true);
+
+    uint32_t nonce = 0;
+    const uint256 marketid = rng.rand256();
+    WriteTrades(db, marketid, nTradesPerMarket, nonce);
+    for (size_t i = 0; i < nOtherTrades / nTradesPerMarket; i++)
+        WriteTrades(db, rng.rand256(), nTradesPerMarket, nonce);
+
+    while (state.KeepRunning()) {
+        std::vector<marketTrade> vTrade = db.GetTrades(marketid);
+        assert(vTrade.size() == nTradesPerMarket);
+    }
+}
+
+static void MarketListTradesSmallDB(benchmark::State& state)
+{
+    MarketListTrades(state, 1000);
+}
+
+static void MarketListTradesLargeDB(benchmark::State& state)
+{
+    MarketListTrades(state, 100000);
+}
+
+BENCHMARK(MarketListTradesSmallDB, 2000);
+BENCHMARK(MarketListTradesLargeDB, 2000);
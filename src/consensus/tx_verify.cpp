@@ -180,6 +180,12 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state, bool fChe
             return state.DoS(100, false, REJECT_INVALID, "bad-txns-txouttotal-toolarge");
     }
 
+    // Market outputs must hold an object that decodes. The coinbase is
+    // exempt: it carries the miner's outcome, which must not be refused by
+    // a node whose outcome decoder is stricter than the miner's
+    if (!tx.IsCoinBase() && tx.HasMalformedMarketOutput())
+        return state.DoS(100, false, REJECT_INVALID, "bad-txns-market-malformed");
+
     // Check for duplicate inputs - note that this check is slow so we skip it in CheckBlock
     if (fCheckDuplicateInputs) {
         std::set<COutPoint> vInOutPoints;
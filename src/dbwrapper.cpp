@@ -188,8 +188,20 @@ bool CDBWrapper::IsEmpty()
 }
 
 CDBIterator::~CDBIterator() { delete piter; }
-bool CDBIterator::Valid() const { return piter->Valid(); }
+
+bool CDBIterator::Valid() const
+{
+    if (!piter->Valid())
+        return false;
+    if (!strPrefix.empty() && !piter->key().starts_with(strPrefix))
+        return false;
+    if (!strUpperBound.empty() && piter->key().compare(strUpperBound) >= 0)
+        return false;
+    return true;
+}
+
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
+
 void CDBIterator::Next() { piter->Next(); }
 
 namespace dbwrapper_private {
@@ -94,6 +94,20 @@ public:
         ssValue.clear();
     }
 
+    /** Write key with an empty value, for index entries that are all key */
+    template <typename K>
+    void WriteKey(const K& key)
+    {
+        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey << key;
+        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+
+        batch.Put(slKey, leveldb::Slice());
+        // As for Write, with an empty value
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size();
+        ssKey.clear();
+    }
+
     template <typename K>
     void Erase(const K& key)
     {
@@ -120,6 +134,12 @@ private:
     const CDBWrapper &parent;
     leveldb::Iterator *piter;
 
+    //! serialized prefix every key in range must begin with (empty: unbounded)
+    std::string strPrefix;
+
+    //! serialized exclusive upper bound of the range (empty: unbounded)
+    std::string strUpperBound;
+
 public:
 
     /**
@@ -142,6 +162,31 @@ public:
         piter->Seek(slKey);
     }
 
+    /**
+     * Seek to the first key that begins with the serialized form of prefix
+     * and restrict iteration to that prefix: Valid() returns false as soon
+     * as the cursor moves past the last matching key, so a scan costs
+     * O(matches) instead of O(rest of the database).
+     */
+    template<typename P> void SeekPrefix(const P& prefix) {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey << prefix;
+        strPrefix.assign(ssKey.data(), ssKey.size());
+        piter->Seek(strPrefix);
+    }
+
+    /**
+     * Stop iterating at the first key that compares greater than or equal
+     * to the serialized form of key.
+     */
+    template<typename K> void SetUpperBound(const K& key) {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey << key;
+        strUpperBound.assign(ssKey.data(), ssKey.size());
+    }
+
     void Next();
 
     template<typename K> bool GetKey(K& key) {
@@ -339,6 +384,50 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    /**
+     * Append the values of the entries whose key begins with the serialized
+     * form of prefix to vValue, in key order. The scan stops at the end of
+     * the prefix range. The first nOffset matching entries are skipped and
+     * at most nLimit values are appended (0 = no limit). Values that fail to
+     * deserialize are skipped and do not count towards the offset or limit.
+     */
+    template <typename P, typename V>
+    void ReadPrefix(const P& prefix, std::vector<V>& vValue, size_t nOffset = 0, size_t nLimit = 0)
+    {
+        size_t nRead = 0;
+        std::unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix(prefix); pcursor->Valid(); pcursor->Next()) {
+            V value;
+            if (!pcursor->GetValue(value))
+                continue;
+            if (nOffset) {
+                nOffset--;
+                continue;
+            }
+            vValue.push_back(value);
+            if (nLimit && ++nRead >= nLimit)
+                break;
+        }
+    }
+
+    /**
+     * Call fn on the value of each entry whose key begins with the
+     * serialized form of prefix, in key order, as the cursor reaches it.
+     * Unlike ReadPrefix nothing is collected; one V is deserialized into
+     * for the whole scan. Values that fail to deserialize are skipped.
+     */
+    template <typename V, typename P, typename F>
+    void ForEachPrefix(const P& prefix, F fn)
+    {
+        V value;
+        std::unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix(prefix); pcursor->Valid(); pcursor->Next()) {
+            if (!pcursor->GetValue(value))
+                continue;
+            fn(value);
+        }
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
@@ -21,10 +21,12 @@
 #include <httprpc.h>
 #include <key.h>
 #include <validation.h>
+#include <marketindex.h>
 #include <miner.h>
 #include <netbase.h>
 #include <net.h>
 #include <net_processing.h>
+#include <outcomecache.h>
 #include <policy/feerate.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
@@ -166,6 +168,7 @@ void Interrupt()
     InterruptREST();
     InterruptTorControl();
     InterruptMapPort();
+    outcomeCache.Interrupt();
     if (g_connman)
         g_connman->Interrupt();
 }
@@ -203,6 +206,10 @@ void Shutdown()
 
     StopTorControl();
 
+    UnregisterValidationInterface(&outcomeCache);
+    outcomeCache.Interrupt();
+    outcomeCache.Stop();
+
     // After everything has been shut down, but before things get flushed, stop the
     // CScheduler/checkqueue threadGroup
     threadGroup.interrupt_all();
@@ -358,6 +365,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-dbbatchsize", strprintf("Maximum database write batch size in bytes (default: %u)", nDefaultDbBatchSize));
     }
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-marketcache=<n>", strprintf(_("Set the in-memory cache of market index objects in megabytes (0 to disable, default: %d)"), DEFAULT_MARKET_CACHE));
     strUsage += HelpMessageOpt("-debuglogfile=<file>", strprintf(_("Specify location of debug log file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)"), DEFAULT_DEBUGLOGFILE));
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
@@ -376,6 +384,7 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
+    strUsage += HelpMessageOpt("-reindex-market", _("Rebuild the market index from the blocks of the active chain, leaving the chain state alone"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -431,6 +440,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubmarkettrade=<address>", _("Enable publish market trades in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubmarketvote=<address>", _("Enable publish market votes in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubmarketoutcome=<address>", _("Enable publish market outcomes in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubmarketcreated=<address>", _("Enable publish new branches, decisions and markets in <address>"));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -500,6 +513,8 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-blockmaxsize=<n>", "Set maximum BIP141 block weight to this * 4. Deprecated, use blockmaxweight");
     strUsage += HelpMessageOpt("-blockmaxweight=<n>", strprintf(_("Set maximum BIP141 block weight (default: %d)"), DEFAULT_BLOCK_MAX_WEIGHT));
     strUsage += HelpMessageOpt("-blockmintxfee=<amt>", strprintf(_("Set lowest fee rate (in %s/kB) for transactions to be included in block creation. (default: %s)"), CURRENCY_UNIT, FormatMoney(DEFAULT_BLOCK_MIN_TX_FEE)));
+    strUsage += HelpMessageOpt("-outcomeprecompute", strprintf(_("Compute the branch outcomes of the next block in the background as the tip moves, for nodes that build block templates (default: %u)"), DEFAULT_OUTCOME_PRECOMPUTE));
+    strUsage += HelpMessageOpt("-outcomethreads=<n>", strprintf(_("Number of threads to compute a branch outcome with (1 to %d, default: %d)"), MAX_OUTCOME_THREADS, DEFAULT_OUTCOME_THREADS));
     if (showDebug)
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
 
@@ -1286,6 +1301,12 @@ bool AppInitMain()
     peerLogic.reset(new PeerLogicValidation(&connman, scheduler));
     RegisterValidationInterface(peerLogic.get());
 
+    // Precompute branch outcomes for the next block as the tip moves
+    if (gArgs.GetBoolArg("-outcomeprecompute", DEFAULT_OUTCOME_PRECOMPUTE)) {
+        outcomeCache.Start();
+        RegisterValidationInterface(&outcomeCache);
+    }
+
     // sanitize comments per BIP-0014, format user agent and check total size
     std::vector<std::string> uacomments;
     for (const std::string& cmt : gArgs.GetArgs("-uacomment")) {
@@ -1396,6 +1417,8 @@ bool AppInitMain()
 
     fReindex = gArgs.GetBoolArg("-reindex", false);
     bool fReindexChainState = gArgs.GetBoolArg("-reindex-chainstate", false);
+    // A full reindex rebuilds the market index block by block anyway
+    bool fReindexMarket = gArgs.GetBoolArg("-reindex-market", DEFAULT_REINDEX_MARKET) && !fReindex;
 
     // cache size calculations
     int64_t nTotalCache = (gArgs.GetArg("-dbcache", nDefaultDbCache) << 20);
@@ -1414,11 +1437,13 @@ bool AppInitMain()
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
+    int64_t nMarketCache = std::max<int64_t>(0, gArgs.GetArg("-marketcache", DEFAULT_MARKET_CACHE)) << 20;
     int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of unused mempool space)\n", nCoinCacheUsage * (1.0 / 1024 / 1024), nMempoolSizeMax * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for in-memory market index cache\n", nMarketCache * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
     while (!fLoaded && !fRequestShutdown) {
@@ -1439,7 +1464,23 @@ bool AppInitMain()
                 pblocktree.reset();
                 pblocktree.reset(new CBlockTreeDB(nBlockTreeDBCache, false, fReset));
                 psidechaintree.reset(new CSidechainTreeDB(nSidechainTreeDBCache, false, fReset));
-                pmarkettree.reset(new CMarketTreeDB(nMarketTreeDBCache, false, fReset));
+                pmarkettree.reset(new CMarketTreeDB(nMarketTreeDBCache, false, fReset || fReindexMarket, nMarketCache));
+                if (!fReset && !fReindexMarket) {
+                    // Start over an interrupted -reindex-market
+                    bool fReindexing = false;
+                    pmarkettree->ReadReindexing(fReindexing);
+                    if (fReindexing) {
+                        fReindexMarket = true;
+                        pmarkettree.reset();
+                        pmarkettree.reset(new CMarketTreeDB(nMarketTreeDBCache, false, true, nMarketCache));
+                    }
+                }
+
+                // If necessary, upgrade the market indexes from an older format.
+                if (!pmarkettree->Upgrade()) {
+                    strLoadError = _("Error upgrading market database");
+                    break;
+                }
 
                 if (fReset) {
                     pblocktree->WriteReindexing(true);
@@ -1595,6 +1636,17 @@ bool AppInitMain()
         LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
     }
 
+    if (fReindexMarket && !fReindex) {
+        uiInterface.InitMessage(_("Rebuilding market index..."));
+        if (!RebuildMarketIndex(chainparams)) {
+            if (ShutdownRequested()) {
+                LogPrintf("Shutdown requested. Exiting.\n");
+                return false;
+            }
+            return InitError(_("Error rebuilding the market index"));
+        }
+    }
+
     fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fsbridge::fopen(est_path, "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <memory.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include "tc_mat.h"
@@ -15,6 +16,27 @@
  * tc_mat                                                                   *
  ****************************************************************************/
 
+/* malloc() aligned to TC_MAT_ALIGN. The pointer malloc() returned is kept
+ * just below the aligned block for tc_aligned_free() */
+static void *
+tc_aligned_alloc(size_t size)
+{
+    unsigned char *p = (unsigned char *) malloc(size + TC_MAT_ALIGN + sizeof(void *));
+    if (!p)
+        return NULL;
+    uintptr_t addr = (uintptr_t) (p + sizeof(void *));
+    addr = (addr + TC_MAT_ALIGN - 1) & ~(uintptr_t) (TC_MAT_ALIGN - 1);
+    ((void **) addr)[-1] = p;
+    return (void *) addr;
+}
+
+static void
+tc_aligned_free(void *ptr)
+{
+    if (ptr)
+        free(((void **) ptr)[-1]);
+}
+
 struct tc_mat *
 tc_mat_ctr(uint32_t nr_, uint32_t nc_)
 {
@@ -27,7 +49,7 @@ tc_mat_ctr(uint32_t nr_, uint32_t nc_)
 void
 tc_mat_dtr(struct tc_mat *A)
 {
-    if (!A)
+    if (!A || A->ws)
         return;
     tc_mat_clear(A);
     free(A);
@@ -38,15 +60,14 @@ tc_mat_clear(struct tc_mat *A)
 {
     if (!A)
         return;
-    if (A->a) {
-        for(uint32_t r=0; r < A->nr; r++)
-            if (A->a[r])
-                free(A->a[r]);
-        free(A->a);
+    if (!A->ws) {
+        tc_aligned_free(A->a);
+        A->a = NULL;
+        A->cap = 0;
     }
-    A->a = NULL;
     A->nr = 0;
     A->nc = 0;
+    A->stride = 0;
 }
 
 void
@@ -56,7 +77,7 @@ tc_mat_print(const struct tc_mat *A)
         return;
     for(uint32_t i=0; i < A->nr; i++) {
         for(uint32_t j=0; j < A->nc; j++)
-            printf(" %13.10f", A->a[i][j]);
+            printf(" %13.10f", TC_MAT_AT(A, i, j));
         printf("\n");
     }
 }
@@ -69,7 +90,7 @@ tc_mat_norm(const struct tc_mat *A)
     double sum = 0.0;
     for(uint32_t i=0; i < A->nr; i++)
         for(uint32_t j=0; j < A->nc; j++)
-            sum += A->a[i][j] * A->a[i][j];
+            sum += TC_MAT_AT(A, i, j) * TC_MAT_AT(A, i, j);
     return sum;
 }
 
@@ -80,12 +101,53 @@ tc_mat_resize(struct tc_mat *A, uint32_t nr_, uint32_t nc_)
         return;
     if ((A->nr == nr_) && (A->nc == nc_))
         return;
+    const uint32_t align = TC_MAT_ALIGN / sizeof(double);
+    const uint32_t stride = (nc_ + align - 1) / align * align;
+    if (A->ws) {
+        /* a workspace matrix keeps its storage while the new size fits */
+        size_t n = (size_t) stride * nr_;
+        if (n > A->cap) {
+            A->a = (double *) tc_ws_alloc(A->ws, sizeof(double) * n);
+            A->cap = n;
+        }
+        A->nr = nr_;
+        A->nc = nc_;
+        A->stride = stride;
+        return;
+    }
     tc_mat_clear(A);
     A->nr = nr_;
     A->nc = nc_;
-    A->a = (double **) malloc(sizeof(double *) * nr_);
-    for(uint32_t r=0; r < nr_; r++)
-        A->a[r] = (double *) malloc(sizeof(double) * nc_);
+    A->stride = stride;
+    A->a = (double *) tc_aligned_alloc(sizeof(double) * A->stride * nr_);
+    A->cap = (size_t) A->stride * nr_;
+}
+
+/* Room for the new row is doubled when it runs out, so n pushes copy the
+ * matrix O(log n) times */
+double *
+tc_mat_push_row(struct tc_mat *A)
+{
+    if (!A)
+        return NULL;
+    size_t n = (size_t) A->stride * (A->nr + 1);
+    if (n > A->cap) {
+        size_t cap = 2 * A->cap;
+        if (cap < n)
+            cap = n;
+        double *a = (double *) (A->ws? tc_ws_alloc(A->ws, sizeof(double) * cap)
+            : tc_aligned_alloc(sizeof(double) * cap));
+        if (!a)
+            return NULL;
+        if (A->nr)
+            memcpy(a, A->a, sizeof(double) * A->stride * A->nr);
+        if (!A->ws)
+            tc_aligned_free(A->a);
+        A->a = a;
+        A->cap = cap;
+    }
+    A->nr++;
+    return tc_mat_row(A, A->nr - 1);
 }
 
 void
@@ -98,8 +160,20 @@ tc_mat_copy(struct tc_mat *B, const struct tc_mat *A)
     if ((B->nr != A->nr) || (B->nc != A->nc))
         tc_mat_resize(B, A->nr, A->nc);
     for(uint32_t i=0; i < A->nr; i++)
-        for(uint32_t j=0; j < A->nc; j++)
-            B->a[i][j] = A->a[i][j];
+        memcpy(tc_mat_row(B, i), tc_mat_row(A, i), sizeof(double) * A->nc);
+}
+
+/* B = b, where b is the temporary an aliased operation wrote to instead
+ * of B, taken from B's workspace at mark. b is given back unless B had to
+ * grow into the workspace above it */
+static void
+tc_mat_move_tmp(struct tc_mat *B, struct tc_mat *b, size_t mark)
+{
+    int fits = ((size_t) b->stride * b->nr <= B->cap);
+    tc_mat_copy(B, b);
+    tc_mat_dtr(b);
+    if (fits)
+        tc_ws_release(B->ws, mark);
 }
 
 void
@@ -109,28 +183,38 @@ tc_mat_identity(struct tc_mat *A)
         return;
     for(uint32_t i=0; i < A->nr; i++)
         for(uint32_t j=0; j < A->nc; j++)
-            A->a[i][j] = (i==j)? 1.0: 0.0;
+            TC_MAT_AT(A, i, j) = (i==j)? 1.0: 0.0;
 }
 
+/* Tile edge, in elements, of the blocked transpose. A tile of source and
+ * destination rows stays in L1 */
+#define TC_MAT_TRANSPOSE_BLOCK  32
+
 void
 tc_mat_transpose(struct tc_mat *B, const struct tc_mat *A)
 {
     if (!A || !B)
         return;
     if (A == B) {
-        struct tc_mat *b = tc_mat_ctr(A->nc, A->nr);
-        for(uint32_t i=0; i < A->nr; i++)
-            for(uint32_t j=0; j < A->nc; j++)
-                b->a[j][i] = A->a[i][j];
-        tc_mat_copy(B, b);
-        tc_mat_dtr(b);
+        size_t mark = tc_ws_mark(B->ws);
+        struct tc_mat *b = tc_ws_mat(B->ws, A->nc, A->nr);
+        tc_mat_transpose(b, A);
+        tc_mat_move_tmp(B, b, mark);
         return;
     }
     if ((B->nr != A->nc) || (B->nc != A->nr))
         tc_mat_resize(B, A->nc, A->nr);
-    for(uint32_t i=0; i < A->nr; i++)
-        for(uint32_t j=0; j < A->nc; j++)
-            B->a[j][i] = A->a[i][j];
+    for(uint32_t ii=0; ii < A->nr; ii += TC_MAT_TRANSPOSE_BLOCK) {
+        uint32_t iend = (A->nr - ii < TC_MAT_TRANSPOSE_BLOCK)? A->nr: ii + TC_MAT_TRANSPOSE_BLOCK;
+        for(uint32_t jj=0; jj < A->nc; jj += TC_MAT_TRANSPOSE_BLOCK) {
+            uint32_t jend = (A->nc - jj < TC_MAT_TRANSPOSE_BLOCK)? A->nc: jj + TC_MAT_TRANSPOSE_BLOCK;
+            for(uint32_t i=ii; i < iend; i++) {
+                const double *a = tc_mat_row(A, i);
+                for(uint32_t j=jj; j < jend; j++)
+                    TC_MAT_AT(B, j, i) = a[j];
+            }
+        }
+    }
 }
 
 int
@@ -142,7 +226,7 @@ tc_mat_add(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B)
         tc_mat_resize(C, A->nr, B->nc);
     for(uint32_t i=0; i < C->nr; i++)
         for(uint32_t j=0; j < C->nc; j++)
-            C->a[i][j] = A->a[i][j] + B->a[i][j];
+            TC_MAT_AT(C, i, j) = TC_MAT_AT(A, i, j) + TC_MAT_AT(B, i, j);
     return 0;
 }
 
@@ -155,31 +239,145 @@ tc_mat_sub(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B)
         tc_mat_resize(C, A->nr, B->nc);
     for(uint32_t i=0; i < C->nr; i++)
         for(uint32_t j=0; j < C->nc; j++)
-            C->a[i][j] = A->a[i][j] - B->a[i][j];
+            TC_MAT_AT(C, i, j) = TC_MAT_AT(A, i, j) - TC_MAT_AT(B, i, j);
     return 0;
 }
 
+/* Block sizes, in elements, of the blocked multiply. A block of rows of B
+ * (TC_MAT_MULT_KBLOCK x TC_MAT_MULT_JBLOCK doubles, 256KB) stays in L2
+ * while every row of A streams past it */
+#define TC_MAT_MULT_KBLOCK      128
+#define TC_MAT_MULT_JBLOCK      256
+
+/* c[j] += a * b[j] for j < n. The rows are contiguous and do not alias,
+ * so the compiler vectorizes this loop */
+static void
+tc_mat_axpy(double *c, double a, const double *b, uint32_t n)
+{
+    for(uint32_t j=0; j < n; j++)
+        c[j] += a * b[j];
+}
+
+/* tc_mat_axpy() for four consecutive k at once. The terms are still added
+ * to c[j] one at a time in k order, but c is loaded and stored once */
+static void
+tc_mat_axpy4(double *c, const double *a, const double *b0, const double *b1,
+    const double *b2, const double *b3, uint32_t n)
+{
+    for(uint32_t j=0; j < n; j++)
+        c[j] = (((c[j] + a[0] * b0[j]) + a[1] * b1[j]) + a[2] * b2[j]) + a[3] * b3[j];
+}
+
+/* Rows [i0, i1) of C = A B, C already sized */
+static void
+tc_mat_mult_rows(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B,
+    uint32_t i0, uint32_t i1)
+{
+    /* matrix times column vector: one dot product per row of A */
+    if (B->nc == 1) {
+        for(uint32_t i=i0; i < i1; i++) {
+            const double *a = tc_mat_row(A, i);
+            double sum = 0.0;
+            for(uint32_t k=0; k < A->nc; k++)
+                sum += a[k] * TC_MAT_AT(B, k, 0);
+            TC_MAT_AT(C, i, 0) = sum;
+        }
+        return;
+    }
+
+    for(uint32_t i=i0; i < i1; i++)
+        memset(tc_mat_row(C, i), 0, sizeof(double) * C->nc);
+
+    /* row vector times matrix, or a row of A that fits one block */
+    if ((C->nr == 1) || ((A->nc <= TC_MAT_MULT_KBLOCK) && (B->nc <= TC_MAT_MULT_JBLOCK))) {
+        for(uint32_t i=i0; i < i1; i++) {
+            double *c = tc_mat_row(C, i);
+            const double *a = tc_mat_row(A, i);
+            uint32_t k = 0;
+            for( ; k + 4 <= A->nc; k += 4)
+                tc_mat_axpy4(c, a + k, tc_mat_row(B, k), tc_mat_row(B, k+1),
+                    tc_mat_row(B, k+2), tc_mat_row(B, k+3), B->nc);
+            for( ; k < A->nc; k++)
+                tc_mat_axpy(c, a[k], tc_mat_row(B, k), B->nc);
+        }
+        return;
+    }
+
+    for(uint32_t kk=0; kk < A->nc; kk += TC_MAT_MULT_KBLOCK) {
+        uint32_t kend = (A->nc - kk < TC_MAT_MULT_KBLOCK)? A->nc: kk + TC_MAT_MULT_KBLOCK;
+        for(uint32_t jj=0; jj < B->nc; jj += TC_MAT_MULT_JBLOCK) {
+            uint32_t n = (B->nc - jj < TC_MAT_MULT_JBLOCK)? B->nc - jj: TC_MAT_MULT_JBLOCK;
+            for(uint32_t i=i0; i < i1; i++) {
+                double *c = tc_mat_row(C, i) + jj;
+                const double *a = tc_mat_row(A, i);
+                uint32_t k = kk;
+                for( ; k + 4 <= kend; k += 4)
+                    tc_mat_axpy4(c, a + k, tc_mat_row(B, k) + jj, tc_mat_row(B, k+1) + jj,
+                        tc_mat_row(B, k+2) + jj, tc_mat_row(B, k+3) + jj, n);
+                for( ; k < kend; k++)
+                    tc_mat_axpy(c, a[k], tc_mat_row(B, k) + jj, n);
+            }
+        }
+    }
+}
+
+/* C = A B is computed as, for each row i of C, the sum over k of
+ * A(i,k) times row k of B. Every term of C(i,j) is still added in
+ * increasing k starting from 0.0, as in the textbook triple loop, so
+ * blocking does not change the result. There are no explicit SIMD
+ * paths: an FMA would round differently on different nodes, and the
+ * outcome matrices must agree everywhere */
 int
 tc_mat_mult(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B)
 {
     if (!C || !A || !B || (A->nc != B->nr))
         return -1;
     if ((C == A) || (C == B)) {
-        struct tc_mat *c = tc_mat_ctr(A->nr, B->nr);
+        size_t mark = tc_ws_mark(C->ws);
+        struct tc_mat *c = tc_ws_mat(C->ws, A->nr, B->nc);
         tc_mat_mult(c, A, B);
-        tc_mat_copy(C, c);
-        tc_mat_dtr(c);
+        tc_mat_move_tmp(C, c, mark);
         return 0;
     }
     if ((C->nc != B->nc) || (C->nr != A->nr))
         tc_mat_resize(C, A->nr, B->nc);
-    for(uint32_t i=0; i < C->nr; i++) {
-        for(uint32_t j=0; j < C->nc; j++) {
-            C->a[i][j] = 0.0;
-            for(uint32_t k=0; k < A->nc; k++)
-                C->a[i][j] += A->a[i][k] * B->a[k][j];
-        }
+    tc_mat_mult_rows(C, A, B, 0, C->nr);
+    return 0;
+}
+
+/* Rows [i0, i1) and columns [j0, j1) of C = A^T B, C already sized.
+ * C(i,j) = sum_k A(k,i) B(k,j), still added in increasing k. Row k of
+ * A and of B are read once for all of C, so for a column vector A
+ * (wgt^T M) this streams M exactly once */
+static void
+tc_mat_mult_tn_part(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B,
+    uint32_t i0, uint32_t i1, uint32_t j0, uint32_t j1)
+{
+    for(uint32_t i=i0; i < i1; i++)
+        memset(tc_mat_row(C, i) + j0, 0, sizeof(double) * (j1 - j0));
+    for(uint32_t k=0; k < A->nr; k++) {
+        const double *a = tc_mat_row(A, k);
+        const double *b = tc_mat_row(B, k) + j0;
+        for(uint32_t i=i0; i < i1; i++)
+            tc_mat_axpy(tc_mat_row(C, i) + j0, a[i], b, j1 - j0);
     }
+}
+
+int
+tc_mat_mult_tn(struct tc_mat *C, const struct tc_mat *A, const struct tc_mat *B)
+{
+    if (!C || !A || !B || (A->nr != B->nr))
+        return -1;
+    if ((C == A) || (C == B)) {
+        size_t mark = tc_ws_mark(C->ws);
+        struct tc_mat *c = tc_ws_mat(C->ws, A->nc, B->nc);
+        tc_mat_mult_tn(c, A, B);
+        tc_mat_move_tmp(C, c, mark);
+        return 0;
+    }
+    if ((C->nr != A->nc) || (C->nc != B->nc))
+        tc_mat_resize(C, A->nc, B->nc);
+    tc_mat_mult_tn_part(C, A, B, 0, C->nr, 0, C->nc);
     return 0;
 }
 
@@ -192,7 +390,7 @@ tc_mat_mult_scalar(struct tc_mat *C, double a, const struct tc_mat *B)
         tc_mat_resize(C, B->nr, B->nc);
     for(uint32_t i=0; i < C->nr; i++)
         for(uint32_t j=0; j < C->nc; j++)
-            C->a[i][j] = a * B->a[i][j];
+            TC_MAT_AT(C, i, j) = a * TC_MAT_AT(B, i, j);
     return 0;
 }
 
@@ -291,27 +489,30 @@ tc_mat_bidiag_decomp(
     tc_mat_copy(B, A);
     tc_mat_identity(U);
     tc_mat_identity(V);
-    struct tc_mat *Ic = tc_mat_ctr(A->nc, A->nc);
+    /* temporaries from U's workspace, if it has one */
+    struct tc_ws *ws = U->ws;
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *Ic = tc_ws_mat(ws, A->nc, A->nc);
     tc_mat_identity(Ic);
-    struct tc_mat *Ir = tc_mat_ctr(A->nr, A->nr);
+    struct tc_mat *Ir = tc_ws_mat(ws, A->nr, A->nr);
     tc_mat_identity(Ir);
-    struct tc_mat *u = tc_mat_ctr(0, 0);
-    struct tc_mat *uT = tc_mat_ctr(0, 0);
-    struct tc_mat *u_uT = tc_mat_ctr(0, 0);
-    struct tc_mat *P = tc_mat_ctr(0, 0);
+    struct tc_mat *u = tc_ws_mat(ws, 0, 0);
+    struct tc_mat *uT = tc_ws_mat(ws, 0, 0);
+    struct tc_mat *u_uT = tc_ws_mat(ws, 0, 0);
+    struct tc_mat *P = tc_ws_mat(ws, 0, 0);
     for(uint32_t k=0; (k < A->nc) && (k+1 < A->nr); k++) {
         /* from the left */
-        double b_k = B->a[k][k];
+        double b_k = TC_MAT_AT(B, k, k);
         double b = 0.0;
         for(uint32_t i=k; i < A->nr; i++)
-            b += B->a[i][k] * B->a[i][k];
+            b += TC_MAT_AT(B, i, k) * TC_MAT_AT(B, i, k);
         if (b != 0.0) { /* if b = 0, there's nothing to do */
             b = ((b_k > 0)? -1.0: 1.0) * sqrt(b);
             double s = b_k - b;
             double tau = - s / b;
             tc_mat_resize(u, A->nr, 1);
             for(uint32_t i=0; i < A->nr; i++)
-                u->a[i][0] = (i > k)? B->a[i][k]/s: ((i==k)? 1.0: 0.0);
+                TC_MAT_AT(u, i, 0) = (i > k)? TC_MAT_AT(B, i, k)/s: ((i==k)? 1.0: 0.0);
             /*  P = I - tau u u^T */
             tc_mat_transpose(uT, u);
             tc_mat_mult(u_uT, u, uT);
@@ -323,17 +524,17 @@ tc_mat_bidiag_decomp(
         }
         if (k + 2 < A->nc) {
             /* from the right */
-            double b_k1 = B->a[k][k+1];
+            double b_k1 = TC_MAT_AT(B, k, k+1);
             double bb = 0.0;
             for(uint32_t j=k+1; j < A->nc; j++)
-                bb += B->a[k][j] * B->a[k][j];
+                bb += TC_MAT_AT(B, k, j) * TC_MAT_AT(B, k, j);
             bb = ((b_k1 > 0)? -1.0: 1.0) * sqrt(bb);
             if (bb != 0.0) { /* if bb = 0, there's nothing to do */
                 double s = b_k1 - bb;
                 double tau = - s / bb;
                 tc_mat_resize(u, A->nc, 1);
                 for(uint32_t i=0; i < A->nc; i++)
-                    u->a[i][0] = (i > k+1)? B->a[k][i]/s: ((i==k+1)? 1.0: 0.0);
+                    TC_MAT_AT(u, i, 0) = (i > k+1)? TC_MAT_AT(B, k, i)/s: ((i==k+1)? 1.0: 0.0);
                 /*  P = I - tau u u^T */
                 tc_mat_transpose(uT, u);
                 tc_mat_mult(u_uT, u, uT);
@@ -351,6 +552,7 @@ tc_mat_bidiag_decomp(
     tc_mat_dtr(u_uT);
     tc_mat_dtr(Ic);
     tc_mat_dtr(Ir);
+    tc_ws_release(ws, mark);
     return 0;
 }
 
@@ -375,15 +577,15 @@ tc_mat_eigenvalues(struct tc_mat *E, const struct tc_mat *A)
         return -1;
     if (E->nr != A->nr)
         tc_mat_resize(E, A->nr, 1);
-    double a = A->a[0][0];
-    double b = A->a[1][0];
-    double c = A->a[0][1];
-    double d = A->a[1][1];
+    double a = TC_MAT_AT(A, 0, 0);
+    double b = TC_MAT_AT(A, 1, 0);
+    double c = TC_MAT_AT(A, 0, 1);
+    double d = TC_MAT_AT(A, 1, 1);
     double ad2 = (a + d)/2.0;
     double det = ad2*ad2 - (a*d - b*c);
     double s = (det <= 0.0)? 0.0: sqrt(det);
-    E->a[0][0] = ad2 + s;
-    E->a[1][0] = ad2 - s;
+    TC_MAT_AT(E, 0, 0) = ad2 + s;
+    TC_MAT_AT(E, 1, 0) = ad2 - s;
     return 0;
 }
 
@@ -400,18 +602,20 @@ tc_mat_wilkinson_shift(const struct tc_mat *A)
         return 0.0;
     if (A->nc != 2)
         return 0.0;
-    struct tc_mat *AT = tc_mat_ctr(2, A->nr);
+    size_t mark = tc_ws_mark(A->ws);
+    struct tc_mat *AT = tc_ws_mat(A->ws, 2, A->nr);
     tc_mat_transpose(AT, A);
-    struct tc_mat *AT_A = tc_mat_ctr(2, 2);
+    struct tc_mat *AT_A = tc_ws_mat(A->ws, 2, 2);
     tc_mat_mult(AT_A, AT, A);
-    struct tc_mat *E = tc_mat_ctr(2, 1);
+    struct tc_mat *E = tc_ws_mat(A->ws, 2, 1);
     tc_mat_eigenvalues(E, AT_A);
-    double l0 = E->a[0][0];
-    double l1 = E->a[1][0];
-    double t22 = AT_A->a[1][1];
+    double l0 = TC_MAT_AT(E, 0, 0);
+    double l1 = TC_MAT_AT(E, 1, 0);
+    double t22 = TC_MAT_AT(AT_A, 1, 1);
     tc_mat_dtr(AT);
     tc_mat_dtr(AT_A);
     tc_mat_dtr(E);
+    tc_ws_release(A->ws, mark);
     return (fabs(l0 - t22) < fabs(l1 - t22))? l0: l1;
 }
 
@@ -437,17 +641,17 @@ tc_mat_svd(
 
     /* case nc = 1 */
     if (A->nc == 1) {
-        V->a[0][0] = 1.0;
+        TC_MAT_AT(V, 0, 0) = 1.0;
         double normsq = 0.0;
         for(uint32_t i=0; i < A->nr; i++)
-            normsq += A->a[i][0] * A->a[i][0];
-        D->a[0][0] = sqrt(normsq);
-        if (D->a[0][0] == 0.0)
+            normsq += TC_MAT_AT(A, i, 0) * TC_MAT_AT(A, i, 0);
+        TC_MAT_AT(D, 0, 0) = sqrt(normsq);
+        if (TC_MAT_AT(D, 0, 0) == 0.0)
             tc_mat_copy(U, A);
         else {
-            double inv = 1.0 / D->a[0][0];
+            double inv = 1.0 / TC_MAT_AT(D, 0, 0);
             for(uint32_t i=0; i < A->nr; i++)
-                U->a[i][0] = A->a[i][0] * inv;
+                TC_MAT_AT(U, i, 0) = TC_MAT_AT(A, i, 0) * inv;
         }
         return 0;
     }
@@ -463,22 +667,27 @@ tc_mat_svd(
      *            D  nc x nc
      */
     tc_mat_bidiag_decomp(A, U, D, V);
+    /* temporaries from U's workspace, if it has one. U and D only shrink
+     * from here on, so they stay below the mark */
+    struct tc_ws *ws = U->ws;
+    const size_t mark = tc_ws_mark(ws);
     if (D->nr != D->nc) {
-        struct tc_mat *U0 = tc_mat_ctr(A->nr, A->nc);
+        struct tc_mat *U0 = tc_ws_mat(ws, A->nr, A->nc);
         for(uint32_t i=0; i < A->nr; i++)
             for(uint32_t j=0; j < A->nc; j++)
-                U0->a[i][j] = U->a[i][j];
+                TC_MAT_AT(U0, i, j) = TC_MAT_AT(U, i, j);
         tc_mat_resize(U, A->nr, A->nc);
         tc_mat_copy(U, U0);
         tc_mat_dtr(U0);
 
-        struct tc_mat *D0 = tc_mat_ctr(A->nc, A->nc);
+        struct tc_mat *D0 = tc_ws_mat(ws, A->nc, A->nc);
         for(uint32_t i=0; i < A->nc; i++)
             for(uint32_t j=0; j < A->nc; j++)
-                D0->a[i][j] = D->a[i][j];
+                TC_MAT_AT(D0, i, j) = TC_MAT_AT(D, i, j);
         tc_mat_resize(D, A->nc, A->nc);
         tc_mat_copy(D, D0);
         tc_mat_dtr(D0);
+        tc_ws_release(ws, mark);
     }
     /* iterate until either max_iterations has been hit
      * or the largest superdiagonal entry is below the
@@ -487,13 +696,13 @@ tc_mat_svd(
      * to be zero.
      */
     const uint32_t max_iterations = 100 * D->nc;
-    double threshold = D->a[0][0];
+    double threshold = TC_MAT_AT(D, 0, 0);
     for(uint32_t i=0; i < D->nc; i++)
-        if (fabs(D->a[i][i]) > threshold)
-            threshold = fabs(D->a[i][i]);
+        if (fabs(TC_MAT_AT(D, i, i)) > threshold)
+            threshold = fabs(TC_MAT_AT(D, i, i));
     for(uint32_t i=0; i+1 < D->nc; i++)
-        if (fabs(D->a[i][i+1]) > threshold)
-            threshold = fabs(D->a[i][i+1]);
+        if (fabs(TC_MAT_AT(D, i, i+1)) > threshold)
+            threshold = fabs(TC_MAT_AT(D, i, i+1));
     threshold *= 1e-12;
     const double zero_threshold = 0.1 * threshold;
     /* Always reindex the components so that D has the form
@@ -509,31 +718,31 @@ tc_mat_svd(
          * term. Then move this component into D1.
          */
         for(uint32_t i1=i0; i1 < D->nr; i1++) {
-            if (fabs(D->a[i1][i1]) > zero_threshold)
+            if (fabs(TC_MAT_AT(D, i1, i1)) > zero_threshold)
                 continue;
-            if ((i1+1 == D->nr) && fabs(D->a[i1-1][i1]) > zero_threshold)
+            if ((i1+1 == D->nr) && fabs(TC_MAT_AT(D, i1-1, i1)) > zero_threshold)
                 continue;
-            if ((i1+1 < D->nr) && (fabs(D->a[i1][i1+1]) > zero_threshold)) {
+            if ((i1+1 < D->nr) && (fabs(TC_MAT_AT(D, i1, i1+1)) > zero_threshold)) {
                 for(uint32_t i=i1; i+1 < D->nr; i++) {
                     /* U D = (U G) (G^T D)  */
-                    double alpha = D->a[i1][i+1];
+                    double alpha = TC_MAT_AT(D, i1, i+1);
                     if (fabs(alpha) < zero_threshold)
                         break;
-                    double beta = D->a[i+1][i+1];
+                    double beta = TC_MAT_AT(D, i+1, i+1);
                     double gamma = sqrt(alpha*alpha + beta*beta);
                     double c = beta / gamma;
                     double s = alpha / gamma;
                     for(uint32_t j=0; j < D->nr; j++) {
-                        double a = D->a[i1][j];
-                        double b = D->a[i+1][j];
-                        D->a[i1][j] = a*c - b*s;
-                        D->a[i+1][j] = a*s + b*c;
+                        double a = TC_MAT_AT(D, i1, j);
+                        double b = TC_MAT_AT(D, i+1, j);
+                        TC_MAT_AT(D, i1, j) = a*c - b*s;
+                        TC_MAT_AT(D, i+1, j) = a*s + b*c;
                     }
                     for(uint32_t j=0; j < U->nr; j++) {
-                        double a = U->a[j][i1];
-                        double b = U->a[j][i+1];
-                        U->a[j][i1] = a*c - b*s;
-                        U->a[j][i+1] = a*s + b*c;
+                        double a = TC_MAT_AT(U, j, i1);
+                        double b = TC_MAT_AT(U, j, i+1);
+                        TC_MAT_AT(U, j, i1) = a*c - b*s;
+                        TC_MAT_AT(U, j, i+1) = a*s + b*c;
                     }
                 }
                 i1++;
@@ -541,40 +750,40 @@ tc_mat_svd(
 
             /* move (i0,i1-1) down, i1 -> i0  */
             for(uint32_t j=0; j < D->nr; j++) {
-                double tmp = V->a[i1][j];
+                double tmp = TC_MAT_AT(V, i1, j);
                 for(uint32_t k=i1; k > i0; k--)
-                    V->a[k][j] = V->a[k-1][j];
-                V->a[i0][j] = tmp;
+                    TC_MAT_AT(V, k, j) = TC_MAT_AT(V, k-1, j);
+                TC_MAT_AT(V, i0, j) = tmp;
             }
 
             for(uint32_t j=0; j < D->nr; j++) {
-                double tmp = U->a[j][i1];
+                double tmp = TC_MAT_AT(U, j, i1);
                 for(uint32_t k=i1; k > i0; k--)
-                    U->a[j][k] = U->a[j][k-1];
-                U->a[j][i0] = tmp;
+                    TC_MAT_AT(U, j, k) = TC_MAT_AT(U, j, k-1);
+                TC_MAT_AT(U, j, i0) = tmp;
             }
 
             uint32_t ir = i1;
             if (ir+1 == D->nr)
                 ir--;
-            double tmp = D->a[i1][i1];
-            double tmp1 = D->a[i1][ir+1];
+            double tmp = TC_MAT_AT(D, i1, i1);
+            double tmp1 = TC_MAT_AT(D, i1, ir+1);
 
             for(uint32_t k=i1; k > i0; k--) {
-                D->a[k][k] = D->a[k-1][k-1];
+                TC_MAT_AT(D, k, k) = TC_MAT_AT(D, k-1, k-1);
                 if (k+1 < D->nc)
-                    D->a[k][k+1] = D->a[k-1][k];
+                    TC_MAT_AT(D, k, k+1) = TC_MAT_AT(D, k-1, k);
             }
 
-            D->a[i0][i0] = tmp;
-            D->a[i0][ir+1] = tmp1;
+            TC_MAT_AT(D, i0, i0) = tmp;
+            TC_MAT_AT(D, i0, ir+1) = tmp1;
             i0++;
         }
         /* For any zeros on the superdiagonal, move the
          * component to D1.
          */
         for(uint32_t i=i0; i+1 < D->nr; i++) {
-            if (fabs(D->a[i][i+1]) >= zero_threshold)
+            if (fabs(TC_MAT_AT(D, i, i+1)) >= zero_threshold)
                 continue;
             if (i == i0) {
                 i0++;
@@ -584,24 +793,24 @@ tc_mat_svd(
                 continue;
             /* move (i0,i) down, i+1 -> i0    */
             for(uint32_t j=0; j < D->nr; j++) {
-                double tmp = V->a[i+1][j];
+                double tmp = TC_MAT_AT(V, i+1, j);
                 for(uint32_t k=i+1; k > i0; k--)
-                    V->a[k][j] = V->a[k-1][j];
-                V->a[i0][j] = tmp;
+                    TC_MAT_AT(V, k, j) = TC_MAT_AT(V, k-1, j);
+                TC_MAT_AT(V, i0, j) = tmp;
             }
             for(uint32_t j=0; j < D->nr; j++) {
-                double tmp = U->a[j][i+1];
+                double tmp = TC_MAT_AT(U, j, i+1);
                 for(uint32_t k=i+1; k > i0; k--)
-                    U->a[j][k] = U->a[j][k-1];
-                U->a[j][i0] = tmp;
+                    TC_MAT_AT(U, j, k) = TC_MAT_AT(U, j, k-1);
+                TC_MAT_AT(U, j, i0) = tmp;
             }
-            double tmp = D->a[i+1][i+1];
-            double tmp1 = D->a[i][i+1];
+            double tmp = TC_MAT_AT(D, i+1, i+1);
+            double tmp1 = TC_MAT_AT(D, i, i+1);
             for(uint32_t k=i+1; k > i0; k--) {
-                D->a[k][k] = D->a[k-1][k-1];
-                D->a[k-1][k] = (k-1==i0)? tmp1: D->a[k-2][k-1];
+                TC_MAT_AT(D, k, k) = TC_MAT_AT(D, k-1, k-1);
+                TC_MAT_AT(D, k-1, k) = (k-1==i0)? tmp1: TC_MAT_AT(D, k-2, k-1);
             }
-            D->a[i0][i0] = tmp;
+            TC_MAT_AT(D, i0, i0) = tmp;
             i0++;
             if ((i+2 == D->nr) && (i0 != i))
                 i--; /* retry last term */
@@ -612,9 +821,9 @@ tc_mat_svd(
         double largest_off_diag = 0.0;
         uint32_t n_zeros_on_off_diagonal = 0;
         for(uint32_t i=i0; i+1 < D->nr; i++) {
-            if (fabs(D->a[i][i+1]) > largest_off_diag)
-                largest_off_diag = fabs(D->a[i][i+1]);
-            if (fabs(D->a[i][i+1]) < zero_threshold)
+            if (fabs(TC_MAT_AT(D, i, i+1)) > largest_off_diag)
+                largest_off_diag = fabs(TC_MAT_AT(D, i, i+1));
+            if (fabs(TC_MAT_AT(D, i, i+1)) < zero_threshold)
                 n_zeros_on_off_diagonal++;
         }
         /* Break if largest element less than threshold. */
@@ -624,17 +833,18 @@ tc_mat_svd(
         /* Treat [i0,i1] as a block.              */
         uint32_t i1 = i0;
         for(  ; i1+1 < D->nr; i1++)
-            if (fabs(D->a[i1][i1+1]) < zero_threshold)
+            if (fabs(TC_MAT_AT(D, i1, i1+1)) < zero_threshold)
                 break;
         /* Find Wilkinson shift. */
-        struct tc_mat *t = tc_mat_ctr(3, 2);
+        struct tc_mat *t = tc_ws_mat(ws, 3, 2);
         for(uint32_t i=0; i < 3; i++)
             for(uint32_t j=0; j < 2; j++)
-                t->a[i][j] = (i1+i>2)? D->a[i1+i-2][i1+j-1]: 0.0;
+                TC_MAT_AT(t, i, j) = (i1+i>2)? TC_MAT_AT(D, i1+i-2, i1+j-1): 0.0;
         double mu = tc_mat_wilkinson_shift(t);
         tc_mat_dtr(t);
-        double alpha = D->a[i0][i0] * D->a[i0][i0] - mu;
-        double beta = D->a[i0][i0] * D->a[i0][i0+1];
+        tc_ws_release(ws, mark);
+        double alpha = TC_MAT_AT(D, i0, i0) * TC_MAT_AT(D, i0, i0) - mu;
+        double beta = TC_MAT_AT(D, i0, i0) * TC_MAT_AT(D, i0, i0+1);
         /* Apply Givens rotations G from i0 to the bottom,
          * chasing the nonzero element until off the matrix
          */
@@ -644,40 +854,40 @@ tc_mat_svd(
             double c = alpha / gamma;
             double s = -beta / gamma;
             for(uint32_t j=0; j < D->nr; j++) {
-                double a = D->a[j][i+0];
-                double b = D->a[j][i+1];
-                D->a[j][i+0] = a*c - b*s;
-                D->a[j][i+1] = a*s + b*c;
+                double a = TC_MAT_AT(D, j, i+0);
+                double b = TC_MAT_AT(D, j, i+1);
+                TC_MAT_AT(D, j, i+0) = a*c - b*s;
+                TC_MAT_AT(D, j, i+1) = a*s + b*c;
             }
             for(uint32_t j=0; j < D->nc; j++) {
-                double a = V->a[i+0][j];
-                double b = V->a[i+1][j];
-                V->a[i+0][j] = a*c - b*s;
-                V->a[i+1][j] = a*s + b*c;
+                double a = TC_MAT_AT(V, i+0, j);
+                double b = TC_MAT_AT(V, i+1, j);
+                TC_MAT_AT(V, i+0, j) = a*c - b*s;
+                TC_MAT_AT(V, i+1, j) = a*s + b*c;
             }
             /* U D = (U G) (G^T D) */
-            alpha = D->a[i+0][i];
-            beta = D->a[i+1][i];
+            alpha = TC_MAT_AT(D, i+0, i);
+            beta = TC_MAT_AT(D, i+1, i);
             gamma = sqrt(alpha*alpha + beta*beta);
             if (fabs(gamma) > 0.0) {
                 c = alpha / gamma;
                 s = -beta / gamma;
                 for(uint32_t j=0; j < D->nc; j++) {
-                    double a = D->a[i+0][j];
-                    double b = D->a[i+1][j];
-                    D->a[i+0][j] = a*c - b*s;
-                    D->a[i+1][j] = a*s + b*c;
+                    double a = TC_MAT_AT(D, i+0, j);
+                    double b = TC_MAT_AT(D, i+1, j);
+                    TC_MAT_AT(D, i+0, j) = a*c - b*s;
+                    TC_MAT_AT(D, i+1, j) = a*s + b*c;
                 }
                 for(uint32_t j=0; j < U->nr; j++) {
-                    double a = U->a[j][i+0];
-                    double b = U->a[j][i+1];
-                    U->a[j][i+0] = a*c - b*s;
-                    U->a[j][i+1] = a*s + b*c;
+                    double a = TC_MAT_AT(U, j, i+0);
+                    double b = TC_MAT_AT(U, j, i+1);
+                    TC_MAT_AT(U, j, i+0) = a*c - b*s;
+                    TC_MAT_AT(U, j, i+1) = a*s + b*c;
                 }
             }
             if (i + 2 < D->nr) {
-                alpha = D->a[i][i+1];
-                beta = D->a[i][i+2];
+                alpha = TC_MAT_AT(D, i, i+1);
+                beta = TC_MAT_AT(D, i, i+2);
             }
         }
     }
@@ -685,43 +895,380 @@ tc_mat_svd(
      * from largest to smallest
      */
     for(uint32_t i=0; i+1 < D->nr; i++) {
-        double largest = fabs(D->a[i][i]);
+        double largest = fabs(TC_MAT_AT(D, i, i));
         uint32_t largest_i = i;
         for(uint32_t j=i+1; j < D->nr; j++) {
-            if (fabs(D->a[j][j]) > largest) {
+            if (fabs(TC_MAT_AT(D, j, j)) > largest) {
                 largest_i = j;
-                largest = fabs(D->a[j][j]);
+                largest = fabs(TC_MAT_AT(D, j, j));
             }
         }
         if (largest_i != i) {
             for(uint32_t j=0; j < D->nr; j++) {
-                double tmp = V->a[i][j];
-                V->a[i][j] = V->a[largest_i][j];
-                V->a[largest_i][j] = tmp;
-                tmp = U->a[j][i];
-                U->a[j][i] = U->a[j][largest_i];
-                U->a[j][largest_i] = tmp;
+                double tmp = TC_MAT_AT(V, i, j);
+                TC_MAT_AT(V, i, j) = TC_MAT_AT(V, largest_i, j);
+                TC_MAT_AT(V, largest_i, j) = tmp;
+                tmp = TC_MAT_AT(U, j, i);
+                TC_MAT_AT(U, j, i) = TC_MAT_AT(U, j, largest_i);
+                TC_MAT_AT(U, j, largest_i) = tmp;
             }
-            double tmp = D->a[i][i];
-            D->a[i][i] = D->a[largest_i][largest_i];
-            D->a[largest_i][largest_i] = tmp;
+            double tmp = TC_MAT_AT(D, i, i);
+            TC_MAT_AT(D, i, i) = TC_MAT_AT(D, largest_i, largest_i);
+            TC_MAT_AT(D, largest_i, largest_i) = tmp;
         }
-        if (D->a[i][i] < 0) {
-            D->a[i][i] = -D->a[i][i];
+        if (TC_MAT_AT(D, i, i) < 0) {
+            TC_MAT_AT(D, i, i) = -TC_MAT_AT(D, i, i);
             for(uint32_t j=0; j < D->nr; j++)
-                V->a[i][j] = -V->a[i][j];
+                TC_MAT_AT(V, i, j) = -TC_MAT_AT(V, i, j);
         }
     }
     /* just to be sure, zero out all off-diagonal terms of D */
     for(uint32_t i=0; i < D->nr; i++)
         for(uint32_t j=0; j < D->nc; j++)
             if (i != j)
-                D->a[i][j] = 0.0;
+                TC_MAT_AT(D, i, j) = 0.0;
     /* transpose V */
     tc_mat_transpose(V, V);
     return 0;
 }
 
+/****************************************************************************
+ * tc_ws                                                                    *
+ ****************************************************************************/
+
+/* A workspace is a stack of blocks that allocations are bumped out of.
+ * Offsets into it (used, mark, peak) count the bytes handed out, as if it
+ * were one block: a block chained when the top one is full starts at the
+ * offset it was chained at. tc_ws_release() pops the blocks above the
+ * mark, so a workspace large enough for its peak stays a single block */
+#define TC_WS_ROUND(n)          (((n) + TC_MAT_ALIGN - 1) & ~(size_t) (TC_MAT_ALIGN - 1))
+#define TC_WS_BLOCK_MIN         (64 * 1024)
+
+struct tc_ws_block {
+    struct tc_ws_block *prev;
+    size_t start; /* offset of the first byte of the block */
+    size_t size;
+};
+
+#define TC_WS_HDR               TC_WS_ROUND(sizeof(struct tc_ws_block))
+
+struct tc_ws {
+    struct tc_ws_block *top;
+    size_t used;
+    size_t peak;
+    size_t block_size;
+};
+
+static int
+tc_ws_push(struct tc_ws *ws, size_t size)
+{
+    struct tc_ws_block *blk = (struct tc_ws_block *) tc_aligned_alloc(TC_WS_HDR + size);
+    if (!blk)
+        return -1;
+    blk->prev = ws->top;
+    blk->start = ws->used;
+    blk->size = size;
+    ws->top = blk;
+    return 0;
+}
+
+static void
+tc_ws_pop(struct tc_ws *ws)
+{
+    struct tc_ws_block *blk = ws->top;
+    ws->top = blk->prev;
+    tc_aligned_free(blk);
+}
+
+struct tc_ws *
+tc_ws_ctr(size_t bytes)
+{
+    struct tc_ws *ws = (struct tc_ws *) malloc(sizeof(struct tc_ws));
+    if (!ws)
+        return NULL;
+    memset(ws, 0, sizeof(struct tc_ws));
+    ws->block_size = (bytes > 0)? TC_WS_ROUND(bytes): TC_WS_BLOCK_MIN;
+    if (tc_ws_push(ws, ws->block_size)) {
+        free(ws);
+        return NULL;
+    }
+    return ws;
+}
+
+void
+tc_ws_dtr(struct tc_ws *ws)
+{
+    if (!ws)
+        return;
+    while (ws->top)
+        tc_ws_pop(ws);
+    free(ws);
+}
+
+void *
+tc_ws_alloc(struct tc_ws *ws, size_t bytes)
+{
+    if (!ws || !bytes)
+        return NULL;
+    bytes = TC_WS_ROUND(bytes);
+    if (ws->used - ws->top->start + bytes > ws->top->size) {
+        if (tc_ws_push(ws, (bytes > ws->block_size)? bytes: ws->block_size))
+            return NULL;
+    }
+    void *ptr = (unsigned char *) ws->top + TC_WS_HDR + (ws->used - ws->top->start);
+    ws->used += bytes;
+    if (ws->peak < ws->used)
+        ws->peak = ws->used;
+    return ptr;
+}
+
+size_t
+tc_ws_mark(const struct tc_ws *ws)
+{
+    return ws? ws->used: 0;
+}
+
+void
+tc_ws_release(struct tc_ws *ws, size_t mark)
+{
+    if (!ws || (mark > ws->used))
+        return;
+    while (ws->top->prev && (ws->top->start >= mark))
+        tc_ws_pop(ws);
+    ws->used = mark;
+}
+
+size_t
+tc_ws_peak(const struct tc_ws *ws)
+{
+    return ws? ws->peak: 0;
+}
+
+struct tc_mat *
+tc_ws_mat(struct tc_ws *ws, uint32_t nr_, uint32_t nc_)
+{
+    if (!ws)
+        return tc_mat_ctr(nr_, nc_);
+    struct tc_mat *A = (struct tc_mat *) tc_ws_alloc(ws, sizeof(struct tc_mat));
+    if (!A)
+        return NULL;
+    memset(A, 0, sizeof(struct tc_mat));
+    A->ws = ws;
+    tc_mat_resize(A, nr_, nc_);
+    return A;
+}
+
+/****************************************************************************
+ * tc_pool                                                                  *
+ ****************************************************************************/
+
+/* A fixed set of threads that each run one contiguous slice of an index
+ * range [0, n) and then wait for the next range. Every stage handed to
+ * the pool writes disjoint elements, computed exactly as the serial loop
+ * would, so results do not depend on the number of threads. Slice s of
+ * nthreads is always run by thread s, so it may use per-thread scratch */
+typedef void (*tc_pool_fn)(void *ctx, uint32_t slice, uint32_t begin, uint32_t end);
+
+struct tc_pool;
+
+struct tc_pool_worker {
+    struct tc_pool *pool;
+    uint32_t id;
+    pthread_t thread;
+};
+
+struct tc_pool {
+    struct tc_pool_worker *workers;
+    uint32_t nthreads; /* including the calling thread */
+    pthread_mutex_t mtx;
+    pthread_cond_t cv_work;
+    pthread_cond_t cv_done;
+    uint64_t gen; /* bumped once per tc_pool_run() */
+    uint32_t pending; /* workers still running the current range */
+    int stop;
+    tc_pool_fn fn;
+    void *ctx;
+    uint32_t n;
+};
+
+static void
+tc_pool_slice(uint32_t n, uint32_t nthreads, uint32_t id, uint32_t *begin, uint32_t *end)
+{
+    *begin = (uint32_t) (((uint64_t) n * id) / nthreads);
+    *end = (uint32_t) (((uint64_t) n * (id + 1)) / nthreads);
+}
+
+static void *
+tc_pool_main(void *arg)
+{
+    struct tc_pool_worker *worker = (struct tc_pool_worker *) arg;
+    struct tc_pool *pool = worker->pool;
+    uint64_t gen = 0;
+
+    pthread_mutex_lock(&pool->mtx);
+    for(;;) {
+        while (!pool->stop && (pool->gen == gen))
+            pthread_cond_wait(&pool->cv_work, &pool->mtx);
+        if (pool->stop)
+            break;
+        gen = pool->gen;
+        tc_pool_fn fn = pool->fn;
+        void *ctx = pool->ctx;
+        uint32_t begin, end;
+        tc_pool_slice(pool->n, pool->nthreads, worker->id, &begin, &end);
+        pthread_mutex_unlock(&pool->mtx);
+
+        if (begin < end)
+            fn(ctx, worker->id, begin, end);
+
+        pthread_mutex_lock(&pool->mtx);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->cv_done);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+/* Return NULL (run serially) if nthreads <= 1. If fewer threads can be
+ * started than asked for, the pool runs with those */
+static struct tc_pool *
+tc_pool_ctr(uint32_t nthreads)
+{
+    if (nthreads <= 1)
+        return NULL;
+    struct tc_pool *pool = (struct tc_pool *) malloc(sizeof(struct tc_pool));
+    if (!pool)
+        return NULL;
+    pool->workers = (struct tc_pool_worker *) malloc(sizeof(struct tc_pool_worker) * nthreads);
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->cv_work, NULL);
+    pthread_cond_init(&pool->cv_done, NULL);
+    pool->gen = 0;
+    pool->pending = 0;
+    pool->stop = 0;
+    pool->fn = NULL;
+    pool->ctx = NULL;
+    pool->n = 0;
+    pool->nthreads = 1;
+    for(uint32_t id=1; id < nthreads; id++) {
+        pool->workers[id].pool = pool;
+        pool->workers[id].id = id;
+        if (pthread_create(&pool->workers[id].thread, NULL, tc_pool_main, &pool->workers[id]))
+            break;
+        pool->nthreads = id + 1;
+    }
+    return pool;
+}
+
+static void
+tc_pool_dtr(struct tc_pool *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->mtx);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cv_work);
+    pthread_mutex_unlock(&pool->mtx);
+    for(uint32_t id=1; id < pool->nthreads; id++)
+        pthread_join(pool->workers[id].thread, NULL);
+    pthread_cond_destroy(&pool->cv_done);
+    pthread_cond_destroy(&pool->cv_work);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool->workers);
+    free(pool);
+}
+
+/* fn(ctx, slice, begin, end) over slices of [0, n), the first slice on
+ * the calling thread. Return once every slice is done */
+static void
+tc_pool_run(struct tc_pool *pool, uint32_t n, tc_pool_fn fn, void *ctx)
+{
+    if (!pool || (pool->nthreads <= 1) || (n < 2)) {
+        if (n)
+            fn(ctx, 0, 0, n);
+        return;
+    }
+    pthread_mutex_lock(&pool->mtx);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n = n;
+    pool->pending = pool->nthreads - 1;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->cv_work);
+    pthread_mutex_unlock(&pool->mtx);
+
+    uint32_t begin, end;
+    tc_pool_slice(n, pool->nthreads, 0, &begin, &end);
+    if (begin < end)
+        fn(ctx, 0, begin, end);
+
+    pthread_mutex_lock(&pool->mtx);
+    while (pool->pending)
+        pthread_cond_wait(&pool->cv_done, &pool->mtx);
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+struct tc_pool_mult_job {
+    struct tc_mat *C;
+    const struct tc_mat *A;
+    const struct tc_mat *B;
+};
+
+static void
+tc_pool_mult_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_pool_mult_job *job = (struct tc_pool_mult_job *) ctx;
+    (void) slice;
+    tc_mat_mult_rows(job->C, job->A, job->B, begin, end);
+}
+
+static void
+tc_pool_mult_tn_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_pool_mult_job *job = (struct tc_pool_mult_job *) ctx;
+    (void) slice;
+    if (job->C->nr > 1)
+        tc_mat_mult_tn_part(job->C, job->A, job->B, begin, end, 0, job->C->nc);
+    else
+        tc_mat_mult_tn_part(job->C, job->A, job->B, 0, 1, begin, end);
+}
+
+/* tc_mat_mult() with the rows of C split over the pool. C must not alias
+ * A or B */
+static void
+tc_pool_mult(struct tc_pool *pool, struct tc_mat *C, const struct tc_mat *A,
+    const struct tc_mat *B)
+{
+    if (!pool || (A->nc != B->nr) || (C->nr == 1)) {
+        tc_mat_mult(C, A, B);
+        return;
+    }
+    if ((C->nc != B->nc) || (C->nr != A->nr))
+        tc_mat_resize(C, A->nr, B->nc);
+    struct tc_pool_mult_job job = { C, A, B };
+    tc_pool_run(pool, C->nr, tc_pool_mult_fn, &job);
+}
+
+/* tc_mat_mult_tn() with the rows of C, or the columns of a row vector C,
+ * split over the pool. C must not alias A or B */
+static void
+tc_pool_mult_tn(struct tc_pool *pool, struct tc_mat *C, const struct tc_mat *A,
+    const struct tc_mat *B)
+{
+    if (!pool || (A->nr != B->nr)) {
+        tc_mat_mult_tn(C, A, B);
+        return;
+    }
+    if ((C->nr != A->nc) || (C->nc != B->nc))
+        tc_mat_resize(C, A->nc, B->nc);
+    struct tc_pool_mult_job job = { C, A, B };
+    tc_pool_run(pool, (C->nr > 1)? C->nr: C->nc, tc_pool_mult_tn_fn, &job);
+}
+
 /****************************************************************************
  * tc_wgt                                                                   *
  ****************************************************************************/
@@ -740,16 +1287,16 @@ tc_wgt_normalize(struct tc_mat *wgt)
     double sum = 0.0;
     for(uint32_t i=0; i < wgt->nr; i++) {
         for(uint32_t j=0; j < wgt->nc; j++) {
-            if (wgt->a[i][j] < 0.0)
-               wgt->a[i][j] = -wgt->a[i][j];
-            sum += wgt->a[i][j];
+            if (TC_MAT_AT(wgt, i, j) < 0.0)
+               TC_MAT_AT(wgt, i, j) = -TC_MAT_AT(wgt, i, j);
+            sum += TC_MAT_AT(wgt, i, j);
         }
     }
     if (sum == 0.0)
         return;
     for(uint32_t i=0; i < wgt->nr; i++)
         for(uint32_t j=0; j < wgt->nc; j++)
-            wgt->a[i][j] = wgt->a[i][j] / sum;
+            TC_MAT_AT(wgt, i, j) = TC_MAT_AT(wgt, i, j) / sum;
 }
 
 /* tc_wgt_mean: weighted mean on the j-th column of A
@@ -767,12 +1314,12 @@ tc_wgt_mean(const struct tc_mat *wgt, const struct tc_mat *A, uint32_t j,
     double sum = 0.0;
     double sum_wgts = 0.0;
     for(uint32_t i=0; i < A->nr; i++) {
-        double w = wgt->a[i][0];
+        double w = TC_MAT_AT(wgt, i, 0);
         if (w <= 0.0)
             continue;
-        if (A->a[i][j] == NA)
+        if (TC_MAT_AT(A, i, j) == NA)
             continue;
-        sum += w * A->a[i][j];
+        sum += w * TC_MAT_AT(A, i, j);
         sum_wgts += w;
     }
     return (sum_wgts > 0.0)? sum / sum_wgts: 0.0;
@@ -786,62 +1333,424 @@ tc_wgt_mean(const struct tc_mat *wgt, const struct tc_mat *A, uint32_t j,
  * is equal to the sum of the weights above, and if there is no exact midpoint
  * a weighted average of the two closest values.
  */
-struct vecdouble { double wgt; double value; };
-int vecdouble_cmp(const void *a, const void *b) {
-    if (!a || !b) return 0;
-    const struct vecdouble *aptr = (const struct vecdouble *) a;
-    const struct vecdouble *bptr = (const struct vecdouble *) b;
-    return (aptr->value < bptr->value)? -1: 1;
-}
-static double
+double
 tc_wgt_median(const struct tc_mat *wgt, const struct tc_mat *A, uint32_t j,
     double NA)
+{
+    return tc_wgt_median_scratch(wgt, A, j, NA, NULL);
+}
+
+/* Below this many values the selection sorts the rest of the window */
+#define TC_WGT_SELECT_SORT      16
+
+/* How close to half the total the weight below or up to the median may
+ * come before the selection defers to the sorted scan */
+#define TC_WGT_SELECT_MARGIN    1e-7
+
+/* Order by value, equal values by weight, so that the sorted scan adds
+ * the weights in one well-defined order */
+static int
+tc_wgt_value_cmp(const void *a, const void *b)
+{
+    const struct tc_wgt_value *aptr = (const struct tc_wgt_value *) a;
+    const struct tc_wgt_value *bptr = (const struct tc_wgt_value *) b;
+    if (aptr->value != bptr->value)
+        return (aptr->value < bptr->value)? -1: 1;
+    if (aptr->wgt != bptr->wgt)
+        return (aptr->wgt < bptr->wgt)? -1: 1;
+    return 0;
+}
+
+static void
+tc_wgt_value_swap(struct tc_wgt_value *a, struct tc_wgt_value *b)
+{
+    struct tc_wgt_value t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/* insertion sort of v[0..n) by value */
+static void
+tc_wgt_value_sort(struct tc_wgt_value *v, uint32_t n)
+{
+    for(uint32_t i=1; i < n; i++) {
+        struct tc_wgt_value x = v[i];
+        uint32_t k = i;
+        for( ; (k > 0) && (v[k-1].value > x.value); k--)
+            v[k] = v[k-1];
+        v[k] = x;
+    }
+}
+
+/* Weighted median of v[0..n) by sorting: iterate through the sorted values
+ * until mid_wgts is passed */
+static double
+tc_wgt_median_sorted(struct tc_wgt_value *v, uint32_t n, double mid_wgts)
+{
+    qsort(v, n, sizeof(struct tc_wgt_value), tc_wgt_value_cmp);
+    double median = v[0].value;
+    double sum = v[0].wgt;
+    uint32_t i;
+    for(i=1; (i < n) && (sum < mid_wgts); i++) {
+        median = v[i].value;
+        sum += v[i].wgt;
+    }
+    /* if within 8 decimal places of half, then average the values */
+    if ((i < n) && (fabs(sum - mid_wgts) < 1e-8))
+        median = 0.5*(median + v[i].value);
+    return median;
+}
+
+/* Weighted median of v[0..n), whose weights add up to sum_wgts in the
+ * order they were added. v is reordered.
+ *
+ * The values are not sorted. A quickselect narrows the window [lo, hi) to
+ * the smallest value x whose weight, together with that of all smaller
+ * values, passes half the total. It carries the weight of the values left
+ * of the window and the smallest value right of it. The pivot is the
+ * median of three, so the steps are deterministic, and the expected cost
+ * is O(N).
+ *
+ * Unless the weight below x or up to x is within TC_WGT_SELECT_MARGIN of
+ * half, the median is x whatever order the weights are added in. Near an
+ * exact midpoint (e.g. equal weights and an even count) the average or not
+ * depends on the rounding of the running sum, so that case is settled by
+ * the sorted scan */
+static double
+tc_wgt_median_select(struct tc_wgt_value *v, uint32_t nwgts, double sum_wgts)
+{
+    double mid_wgts = sum_wgts / 2.0;
+
+    /* Is there a median to look for? */
+    if (nwgts == 0)
+        return 0.0;
+
+    uint32_t lo = 0;
+    uint32_t hi = nwgts;
+    double below = 0.0; /* weight of the values left of lo */
+    double median = 0.0;
+    double wbelow = 0.0; /* weight of the values less than the median */
+    double wupto = 0.0; /* and up to and including it */
+    for(;;) {
+        if (hi - lo <= TC_WGT_SELECT_SORT) {
+            tc_wgt_value_sort(v + lo, hi - lo);
+            uint32_t i = lo;
+            wbelow = below;
+            wupto = below + v[i].wgt;
+            while ((i + 1 < hi) && ((wupto < mid_wgts) || (v[i + 1].value == v[i].value))) {
+                if (v[i + 1].value != v[i].value)
+                    wbelow = wupto;
+                wupto += v[++i].wgt;
+            }
+            median = v[i].value;
+            break;
+        }
+
+        double a = v[lo].value;
+        double b = v[lo + (hi - lo) / 2].value;
+        double c = v[hi - 1].value;
+        double pivot = (a < b)? ((b < c)? b: ((a < c)? c: a))
+                              : ((a < c)? a: ((b < c)? c: b));
+
+        /* [lo, lt) < pivot, [lt, gt) == pivot, [gt, hi) > pivot */
+        uint32_t lt = lo;
+        uint32_t gt = hi;
+        uint32_t i = lo;
+        double wl = 0.0;
+        double we = 0.0;
+        while (i < gt) {
+            if (v[i].value < pivot) {
+                wl += v[i].wgt;
+                tc_wgt_value_swap(&v[lt++], &v[i++]);
+            } else if (v[i].value > pivot)
+                tc_wgt_value_swap(&v[i], &v[--gt]);
+            else
+                we += v[i++].wgt;
+        }
+
+        if ((below + wl >= mid_wgts) && (lt > lo)) {
+            hi = lt;
+            continue;
+        }
+        wbelow = below + wl;
+        wupto = wbelow + we;
+        if ((wupto >= mid_wgts) || (gt == hi)) {
+            median = pivot;
+            break;
+        }
+        below = wupto;
+        lo = gt;
+    }
+
+    if ((fabs(wbelow - mid_wgts) < TC_WGT_SELECT_MARGIN)
+        || (fabs(wupto - mid_wgts) < TC_WGT_SELECT_MARGIN))
+        median = tc_wgt_median_sorted(v, nwgts, mid_wgts);
+    return median;
+}
+
+double
+tc_wgt_median_scratch(const struct tc_mat *wgt, const struct tc_mat *A,
+    uint32_t j, double NA, struct tc_wgt_value *v)
 {
     if (!wgt || !A || !A->nr || !A->nc
         || (wgt->nr != A->nr) || (j >= A->nc))
         return 0.0;
 
-    struct vecdouble *v = (struct vecdouble *)
-        malloc(sizeof(struct vecdouble) * A->nr);
+    struct tc_wgt_value *buf = NULL;
+    if (!v) {
+        buf = (struct tc_wgt_value *) malloc(sizeof(struct tc_wgt_value) * A->nr);
+        v = buf;
+    }
     uint32_t nwgts = 0;
     double sum_wgts = 0.0;
     for(uint32_t i=0; i < A->nr; i++) {
-        if (A->a[i][j] == NA)
+        if (TC_MAT_AT(A, i, j) == NA)
            continue; /* skip NA values */
-        v[nwgts].value = A->a[i][j];
-        v[nwgts].wgt = wgt->a[i][0];
-        sum_wgts += wgt->a[i][0];
+        v[nwgts].value = TC_MAT_AT(A, i, j);
+        v[nwgts].wgt = TC_MAT_AT(wgt, i, 0);
+        sum_wgts += TC_MAT_AT(wgt, i, 0);
         nwgts++;
     }
-    double mid_wgts = sum_wgts / 2.0;
+    double median = tc_wgt_median_select(v, nwgts, sum_wgts);
+    free(buf);
+    return median;
+}
 
-    /* Is there a median to look for? */
-    if (nwgts == 0) return 0.0;
+/* Limits for the power iteration in tc_wgt_prin_comp. Both are fixed so
+ * that every node runs exactly the same sequence of operations; when the
+ * iteration does not settle within them the SVD path is taken instead. */
+#define TC_PC1_MAX_ITER         10000
+#define TC_PC1_TOL              1e-13
+/* Entries of the first component this close (relative) to its largest
+ * magnitude are ties for the sign convention */
+#define TC_SIGN_TIE_TOL         1e-9
+
+/* X = M minus its column weighted averages */
+static void
+tc_wgt_center(
+    struct tc_pool *pool,
+    struct tc_ws *ws,
+    const struct tc_mat *wgt,
+    const struct tc_mat *M,
+    struct tc_mat *x_mat)
+{
+    tc_mat_resize(x_mat, M->nr, M->nc);
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *avg = tc_ws_mat(ws, 1, M->nc);
+    tc_pool_mult_tn(pool, avg, wgt, M);
+    for(uint32_t i=0; i < M->nr; i++) {
+        const double *m = tc_mat_row(M, i);
+        const double *mu = tc_mat_row(avg, 0);
+        double *x = tc_mat_row(x_mat, i);
+        for(uint32_t j=0; j < M->nc; j++)
+            x[j] = m[j] - mu[j];
+    }
+    tc_mat_dtr(avg);
+    tc_ws_release(ws, mark);
+}
 
-    /* iterate through the sorted values until mid_wgts is passed */
-    qsort(v, nwgts, sizeof(struct vecdouble), vecdouble_cmp);
-    double median = v[0].value;
-    double sum = v[0].wgt;
-    uint32_t i;
-    for(i=1; (i < nwgts) && (sum < mid_wgts); i++) {
-        median = v[i].value;
-        sum += v[i].wgt;
+/* wCVM = weighted covariance matrix of X, accumulated one row of X at a
+ * time into the lower triangle, then scaled and mirrored */
+static void
+tc_wgt_cov(
+    const struct tc_mat *wgt,
+    const struct tc_mat *x_mat,
+    struct tc_mat *wCVM)
+{
+    double wgts2 = 0.0;
+    for(uint32_t i=0; i < x_mat->nr; i++)
+        wgts2 += TC_MAT_AT(wgt, i, 0) * TC_MAT_AT(wgt, i, 0);
+    double factor = 1.0/(1.0 - wgts2);
+    tc_mat_resize(wCVM, x_mat->nc, x_mat->nc);
+    for(uint32_t i=0; i < x_mat->nc; i++)
+        memset(tc_mat_row(wCVM, i), 0, sizeof(double) * x_mat->nc);
+    for(uint32_t k=0; k < x_mat->nr; k++) {
+        const double *x = tc_mat_row(x_mat, k);
+        double w = TC_MAT_AT(wgt, k, 0);
+        for(uint32_t i=0; i < x_mat->nc; i++)
+            tc_mat_axpy(tc_mat_row(wCVM, i), w * x[i], x, i + 1);
+    }
+    for(uint32_t i=0; i < x_mat->nc; i++) {
+        for(uint32_t j=0; j <= i; j++) {
+            TC_MAT_AT(wCVM, i, j) =
+            TC_MAT_AT(wCVM, j, i) = factor * TC_MAT_AT(wCVM, i, j);
+        }
     }
-    /* if within 8 decimal places of half, then average the values */
-    if ((i < nwgts) && (fabs(sum - mid_wgts) < 1e-8))
-        median = 0.5*(median + v[i].value);
-    free(v);
-    return median;
+}
+
+/* Flip v so that its first entry within TC_SIGN_TIE_TOL (relative) of the
+ * largest magnitude is positive. Eigenvectors are only defined up to sign.
+ * Ties are common (two camps of voters give every entry the same
+ * magnitude) and the power and SVD paths round them differently, so the
+ * plain largest entry could come out with opposite signs. With the
+ * tolerance the paths agree unless an entry lies within their rounding of
+ * its edge. */
+static void
+tc_wgt_sign_normalize(struct tc_mat *v)
+{
+    double vmax = 0.0;
+    for(uint32_t i=0; i < v->nr; i++)
+        if (fabs(TC_MAT_AT(v, i, 0)) > vmax)
+            vmax = fabs(TC_MAT_AT(v, i, 0));
+    uint32_t imax = 0;
+    while ((imax + 1 < v->nr) && (fabs(TC_MAT_AT(v, imax, 0)) < (1.0 - TC_SIGN_TIE_TOL) * vmax))
+        imax++;
+    if (v->nr && TC_MAT_AT(v, imax, 0) < 0.0)
+        for(uint32_t i=0; i < v->nr; i++)
+            TC_MAT_AT(v, i, 0) = -TC_MAT_AT(v, i, 0);
+}
+
+/* Leading eigenvector of X^T W X by power iteration. The covariance matrix
+ * is applied as X^T (W (X v)), so each step costs O(nr*nc) and wCVM is never
+ * formed. The positive scale factor of the covariance does not change its
+ * eigenvectors and is left out. Return 0 once successive iterates differ by
+ * at most TC_PC1_TOL in every entry, 1 if the iteration does not converge
+ * (or X^T W X is zero). */
+static int
+tc_wgt_pc1_power(
+    struct tc_pool *pool,
+    struct tc_ws *ws,
+    const struct tc_mat *wgt,
+    const struct tc_mat *x_mat,
+    struct tc_mat *v)
+{
+    const uint32_t nc = x_mat->nc;
+    tc_mat_resize(v, nc, 1);
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *y = tc_ws_mat(ws, x_mat->nr, 1);
+    struct tc_mat *z = tc_ws_mat(ws, nc, 1);
+
+    /* Fixed start vector; its entries are distinct so that it is not
+     * orthogonal to the leading eigenvector for symmetric ballots */
+    double norm = 0.0;
+    for(uint32_t j=0; j < nc; j++) {
+        TC_MAT_AT(v, j, 0) = 1.0 + (double)j / nc;
+        norm += TC_MAT_AT(v, j, 0) * TC_MAT_AT(v, j, 0);
+    }
+    norm = sqrt(norm);
+    for(uint32_t j=0; j < nc; j++)
+        TC_MAT_AT(v, j, 0) /= norm;
+
+    int rc = 1;
+    for(uint32_t iter=0; (iter < TC_PC1_MAX_ITER) && rc; iter++) {
+        tc_pool_mult(pool, y, x_mat, v);
+        for(uint32_t i=0; i < x_mat->nr; i++)
+            TC_MAT_AT(y, i, 0) *= TC_MAT_AT(wgt, i, 0);
+        tc_pool_mult_tn(pool, z, x_mat, y);
+
+        norm = 0.0;
+        for(uint32_t j=0; j < nc; j++)
+            norm += TC_MAT_AT(z, j, 0) * TC_MAT_AT(z, j, 0);
+        norm = sqrt(norm);
+        if (norm == 0.0)
+            break;
+
+        /* X^T W X is positive semi-definite, so the iterates never flip
+         * sign and can be compared entry by entry */
+        double diff = 0.0;
+        for(uint32_t j=0; j < nc; j++) {
+            double vj = TC_MAT_AT(z, j, 0) / norm;
+            double d = fabs(vj - TC_MAT_AT(v, j, 0));
+            if (d > diff)
+                diff = d;
+            TC_MAT_AT(v, j, 0) = vj;
+        }
+        if (diff <= TC_PC1_TOL)
+            rc = 0;
+    }
+
+    tc_mat_dtr(y);
+    tc_mat_dtr(z);
+    tc_ws_release(ws, mark);
+    return rc;
+}
+
+/* Loadings from the SVD of the full weighted covariance matrix */
+static int
+tc_wgt_pc1_svd(
+    struct tc_ws *ws,
+    const struct tc_mat *wgt,
+    const struct tc_mat *x_mat,
+    struct tc_mat *loadings)
+{
+    tc_mat_resize(loadings, x_mat->nc, 1);
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *wCVM = tc_ws_mat(ws, 0, 0);
+    tc_wgt_cov(wgt, x_mat, wCVM);
+    struct tc_mat *U = tc_ws_mat(ws, 0, 0);
+    struct tc_mat *D = tc_ws_mat(ws, 0, 0);
+    struct tc_mat *V = tc_ws_mat(ws, 0, 0);
+    int rc = tc_mat_svd(wCVM, U, D, V);
+    if (!rc) {
+        for(uint32_t i=0; i < x_mat->nc; i++)
+            TC_MAT_AT(loadings, i, 0) = TC_MAT_AT(U, i, 0);
+    }
+    tc_mat_dtr(wCVM);
+    tc_mat_dtr(U);
+    tc_mat_dtr(D);
+    tc_mat_dtr(V);
+    tc_ws_release(ws, mark);
+    return rc;
+}
+
+/* tc_wgt_prin_comp() with the products split over the pool and the
+ * temporaries in ws. loadings and scores are sized before any temporary
+ * is taken, so that they may live in ws as well */
+static int
+tc_wgt_prin_comp_pool(
+    struct tc_pool *pool,
+    struct tc_ws *ws,
+    const struct tc_mat *wgt,
+    const struct tc_mat *M,
+    struct tc_mat *loadings,
+    struct tc_mat *scores)
+{
+    if (!wgt || !M || !loadings || !scores)
+        return -1;
+    if ((M->nr <= 1) || (wgt->nr != M->nr))
+        return -1;
+
+    tc_mat_resize(loadings, M->nc, 1);
+    tc_mat_resize(scores, M->nr, 1);
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *x_mat = tc_ws_mat(ws, M->nr, M->nc);
+    tc_wgt_center(pool, ws, wgt, M, x_mat);
+    int rc = 0;
+    if (tc_wgt_pc1_power(pool, ws, wgt, x_mat, loadings))
+        rc = tc_wgt_pc1_svd(ws, wgt, x_mat, loadings);
+    if (!rc) {
+        tc_wgt_sign_normalize(loadings);
+        tc_pool_mult(pool, scores, x_mat, loadings);
+    }
+    tc_mat_dtr(x_mat);
+    tc_ws_release(ws, mark);
+    return rc;
 }
 
 /* tc_wgt_prin_comp
+ * X = M minus its column weighted averages
+ * loadings = leading eigenvector of the weighted covariance matrix of M,
+ *            by power iteration, falling back to the SVD of wCVM
+ * scores = X * loadings
+ */
+int
+tc_wgt_prin_comp(
+    const struct tc_mat *wgt /* Reputation Vector */,
+    const struct tc_mat *M /* Vote Matrix*/,
+    struct tc_mat *loadings,
+    struct tc_mat *scores)
+{
+    return tc_wgt_prin_comp_pool(NULL, NULL, wgt, M, loadings, scores);
+}
+
+/* tc_wgt_prin_comp_svd
  * wCVM = weighted covariance matrix of M
  * U D V^T = singular value decomposition of wCVM
  * loadings = first column of U
  * scores = (M-colavgs(M)) * loadings
  */
 int
-tc_wgt_prin_comp(
+tc_wgt_prin_comp_svd(
     const struct tc_mat *wgt /* Reputation Vector */,
     const struct tc_mat *M /* Vote Matrix*/,
     struct tc_mat *loadings,
@@ -852,68 +1761,162 @@ tc_wgt_prin_comp(
     if ((M->nr <= 1) || (wgt->nr != M->nr))
         return -1;
 
-    int rc = 0;
-
-    /* X = M minus its column weighted averages */
     struct tc_mat *x_mat = tc_mat_ctr(M->nr, M->nc);
-    double **x = (double **) x_mat->a;
-    for(uint32_t j=0; j < M->nc; j++) {
-        double avg = 0.0;
-        for(uint32_t i=0; i < M->nr; i++)
-            avg += wgt->a[i][0] * M->a[i][j];
-        for(uint32_t i=0; i < M->nr; i++)
-            x[i][j] = M->a[i][j] - avg;
-    }
-    /* wCVM = weighted covariance matrix of M */
-    double wgts2 = 0.0;
-    for(uint32_t i=0; i < M->nr; i++)
-        wgts2 += wgt->a[i][0] * wgt->a[i][0];
-    double factor = 1.0/(1.0 - wgts2);
-    struct tc_mat *wCVM = tc_mat_ctr(M->nc, M->nc);
-    for(uint32_t i=0; i < M->nc; i++) {
-        for(uint32_t j=0; j <= i; j++) {
-            double sum = 0.0;
-            for(uint32_t k=0; k < M->nr; k++)
-                sum += wgt->a[k][0] * x[k][i] * x[k][j];
-            wCVM->a[i][j] =
-            wCVM->a[j][i] = factor * sum;
-        }
-    }
-    /* SVD of wCVM */
-    struct tc_mat *U = tc_mat_ctr(0, 0);
-    struct tc_mat *D = tc_mat_ctr(0, 0);
-    struct tc_mat *V = tc_mat_ctr(0, 0);
-    rc = tc_mat_svd(wCVM, U, D, V);
+    tc_wgt_center(NULL, NULL, wgt, M, x_mat);
+    int rc = tc_wgt_pc1_svd(NULL, wgt, x_mat, loadings);
     if (!rc) {
-        tc_mat_resize(loadings, M->nc, 1);
-        for(uint32_t i=0; i < M->nc; i++)
-            loadings->a[i][0] = U->a[i][0];
+        tc_wgt_sign_normalize(loadings);
         tc_mat_mult(scores, x_mat, loadings);
     }
-
-    tc_mat_dtr(wCVM);
-    tc_mat_dtr(U);
-    tc_mat_dtr(D);
-    tc_mat_dtr(V);
     tc_mat_dtr(x_mat);
     return rc;
 }
 
+/****************************************************************************
+ * tc_spmat                                                                 *
+ ****************************************************************************/
+
+/* The entries are counted into their columns and then placed, row after
+ * row, so each column comes out by increasing row */
+struct tc_spmat *
+tc_spmat_ctr_rows(uint32_t nr, uint32_t nc, const uint32_t *rowptr,
+    const uint32_t *colidx, const double *val)
+{
+    const uint32_t nnz = nr? rowptr[nr]: 0;
+    struct tc_spmat *S = (struct tc_spmat *) calloc(1, sizeof(struct tc_spmat));
+    if (!S)
+        return NULL;
+    S->nr = nr;
+    S->nc = nc;
+    S->colptr = (uint32_t *) calloc((size_t) nc + 1, sizeof(uint32_t));
+    S->rowidx = (uint32_t *) malloc(sizeof(uint32_t) * (nnz? nnz: 1));
+    S->val = (double *) malloc(sizeof(double) * (nnz? nnz: 1));
+    if (!S->colptr || !S->rowidx || !S->val) {
+        tc_spmat_dtr(S);
+        return NULL;
+    }
+    for(uint32_t k=0; k < nnz; k++) {
+        if (colidx[k] >= nc) {
+            tc_spmat_dtr(S);
+            return NULL;
+        }
+        S->colptr[colidx[k] + 1]++;
+    }
+    for(uint32_t j=0; j < nc; j++)
+        S->colptr[j + 1] += S->colptr[j];
+
+    /* colptr[j] is the next free entry of column j while placing */
+    for(uint32_t i=0; i < nr; i++) {
+        for(uint32_t k=rowptr[i]; k < rowptr[i + 1]; k++) {
+            uint32_t n = S->colptr[colidx[k]]++;
+            S->rowidx[n] = i;
+            S->val[n] = val[k];
+        }
+    }
+    for(uint32_t j=nc; j > 0; j--)
+        S->colptr[j] = S->colptr[j - 1];
+    S->colptr[0] = 0;
+    return S;
+}
+
+void
+tc_spmat_dtr(struct tc_spmat *S)
+{
+    if (!S)
+        return;
+    free(S->val);
+    free(S->rowidx);
+    free(S->colptr);
+    free(S);
+}
+
+void
+tc_spmat_fill(struct tc_mat *A, const struct tc_spmat *S, double NA)
+{
+    if (!A || !S)
+        return;
+    tc_mat_resize(A, S->nr, S->nc);
+    for(uint32_t i=0; i < A->nr; i++) {
+        double *a = tc_mat_row(A, i);
+        for(uint32_t j=0; j < A->nc; j++)
+            a[j] = NA;
+    }
+    for(uint32_t j=0; j < S->nc; j++)
+        for(uint32_t k=S->colptr[j]; k < S->colptr[j + 1]; k++)
+            TC_MAT_AT(A, S->rowidx[k], j) = S->val[k];
+}
+
+/* tc_wgt_mean on the entries of the j-th column of S */
+static double
+tc_spmat_wgt_mean(const struct tc_mat *wgt, const struct tc_spmat *S, uint32_t j)
+{
+    double sum = 0.0;
+    double sum_wgts = 0.0;
+    for(uint32_t k=S->colptr[j]; k < S->colptr[j + 1]; k++) {
+        double w = TC_MAT_AT(wgt, S->rowidx[k], 0);
+        if (w <= 0.0)
+            continue;
+        sum += w * S->val[k];
+        sum_wgts += w;
+    }
+    return (sum_wgts > 0.0)? sum / sum_wgts: 0.0;
+}
+
+/* tc_wgt_median_scratch on the entries of the j-th column of S */
+static double
+tc_spmat_wgt_median(const struct tc_mat *wgt, const struct tc_spmat *S,
+    uint32_t j, struct tc_wgt_value *v)
+{
+    uint32_t nwgts = 0;
+    double sum_wgts = 0.0;
+    for(uint32_t k=S->colptr[j]; k < S->colptr[j + 1]; k++) {
+        v[nwgts].value = S->val[k];
+        v[nwgts].wgt = TC_MAT_AT(wgt, S->rowidx[k], 0);
+        sum_wgts += v[nwgts].wgt;
+        nwgts++;
+    }
+    return tc_wgt_median_select(v, nwgts, sum_wgts);
+}
+
 /****************************************************************************
  * tc_vote                                                                  *
  ****************************************************************************/
 
 struct tc_vote *
 tc_vote_ctr(uint32_t nr, uint32_t nc)
+{
+    return tc_vote_ctr_mat(tc_mat_ctr(nr, nc));
+}
+
+struct tc_vote *
+tc_vote_ctr_mat(struct tc_mat *M)
 {
     struct tc_vote *ptr = (struct tc_vote *) malloc(sizeof(struct tc_vote));
-    ptr->nr = nr;
-    ptr->nc = nc;
-    ptr->M = tc_mat_ctr(nr, nc);
+    ptr->nr = M->nr;
+    ptr->nc = M->nc;
+    ptr->nthreads = 1;
+    ptr->M = M;
+    ptr->S = NULL;
     for(uint32_t i=0; i < TC_VOTE_NCOLS; i++)
-        ptr->cvecs[i] = tc_mat_ctr(1, nc);
+        ptr->cvecs[i] = tc_mat_ctr(1, ptr->nc);
     for(uint32_t i=0; i < TC_VOTE_NROWS; i++)
-        ptr->rvecs[i] = tc_mat_ctr(nr, 1);
+        ptr->rvecs[i] = tc_mat_ctr(ptr->nr, 1);
+    return ptr;
+}
+
+struct tc_vote *
+tc_vote_ctr_sparse(struct tc_spmat *S)
+{
+    struct tc_vote *ptr = (struct tc_vote *) malloc(sizeof(struct tc_vote));
+    ptr->nr = S->nr;
+    ptr->nc = S->nc;
+    ptr->nthreads = 1;
+    ptr->M = NULL;
+    ptr->S = S;
+    for(uint32_t i=0; i < TC_VOTE_NCOLS; i++)
+        ptr->cvecs[i] = tc_mat_ctr(1, ptr->nc);
+    for(uint32_t i=0; i < TC_VOTE_NROWS; i++)
+        ptr->rvecs[i] = tc_mat_ctr(ptr->nr, 1);
     return ptr;
 }
 
@@ -923,6 +1926,7 @@ tc_vote_dtr(struct tc_vote *ptr)
     if (!ptr)
         return;
     tc_mat_dtr(ptr->M);
+    tc_spmat_dtr(ptr->S);
     for(uint32_t i=0; i < TC_VOTE_NCOLS; i++)
         tc_mat_dtr(ptr->cvecs[i]);
     for(uint32_t i=0; i < TC_VOTE_NROWS; i++)
@@ -935,16 +1939,20 @@ tc_vote_notvalid(const struct tc_vote *ptr)
 {
     if (!ptr)
         return -1;
-    if (!ptr->M)
+    if (!ptr->M == !ptr->S)
+        return -1;
+    if (ptr->M && ((ptr->M->nr != ptr->nr) || (ptr->M->nc != ptr->nc)))
+        return -1;
+    if (ptr->S && ((ptr->S->nr != ptr->nr) || (ptr->S->nc != ptr->nc)))
         return -1;
     for(uint32_t i=0; i < TC_VOTE_NCOLS; i++)
         if ((!ptr->cvecs[i])
             || (ptr->cvecs[i]->nr != 1)
-            || (ptr->cvecs[i]->nc != ptr->M->nc))
+            || (ptr->cvecs[i]->nc != ptr->nc))
                 return -1;
     for(uint32_t i=0; i < TC_VOTE_NROWS; i++)
         if ((!ptr->rvecs[i])
-            || (ptr->rvecs[i]->nr != ptr->M->nr)
+            || (ptr->rvecs[i]->nr != ptr->nr)
             || (ptr->rvecs[i]->nc != 1))
                 return -1;
     return 0;
@@ -953,15 +1961,22 @@ tc_vote_notvalid(const struct tc_vote *ptr)
 static int
 tc_vote_print_M(const struct tc_vote *ptr)
 {
-    const double **M = (const double **) ptr->M->a;
+    struct tc_mat *fill = NULL;
+    const struct tc_mat *M = ptr->M;
+    if (!M) {
+        fill = tc_mat_ctr(0, 0);
+        tc_spmat_fill(fill, ptr->S, ptr->NA);
+        M = fill;
+    }
     for(uint32_t i=0; i < ptr->nr; i++) {
         for(uint32_t j=0; j < ptr->nc; j++)
-            if (M[i][j] != ptr->NA)
-                printf(" %12.8f", M[i][j]);
+            if (TC_MAT_AT(M, i, j) != ptr->NA)
+                printf(" %12.8f", TC_MAT_AT(M, i, j));
             else
                 printf(" %12s", "NA");
         printf("\n");
     }
+    tc_mat_dtr(fill);
 
     return 0;
 }
@@ -976,8 +1991,8 @@ tc_vote_print_cols(const struct tc_vote *ptr)
     for(uint32_t i=0; i < TC_VOTE_NCOLS; i++) {
         printf(" %12s", hdrs[i]);
         for(uint32_t j=0; j < ptr->nc; j++)
-            if (ptr->cvecs[i]->a[0][j] != ptr->NA)
-                printf(" %12.8f", ptr->cvecs[i]->a[0][j]);
+            if (TC_MAT_AT(ptr->cvecs[i], 0, j) != ptr->NA)
+                printf(" %12.8f", TC_MAT_AT(ptr->cvecs[i], 0, j));
             else
                 printf(" %12s", "NA");
         printf("\n");
@@ -998,8 +2013,8 @@ tc_vote_print_rows(const struct tc_vote *ptr)
 
     for(uint32_t i=0; i < ptr->nr; i++) {
         for(uint32_t j=0; j < TC_VOTE_NROWS; j++)
-            if (ptr->rvecs[j]->a[i][0] != ptr->NA)
-                printf(" %12.8f", ptr->rvecs[j]->a[i][0]);
+            if (TC_MAT_AT(ptr->rvecs[j], i, 0) != ptr->NA)
+                printf(" %12.8f", TC_MAT_AT(ptr->rvecs[j], i, 0));
             else
                 printf(" %12s", "NA");
         printf("\n");
@@ -1022,69 +2037,307 @@ tc_vote_print(const struct tc_vote *ptr)
     return 0;
 }
 
-int
-tc_vote_proc(struct tc_vote *vote)
+/* The per-decision and per-voter stages of tc_vote_proc(), each over a
+ * range of columns or rows, for tc_pool_run() */
+struct tc_vote_job {
+    struct tc_vote *vote;
+    struct tc_mat *fM;
+    struct tc_mat *wgtT_fM;
+    struct tc_mat *dist;
+    struct tc_wgt_value *scratch; /* vote->nr values per slice */
+};
+
+/* fM: columns [begin, end) of the sparse vote matrix, the preliminary
+ * outcome where there is no vote */
+static void
+tc_vote_fill_sparse(struct tc_vote *vote, struct tc_mat *fM, uint32_t begin,
+    uint32_t end, struct tc_wgt_value *scratch)
 {
-    if (!vote || tc_vote_notvalid(vote))
-        return -1;
+    const struct tc_spmat *S = vote->S;
+    struct tc_mat *wgt = vote->rvecs[TC_VOTE_OLD_REP];
+    struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
+    for(uint32_t j=begin; j < end; j++) {
+        double prelim_outcome = (TC_MAT_AT(isbin, 0, j) != 0.0)
+            ? tc_spmat_wgt_mean(wgt, S, j)
+            : tc_spmat_wgt_median(wgt, S, j, scratch);
+        for(uint32_t i=0; i < fM->nr; i++)
+            TC_MAT_AT(fM, i, j) = prelim_outcome;
+        for(uint32_t k=S->colptr[j]; k < S->colptr[j + 1]; k++)
+            TC_MAT_AT(fM, S->rowidx[k], j) = S->val[k];
+    }
+}
 
+/* fM: NAs in columns [begin, end) filled with the preliminary outcomes */
+static void
+tc_vote_fill_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    struct tc_vote *vote = job->vote;
     struct tc_mat *M = vote->M;
     struct tc_mat *wgt = vote->rvecs[TC_VOTE_OLD_REP];
-    struct tc_mat *twgt = vote->rvecs[TC_VOTE_THIS_REP];
-    struct tc_mat *nwgt = vote->rvecs[TC_VOTE_SMOOTHED_REP];
     struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
-    struct tc_mat *firstloading = vote->cvecs[TC_VOTE_FIRST_LOADING];
-
-    /* fM: M with NAs filled in (for SVD) with the preliminary outcomes */
-    struct tc_mat *fM = tc_mat_ctr(M->nr, M->nc);
-    tc_mat_copy(fM, M);
-    for(uint32_t j=0; j < M->nc; j++) {
+    struct tc_wgt_value *scratch = job->scratch + (size_t) slice * vote->nr;
+    if (!M) {
+        tc_vote_fill_sparse(vote, job->fM, begin, end, scratch);
+        return;
+    }
+    for(uint32_t j=begin; j < end; j++) {
         /* Calculate the preliminary outcome */
         double prelim_outcome = 0.0;
-        if (isbin->a[0][j] != 0.0) {
+        if (TC_MAT_AT(isbin, 0, j) != 0.0) {
             // Use the mean for binary decisions
             prelim_outcome = tc_wgt_mean(wgt, M, j, vote->NA);
         } else {
             // Use the median for scaled decisions
-            prelim_outcome = tc_wgt_median(wgt, M, j, vote->NA);
+            prelim_outcome = tc_wgt_median_scratch(wgt, M, j, vote->NA, scratch);
         }
 
         // Replace NA values in the matrix with the preliminary outcome
         for(uint32_t i=0; i < M->nr; i++)
-            if (fM->a[i][j] == vote->NA)
-                fM->a[i][j] = prelim_outcome;
+            if (TC_MAT_AT(job->fM, i, j) == vote->NA)
+                TC_MAT_AT(job->fM, i, j) = prelim_outcome;
+    }
+}
+
+/* wgtT_fM: medians instead of means for the scaled decisions */
+static void
+tc_vote_median_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    struct tc_vote *vote = job->vote;
+    struct tc_mat *wgt = vote->rvecs[TC_VOTE_OLD_REP];
+    struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
+    struct tc_wgt_value *scratch = job->scratch + (size_t) slice * vote->nr;
+    for(uint32_t j=begin; j < end; j++)
+        if (TC_MAT_AT(isbin, 0, j) == 0.0)
+            TC_MAT_AT(job->wgtT_fM, 0, j) =
+                tc_wgt_median_scratch(wgt, job->fM, j, vote->NA, scratch);
+}
+
+/* distance of each vote from the (rounded) weighted outcome */
+static void
+tc_vote_dist_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    (void) slice;
+    struct tc_mat *isbin = job->vote->cvecs[TC_VOTE_IS_BINARY];
+    struct tc_mat *dist = job->dist;
+    for(uint32_t j=begin; j < end; j++) {
+        double val = 0.0;
+        if (TC_MAT_AT(isbin, 0, j) != 0.0)
+            val = (TC_MAT_AT(job->wgtT_fM, 0, j) < 0.5)
+                ? 0.0: ((TC_MAT_AT(job->wgtT_fM, 0, j) > 0.5)? 1.0: 0.5);
+        else
+            val = TC_MAT_AT(job->wgtT_fM, 0, j);
+        for(uint32_t i=0; i < dist->nr; i++)
+            TC_MAT_AT(dist, i, j) = fabs(TC_MAT_AT(dist, i, j) - val);
+    }
+}
+
+/* outcome (raw) */
+static void
+tc_vote_decraw_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    struct tc_vote *vote = job->vote;
+    struct tc_mat *nwgt = vote->rvecs[TC_VOTE_SMOOTHED_REP];
+    struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
+    struct tc_mat *decraw = vote->cvecs[TC_VOTE_DECISIONS_RAW];
+    struct tc_wgt_value *scratch = job->scratch + (size_t) slice * vote->nr;
+    for(uint32_t j=begin; j < end; j++) {
+        TC_MAT_AT(decraw, 0, j) = (TC_MAT_AT(isbin, 0, j) != 0.0)?
+            tc_wgt_mean(nwgt, job->fM, j, vote->NA):
+            tc_wgt_median_scratch(nwgt, job->fM, j, vote->NA, scratch);
+    }
+}
+
+/* row stats */
+static void
+tc_vote_rowstats_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    (void) slice;
+    struct tc_vote *vote = job->vote;
+    struct tc_mat *M = vote->M;
+    struct tc_mat *narow = vote->rvecs[TC_VOTE_NA_ROW];
+    struct tc_mat *partrow = vote->rvecs[TC_VOTE_PARTIC_ROW];
+    if (!M) {
+        /* narow holds the votes of each row, counted beforehand */
+        for(uint32_t i=begin; i < end; i++) {
+            TC_MAT_AT(narow, i, 0) = vote->nc - TC_MAT_AT(narow, i, 0);
+            TC_MAT_AT(partrow, i, 0) = 1.0 - TC_MAT_AT(narow, i, 0) /  vote->nc;
+        }
+        return;
+    }
+    for(uint32_t i=begin; i < end; i++) {
+        TC_MAT_AT(narow, i, 0) = 0;
+        for(uint32_t j=0; j < M->nc; j++)
+            if (TC_MAT_AT(M, i, j) == vote->NA)
+                TC_MAT_AT(narow, i, 0) += 1.0;
+        TC_MAT_AT(partrow, i, 0) = 1.0 - TC_MAT_AT(narow, i, 0) /  M->nc;
+    }
+}
+
+/* col stats and certainty */
+static void
+tc_vote_colstats_fn(void *ctx, uint32_t slice, uint32_t begin, uint32_t end)
+{
+    struct tc_vote_job *job = (struct tc_vote_job *) ctx;
+    (void) slice;
+    struct tc_vote *vote = job->vote;
+    struct tc_mat *M = vote->M;
+    struct tc_mat *nwgt = vote->rvecs[TC_VOTE_SMOOTHED_REP];
+    struct tc_mat *decfin = vote->cvecs[TC_VOTE_DECISIONS_FINAL];
+    struct tc_mat *nacol = vote->cvecs[TC_VOTE_NA_COL];
+    struct tc_mat *partcol = vote->cvecs[TC_VOTE_PARTIC_COL];
+    struct tc_mat *certainty = vote->cvecs[TC_VOTE_CERTAINTY];
+    for(uint32_t j=begin; j < end; j++) {
+        double value = 0.0;
+        TC_MAT_AT(nacol, 0, j) = 0;
+        if (M) {
+            for(uint32_t i=0; i < M->nr; i++)
+                if (TC_MAT_AT(M, i, j) == vote->NA) {
+                    TC_MAT_AT(nacol, 0, j) += 1.0;
+                    value += TC_MAT_AT(nwgt, i, 0);
+                }
+        } else {
+            /* the rows between one entry and the next are NA */
+            const struct tc_spmat *S = vote->S;
+            uint32_t k = S->colptr[j];
+            for(uint32_t i=0; i < S->nr; i++) {
+                if ((k < S->colptr[j + 1]) && (S->rowidx[k] == i)) {
+                    k++;
+                    continue;
+                }
+                TC_MAT_AT(nacol, 0, j) += 1.0;
+                value += TC_MAT_AT(nwgt, i, 0);
+            }
+        }
+        TC_MAT_AT(partcol, 0, j) = 1.0 - value;
+
+        double sum = 0.0;
+        for(uint32_t i=0; i < vote->nr; i++)
+            if (fabs(TC_MAT_AT(job->fM, i, j) - TC_MAT_AT(decfin, 0, j)) < 1e-5)
+                sum += TC_MAT_AT(nwgt, i, 0);
+        TC_MAT_AT(certainty, 0, j) = sum;
     }
+}
+
+/* Threads tc_vote_proc() runs a ballot with, and so the slices that each
+ * need their own median scratch */
+static uint32_t
+tc_vote_nslices(uint32_t nr, uint32_t nc, uint32_t nthreads)
+{
+    return ((nthreads > 1) && ((uint64_t) nr * nc >= TC_VOTE_MT_MIN_CELLS))? nthreads: 1;
+}
+
+/* Workspace bytes of an nr x nc tc_ws_mat() */
+static size_t
+tc_ws_mat_bytes(uint32_t nr, uint32_t nc)
+{
+    const uint32_t align = TC_MAT_ALIGN / sizeof(double);
+    const size_t stride = (nc + align - 1) / align * align;
+    return TC_WS_ROUND(sizeof(struct tc_mat)) + TC_WS_ROUND(sizeof(double) * stride * nr);
+}
+
+/* The temporaries of tc_vote_proc_ws(), in the order they are taken:
+ * the scratch, fM, loadings and scores live throughout; the principal
+ * component analysis then takes x_mat and either avg, or y and z, or on
+ * the SVD fallback wCVM, U, D and V (nc x nc each) and the temporaries of
+ * the bidiagonalization (Ic, Ir, P, u u^T and a product, nc x nc each, and
+ * u and u^T); after it come wgtT_fM and either the new reputation
+ * (scores1, scores2, new_scores_1, new_scores_2, dist, mainstream,
+ * noncompliance, compliance, v1, v2) or partic_rel_col */
+size_t
+tc_vote_ws_bytes(uint32_t nr, uint32_t nc, uint32_t nthreads)
+{
+    size_t scratch = TC_WS_ROUND(sizeof(struct tc_wgt_value) * nr
+        * tc_vote_nslices(nr, nc, nthreads));
+    size_t base = scratch + tc_ws_mat_bytes(nr, nc) + tc_ws_mat_bytes(nc, 1)
+        + tc_ws_mat_bytes(nr, 1);
+    size_t avg = tc_ws_mat_bytes(1, nc);
+    size_t yz = tc_ws_mat_bytes(nr, 1) + tc_ws_mat_bytes(nc, 1);
+    size_t svd = 9 * tc_ws_mat_bytes(nc, nc) + tc_ws_mat_bytes(nc, 1)
+        + tc_ws_mat_bytes(1, nc);
+    size_t pc1 = (avg > yz)? avg: yz;
+    size_t pca = tc_ws_mat_bytes(nr, nc) + ((pc1 > svd)? pc1: svd);
+    size_t rep = 8 * tc_ws_mat_bytes(nr, 1) + tc_ws_mat_bytes(nr, nc)
+        + tc_ws_mat_bytes(nc, 1);
+    size_t col = tc_ws_mat_bytes(1, nc);
+    size_t post = tc_ws_mat_bytes(1, nc) + ((rep > col)? rep: col);
+    return base + ((pca > post)? pca: post);
+}
+
+int
+tc_vote_proc(struct tc_vote *vote)
+{
+    if (!vote || tc_vote_notvalid(vote))
+        return -1;
+    struct tc_ws *ws = tc_ws_ctr(tc_vote_ws_bytes(vote->nr, vote->nc, vote->nthreads));
+    if (!ws)
+        return -1;
+    int rc = tc_vote_proc_ws(vote, ws);
+    tc_ws_dtr(ws);
+    return rc;
+}
+
+int
+tc_vote_proc_ws(struct tc_vote *vote, struct tc_ws *ws)
+{
+    if (!vote || !ws || tc_vote_notvalid(vote))
+        return -1;
+
+    struct tc_mat *M = vote->M;
+    struct tc_mat *wgt = vote->rvecs[TC_VOTE_OLD_REP];
+    struct tc_mat *twgt = vote->rvecs[TC_VOTE_THIS_REP];
+    struct tc_mat *nwgt = vote->rvecs[TC_VOTE_SMOOTHED_REP];
+    struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
+    struct tc_mat *firstloading = vote->cvecs[TC_VOTE_FIRST_LOADING];
+
+    /* Large ballots are split over vote->nthreads threads */
+    struct tc_pool *pool = NULL;
+    if (tc_vote_nslices(vote->nr, vote->nc, vote->nthreads) > 1)
+        pool = tc_pool_ctr(vote->nthreads);
+    const size_t mark = tc_ws_mark(ws);
+
+    /* median scratch, one per slice */
+    const uint32_t nslices = pool? pool->nthreads: 1;
+    struct tc_wgt_value *scratch = (struct tc_wgt_value *)
+        tc_ws_alloc(ws, sizeof(struct tc_wgt_value) * vote->nr * nslices);
+
+    /* fM: M with NAs filled in (for SVD) with the preliminary outcomes */
+    struct tc_mat *fM = tc_ws_mat(ws, vote->nr, vote->nc);
+    if (M)
+        tc_mat_copy(fM, M);
+    struct tc_vote_job job = { vote, fM, NULL, NULL, scratch };
+    tc_pool_run(pool, vote->nc, tc_vote_fill_fn, &job);
 
     /* loadings:
      * scores:
      */
-    struct tc_mat *scores = tc_mat_ctr(0, 0);
-    int rc = tc_wgt_prin_comp(wgt, fM, firstloading, scores);
+    struct tc_mat *loadings = tc_ws_mat(ws, vote->nc, 1);
+    struct tc_mat *scores = tc_ws_mat(ws, vote->nr, 1);
+    int rc = tc_wgt_prin_comp_pool(pool, ws, wgt, fM, loadings, scores);
     if (rc < 0) {
-        tc_mat_dtr(scores);
-        tc_mat_dtr(fM);
+        tc_ws_release(ws, mark);
+        tc_pool_dtr(pool);
         return rc;
     }
-    tc_mat_transpose(firstloading, firstloading);
-
-    /* wgtT: transpose of wgt */
-    struct tc_mat *wgtT = tc_mat_ctr(0, 0);
-    tc_mat_transpose(wgtT, wgt);
+    tc_mat_transpose(firstloading, loadings);
 
     /* wgtT_M: wgt^T * fM */
-    struct tc_mat *wgtT_fM = tc_mat_ctr(0, 0);
-    tc_mat_mult(wgtT_fM, wgtT, fM);
-    for(uint32_t j=0; j < M->nc; j++)
-        if (isbin->a[0][j] == 0.0)
-            wgtT_fM->a[0][j] = tc_wgt_median(wgt, fM, j, vote->NA);
+    struct tc_mat *wgtT_fM = tc_ws_mat(ws, 0, 0);
+    tc_pool_mult_tn(pool, wgtT_fM, wgt, fM);
+    job.wgtT_fM = wgtT_fM;
+    tc_pool_run(pool, vote->nc, tc_vote_median_fn, &job);
 
     /* Calculate sum of first score's absolute values */
     double sum_first_fabs = 0.0;
     for(uint32_t i=0; i < scores->nr; i++) {
         for(uint32_t j=0; j < scores->nc; j++) {
-            if (scores->a[i][j] == 0.0)
+            if (TC_MAT_AT(scores, i, j) == 0.0)
               continue;
-            sum_first_fabs += fabs(scores->a[i][j]);
+            sum_first_fabs += fabs(TC_MAT_AT(scores, i, j));
         }
     }
 
@@ -1092,103 +2345,97 @@ tc_vote_proc(struct tc_vote *vote)
     if (!sum_first_fabs != 0) {
         tc_mat_copy(twgt, wgt);
     } else {
+        const size_t rep_mark = tc_ws_mark(ws);
+
         /* scores1: scores adjusted by adding min{scores} */
-        double min_score = scores->a[0][0];
+        double min_score = TC_MAT_AT(scores, 0, 0);
         for(uint32_t i=1; i < scores->nr; i++)
-            if (min_score > scores->a[i][0])
-                min_score = scores->a[i][0];
+            if (min_score > TC_MAT_AT(scores, i, 0))
+                min_score = TC_MAT_AT(scores, i, 0);
         if (min_score < 0.0)
             min_score = -min_score;
-        struct tc_mat *scores1 = tc_mat_ctr(0, 0);
+        struct tc_mat *scores1 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(scores1, scores);
         for(uint32_t i=0; i < scores1->nr; i++)
-            scores1->a[i][0] += min_score;
+            TC_MAT_AT(scores1, i, 0) += min_score;
 
         /* scores2: scores adjusted by subtracting max{scores} */
-        double max_score = scores->a[0][0];
+        double max_score = TC_MAT_AT(scores, 0, 0);
         for(uint32_t i=1; i < scores->nr; i++)
-            if (max_score < scores->a[i][0])
-                max_score = scores->a[i][0];
-        struct tc_mat *scores2 = tc_mat_ctr(0, 0);
+            if (max_score < TC_MAT_AT(scores, i, 0))
+                max_score = TC_MAT_AT(scores, i, 0);
+        struct tc_mat *scores2 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(scores2, scores);
         for(uint32_t i=0; i < scores2->nr; i++)
-            scores2->a[i][0] = max_score - scores2->a[i][0];
+            TC_MAT_AT(scores2, i, 0) = max_score - TC_MAT_AT(scores2, i, 0);
 
         /* Median factors for both choices */
-        double median_factor_1 = tc_wgt_median(wgt, scores1, 0, vote->NA);
-        double median_factor_2 = tc_wgt_median(wgt, scores2, 0, vote->NA);
+        double median_factor_1 = tc_wgt_median_scratch(wgt, scores1, 0, vote->NA, scratch);
+        double median_factor_2 = tc_wgt_median_scratch(wgt, scores2, 0, vote->NA, scratch);
 
         /* Use median as new upper limit, shift excessive values */
-        struct tc_mat *new_scores_1 = tc_mat_ctr(0, 0);
+        struct tc_mat *new_scores_1 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(new_scores_1, scores1);
         if (median_factor_1 > 0.0) {
             /* above-median weights are adjusted to below median */
             for(uint32_t i=0; i < scores1->nr; i++)
-              if (scores1->a[i][0] > median_factor_1) {
-                  double excessive = scores1->a[i][0] - median_factor_1;
-                  new_scores_1->a[i][0] = scores1->a[i][0] - (excessive * 0.5);
+              if (TC_MAT_AT(scores1, i, 0) > median_factor_1) {
+                  double excessive = TC_MAT_AT(scores1, i, 0) - median_factor_1;
+                  TC_MAT_AT(new_scores_1, i, 0) = TC_MAT_AT(scores1, i, 0) - (excessive * 0.5);
               } else {
-                new_scores_1->a[i][0] = scores1->a[i][0];
+                TC_MAT_AT(new_scores_1, i, 0) = TC_MAT_AT(scores1, i, 0);
               }
         }
 
         /* Use median as new upper limit, shift excessive values */
-        struct tc_mat *new_scores_2 = tc_mat_ctr(0, 0);
+        struct tc_mat *new_scores_2 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(new_scores_2, scores2);
         if (median_factor_2 > 0.0) {
             /* above-median weights are adjusted to below median */
             for(uint32_t i=0; i < scores2->nr; i++)
-              if (scores2->a[i][0] > median_factor_2) {
-                  double excessive = scores2->a[i][0] - median_factor_2;
-                  new_scores_2->a[i][0] = scores2->a[i][0] - (excessive * 0.5);
+              if (TC_MAT_AT(scores2, i, 0) > median_factor_2) {
+                  double excessive = TC_MAT_AT(scores2, i, 0) - median_factor_2;
+                  TC_MAT_AT(new_scores_2, i, 0) = TC_MAT_AT(scores2, i, 0) - (excessive * 0.5);
               } else {
-                new_scores_2->a[i][0] = scores2->a[i][0];
+                TC_MAT_AT(new_scores_2, i, 0) = TC_MAT_AT(scores2, i, 0);
               }
         }
 
         /* distance */
-        struct tc_mat *dist = tc_mat_ctr(0, 0);
+        struct tc_mat *dist = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(dist, fM);
-        for(uint32_t j=0; j < dist->nc; j++) {
-            double val = 0.0;
-            if (isbin->a[0][j] != 0.0)
-                val = (wgtT_fM->a[0][j] < 0.5)
-                    ? 0.0: ((wgtT_fM->a[0][j] > 0.5)? 1.0: 0.5);
-            else
-                val = wgtT_fM->a[0][j];
-            for(uint32_t i=0; i < dist->nr; i++)
-                dist->a[i][j] = fabs(dist->a[i][j] - val);
-        }
+        job.dist = dist;
+        tc_pool_run(pool, dist->nc, tc_vote_dist_fn, &job);
 
         /* mainstream = 1/dissent */
-        struct tc_mat *mainstream = tc_mat_ctr(firstloading->nc, 1);
+        struct tc_mat *mainstream = tc_ws_mat(ws, firstloading->nc, 1);
         for(uint32_t j=0; j < firstloading->nc; j++) {
-            double value = firstloading->a[0][j];
+            double value = TC_MAT_AT(firstloading, 0, j);
             if (value == 0.0)
-                mainstream->a[j][0] = vote->NA;
+                TC_MAT_AT(mainstream, j, 0) = vote->NA;
             else
-                mainstream->a[j][0] = 1.0/fabs(value);
+                TC_MAT_AT(mainstream, j, 0) = 1.0/fabs(value);
         }
         tc_wgt_normalize(mainstream);
 
         /* noncompliance = distance * mainstream^T */
-        struct tc_mat *noncompliance = tc_mat_ctr(0, 0);
-        tc_mat_mult(noncompliance, dist, mainstream);
-        double max_noncompliance = noncompliance->a[0][0];
+        struct tc_mat *noncompliance = tc_ws_mat(ws, 0, 0);
+        tc_pool_mult(pool, noncompliance, dist, mainstream);
+        double max_noncompliance = TC_MAT_AT(noncompliance, 0, 0);
         for(uint32_t i=1; i < noncompliance->nr; i++)
-            if (max_noncompliance < noncompliance->a[i][0])
-                max_noncompliance = noncompliance->a[i][0];
+            if (max_noncompliance < TC_MAT_AT(noncompliance, i, 0))
+                max_noncompliance = TC_MAT_AT(noncompliance, i, 0);
         /* compliance */
-        struct tc_mat *compliance = tc_mat_ctr(noncompliance->nr, 1);
+        struct tc_mat *compliance = tc_ws_mat(ws, noncompliance->nr, 1);
         for(uint32_t i=0; i < noncompliance->nr; i++)
-            compliance->a[i][0] = max_noncompliance - noncompliance->a[i][0];
+            TC_MAT_AT(compliance, i, 0) = max_noncompliance - TC_MAT_AT(noncompliance, i, 0);
         tc_wgt_normalize(compliance);
 
-        struct tc_mat *v1 = tc_mat_ctr(0, 0);
+        struct tc_mat *v1 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(v1, new_scores_1);
         tc_wgt_normalize(v1);
         tc_mat_sub(v1, v1, compliance);
-        struct tc_mat *v2 = tc_mat_ctr(0, 0);
+        struct tc_mat *v2 = tc_ws_mat(ws, 0, 0);
         tc_mat_copy(v2, new_scores_2);
         tc_wgt_normalize(v2);
         tc_mat_sub(v2, v2, compliance);
@@ -1213,103 +2460,83 @@ tc_vote_proc(struct tc_vote *vote)
         tc_mat_dtr(new_scores_1);
         tc_mat_dtr(scores2);
         tc_mat_dtr(scores1);
+        tc_ws_release(ws, rep_mark);
     }
 
     /* smoothedrep: smoothed with previous oldrep   */
     /* smoothedrep: (1-alpha) oldrep + alpha * smoothedrep */
     for(uint32_t i=0; i < wgt->nr; i++)
-        nwgt->a[i][0] = (1.0 - vote->alpha) * wgt->a[i][0]
-                         + vote->alpha * twgt->a[i][0];
+        TC_MAT_AT(nwgt, i, 0) = (1.0 - vote->alpha) * TC_MAT_AT(wgt, i, 0)
+                         + vote->alpha * TC_MAT_AT(twgt, i, 0);
 
     /* outcome (raw) */
     struct tc_mat *decraw = vote->cvecs[TC_VOTE_DECISIONS_RAW];
-    for(uint32_t j=0; j < fM->nc; j++) {
-        decraw->a[0][j] = (isbin->a[0][j] != 0.0)?
-            tc_wgt_mean(nwgt, fM, j, vote->NA):
-            tc_wgt_median(nwgt, fM, j, vote->NA);
-    }
+    tc_pool_run(pool, fM->nc, tc_vote_decraw_fn, &job);
 
     /* outcome (final) */
     struct tc_mat *decfin = vote->cvecs[TC_VOTE_DECISIONS_FINAL];
-    for(uint32_t j=0; j < M->nc; j++) {
-        if (isbin->a[0][j] != 0.0) {
-            if (decraw->a[0][j] > 0.50 + 0.50*vote->tol)
-                decfin->a[0][j] = 1.0;
+    for(uint32_t j=0; j < vote->nc; j++) {
+        if (TC_MAT_AT(isbin, 0, j) != 0.0) {
+            if (TC_MAT_AT(decraw, 0, j) > 0.50 + 0.50*vote->tol)
+                TC_MAT_AT(decfin, 0, j) = 1.0;
             else
-            if (decraw->a[0][j] < 0.50 - 0.50*vote->tol)
-                decfin->a[0][j] = 0.0;
+            if (TC_MAT_AT(decraw, 0, j) < 0.50 - 0.50*vote->tol)
+                TC_MAT_AT(decfin, 0, j) = 0.0;
             else
-                decfin->a[0][j] = 0.50;
+                TC_MAT_AT(decfin, 0, j) = 0.50;
         }
         else
-            decfin->a[0][j] = decraw->a[0][j];
+            TC_MAT_AT(decfin, 0, j) = TC_MAT_AT(decraw, 0, j);
     }
 
     /* row stats */
-    struct tc_mat *narow = vote->rvecs[TC_VOTE_NA_ROW];
     struct tc_mat *partrow = vote->rvecs[TC_VOTE_PARTIC_ROW];
-    for(uint32_t i=0; i < M->nr; i++) {
-        narow->a[i][0] = 0;
-        for(uint32_t j=0; j < M->nc; j++)
-            if (M->a[i][j] == vote->NA)
-                narow->a[i][0] += 1.0;
-        partrow->a[i][0] = 1.0 - narow->a[i][0] /  M->nc;
+    if (!M) {
+        struct tc_mat *narow = vote->rvecs[TC_VOTE_NA_ROW];
+        for(uint32_t i=0; i < vote->nr; i++)
+            TC_MAT_AT(narow, i, 0) = 0.0;
+        for(uint32_t k=0; k < vote->S->colptr[vote->nc]; k++)
+            TC_MAT_AT(narow, vote->S->rowidx[k], 0) += 1.0;
     }
+    tc_pool_run(pool, vote->nr, tc_vote_rowstats_fn, &job);
 
-    /* col stats */
-    struct tc_mat *nacol = vote->cvecs[TC_VOTE_NA_COL];
+    /* col stats and certainty */
     struct tc_mat *partcol = vote->cvecs[TC_VOTE_PARTIC_COL];
-    for(uint32_t j=0; j < M->nc; j++) {
-        double value = 0.0;
-        nacol->a[0][j] = 0;
-        for(uint32_t i=0; i < M->nr; i++)
-            if (M->a[i][j] == vote->NA) {
-                nacol->a[0][j] += 1.0;
-                value += nwgt->a[i][0];
-            }
-        partcol->a[0][j] = 1.0 - value;
-    }
+    struct tc_mat *certainty = vote->cvecs[TC_VOTE_CERTAINTY];
+    tc_pool_run(pool, vote->nc, tc_vote_colstats_fn, &job);
 
     /* fracNA */
     double x = 0.0;
-    for(uint32_t j=0; j < M->nc; j++)
-        x += partcol->a[0][j];
-    double fracNA = 1.0 - x / M->nc;
+    for(uint32_t j=0; j < vote->nc; j++)
+        x += TC_MAT_AT(partcol, 0, j);
+    double fracNA = 1.0 - x / vote->nc;
 
     /* row bonus */
     struct tc_mat *partic_rel = vote->rvecs[TC_VOTE_PARTIC_REL];
     tc_mat_copy(partic_rel, partrow);
     tc_wgt_normalize(partic_rel);
     struct tc_mat *rowbonus = vote->rvecs[TC_VOTE_ROW_BONUS];
-    for(uint32_t i=0; i < M->nr; i++)
-        rowbonus->a[i][0] = fracNA * partic_rel->a[i][0] + (1.0 - fracNA) * nwgt->a[i][0];
-
-    /* certainty */
-    struct tc_mat *certainty = vote->cvecs[TC_VOTE_CERTAINTY];
-    for(uint32_t j=0; j < M->nc; j++) {
-        double sum = 0.0;
-        for(uint32_t i=0; i < M->nr; i++)
-            if (fabs(fM->a[i][j] - decfin->a[0][j]) < 1e-5)
-                sum += nwgt->a[i][0];
-        certainty->a[0][j] = sum;
-    }
+    for(uint32_t i=0; i < vote->nr; i++)
+        TC_MAT_AT(rowbonus, i, 0) = fracNA * TC_MAT_AT(partic_rel, i, 0) + (1.0 - fracNA) * TC_MAT_AT(nwgt, i, 0);
 
     /* col bonus */
     struct tc_mat *conreward = vote->cvecs[TC_VOTE_CONSENSUS_REW];
-    struct tc_mat *partic_rel_col = tc_mat_ctr(0, 0);
+    struct tc_mat *partic_rel_col = tc_ws_mat(ws, 0, 0);
     tc_mat_copy(partic_rel_col, partcol);
     tc_wgt_normalize(partic_rel_col);
     tc_mat_copy(conreward, certainty);
     tc_wgt_normalize(conreward);
     struct tc_mat *colbonus = vote->cvecs[TC_VOTE_AUTHOR_BONUS];
-    for(uint32_t j=0; j < M->nc; j++)
-        colbonus->a[0][j] = fracNA * partic_rel_col->a[0][j] + (1.0 - fracNA) * conreward->a[0][j];
+    for(uint32_t j=0; j < vote->nc; j++)
+        TC_MAT_AT(colbonus, 0, j) = fracNA * TC_MAT_AT(partic_rel_col, 0, j) + (1.0 - fracNA) * TC_MAT_AT(conreward, 0, j);
     tc_mat_dtr(partic_rel_col);
 
     tc_mat_dtr(wgtT_fM);
-    tc_mat_dtr(wgtT);
     tc_mat_dtr(scores);
+    tc_mat_dtr(loadings);
     tc_mat_dtr(fM);
+    tc_ws_release(ws, mark);
+    tc_pool_dtr(pool);
 
     return rc;
 }
@@ -7,13 +7,40 @@
 #ifndef HIVEMIND_LINALG_MAT_H
 #define HIVEMIND_LINALG_MAT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* Alignment of the matrix storage and of every row, in bytes */
+#define TC_MAT_ALIGN            64
+
+struct tc_ws;
+
+/**
+ * Row-major matrix in one contiguous allocation. Row i starts at
+ * a + i * stride, and stride is nc rounded up to a whole number of
+ * TC_MAT_ALIGN bytes so every row is aligned.
+ */
 struct tc_mat {
-    double **a;
+    double *a;
     uint32_t nr, nc;
+    uint32_t stride;
+    size_t cap; /* doubles at a */
+    struct tc_ws *ws; /* workspace holding a, NULL if a is malloc()ed */
 };
 
+/**
+ * Element (i, j) of a matrix, usable as an lvalue.
+ */
+#define TC_MAT_AT(A, i, j) ((A)->a[(size_t)(i) * (A)->stride + (j)])
+
+/**
+ * Pointer to the first element of row i of a matrix.
+ */
+static inline double *tc_mat_row(const struct tc_mat *A, uint32_t i)
+{
+    return A->a + (size_t)i * A->stride;
+}
+
 /**
  * Create a matrix.
  * Return tc_mat matrix if successful.
@@ -21,7 +48,7 @@ struct tc_mat {
 struct tc_mat *tc_mat_ctr(uint32_t nr_, uint32_t nc_);
 
 /**
- * Delete a matrix.
+ * Delete a matrix. A workspace matrix is left to its workspace.
  */
 void tc_mat_dtr(struct tc_mat *);
 
@@ -30,6 +57,46 @@ void tc_mat_dtr(struct tc_mat *);
  */
 void tc_mat_clear(struct tc_mat *);
 
+/**
+ * Create a workspace (arena) of the given size in bytes. Allocations past
+ * it chain further blocks.
+ * Return tc_ws if successful, NULL if error.
+ */
+struct tc_ws *tc_ws_ctr(size_t bytes);
+
+/**
+ * Delete a workspace and everything allocated in it.
+ */
+void tc_ws_dtr(struct tc_ws *);
+
+/**
+ * Allocate bytes in a workspace, aligned to TC_MAT_ALIGN.
+ * Return NULL if error (or if bytes is 0).
+ */
+void *tc_ws_alloc(struct tc_ws *, size_t bytes);
+
+/**
+ * Current top of a workspace, for tc_ws_release(). Return 0 for NULL.
+ */
+size_t tc_ws_mark(const struct tc_ws *);
+
+/**
+ * Free everything allocated in a workspace since the mark was taken.
+ */
+void tc_ws_release(struct tc_ws *, size_t mark);
+
+/**
+ * Most bytes a workspace has had in use at once.
+ */
+size_t tc_ws_peak(const struct tc_ws *);
+
+/**
+ * Create a matrix in a workspace. It grows inside the workspace and
+ * tc_mat_dtr() leaves it there. With a NULL workspace this is
+ * tc_mat_ctr().
+ */
+struct tc_mat *tc_ws_mat(struct tc_ws *, uint32_t nr_, uint32_t nc_);
+
 /**
  * Printf() a matrix.
  */
@@ -46,6 +113,12 @@ double tc_mat_norm(const struct tc_mat *);
  */
 void tc_mat_resize(struct tc_mat *, uint32_t nr_, uint32_t nc_);
 
+/**
+ * Append a row to a matrix, keeping its contents.
+ * Return the new (uninitialized) row, NULL if error.
+ */
+double *tc_mat_push_row(struct tc_mat *);
+
 /**
  * Copy contents and size of second matrix to first.
  */
@@ -79,6 +152,14 @@ int tc_mat_sub(struct tc_mat *, const struct tc_mat *A, const struct tc_mat *B);
  */
 int tc_mat_mult(struct tc_mat *, const struct tc_mat *A, const struct tc_mat *B);
 
+/**
+ * Multiply the transpose of matrix A with B, save result in first pointer.
+ * Same result as tc_mat_transpose() followed by tc_mat_mult(), without
+ * forming the transpose.
+ * Return 0 if successful, -1 if error.
+ */
+int tc_mat_mult_tn(struct tc_mat *, const struct tc_mat *A, const struct tc_mat *B);
+
 /**
  * Perform scalar multiplication, based on param 'a', save result in first
  * pointer
@@ -88,7 +169,7 @@ int tc_mat_mult_scalar(struct tc_mat *, double a, const struct tc_mat *B);
 
 /**
  * Perform Householder transformation to decompose matrix. Decomposes into
- * matrices U, B and V.
+ * matrices U, B and V. The temporaries come from U's workspace, if any.
  * Return 0 if successful, -1 if error.
  */
 int tc_mat_bidiag_decomp(const struct tc_mat *A, struct tc_mat *U, struct tc_mat *B, struct tc_mat *V);
@@ -107,6 +188,7 @@ double tc_mat_wilkinson_shift(const struct tc_mat *A);
 
 /**
  * Perform singular value decomposition on matrix A saving results in pointers.
+ * The temporaries come from U's workspace, if any.
  * Return 0 if successful, -1 if error.
  */
 int tc_mat_svd(const struct tc_mat *A, struct tc_mat *U, struct tc_mat *D, struct tc_mat *V);
@@ -116,13 +198,80 @@ int tc_mat_svd(const struct tc_mat *A, struct tc_mat *U, struct tc_mat *D, struc
  */
 void tc_wgt_normalize(struct tc_mat *wgt);
 
+/**
+ * A value and its weight, the scratch space of tc_wgt_median_scratch()
+ */
+struct tc_wgt_value {
+    double wgt;
+    double value;
+};
+
+/**
+ * Weighted median of the j-th column of A, skipping NA values.
+ * Return 0.0 if error or if every value is NA.
+ */
+double tc_wgt_median(const struct tc_mat *wgt, const struct tc_mat *A,
+    uint32_t j, double NA);
+
+/**
+ * Same as tc_wgt_median, using scratch (room for A->nr values) instead of
+ * allocating, so that one buffer serves every column. A NULL scratch is
+ * allocated for the call.
+ */
+double tc_wgt_median_scratch(const struct tc_mat *wgt, const struct tc_mat *A,
+    uint32_t j, double NA, struct tc_wgt_value *scratch);
+
 /**
  * Perform principal component analysis, save loadings and scores in pointers.
+ * The first component is found by power iteration on the weighted covariance
+ * matrix, falling back to its SVD when the iteration does not converge. The
+ * loadings are signed so that their first entry within a relative 1e-9 of
+ * the largest magnitude is positive.
  * Return 0 if successful, -1 if error.
  */
 int tc_wgt_prin_comp(const struct tc_mat *wgt, const struct tc_mat *M,
     struct tc_mat *loadings, struct tc_mat *scores);
 
+/**
+ * Same as tc_wgt_prin_comp, always taking the first component from the SVD
+ * of the weighted covariance matrix.
+ * Return 0 if successful, -1 if error.
+ */
+int tc_wgt_prin_comp_svd(const struct tc_mat *wgt, const struct tc_mat *M,
+    struct tc_mat *loadings, struct tc_mat *scores);
+
+/**
+ * Sparse matrix, by columns. The entries of column j are rowidx[k] and
+ * val[k] for k in [colptr[j], colptr[j+1]), by increasing row. Entries not
+ * stored are NA.
+ */
+struct tc_spmat {
+    uint32_t nr, nc;
+    uint32_t *colptr; /* nc + 1 */
+    uint32_t *rowidx;
+    double *val;
+};
+
+/**
+ * Create a sparse matrix from its entries by rows: those of row i are at
+ * [rowptr[i], rowptr[i+1]) of colidx and val. A column may appear once
+ * per row.
+ * Return tc_spmat matrix if successful, NULL if error.
+ */
+struct tc_spmat *tc_spmat_ctr_rows(uint32_t nr, uint32_t nc,
+    const uint32_t *rowptr, const uint32_t *colidx, const double *val);
+
+/**
+ * Delete a sparse matrix.
+ */
+void tc_spmat_dtr(struct tc_spmat *);
+
+/**
+ * Copy a sparse matrix to the dense A (resized), with NA where there is no
+ * entry.
+ */
+void tc_spmat_fill(struct tc_mat *A, const struct tc_spmat *S, double NA);
+
 #define TC_VOTE_NCOLS           9
 #define TC_VOTE_NROWS           7
 
@@ -144,14 +293,20 @@ int tc_wgt_prin_comp(const struct tc_mat *wgt, const struct tc_mat *M,
 #define TC_VOTE_AUTHOR_BONUS    7
 #define TC_VOTE_DECISIONS_FINAL 8
 
+/* Smallest ballot (voters x decisions) that tc_vote_proc() splits over
+ * threads; below it the thread handoffs cost more than they save */
+#define TC_VOTE_MT_MIN_CELLS    65536
+
 struct tc_vote {
-    struct tc_mat *M; /* Vote Matrix */
+    struct tc_mat *M; /* Vote Matrix, NULL if S */
+    struct tc_spmat *S; /* Sparse Vote Matrix, NULL if M */
     struct tc_mat *cvecs[TC_VOTE_NCOLS]; /* column (Decision) vectors */
     struct tc_mat *rvecs[TC_VOTE_NROWS]; /* row (Voter) vectors */
     double NA;
     double alpha;
     double tol;
     uint32_t nr, nc;
+    uint32_t nthreads; /* threads for tc_vote_proc(), 1 (default) is serial */
 };
 
 /**
@@ -160,6 +315,20 @@ struct tc_vote {
  */
 struct tc_vote *tc_vote_ctr(uint32_t nr, uint32_t nc);
 
+/**
+ * Create vote struct around the vote matrix M, which the vote takes over.
+ * Return tc_vote if successful.
+ */
+struct tc_vote *tc_vote_ctr_mat(struct tc_mat *M);
+
+/**
+ * Create vote struct around the sparse vote matrix S, which the vote takes
+ * over. Only the principal component analysis and what follows it run on
+ * the dense matrix, with the missing votes filled in.
+ * Return tc_vote if successful.
+ */
+struct tc_vote *tc_vote_ctr_sparse(struct tc_spmat *S);
+
 /**
  * Delete vote.
  */
@@ -177,9 +346,28 @@ int tc_vote_notvalid(const struct tc_vote *);
 int tc_vote_print(const struct tc_vote *);
 
 /**
- * Perform the entire hivemind vote process.
+ * Perform the entire hivemind vote process. With nthreads > 1 the stages of
+ * a large ballot are split over that many threads; the results are bit for
+ * bit those of the serial run. The temporaries come from one workspace of
+ * tc_vote_ws_bytes().
  * Return 0 if successful, -1 if error.
  */
 int tc_vote_proc(struct tc_vote *);
 
+/**
+ * Same as tc_vote_proc, taking the temporaries from ws. Everything is
+ * released before returning, so one workspace serves ballot after ballot.
+ * Return 0 if successful, -1 if error.
+ */
+int tc_vote_proc_ws(struct tc_vote *, struct tc_ws *ws);
+
+/**
+ * Workspace bytes tc_vote_proc() needs for a ballot of nr voters and nc
+ * decisions with nthreads threads: the larger of its peaks when the first
+ * component is found by power iteration and when it falls back to the SVD
+ * of the weighted covariance matrix, whose temporaries are about nine
+ * nc x nc matrices. A workspace of this size never chains a block.
+ */
+size_t tc_vote_ws_bytes(uint32_t nr, uint32_t nc, uint32_t nthreads);
+
 #endif /* HIVEMIND_LINALG_MAT_H */
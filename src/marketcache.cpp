@@ -0,0 +1,188 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <marketcache.h>
+
+#include <clientversion.h>
+#include <memusage.h>
+#include <serialize.h>
+
+CMarketCache::CMarketCache(size_t nMaxUsageIn)
+  : nMaxUsage(nMaxUsageIn), nUsage(0), nGeneration(0), nHits(0), nMisses(0)
+{
+}
+
+void CMarketCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs_cache);
+    nMaxUsage = nMaxUsageIn;
+    while (nUsage > nMaxUsage && !listLRU.empty())
+        EraseEntry(mapEntry.find(listLRU.back()));
+}
+
+uint64_t CMarketCache::GetGeneration() const
+{
+    LOCK(cs_cache);
+    return nGeneration;
+}
+
+template <typename T>
+bool CMarketCache::Get(std::map<Key, T>& mapValue, const Key& key, T& value)
+{
+    LOCK(cs_cache);
+    typename std::map<Key, T>::const_iterator it = mapValue.find(key);
+    if (it == mapValue.end()) {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    std::list<Key>::iterator itLRU = mapEntry.find(key)->second.itLRU;
+    listLRU.splice(listLRU.begin(), listLRU, itLRU);
+    value = it->second;
+    return true;
+}
+
+template <typename T>
+void CMarketCache::Put(std::map<Key, T>& mapValue, const Key& key, const T& value, uint64_t nGenerationIn)
+{
+    // The serialized size stands in for the strings and vectors the value
+    // owns, the rest for the value and the nodes holding it
+    size_t nEntryUsage = GetSerializeSize(value, SER_DISK, CLIENT_VERSION) + sizeof(T) +
+        memusage::IncrementalDynamicUsage(mapValue) + memusage::IncrementalDynamicUsage(mapEntry) +
+        memusage::MallocUsage(sizeof(Key) + 2 * sizeof(void*));
+
+    LOCK(cs_cache);
+    if (nGenerationIn != nGeneration || nEntryUsage > nMaxUsage || mapEntry.count(key))
+        return;
+
+    while (nUsage + nEntryUsage > nMaxUsage)
+        EraseEntry(mapEntry.find(listLRU.back()));
+
+    listLRU.push_front(key);
+    Entry entry;
+    entry.nUsage = nEntryUsage;
+    entry.itLRU = listLRU.begin();
+    mapEntry.insert(std::make_pair(key, entry));
+    mapValue.insert(std::make_pair(key, value));
+    nUsage += nEntryUsage;
+}
+
+void CMarketCache::EraseEntry(std::map<Key, Entry>::iterator it)
+{
+    AssertLockHeld(cs_cache);
+    const Key& key = it->first;
+    switch (key.first) {
+    case 'B': mapBranch.erase(key); break;
+    case 'D': mapDecision.erase(key); break;
+    case 'M': mapMarket.erase(key); break;
+    case 'a': mapShareState.erase(key); break;
+    default: mapIndex.erase(key); break;
+    }
+    nUsage -= it->second.nUsage;
+    listLRU.erase(it->second.itLRU);
+    mapEntry.erase(it);
+}
+
+bool CMarketCache::GetBranch(const uint256& id, marketBranch& branch)
+{
+    return Get(mapBranch, Key('B', id), branch);
+}
+
+bool CMarketCache::GetDecision(const uint256& id, marketDecision& decision)
+{
+    return Get(mapDecision, Key('D', id), decision);
+}
+
+bool CMarketCache::GetMarket(const uint256& id, marketMarket& market)
+{
+    return Get(mapMarket, Key('M', id), market);
+}
+
+bool CMarketCache::GetShareState(const uint256& marketid, marketShareState& state)
+{
+    return Get(mapShareState, Key('a', marketid), state);
+}
+
+bool CMarketCache::GetIndex(const Key& key, std::vector<uint256>& vId)
+{
+    return Get(mapIndex, key, vId);
+}
+
+void CMarketCache::PutBranch(const uint256& id, const marketBranch& branch, uint64_t nGenerationIn)
+{
+    Put(mapBranch, Key('B', id), branch, nGenerationIn);
+}
+
+void CMarketCache::PutDecision(const uint256& id, const marketDecision& decision, uint64_t nGenerationIn)
+{
+    Put(mapDecision, Key('D', id), decision, nGenerationIn);
+}
+
+void CMarketCache::PutMarket(const uint256& id, const marketMarket& market, uint64_t nGenerationIn)
+{
+    Put(mapMarket, Key('M', id), market, nGenerationIn);
+}
+
+void CMarketCache::PutShareState(const uint256& marketid, const marketShareState& state, uint64_t nGenerationIn)
+{
+    Put(mapShareState, Key('a', marketid), state, nGenerationIn);
+}
+
+void CMarketCache::PutIndex(const Key& key, const std::vector<uint256>& vId, uint64_t nGenerationIn)
+{
+    Put(mapIndex, key, vId, nGenerationIn);
+}
+
+void CMarketCache::Erase(const Key& key)
+{
+    LOCK(cs_cache);
+    nGeneration++;
+    std::map<Key, Entry>::iterator it = mapEntry.find(key);
+    if (it != mapEntry.end())
+        EraseEntry(it);
+}
+
+void CMarketCache::Clear()
+{
+    LOCK(cs_cache);
+    nGeneration++;
+    listLRU.clear();
+    mapEntry.clear();
+    mapBranch.clear();
+    mapDecision.clear();
+    mapMarket.clear();
+    mapShareState.clear();
+    mapIndex.clear();
+    nUsage = 0;
+}
+
+size_t CMarketCache::Size() const
+{
+    LOCK(cs_cache);
+    return mapEntry.size();
+}
+
+size_t CMarketCache::DynamicMemoryUsage() const
+{
+    LOCK(cs_cache);
+    return nUsage;
+}
+
+size_t CMarketCache::GetMaxUsage() const
+{
+    LOCK(cs_cache);
+    return nMaxUsage;
+}
+
+uint64_t CMarketCache::GetHits() const
+{
+    LOCK(cs_cache);
+    return nHits;
+}
+
+uint64_t CMarketCache::GetMisses() const
+{
+    LOCK(cs_cache);
+    return nMisses;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MARKETCACHE_H
+#define BITCOIN_MARKETCACHE_H
+
+#include <primitives/market.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+/** Default for -marketcache (MiB) */
+static const int64_t DEFAULT_MARKET_CACHE = 32;
+
+/**
+ * Memory-bounded cache of the market index, in front of the LevelDB reads
+ * of CMarketTreeDB.
+ *
+ * Holds branches, decisions and markets by id, the share state of each
+ * market and the id lists of the secondary indexes the RPC and the GUI walk
+ * (all branches, the decisions of a branch, the markets of a decision).
+ * Objects are immutable under their id, so connecting a block only drops
+ * the lists it adds to; disconnecting drops the objects it erases. Entries
+ * are evicted least recently used first once the estimated usage passes
+ * the limit.
+ *
+ * A read that misses goes to the database without the lock held. It takes
+ * the generation before and only fills the cache if no invalidation came
+ * in between, so a read racing a block cannot put back what it dropped.
+ */
+class CMarketCache
+{
+public:
+    /** Cache key: (op, id), op as in the market database ('b' with a null
+     *  id is the list of all branches) */
+    typedef std::pair<char, uint256> Key;
+
+    explicit CMarketCache(size_t nMaxUsageIn = 0);
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    uint64_t GetGeneration() const;
+
+    bool GetBranch(const uint256& id, marketBranch& branch);
+    bool GetDecision(const uint256& id, marketDecision& decision);
+    bool GetMarket(const uint256& id, marketMarket& market);
+    bool GetShareState(const uint256& marketid, marketShareState& state);
+    bool GetIndex(const Key& key, std::vector<uint256>& vId);
+
+    void PutBranch(const uint256& id, const marketBranch& branch, uint64_t nGeneration);
+    void PutDecision(const uint256& id, const marketDecision& decision, uint64_t nGeneration);
+    void PutMarket(const uint256& id, const marketMarket& market, uint64_t nGeneration);
+    void PutShareState(const uint256& marketid, const marketShareState& state, uint64_t nGeneration);
+    void PutIndex(const Key& key, const std::vector<uint256>& vId, uint64_t nGeneration);
+
+    /** Drop an entry, e.g. after the database entry it mirrors changed */
+    void Erase(const Key& key);
+
+    void Clear();
+
+    size_t Size() const;
+    size_t DynamicMemoryUsage() const;
+    size_t GetMaxUsage() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+
+private:
+    struct Entry {
+        size_t nUsage;
+        std::list<Key>::iterator itLRU;
+    };
+
+    template <typename T>
+    bool Get(std::map<Key, T>& mapValue, const Key& key, T& value);
+
+    template <typename T>
+    void Put(std::map<Key, T>& mapValue, const Key& key, const T& value, uint64_t nGenerationIn);
+
+    void EraseEntry(std::map<Key, Entry>::iterator it);
+
+    mutable CCriticalSection cs_cache;
+    size_t nMaxUsage;
+    size_t nUsage;
+    uint64_t nGeneration;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    //! Keys, most recently used first
+    std::list<Key> listLRU;
+    std::map<Key, Entry> mapEntry;
+
+    std::map<Key, marketBranch> mapBranch;
+    std::map<Key, marketDecision> mapDecision;
+    std::map<Key, marketMarket> mapMarket;
+    std::map<Key, marketShareState> mapShareState;
+    std::map<Key, std::vector<uint256> > mapIndex;
+};
+
+#endif // BITCOIN_MARKETCACHE_H
@@ -0,0 +1,186 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <marketindex.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <init.h>
+#include <primitives/market.h>
+#include <txdb.h>
+#include <ui_interface.h>
+#include <util.h>
+#include <validation.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+typedef std::vector<std::pair<uint256, std::shared_ptr<const marketObj> > > MarketObjList;
+
+/** The blocks to index and the market objects read from them, shared by
+ *  the reader threads and the writer */
+struct MarketReindexState {
+    //! Positions of the blocks, in height order (read only once started)
+    std::vector<CDiskBlockPos> vPos;
+
+    std::mutex mutex;
+    //! Signalled when the writer takes a block or the build stops
+    std::condition_variable cvRead;
+    //! Signalled when a block has been read
+    std::condition_variable cvWrite;
+    std::vector<MarketObjList> vObj;
+    std::vector<char> vDone;
+    //! Next block to read
+    size_t nNext = 0;
+    //! Blocks taken by the writer
+    size_t nWritten = 0;
+    bool fStop = false;
+    bool fError = false;
+};
+
+void ThreadReadMarketObjs(MarketReindexState& state, const Consensus::Params& consensusParams)
+{
+    RenameThread("hivemind-marketidx");
+    while (true) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.cvRead.wait(lock, [&state] {
+                return state.fStop || state.nNext >= state.vPos.size() ||
+                    state.nNext < state.nWritten + MARKET_REINDEX_WINDOW;
+            });
+            if (state.fStop || state.nNext >= state.vPos.size())
+                return;
+            i = state.nNext++;
+        }
+
+        CBlock block;
+        bool fRead = ReadBlockFromDisk(block, state.vPos[i], consensusParams);
+        MarketObjList vObj;
+        if (fRead) {
+            for (const CTransactionRef& tx : block.vtx) {
+                for (const std::shared_ptr<const marketObj>& obj : tx->GetMarketObjs())
+                    vObj.push_back(std::make_pair(obj->GetHash(), obj));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (fRead) {
+                state.vObj[i].swap(vObj);
+                state.vDone[i] = 1;
+            } else {
+                state.fError = true;
+            }
+        }
+        state.cvWrite.notify_one();
+    }
+}
+
+} // namespace
+
+bool RebuildMarketIndex(const CChainParams& chainparams)
+{
+    MarketReindexState state;
+    std::vector<const CBlockIndex*> vIndex;
+    {
+        LOCK(cs_main);
+        // The genesis block is not connected; its branch is written below
+        for (int nHeight = 1; nHeight <= chainActive.Height(); nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                return error("%s: block %s at height %d is not on disk", __func__, pindex->GetBlockHash().ToString(), nHeight);
+            vIndex.push_back(pindex);
+            state.vPos.push_back(pindex->GetBlockPos());
+        }
+    }
+    state.vObj.resize(vIndex.size());
+    state.vDone.assign(vIndex.size(), 0);
+
+    const int nThreads = std::max(1, nScriptCheckThreads);
+    LogPrintf("Rebuilding market index of %u blocks with %d threads...\n", vIndex.size(), nThreads);
+    int64_t nStart = GetTimeMillis();
+
+    if (!pmarkettree->WriteReindexing(true) || !pmarkettree->WriteFlag("market", true))
+        return error("%s: cannot write to the market database", __func__);
+    fMarketIndex = true;
+
+    CMarketIndexBatch batch(*pmarkettree);
+    const marketBranch& branch = chainparams.GenesisBranch();
+    batch.Add(std::vector<std::pair<uint256, const marketObj *> >(1, std::make_pair(branch.GetHash(), &branch)));
+
+    std::vector<std::thread> vThread;
+    for (int i = 0; i < nThreads; i++)
+        vThread.emplace_back(ThreadReadMarketObjs, std::ref(state), std::cref(chainparams.GetConsensus()));
+
+    const size_t nBatchSize = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    size_t nObj = 0;
+    int nReported = -1;
+    bool fOk = true;
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        MarketObjList vObj;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.cvWrite.wait(lock, [&state, i] { return state.vDone[i] || state.fError; });
+            if (!state.vDone[i]) {
+                fOk = false;
+                break;
+            }
+            vObj.swap(state.vObj[i]);
+            state.nWritten = i + 1;
+        }
+        state.cvRead.notify_all();
+
+        if (ShutdownRequested()) {
+            fOk = false;
+            break;
+        }
+
+        if (!vObj.empty()) {
+            std::vector<std::pair<uint256, const marketObj *> > vMarketObj;
+            for (const std::pair<uint256, std::shared_ptr<const marketObj> >& item : vObj)
+                vMarketObj.push_back(std::make_pair(item.first, item.second.get()));
+            batch.Add(vMarketObj, vIndex[i]);
+            nObj += vObj.size();
+        }
+
+        if (batch.SizeEstimate() > nBatchSize && !batch.Write()) {
+            fOk = false;
+            break;
+        }
+
+        int nProgress = (int)((i + 1) * 100 / vIndex.size());
+        if (nProgress != nReported) {
+            uiInterface.ShowProgress(_("Rebuilding market index..."), nProgress, false);
+            if (nProgress % 10 == 0)
+                LogPrintf("[%d%%]...", nProgress);
+            nReported = nProgress;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.fStop = true;
+    }
+    state.cvRead.notify_all();
+    for (std::thread& thread : vThread)
+        thread.join();
+    uiInterface.ShowProgress("", 100, false);
+
+    if (fOk)
+        fOk = batch.Write(true) && pmarkettree->WriteReindexing(false);
+    LogPrintf("[%s].\n", fOk ? "DONE" : ShutdownRequested() ? "CANCELLED" : "FAILED");
+    if (!fOk)
+        return ShutdownRequested() ? false : error("%s: failed to rebuild the market index", __func__);
+
+    LogPrintf("Rebuilt market index: %u objects in %u blocks, %dms\n", nObj, vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
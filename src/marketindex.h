@@ -0,0 +1,27 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MARKETINDEX_H
+#define BITCOIN_MARKETINDEX_H
+
+class CChainParams;
+
+/** Default for -reindex-market */
+static const bool DEFAULT_REINDEX_MARKET = false;
+
+/** Blocks read ahead of the one being written by RebuildMarketIndex */
+static const unsigned int MARKET_REINDEX_WINDOW = 1024;
+
+/**
+ * Build the market index of the active chain from the block files, into an
+ * empty market database (-reindex-market). The chainstate is not touched.
+ *
+ * Worker threads (-par) read the blocks and decode their market objects;
+ * the calling thread adds them in height order to batches of about
+ * -dbbatchsize bytes. The database is marked as reindexing until the build
+ * is complete, so an interrupted build starts over on the next start.
+ */
+bool RebuildMarketIndex(const CChainParams& chainparams);
+
+#endif // BITCOIN_MARKETINDEX_H
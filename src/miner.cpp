@@ -18,6 +18,7 @@
 #include <hash.h>
 #include <validation.h>
 #include <net.h>
+#include <outcomecache.h>
 #include <policy/feerate.h>
 #include <policy/policy.h>
 #include <policy/withdrawalbundle.h>
@@ -76,23 +77,13 @@ static const uint64_t nRefundOutputSize = 34;
 //      1) all trade payouts are calculated, and
 //      2) the market author fee is calculated.
 //
-void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t height)
+void getBranchOutcome(std::vector<CTxOut>& vout, const marketBranch& branch, uint32_t height)
 {
     /* Make sure the current height is a factor of tau */
     if (height % branch.tau) return;
 
     LogPrintf("%s: Miner generating outcomes for branch %s for period ending at height %u\n", __func__, branch.GetHash().ToString(), height);
 
-    /* Retrieve the votes for this height. */
-    vector<marketRevealVote> revealvotes = pmarkettree->GetRevealVotes(branch.GetHash(), height);
-
-    LogPrintf("%s: Total reveal votes: %u\n", __func__, revealvotes.size());
-
-    /* Create a map of new votes, indexed by their keyID(s) */
-    map<CKeyID, marketRevealVote> voteMap;
-    for(size_t i=0; i < revealvotes.size(); i++)
-       voteMap[ revealvotes[i].keyID ] = revealvotes[i];
-
     /* outcome for this height */
     struct marketOutcome *outcome = NULL;
 
@@ -112,22 +103,13 @@ void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t hei
 
     LogPrintf("%s: Decision ending time range: %u -> %u\n", __func__, minHeight, maxHeight);
 
-    /* Get the list of decisions on the branch, and create decisionMap */
-    vector<marketDecision> decisions = pmarkettree->GetDecisions(branch.GetHash());
+    /* Get the decisions on the branch ending within our range */
+    vector<marketDecision> decisions = pmarkettree->GetDecisionsInRange(branch.GetHash(), minHeight + 1, maxHeight);
 
     LogPrintf("%s: Total decisions: %u\n", __func__, decisions.size());
 
-    map<uint256, marketDecision> decisionMap;
-    for(size_t i=0; i < decisions.size(); i++)
-        decisionMap[ decisions[i].GetHash() ] = decisions[i];
-
-    /* Find the decisions within our range */
     for(size_t i=0; i < decisions.size(); i++) {
-        const marketDecision decision = decisions[i];
-        if (decision.eventOverBy <= minHeight)
-            continue;
-        if (decision.eventOverBy > maxHeight)
-            continue;
+        const marketDecision& decision = decisions[i];
 
         /* Add relevant decisions to the new outcome */
         outcome->nDecisions++;
@@ -153,54 +135,28 @@ void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t hei
     }
 
     /* Populate the vote matrix [nVoters][nDecisions] */
+    marketVoteMatrix voteMatrix(*outcome);
     if (outcome->nDecisions) {
-        /* Retrieve the votes for this height. */
-        vector<marketRevealVote> revealvotes = pmarkettree->GetRevealVotes(branch.GetHash(), height);
-
-        /* Create a map of new votes, indexed by their owner's keyID */
-        map<CKeyID, marketRevealVote> voteMap;
-        for(size_t i=0; i < revealvotes.size(); i++)
-           voteMap[ revealvotes[i].keyID ] = revealvotes[i];
-
-        // Clear and resize the vote matrix for new outcome calculation
-        outcome->voteMatrix.clear();
-        outcome->voteMatrix.resize(voteMap.size()*outcome->nDecisions, outcome->NA);
-
-        /* Go through the reveal votes and collect voter keys */
-        for(uint32_t i=0; i < revealvotes.size(); i++) {
-            outcome->voterIDs.push_back(revealvotes.at(i).keyID);
-
-            // TODO unused?
-            uint256 txid = revealvotes.at(i).txid;
-//            pcoinsTip->GetCoins()
-// TODO OLD REP
-            outcome->oldRep.push_back(25000);
-            map<CKeyID, marketRevealVote>::const_iterator vit
-                = voteMap.find(revealvotes.at(i).keyID);
-            if (vit != voteMap.end()) {
-                const marketRevealVote vote = vit->second;
-                const vector<uint256> &decisionIDs = vote.decisionIDs;
-                const vector<uint64_t> &decisionVotes = vote.decisionVotes;
-                if (decisionIDs.size() == decisionVotes.size()) {
-                    for(uint32_t j=0; j < decisionIDs.size(); j++) {
-                        /* find this voter's response on that decision */
-                        uint64_t resp = outcome->NA;
-                        for(uint32_t k=0; k < decisionIDs.size(); k++)
-                            if (decisionIDs[k] == outcome->decisionIDs[j])
-                                { resp = decisionVotes[k]; break; }
-                        outcome->voteMatrix[ i*outcome->nDecisions + j] = resp;
-                    }
-                }
-            }
-            outcome->nVoters++;
-        }
+        /* Add the reveal votes for this height as the cursor reads them */
+        uint32_t nRevealVotes = 0;
+        pmarkettree->ForEachRevealVote(branch.GetHash(), height,
+            [&voteMatrix, &nRevealVotes](const marketRevealVote& vote) {
+                voteMatrix.AddVote(vote);
+                nRevealVotes++;
+            });
+
+        LogPrintf("%s: Total reveal votes: %u\n", __func__, nRevealVotes);
+
+        // TODO OLD REP
+        outcome->oldRep.assign(outcome->nVoters, 25000);
     }
 
     LogPrintf("%s: Number of outcome voters: %u\n", __func__, outcome->nVoters);
 
     /* Calculate new outcome, add reputation payouts to transaction */
     if (outcome->nVoters) {
-        int ret = outcome->calc();
+        int nThreads = std::min<int>(std::max<int>(gArgs.GetArg("-outcomethreads", DEFAULT_OUTCOME_THREADS), 1), MAX_OUTCOME_THREADS);
+        int ret = voteMatrix.Calc(nThreads);
 
         if (ret == 0) {
             for(uint32_t i=0; i < outcome->voterIDs.size(); i++) {
@@ -209,76 +165,56 @@ void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t hei
                 CScript script;
                 script << OP_DUP << OP_HASH160 << ToByteVector(keyID) << OP_EQUALVERIFY << OP_CHECKSIG;
 
-                // Pay voter
-                tx.vout.push_back(CTxOut(1e-8*outcome->smoothedRep[i], script));
+                // Pay voter, smoothedRep in 1e-8 units as whole satoshis
+                vout.push_back(CTxOut(outcome->smoothedRep[i] / COIN, script));
             }
         }
     }
 
-    /* Find all of the markets on this branch */
+    /* Find the markets on this branch that have just ended. Market
+     * maturation is not tied to the end heights of its decisions, so they
+     * are read from the maturation index and kept if one of their
+     * decisions is on this branch. */
     vector<marketMarket> markets;
-    for (unsigned int x = 0; x < decisions.size(); x++) {
-        // Get the markets for this decision
-        uint256 uDecision(decisions.at(x).GetHash());
-        vector<marketMarket> decisionMarkets = pmarkettree->GetMarkets(uDecision);
-
-        // Add the markets to the markets vector
-        for (unsigned int y = 0; y < decisionMarkets.size(); y++) {
-            markets.push_back(decisionMarkets.at(y));
-        }
-    }
-    LogPrintf("%s: Number of markets on branch: %u\n", __func__, markets.size());
-
-    /* find which markets have just ended */
-    uint32_t nMarketsEnded = 0; // Count of markets that have ended
-    uint8_t *marketNeedsCalc = NULL; // Array indicating markets that need calculation (1 = calc 0 = skip)
-    if (!markets.empty()) {
-        marketNeedsCalc = new uint8_t [markets.size()];
-        memset(marketNeedsCalc, 0, markets.size());
-        for(size_t i=0; i < markets.size(); i++) {
-            const marketMarket market = markets[i];
-            if (market.maturation <= minHeight)
-                continue;
-            if (market.maturation > maxHeight)
-                continue;
-
-            marketNeedsCalc[i] = 1;
-            nMarketsEnded++;
+    for (const marketMarket& market : pmarkettree->GetMarketsInRange(minHeight + 1, maxHeight)) {
+        for (const uint256& decisionid : market.decisionIDs) {
+            marketDecision decision;
+            if (pmarkettree->GetDecision(decisionid, decision) && decision.branchid == branch.GetHash()) {
+                markets.push_back(market);
+                break;
+            }
         }
     }
 
-    LogPrintf("%s: Number of markets that have ended: %u\n", __func__, nMarketsEnded);
+    LogPrintf("%s: Number of markets that have ended: %u\n", __func__, markets.size());
 
     /* If markets have ended, calculate the payouts */
-    if (nMarketsEnded) {
-        /* Loop through the list of markets, and calculate those that need to be */
+    if (!markets.empty()) {
         for(uint32_t i=0; i < markets.size(); i++) {
-            if (!marketNeedsCalc[i])
-                continue;
             /* populate the market's decisionsFinal and isScaled arrays */
             vector<uint64_t> decisionsFinals;
             vector<uint64_t> isScaleds;
             vector<uint64_t> mins;
             vector<uint64_t> maxs;
             for(size_t j=0; j < markets[i].decisionIDs.size(); j++) {
-                map<uint256, marketDecision>::const_iterator it
-                        = decisionMap.find(markets[i].decisionIDs[j]);
+                marketDecision decision;
                 uint64_t decisionFinal = 2016;
                 uint64_t min = 0;
                 uint64_t max = 0;
                 uint8_t isScaled = 0;
-                if (it != decisionMap.end()) {
-                    min = it->second.min;
-                    max = it->second.max;
+                if (pmarkettree->GetDecision(markets[i].decisionIDs[j], decision)) {
+                    min = decision.min;
+                    max = decision.max;
                     /* get the outcome for this decision */
                     const marketOutcome *decisionOutcome = NULL;
-                    if (it->second.eventOverBy == height && outcome) {
+                    if (decision.eventOverBy == height && outcome) {
                         decisionOutcome = outcome;
                     }
 
-                    /* find the decisionFinal in this outcome */
+                    /* find the decisionFinal in this outcome, which has
+                     * none if it was not calculated */
                     if (decisionOutcome) {
-                        for(size_t k=0; k < outcome->decisionIDs.size(); i++) {
+                        for(size_t k=0; k < decisionOutcome->decisionsFinal.size(); k++) {
                             if (decisionOutcome->decisionIDs[k] != markets[i].decisionIDs[j])
                                 continue;
                             decisionFinal = decisionOutcome->decisionsFinal[k];
@@ -299,34 +235,15 @@ void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t hei
             for(uint32_t j=0; j < trades.size(); j++) {
                 if (!trades[j].isBuy)
                     continue;
-                // TODO unused
                 /* TODO: lookup and skip if previously sold */
-                uint64_t nShares = trades[j].nShares;
-                uint32_t decisionState = trades[j].decisionState;
-                /* iterate through all decision finals */
-                double payout = 1.0;
-                for(uint32_t k=0; k < decisionsFinals.size(); k++) {
-                    uint8_t state = (decisionState >> k) & 1;
-                    if (isScaleds[k] && (maxs[k] > mins[k])) {
-                        if (state == 0) {
-                            payout *= (maxs[k] - decisionsFinals[k]) / (maxs[k] - mins[k]);
-                        } else if (state == 1) {
-                            payout *= (decisionsFinals[k] - mins[k]) / (maxs[k] - mins[k]);
-                        }
-                    } else if ((state == 0) && (decisionsFinals[k] > 0.5*1e8)) {
-                         payout = 0;
-                         break;
-                    } else if ((state == 1) && (decisionsFinals[k] < 0.5*1e8)) {
-                        payout = 0;
-                        break;
-                    }
-                }
+                uint64_t payout = marketTradePayout(trades[j].nShares, trades[j].decisionState,
+                    decisionsFinals, isScaleds, mins, maxs);
 
                 /* If there is payout to be made, create the script and add it to the coinTX */
-                if (payout > 0.0) {
+                if (payout > 0) {
                     CScript script;
                     script << OP_DUP << OP_HASH160 << ToByteVector(trades[j].keyID) << OP_EQUALVERIFY << OP_CHECKSIG;
-                    tx.vout.push_back(CTxOut(nShares*payout, script));
+                    vout.push_back(CTxOut(payout, script));
                 }
             }
         }
@@ -334,11 +251,9 @@ void getBranchOutcome(CMutableTransaction &tx, marketBranch branch, uint32_t hei
 
     // add outcome
     if (outcome)
-        tx.vout.push_back(CTxOut(0, outcome->GetScript()));
+        vout.push_back(CTxOut(0, outcome->GetScript()));
 
     /* clean up */
-    if (marketNeedsCalc)
-        delete [] marketNeedsCalc;
     if (outcome)
         delete outcome;
 }
@@ -389,6 +304,7 @@ BlockAssembler::BlockAssembler(const CChainParams& params) : BlockAssembler(para
 void BlockAssembler::resetBlock()
 {
     inBlock.clear();
+    marketState.Clear();
 
     // Reserve space for coinbase tx
     nBlockWeight = 4000;
@@ -494,11 +410,12 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     coinbaseTx.vout.resize(1);
     coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
 
-    // Add branch outcome output(s)
-    uint32_t height = chainActive.Height() + 1;
+    // Add branch outcome output(s), precomputed by the outcome cache
+    // when it had the chance
     vector<marketBranch> branches = pmarkettree->GetBranches();
     for(size_t i=0; i < branches.size(); i++) {
-        getBranchOutcome(coinbaseTx, branches[i], height);
+        vector<CTxOut> vout = outcomeCache.GetOutcomeOutputs(branches[i], pindexPrev);
+        coinbaseTx.vout.insert(coinbaseTx.vout.end(), vout.begin(), vout.end());
     }
 
     SidechainClient client;
@@ -793,6 +710,8 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblocktemplate->vTxFees[0] = -nFees;
 
     LogPrintf("CreateNewBlock(): block weight: %u txs: %u fees: %ld sigops %d\n", GetBlockWeight(*pblock), nBlockTx, nFees, nBlockSigOpsCost);
+    if (marketState.GetSkipped())
+        LogPrintf("CreateNewBlock(): skipped %u packages with trades below their price\n", marketState.GetSkipped());
 
     // Fill in header
     pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -1095,13 +1014,22 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
             continue;
         }
 
-        // This transaction will make it in; reset the failed counter.
-        nConsecutiveFailed = 0;
-
-        // Package can be added. Sort the entries in a valid order.
+        // Sort the entries in a valid order.
         std::vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
 
+        // Test the trades against the markets as the block leaves them
+        if (!TestPackageMarketTrades(sortedEntries)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
         for (size_t i=0; i<sortedEntries.size(); ++i) {
             // Keep track of withdrawal refunds that are added
             if (sortedEntries[i]->IsWithdrawalRefund()) {
@@ -1121,6 +1049,83 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     }
 }
 
+bool BlockAssembler::TestPackageMarketTrades(const std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    std::vector<const marketTrade*> vTrade;
+    for (const CTxMemPool::txiter& it : sortedEntries) {
+        for (const std::shared_ptr<const marketObj>& obj : it->GetTx().GetMarketObjs()) {
+            if (obj->marketop != 'T')
+                continue;
+            const marketTrade* trade = (const marketTrade*)obj.get();
+            if (!marketState.HasMarket(trade->marketid)) {
+                marketMarket market;
+                marketShareState state;
+                bool fMarket = pmarkettree && pmarkettree->GetMarket(trade->marketid, market);
+                if (fMarket)
+                    pmarkettree->GetMarketShareState(trade->marketid, state);
+                marketState.SetMarket(trade->marketid, fMarket ? &market : nullptr, state);
+            }
+            vTrade.push_back(trade);
+        }
+    }
+    return vTrade.empty() || marketState.AddTrades(vTrade);
+}
+
+void BlockMarketState::SetMarket(const uint256& marketid, const marketMarket* market, const marketShareState& state)
+{
+    Market& m = mapMarket[marketid];
+    m.fKnown = (market != nullptr);
+    if (!m.fKnown)
+        return;
+    uint32_t nStates = marketNStates(*market);
+    m.B = market->B;
+    m.maxCommission = market->maxCommission;
+    m.nShares = state.nShares;
+    m.nShares.resize(nStates, 0);
+    m.nAccount = marketAccountValueFixed(m.maxCommission, m.B, nStates, m.nShares.data());
+}
+
+bool BlockMarketState::AddTrades(const std::vector<const marketTrade*>& vTrade)
+{
+    // Price the trades on copies of the markets, kept if all of them hold
+    std::map<uint256, Market> mapPackage;
+    for (const marketTrade* trade : vTrade) {
+        std::map<uint256, Market>::iterator mi = mapPackage.find(trade->marketid);
+        if (mi == mapPackage.end()) {
+            std::map<uint256, Market>::const_iterator it = mapMarket.find(trade->marketid);
+            if (it == mapMarket.end() || !it->second.fKnown)
+                continue;
+            mi = mapPackage.insert(*it).first;
+        }
+        Market& m = mi->second;
+        if (trade->decisionState >= m.nShares.size()) {
+            nSkipped++;
+            return false;
+        }
+        if (!trade->nShares)
+            continue;
+
+        /* as createtrade: buys must pay for the change in account value */
+        m.nShares[trade->decisionState] += (trade->isBuy)? (int64_t)trade->nShares: -(int64_t)trade->nShares;
+        int64_t nAccount = marketAccountValueFixed(m.maxCommission, m.B, m.nShares.size(), m.nShares.data());
+        if (trade->isBuy && !marketPriceCovers(nAccount - m.nAccount, trade->nShares, trade->price)) {
+            nSkipped++;
+            return false;
+        }
+        m.nAccount = nAccount;
+    }
+
+    for (std::pair<const uint256, Market>& item : mapPackage)
+        mapMarket[item.first] = std::move(item.second);
+    return true;
+}
+
+void BlockMarketState::Clear()
+{
+    mapMarket.clear();
+    nSkipped = 0;
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -1174,6 +1179,8 @@ bool BlockAssembler::GenerateBMMBlock(CBlock& block, std::string& strError, CAmo
         return false;
     }
 
+    CBlock *pblock = &pblocktemplate->block;
+
     // If an optional vector of transactions was passed in, we replace all
     // but the coinbase with them.
     if (vtx.size()) {
@@ -1184,7 +1191,6 @@ bool BlockAssembler::GenerateBMMBlock(CBlock& block, std::string& strError, CAmo
     }
 
     unsigned int nExtraNonce = 0;
-    CBlock *pblock = &pblocktemplate->block;
     CBlockIndex* prevBlock = mapBlockIndex[pblock->hashPrevBlock];
     {
         LOCK(cs_main);
@@ -10,13 +10,19 @@
 #include <txmempool.h>
 
 #include <stdint.h>
+#include <map>
 #include <memory>
+#include <vector>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 
 class CBlockIndex;
 class CChainParams;
 class CScript;
+struct marketBranch;
+struct marketMarket;
+struct marketShareState;
+struct marketTrade;
 
 namespace Consensus { struct Params; };
 
@@ -119,6 +125,41 @@ struct update_for_parent_inclusion
     CTxMemPool::txiter iter;
 };
 
+/** The share totals of the markets traded on in a block being assembled.
+ *  Trades are priced on the LMSR in block order, so that a trade whose
+ *  price no longer covers its cost after the trades before it is left out
+ *  instead of being mined to fail. The pricing is on the fixed-point
+ *  account value, so every node assembling the same trades agrees. */
+class BlockMarketState
+{
+private:
+    struct Market {
+        bool fKnown;
+        uint64_t B;
+        uint64_t maxCommission;
+        std::vector<int64_t> nShares;
+        int64_t nAccount; // account value at nShares, in 1e-8 units
+    };
+    std::map<uint256, Market> mapMarket;
+    uint64_t nSkipped;
+
+public:
+    BlockMarketState() : nSkipped(0) { }
+
+    /** Whether the state of the market was set */
+    bool HasMarket(const uint256& marketid) const { return mapMarket.count(marketid); }
+    /** Set the share state of a market before its first trade in the block.
+     *  Without a market (nullptr) its trades are added without a price check */
+    void SetMarket(const uint256& marketid, const marketMarket* market, const marketShareState& state);
+    /** Add the trades of a package in order. If a buy would cost more than
+     *  its price or a trade is on a state the market does not have, none
+     *  of them are added and false is returned */
+    bool AddTrades(const std::vector<const marketTrade*>& vTrade);
+    /** Packages refused by AddTrades */
+    uint64_t GetSkipped() const { return nSkipped; }
+    void Clear();
+};
+
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
@@ -139,6 +180,7 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    BlockMarketState marketState;
 
     // Chain context for the block
     int nHeight;
@@ -197,6 +239,10 @@ private:
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
     bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    /** Test that the trades of a package, in block order, still meet their
+      * price after the trades already in the block, and add them to
+      * marketState if so */
+    bool TestPackageMarketTrades(const std::vector<CTxMemPool::txiter>& sortedEntries);
     /** Return true if given transaction from mapTx has already been evaluated,
       * or if the transaction's cached data in mapTx is incorrect. */
     bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
@@ -210,6 +256,9 @@ private:
 
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Append the outputs paying the outcome of branch at height. Nothing is
+ *  appended off the branch's tau boundaries */
+void getBranchOutcome(std::vector<CTxOut>& vout, const marketBranch& branch, uint32_t height);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
 bool CreateDepositTx(CMutableTransaction& depositTx);
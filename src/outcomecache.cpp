@@ -0,0 +1,180 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <outcomecache.h>
+
+#include <chain.h>
+#include <miner.h>
+#include <primitives/market.h>
+#include <txdb.h>
+#include <util.h>
+#include <validation.h>
+
+#include <functional>
+
+OutcomeCache outcomeCache;
+
+std::vector<CTxOut> OutcomeCache::Compute(const marketBranch& branch, const CBlockIndex* pindexPrev)
+{
+    uint32_t height = pindexPrev->nHeight + 1;
+    OutcomeKey key(pindexPrev->GetBlockHash(), branch.GetHash());
+    {
+        LOCK(cs_outcome);
+        std::map<OutcomeKey, std::vector<CTxOut> >::const_iterator it = mapOutcome.find(key);
+        if (it != mapOutcome.end())
+            return it->second;
+    }
+
+    std::vector<CTxOut> vout;
+    getBranchOutcome(vout, branch, height);
+
+    LOCK(cs_outcome);
+    mapOutcome[key] = vout;
+    return vout;
+}
+
+std::vector<CTxOut> OutcomeCache::GetOutcomeOutputs(const marketBranch& branch, const CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+
+    uint32_t height = pindexPrev->nHeight + 1;
+    if (!branch.tau || height % branch.tau)
+        return std::vector<CTxOut>();
+
+    if (pindexPrev != chainActive.Tip()) {
+        std::vector<CTxOut> vout;
+        getBranchOutcome(vout, branch, height);
+        return vout;
+    }
+
+    return Compute(branch, pindexPrev);
+}
+
+size_t OutcomeCache::Size() const
+{
+    LOCK(cs_outcome);
+    return mapOutcome.size();
+}
+
+void OutcomeCache::Clear()
+{
+    LOCK(cs_outcome);
+    mapOutcome.clear();
+}
+
+void OutcomeCache::Precompute(const CBlockIndex* pindexNew)
+{
+    if (!pmarkettree)
+        return;
+
+    // The tip may have moved on since it was queued, and the index is only
+    // read as the active tip describes it
+    const uint256 hashTip = pindexNew->GetBlockHash();
+    const uint32_t height = pindexNew->nHeight + 1;
+    std::vector<marketBranch> vBranch;
+    uint64_t nWriteCount;
+    {
+        LOCK(cs_main);
+        if (pindexNew != chainActive.Tip())
+            return;
+        vBranch = pmarkettree->GetBranches();
+        nWriteCount = pmarkettree->GetWriteCount();
+    }
+
+    {
+        // Entries built on any other tip will not be asked for again
+        LOCK(cs_outcome);
+        std::map<OutcomeKey, std::vector<CTxOut> >::iterator it = mapOutcome.begin();
+        while (it != mapOutcome.end()) {
+            if (it->first.first != hashTip)
+                it = mapOutcome.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    for (const marketBranch& branch : vBranch) {
+        if (!branch.tau || height % branch.tau)
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock(mutPending);
+            if (fInterrupt)
+                return;
+        }
+
+        OutcomeKey key(hashTip, branch.GetHash());
+        {
+            LOCK(cs_outcome);
+            if (mapOutcome.count(key))
+                continue;
+        }
+
+        // Validation goes on while the votes are calculated. Any write to
+        // the index meanwhile, a reorg away and back included, may have
+        // mixed two states into the result, so it is dropped.
+        int64_t nTimeStart = GetTimeMicros();
+        std::vector<CTxOut> vout;
+        getBranchOutcome(vout, branch, height);
+
+        LOCK2(cs_main, cs_outcome);
+        if (pindexNew != chainActive.Tip() || pmarkettree->GetWriteCount() != nWriteCount)
+            return;
+        mapOutcome[key] = vout;
+        LogPrint(BCLog::BENCH, "%s: precomputed outcome of branch %s at height %u: %.2fms\n", __func__,
+            branch.GetHash().ToString(), height, 0.001 * (GetTimeMicros() - nTimeStart));
+    }
+}
+
+void OutcomeCache::ThreadPrecompute()
+{
+    while (true) {
+        const CBlockIndex* pindex;
+        {
+            std::unique_lock<std::mutex> lock(mutPending);
+            condPending.wait(lock, [this] { return fInterrupt || pindexPending; });
+            if (fInterrupt)
+                return;
+            pindex = pindexPending;
+            pindexPending = nullptr;
+        }
+        Precompute(pindex);
+    }
+}
+
+void OutcomeCache::Start()
+{
+    if (!threadPrecompute.joinable())
+        threadPrecompute = std::thread(&TraceThread<std::function<void()> >, "outcome", std::function<void()>(std::bind(&OutcomeCache::ThreadPrecompute, this)));
+}
+
+void OutcomeCache::Interrupt()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutPending);
+        fInterrupt = true;
+    }
+    condPending.notify_all();
+}
+
+void OutcomeCache::Stop()
+{
+    if (threadPrecompute.joinable())
+        threadPrecompute.join();
+    std::lock_guard<std::mutex> lock(mutPending);
+    pindexPending = nullptr;
+    fInterrupt = false;
+}
+
+void OutcomeCache::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    if (fInitialDownload)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutPending);
+        pindexPending = pindexNew;
+    }
+    condPending.notify_one();
+}
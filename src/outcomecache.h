@@ -0,0 +1,91 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_OUTCOMECACHE_H
+#define BITCOIN_OUTCOMECACHE_H
+
+#include <primitives/transaction.h>
+#include <sync.h>
+#include <uint256.h>
+#include <validationinterface.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+struct marketBranch;
+
+/** Default for -outcomeprecompute */
+static const bool DEFAULT_OUTCOME_PRECOMPUTE = false;
+/** Default for -outcomethreads */
+static const int DEFAULT_OUTCOME_THREADS = 1;
+/** Maximum number of threads to compute a branch outcome with */
+static const int MAX_OUTCOME_THREADS = 16;
+
+/**
+ * Branch outcome outputs computed ahead of the block that pays them.
+ *
+ * Each new tip is handed to a thread of its own, which precomputes the
+ * outcomes due in the next block without cs_main, so neither validation
+ * nor the other validation interface listeners wait on the vote
+ * calculation. A tip that arrives while one is being computed replaces
+ * any tip still waiting. A result is kept only if the market index was
+ * not written meanwhile, which also catches the tip moving away and
+ * back. Payouts read the decisions, markets, trades and
+ * reveal votes of the chain the block builds on, which its previous
+ * block hash fixes, so entries are keyed by (previous block hash,
+ * branchid) and only serve a block built on that same tip. Outcomes for
+ * a block built on anything but the active tip are computed without the
+ * cache, as the market index describes the tip.
+ */
+class OutcomeCache : public CValidationInterface
+{
+public:
+    /** Outputs paying the outcome of branch in the block after pindexPrev,
+     *  computed on a miss. Requires cs_main. */
+    std::vector<CTxOut> GetOutcomeOutputs(const marketBranch& branch, const CBlockIndex* pindexPrev);
+
+    /** Precompute the outcomes due in the block after pindexNew, if it is
+     *  still the active tip. Runs on the precompute thread. */
+    void Precompute(const CBlockIndex* pindexNew);
+
+    size_t Size() const;
+
+    void Clear();
+
+    void Start();
+    void Interrupt();
+    void Stop();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
+
+private:
+    typedef std::pair<uint256, uint256> OutcomeKey;
+
+    /** Compute the outcome of branch in the block after the active tip
+     *  pindexPrev unless it is cached. Requires cs_main. */
+    std::vector<CTxOut> Compute(const marketBranch& branch, const CBlockIndex* pindexPrev);
+
+    void ThreadPrecompute();
+
+    mutable CCriticalSection cs_outcome;
+    std::map<OutcomeKey, std::vector<CTxOut> > mapOutcome;
+
+    std::thread threadPrecompute;
+    std::mutex mutPending;
+    std::condition_variable condPending;
+    //! Tip waiting to be precomputed, guarded by mutPending
+    const CBlockIndex* pindexPending = nullptr;
+    //! Set to stop the precompute thread, guarded by mutPending
+    bool fInterrupt = false;
+};
+
+extern OutcomeCache outcomeCache;
+
+#endif // BITCOIN_OUTCOMECACHE_H
@@ -4,17 +4,17 @@
 
 #include <primitives/market.h>
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <sstream>
 
 #include <clientversion.h>
+#include <crypto/common.h>
 #include <streams.h>
 
 #include "linalg/src/tc_mat.c"
 
-//extern "C" double FDLIBM_log(double);
-//extern "C" double FDLIBM_exp(double);
-
 
 const uint32_t nType = 1;
 const uint32_t nVersion = 1;
@@ -79,7 +79,76 @@ CScript marketObj::GetScript(void) const
     return script;
 }
 
-marketObj *marketObjCtr(const CScript &script)
+char marketObjPeek(const CScript &script, CKeyID *keyID)
+{
+    /* <serialized object> OP_MARKET */
+    size_t size = script.size();
+    if (size < 2 || script[size-1] != OP_MARKET)
+       return 0;
+
+    /* locate the pushed object in place, as GetOp would */
+    unsigned int opcode = script[0];
+    size_t nHeader = 1;
+    size_t nData = 0;
+    if (opcode < OP_PUSHDATA1) {
+        nData = opcode;
+    }
+    else
+    if (opcode == OP_PUSHDATA1) {
+        nHeader = 2;
+        nData = script[1];
+    }
+    else
+    if (opcode == OP_PUSHDATA2) {
+        if (size < 3)
+            return 0;
+        nHeader = 3;
+        nData = ReadLE16(&script[1]);
+    }
+    else
+    if (opcode == OP_PUSHDATA4) {
+        if (size < 5)
+            return 0;
+        nHeader = 5;
+        nData = ReadLE32(&script[1]);
+    }
+    /* the push must fit in the script. It may run over the trailing
+     * OP_MARKET, as GetOp lets it; such scripts have always counted as
+     * market scripts */
+    if (nData == 0 || size < nHeader + 1 || nData > size - nHeader)
+       return 0;
+
+    const unsigned char *data = &script[nHeader];
+    char marketop = data[0];
+    if (marketop == 'B' || marketop == 'L' || marketop == 'O'
+        || marketop == 'R' || marketop == 'S')
+        return marketop;
+
+    /* decisions, markets and trades serialize their keyID first. One too
+     * short to hold it is still a market script, whose object does not
+     * decode */
+    if (marketop == 'D' || marketop == 'M' || marketop == 'T') {
+        if (keyID) {
+            if (nData < 1 + sizeof(uint160))
+                keyID->SetNull();
+            else
+                memcpy(keyID->begin(), data + 1, sizeof(uint160));
+        }
+        return marketop;
+    }
+
+    return 0;
+}
+
+template <typename T>
+static shared_ptr<marketObj> marketObjRead(CDataStream &ds)
+{
+    shared_ptr<T> obj = make_shared<T>();
+    obj->Unserialize(ds);
+    return obj;
+}
+
+shared_ptr<marketObj> marketObjCtr(const CScript &script)
 {
     CScript::const_iterator pc = script.begin();
     vector<unsigned char> vch;
@@ -91,56 +160,57 @@ marketObj *marketObjCtr(const CScript &script)
     const char *vch0 = (const char *) &vch.begin()[0];
     CDataStream ds(vch0, vch0+vch.size(), SER_DISK, CLIENT_VERSION);
 
-    if (*vch0 == 'B') {
-        marketBranch *obj = new marketBranch;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'B')
+        return marketObjRead<marketBranch>(ds);
     else
-    if (*vch0 == 'D') {
-        marketDecision *obj = new marketDecision;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'D')
+        return marketObjRead<marketDecision>(ds);
     else
-    if (*vch0 == 'L') {
-        marketStealVote *obj = new marketStealVote;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'L')
+        return marketObjRead<marketStealVote>(ds);
     else
-    if (*vch0 == 'M') {
-        marketMarket *obj = new marketMarket;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'M')
+        return marketObjRead<marketMarket>(ds);
     else
-    if (*vch0 == 'O') {
-        marketOutcome *obj = new marketOutcome;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'O')
+        return marketObjRead<marketOutcome>(ds);
     else
-    if (*vch0 == 'R') {
-        marketRevealVote *obj = new marketRevealVote;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'R')
+        return marketObjRead<marketRevealVote>(ds);
     else
-    if (*vch0 == 'S') {
-        marketSealedVote *obj = new marketSealedVote;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'S')
+        return marketObjRead<marketSealedVote>(ds);
     else
-    if (*vch0 == 'T') {
-        marketTrade *obj = new marketTrade;
-        obj->Unserialize(ds);
-        return obj;
-    }
+    if (*vch0 == 'T')
+        return marketObjRead<marketTrade>(ds);
     return NULL;
 }
 
+bool marketOutcomeDecodesLegacy(const CScript &script)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> vch;
+    opcodetype opcode;
+    if (!script.GetOp(pc, opcode, vch))
+       return false;
+    if (vch.size() == 0 || vch[0] != 'O')
+       return false;
+    const char *vch0 = (const char *) &vch.begin()[0];
+    CDataStream ds(vch0, vch0+vch.size(), SER_DISK, CLIENT_VERSION);
+
+    marketOutcome outcome;
+    try {
+        ds >> outcome.marketop;
+        ds >> outcome.nHeight;
+        ds >> outcome.branchid;
+        ds >> outcome.nVoters;
+        outcome.UnserializeLegacy(ds);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
 string marketObj::ToString(void) const
 {
     stringstream str;
@@ -243,17 +313,17 @@ uint32_t marketNStates(const marketMarket& market)
 int marketNShares(const vector<marketTrade> &trades, uint32_t nStates,
     double *nShares)
 {
-    if (nShares)
+    if (!nShares)
         return -1; /* error */
 
     for(uint32_t i=0; i < nStates; i++)
         nShares[i] = 0.0;
 
     for(uint32_t i=0; i < trades.size(); i++) {
-        const marketTrade trade = trades[i];
+        const marketTrade& trade = trades[i];
         uint32_t state = trade.decisionState;
         if (state < nStates)
-           nShares[state] += (trade.isBuy)? trade.nShares: -trade.nShares;
+           nShares[state] += (trade.isBuy)? (double)trade.nShares: -(double)trade.nShares;
     }
 
     for(uint32_t i=0; i < nStates; i++)
@@ -262,6 +332,27 @@ int marketNShares(const vector<marketTrade> &trades, uint32_t nStates,
     return 0;
 }
 
+int marketNShares(const marketShareState &state, uint32_t nStates,
+    double *nShares)
+{
+    if (!nShares)
+        return -1; /* error */
+
+    for(uint32_t i=0; i < nStates; i++)
+        nShares[i] = (i < state.nShares.size())? 1e-8 * state.nShares[i]: 0.0;
+
+    return 0;
+}
+
+void marketShareState::AddTrade(const marketTrade& trade, uint32_t height)
+{
+    uint32_t state = trade.decisionState;
+    if (state < nShares.size())
+        nShares[state] += (trade.isBuy)? (int64_t)trade.nShares: -(int64_t)trade.nShares;
+    nTrades++;
+    nHeight = height;
+}
+
 /* markets with liquidity sensitivity (LS):
  * The market author purchases an initial minShares shares in each of the
  * N states. Those minShares will never be sold (money to be returned to the
@@ -284,67 +375,381 @@ int marketNShares(const vector<marketTrade> &trades, uint32_t nStates,
  */
 
 
-/* FDLIBM version
-double marketAccountValue(double maxCommission, double B, uint32_t nStates,
-   const double *nShares)
+/* Fixed-point version. Only integer arithmetic, so every node gets the
+ * same bits. Products and quotients go through 128-bit intermediates
+ * built from 32-bit halves to stay portable to 32-bit targets. */
+
+/* round(ln(2) * 2^32) and round(ln(2) / 64 * 2^32) */
+static const int64_t MARKET_FIXED_LN2 = 0xb17217f8;
+static const int64_t MARKET_FIXED_LN2_64 = 0x2c5c860;
+
+/* exp(i * MARKET_FIXED_LN2_64), Q32.32 */
+static const int64_t marketFixedExpTable[64] = {
+    0x100000000, 0x102c9a3e8, 0x1059b0d32, 0x108745188,
+    0x10b5586d0, 0x10e3ec32e, 0x111301d02, 0x11429aaec,
+    0x1172b83c9, 0x11a35beb8, 0x11d487318, 0x12063b888,
+    0x12387a6e9, 0x126b45660, 0x129e9df54, 0x12d285a71,
+    0x1306fe0a6, 0x133c08b29, 0x1371a7376, 0x13a7db351,
+    0x13dea64c4, 0x14160a223, 0x144e0860a, 0x1486a2b60,
+    0x14bfdad57, 0x14f9b276e, 0x15342b56e, 0x156f47370,
+    0x15ab07dd9, 0x15e76f160, 0x16247eb09, 0x16623882b,
+    0x16a09e66e, 0x16dfb23cc, 0x171f75e95, 0x175feb56b,
+    0x17a114745, 0x17e2f3374, 0x18258999c, 0x1868d99bc,
+    0x18ace542b, 0x18f1ae99a, 0x193737b15, 0x197d82a07,
+    0x19c491833, 0x1a0c667bf, 0x1a5503b2e, 0x1a9e6b562,
+    0x1ae89f9a0, 0x1b33a2b90, 0x1b7f76f3b, 0x1bcc1e910,
+    0x1c199bde4, 0x1c67f12f2, 0x1cb720ddb, 0x1d072d4ad,
+    0x1d5818ddd, 0x1da9e604b, 0x1dfc97346, 0x1e502ee87,
+    0x1ea4afa39, 0x1efa1bef5, 0x1f50765c6, 0x1fa7c182a
+};
+
+/* log(1 + i / 64), Q32.32 */
+static const int64_t marketFixedLogTable[64] = {
+    0x000000000, 0x003f81516, 0x007e0a6c4, 0x00bba2c7b,
+    0x00f851860, 0x01341d796, 0x016f0d28b, 0x01a926d3a,
+    0x01e27076e, 0x021aefcfa, 0x0252aa5f0, 0x0289a56da,
+    0x02bfe60e1, 0x02f571204, 0x032a4b53a, 0x035e7929d,
+    0x0391fef8f, 0x03c4e0edc, 0x03f7230db, 0x0428c938a,
+    0x0459d72af, 0x048a507ef, 0x04ba38aec, 0x04e993156,
+    0x051862f08, 0x0546ab61d, 0x05746f6fd, 0x05a1b207a,
+    0x05ce75fdb, 0x05fabe0ee, 0x06268ce1b, 0x0651e5071,
+    0x067cc8fb3, 0x06a73b26a, 0x06d13ddef, 0x06fad3677,
+    0x0723fdf1e, 0x074cbf9f8, 0x07751a813, 0x079d10987,
+    0x07c4a3d7f, 0x07ebd623e, 0x0812a952d, 0x08391f2e1,
+    0x085f39721, 0x0884f9cf1, 0x08aa61e98, 0x08cf735a3,
+    0x08f42faf4, 0x0918986be, 0x093caf094, 0x096074f6a,
+    0x0983eb99a, 0x09a7144ed, 0x09c9f069b, 0x09ec81354,
+    0x0a0ec7f42, 0x0a30c5e11, 0x0a527c2ee, 0x0a73ec08e,
+    0x0a9516933, 0x0ab5fceae, 0x0ad6a0262, 0x0af701549
+};
+
+/* a * b as a 128-bit hi:lo pair */
+static void marketMul128(uint64_t a, uint64_t b, uint64_t& hi, uint64_t& lo)
 {
-    // non-LS
-    if (maxCommission == 0.0) {
-        double sumExp = 0.0;
-        for(uint32_t i=0; i < nStates; i++) {
-            double nSharesi = (nShares)? nShares[i]: 0.0;
-            if (nSharesi == 0.0)
-                continue;
-            sumExp += FDLIBM_exp(nSharesi / B);
+    uint64_t al = a & 0xffffffff, ah = a >> 32;
+    uint64_t bl = b & 0xffffffff, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    lo = (mid << 32) | (ll & 0xffffffff);
+    hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+/* (a * b) / c, truncated. The quotient must fit 64 bits */
+static uint64_t marketMulDiv(uint64_t a, uint64_t b, uint64_t c)
+{
+    uint64_t hi, lo;
+    marketMul128(a, b, hi, lo);
+    if (!hi)
+        return lo / c;
+
+    /* shift-subtract long division of hi:lo by c, hi < c */
+    uint64_t q = 0;
+    for(int i=0; i < 64; i++) {
+        bool carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo <<= 1;
+        q <<= 1;
+        if (carry || hi >= c) {
+            hi -= c;
+            q |= 1;
         }
-        return B * FDLIBM_log(sumExp);
     }
+    return q;
+}
+
+/* (a * b) >> 32, for Q32.32 products */
+static uint64_t marketMulFixed(uint64_t a, uint64_t b)
+{
+    uint64_t hi, lo;
+    marketMul128(a, b, hi, lo);
+    return (hi << 32) | (lo >> 32);
+}
+
+int64_t marketFixedExp(int64_t x)
+{
+    /* x = k ln2 + r with r in [0, ln2), then r = i ln2/64 + t */
+    int64_t k = x / MARKET_FIXED_LN2;
+    int64_t r = x - k * MARKET_FIXED_LN2;
+    if (r < 0) {
+        k--;
+        r += MARKET_FIXED_LN2;
+    }
+    if (k >= 31)
+        return INT64_MAX;
+    if (k < -33)
+        return 0;
+
+    int64_t i = r / MARKET_FIXED_LN2_64;
+    if (i > 63)
+        i = 63;
+    uint64_t t = r - i * MARKET_FIXED_LN2_64;
+
+    /* exp(t) = 1 + t + t^2/2 + t^3/6 + t^4/24, t < 0.011 */
+    uint64_t t2 = marketMulFixed(t, t);
+    uint64_t t3 = marketMulFixed(t2, t);
+    uint64_t t4 = marketMulFixed(t3, t);
+    uint64_t poly = MARKET_FIXED_ONE + t + t2 / 2 + t3 / 6 + t4 / 24;
+
+    uint64_t v = marketMulFixed(marketFixedExpTable[i], poly);
+    return (k >= 0)? (int64_t)(v << k): (int64_t)(v >> -k);
+}
+
+int64_t marketFixedLog(int64_t x)
+{
+    if (x <= 0)
+        return INT64_MIN;
+
+    /* x = 2^k m with m in [1, 2), then m = m0 (1 + t), m0 = 1 + i/64 */
+    int64_t k = 0;
+    uint64_t m = x;
+    while (m >= (uint64_t)2 * MARKET_FIXED_ONE) {
+        m >>= 1;
+        k++;
+    }
+    while (m < (uint64_t)MARKET_FIXED_ONE) {
+        m <<= 1;
+        k--;
+    }
+
+    uint64_t i = (m - MARKET_FIXED_ONE) >> 26;
+    uint64_t m0 = MARKET_FIXED_ONE + (i << 26);
+    int64_t t = ((m - m0) << 32) / m0;
+
+    /* log(1 + t) = t - t^2/2 + t^3/3 - t^4/4 + t^5/5, t < 1/64 */
+    int64_t t2 = marketMulFixed(t, t);
+    int64_t t3 = marketMulFixed(t2, t);
+    int64_t t4 = marketMulFixed(t3, t);
+    int64_t t5 = marketMulFixed(t4, t);
+    int64_t poly = t - t2 / 2 + t3 / 3 - t4 / 4 + t5 / 5;
+
+    return k * MARKET_FIXED_LN2 + marketFixedLogTable[i] + poly;
+}
+
+/* B narrowed below 2^31 so the fraction of each quotient is one 64-bit
+ * division */
+static int marketNarrowShift(uint64_t B)
+{
+    int shift = 0;
+    while ((B >> shift) >= ((uint64_t)1 << 31))
+        shift++;
+    return shift;
+}
+
+/* exp(-d / B) in Q32.32 for d = qmax - q[i] >= 0 */
+static int64_t marketExpTermFixed(uint64_t B, int shift, uint64_t d)
+{
+    uint64_t ip = d / B;
+    /* exp(-23) is below one unit */
+    if (ip >= 23)
+        return 0;
+    uint64_t frac = (((d % B) >> shift) << 32) / (B >> shift);
+    return marketFixedExp(-(int64_t)((ip << 32) + frac));
+}
 
-    // LS
-    double minShares = B * FDLIBM_log(nStates) / maxCommission;
-    double sumShares = 0.0;
+/* fixed-point marketLogSumExp, shares and B in 1e-8 units */
+static int64_t marketLogSumExpFixed(uint64_t B, uint32_t nStates,
+   const int64_t *q, int64_t fill)
+{
+    int64_t logN = marketFixedLog((int64_t)nStates * MARKET_FIXED_ONE);
+    if (!q)
+        return fill + (int64_t)marketMulFixed(B, logN);
+
+    int64_t qmax = q[0];
+    for(uint32_t i=1; i < nStates; i++)
+        qmax = (q[i] > qmax)? q[i]: qmax;
+
+    int shift = marketNarrowShift(B);
+    int64_t sumExp = 0;
     for(uint32_t i=0; i < nStates; i++)
-        sumShares += (nShares)? nShares[i]: minShares;
-    B *= sumShares / (nStates * minShares);
+        sumExp += marketExpTermFixed(B, shift, (uint64_t)(qmax - q[i]));
+    return qmax + (int64_t)marketMulFixed(B, marketFixedLog(sumExp));
+}
 
-    double sumExp = 0.0;
-    for(uint32_t i=0; i < nStates; i++) {
-        double nSharesi = (nShares)? nShares[i]: minShares;
-        sumExp += FDLIBM_exp(nSharesi / B);
+int64_t marketAccountValueFixed(uint64_t maxCommission, uint64_t B,
+   uint32_t nStates, const int64_t *nShares)
+{
+    if (!nStates || !B)
+        return 0;
+
+    /* non-LS */
+    if (!maxCommission)
+        return marketLogSumExpFixed(B, nStates, nShares, 0);
+
+    /* LS, maxCommission in 1e-8 units */
+    int64_t logN = marketFixedLog((int64_t)nStates * MARKET_FIXED_ONE);
+    int64_t minShares = marketMulDiv(marketMulFixed(B, logN), 100000000, maxCommission);
+    int64_t sumShares = nStates * minShares;
+    if (nShares) {
+        sumShares = 0;
+        for(uint32_t i=0; i < nStates; i++)
+            sumShares += nShares[i];
+    }
+    if (sumShares <= 0 || minShares <= 0)
+        return 0;
+    B = marketMulDiv(B, sumShares, (uint64_t)nStates * minShares);
+    if (!B)
+        return 0;
+    return marketLogSumExpFixed(B, nStates, nShares, minShares);
+}
+
+bool marketPriceCovers(int64_t cost, uint64_t nShares, uint64_t price)
+{
+    if (cost <= 0 || price == UINT64_MAX)
+        return true;
+
+    /* cost <= (price + 1) nShares / COIN; a quotient past 64 bits is more
+     * than any cost */
+    uint64_t hi, lo;
+    marketMul128(price + 1, nShares, hi, lo);
+    if (hi >= (uint64_t) COIN)
+        return true;
+    return (uint64_t) cost <= marketMulDiv(price + 1, nShares, COIN);
+}
+
+uint64_t marketTradePayout(uint64_t nShares, uint32_t decisionState,
+    const vector<uint64_t>& decisionsFinal, const vector<uint64_t>& isScaled,
+    const vector<uint64_t>& min, const vector<uint64_t>& max)
+{
+    uint64_t payout = nShares;
+    for(size_t k=0; k < decisionsFinal.size(); k++) {
+        uint8_t state = (k < 32)? (decisionState >> k) & 1: 0;
+        if (isScaled[k] && (max[k] > min[k])) {
+            /* a final value outside the range pays as the end it is past */
+            uint64_t value = std::min(std::max(decisionsFinal[k], min[k]), max[k]);
+            payout = marketMulDiv(payout, state? value - min[k]: max[k] - value,
+                max[k] - min[k]);
+        }
+        else
+        if ((state == 0) && (decisionsFinal[k] > COIN / 2))
+            return 0;
+        else
+        if ((state == 1) && (decisionsFinal[k] < COIN / 2))
+            return 0;
     }
-    return B * FDLIBM_log(sumExp);
+    return payout;
+}
+
+/* B log sum exp(q[i] / B), shifted by the largest q[i] so that no term
+ * can overflow: qmax + B log sum exp((q[i] - qmax) / B). When q is NULL
+ * every state holds fill shares. The loops are kept branch free so the
+ * compiler can vectorize them. */
+static double marketLogSumExp(double B, uint32_t nStates, const double *q,
+   double fill)
+{
+    if (!q)
+        return fill + B * std::log((double)nStates);
+
+    double qmax = q[0];
+    for(uint32_t i=1; i < nStates; i++)
+        qmax = (q[i] > qmax)? q[i]: qmax;
+
+    double sumExp = 0.0;
+    for(uint32_t i=0; i < nStates; i++)
+        sumExp += std::exp((q[i] - qmax) / B);
+    return qmax + B * std::log(sumExp);
+}
+
+/* liquidity parameter of an LS market for the given total of shares */
+static double marketLiquidity(double maxCommission, double B, uint32_t nStates,
+   double sumShares)
+{
+    double minShares = B * std::log((double)nStates) / maxCommission;
+    return B * sumShares / (nStates * minShares);
 }
-*/
 
 /* standard library version: */
 double marketAccountValue(double maxCommission, double B, uint32_t nStates,
    const double *nShares)
 {
+    if (!nStates)
+        return 0.0;
+
     /* non-LS */
-    if (maxCommission == 0.0) {
-        double sumExp = 0.0;
-        for(uint32_t i=0; i < nStates; i++) {
-            double nSharesi = (nShares)? nShares[i]: 0.0;
-            if (nSharesi == 0.0)
+    if (maxCommission == 0.0)
+        return marketLogSumExp(B, nStates, nShares, 0.0);
+
+    /* LS */
+    double minShares = B * std::log((double)nStates) / maxCommission;
+    double sumShares = nStates * minShares;
+    if (nShares) {
+        sumShares = 0.0;
+        for(uint32_t i=0; i < nStates; i++)
+            sumShares += nShares[i];
+    }
+    B = marketLiquidity(maxCommission, B, nStates, sumShares);
+    return marketLogSumExp(B, nStates, nShares, minShares);
+}
+
+void marketQuoteTradesFixed(uint64_t maxCommission, uint64_t B,
+   uint32_t nStates, const int64_t *nShares, uint32_t nQuotes,
+   const uint32_t *states, const int64_t *dShares, int64_t *costs)
+{
+    if (!nStates || !B) {
+        for(uint32_t j=0; j < nQuotes; j++)
+            costs[j] = 0;
+        return;
+    }
+
+    vector<int64_t> q(nShares, nShares + nStates);
+    int64_t currAccount = marketAccountValueFixed(maxCommission, B, nStates, q.data());
+
+    /* LS: the liquidity depends on the total of shares, so each candidate
+     * needs a full pass */
+    if (maxCommission) {
+        for(uint32_t j=0; j < nQuotes; j++) {
+            uint32_t s = states[j];
+            if (s >= nStates) {
+                costs[j] = 0;
                 continue;
-            sumExp += std::exp(nSharesi / B);
+            }
+            q[s] += dShares[j];
+            costs[j] = marketAccountValueFixed(maxCommission, B, nStates, q.data()) - currAccount;
+            q[s] = nShares[s];
         }
-        return B * std::log(sumExp);
+        return;
     }
 
-    /* LS */
-    double minShares = B * std::log(nStates) / maxCommission;
-    double sumShares = 0.0;
-    for(uint32_t i=0; i < nStates; i++)
-        sumShares += (nShares)? nShares[i]: minShares;
-    B *= sumShares / (nStates * minShares);
+    /* non-LS: the sum of the exp terms is exact in integers, so a
+     * candidate that leaves the largest q in place swaps the term of its
+     * state and gets the same result as a full pass. Otherwise it takes
+     * one. */
+    int64_t qmax = q[0];
+    for(uint32_t i=1; i < nStates; i++)
+        qmax = (q[i] > qmax)? q[i]: qmax;
+    uint32_t nMax = 0;
+    int64_t qnext = INT64_MIN;
+    for(uint32_t i=0; i < nStates; i++) {
+        if (q[i] == qmax)
+            nMax++;
+        else
+            qnext = (q[i] > qnext)? q[i]: qnext;
+    }
 
-    double sumExp = 0.0;
+    int shift = marketNarrowShift(B);
+    vector<int64_t> terms(nStates);
+    int64_t sumExp = 0;
     for(uint32_t i=0; i < nStates; i++) {
-        double nSharesi = (nShares)? nShares[i]: minShares;
-        sumExp += std::exp(nSharesi / B);
+        terms[i] = marketExpTermFixed(B, shift, (uint64_t)(qmax - q[i]));
+        sumExp += terms[i];
+    }
+
+    for(uint32_t j=0; j < nQuotes; j++) {
+        uint32_t s = states[j];
+        if (s >= nStates) {
+            costs[j] = 0;
+            continue;
+        }
+        int64_t qs = q[s] + dShares[j];
+        int64_t qother = (q[s] == qmax && nMax == 1)? qnext: qmax;
+        if (qs > qmax || qother != qmax) {
+            q[s] = qs;
+            costs[j] = marketLogSumExpFixed(B, nStates, q.data(), 0) - currAccount;
+            q[s] = nShares[s];
+            continue;
+        }
+        int64_t sum = sumExp - terms[s] + marketExpTermFixed(B, shift, (uint64_t)(qmax - qs));
+        costs[j] = qmax + (int64_t)marketMulFixed(B, marketFixedLog(sum)) - currAccount;
     }
-    return B * std::log(sumExp);
 }
 
 string marketOutcome::ToString(void) const
@@ -364,6 +769,7 @@ string marketOutcome::ToString(void) const
 
     /* matrix */
     str << "voteMatrix=" << endl;
+    const vector<uint64_t> voteMatrix = GetVoteMatrix();
     for(uint32_t i=0; i < voteMatrix.size(); i++) {
         double value = voteMatrix[i];
         char buf[20];
@@ -441,25 +847,31 @@ string marketOutcome::ToString(void) const
     return str.str();
 }
 
-int marketOutcome::calc(void)
+int marketOutcome::calc(uint32_t nThreads)
 {
-    struct tc_vote *vote = tc_vote_ctr(nVoters, nDecisions);
+    if (!IsVoteMatrixValid())
+        return -1;
+    vector<double> vValue(voteValues.size());
+    for(size_t k=0; k < voteValues.size(); k++)
+        vValue[k] = voteValues[k] * 1e-8;
+    const uint32_t rowZero = 0;
+    struct tc_spmat *S = tc_spmat_ctr_rows(nVoters, nDecisions,
+        voteRows.empty()? &rowZero: voteRows.data(), voteCols.data(), vValue.data());
+    if (!S)
+        return -1;
+    struct tc_vote *vote = tc_vote_ctr_sparse(S);
     vote->NA = NA;
     vote->alpha = alpha;
     vote->tol = tol;
+    vote->nthreads = nThreads;
 
-    double **oldrep = vote->rvecs[TC_VOTE_OLD_REP]->a;
+    struct tc_mat *oldrep = vote->rvecs[TC_VOTE_OLD_REP];
     for(uint32_t i=0; i < nVoters; i++)
-        oldrep[i][0] = oldRep[i] * 1e-8;
+        TC_MAT_AT(oldrep, i, 0) = oldRep[i] * 1e-8;
 
-    double **isbin = vote->cvecs[TC_VOTE_IS_BINARY]->a;
+    struct tc_mat *isbin = vote->cvecs[TC_VOTE_IS_BINARY];
     for(uint32_t j=0; j < nDecisions; j++)
-        isbin[0][j] = (isScaled[j])? 0.0: 1.0;
-
-    double **m = vote->M->a;
-    for(uint32_t i=0; i < nVoters; i++)
-        for(uint32_t j=0; j < nDecisions; j++)
-            m[i][j] = voteMatrix[i*nDecisions + j] * 1e-8;
+        TC_MAT_AT(isbin, 0, j) = (isScaled[j])? 0.0: 1.0;
 
     int rc = tc_vote_proc(vote);
     if (rc < 0) {
@@ -469,12 +881,12 @@ int marketOutcome::calc(void)
     }
 
     /* row (voters) outputs */
-    double **thisrep = vote->rvecs[TC_VOTE_THIS_REP]->a;
-    double **smoothedrep = vote->rvecs[TC_VOTE_SMOOTHED_REP]->a;
-    double **narow = vote->rvecs[TC_VOTE_NA_ROW]->a;
-    double **particrow = vote->rvecs[TC_VOTE_PARTIC_ROW]->a;
-    double **particrel = vote->rvecs[TC_VOTE_PARTIC_REL]->a;
-    double **rowbonus = vote->rvecs[TC_VOTE_ROW_BONUS]->a;
+    const struct tc_mat *thisrep = vote->rvecs[TC_VOTE_THIS_REP];
+    const struct tc_mat *smoothedrep = vote->rvecs[TC_VOTE_SMOOTHED_REP];
+    const struct tc_mat *narow = vote->rvecs[TC_VOTE_NA_ROW];
+    const struct tc_mat *particrow = vote->rvecs[TC_VOTE_PARTIC_ROW];
+    const struct tc_mat *particrel = vote->rvecs[TC_VOTE_PARTIC_REL];
+    const struct tc_mat *rowbonus = vote->rvecs[TC_VOTE_ROW_BONUS];
     thisRep.clear();
     smoothedRep.clear();
     NARow.clear();
@@ -482,23 +894,23 @@ int marketOutcome::calc(void)
     particRel.clear();
     rowBonus.clear();
     for(uint32_t i=0; i < nVoters; i++) {
-       thisRep.push_back( (uint64_t) (thisrep[0][i] * 1e8) );
-       smoothedRep.push_back( (uint64_t) (smoothedrep[0][i] * 1e8) );
-       NARow.push_back( (uint64_t) (narow[0][i] * 1e8) );
-       particRow.push_back( (uint64_t) (particrow[0][i] * 1e8) );
-       particRel.push_back( (uint64_t) (particrel[0][i] * 1e8) );
-       rowBonus.push_back( (uint64_t) (rowbonus[0][i] * 1e8) );
+       thisRep.push_back( (uint64_t) (TC_MAT_AT(thisrep, i, 0) * 1e8) );
+       smoothedRep.push_back( (uint64_t) (TC_MAT_AT(smoothedrep, i, 0) * 1e8) );
+       NARow.push_back( (uint64_t) (TC_MAT_AT(narow, i, 0) * 1e8) );
+       particRow.push_back( (uint64_t) (TC_MAT_AT(particrow, i, 0) * 1e8) );
+       particRel.push_back( (uint64_t) (TC_MAT_AT(particrel, i, 0) * 1e8) );
+       rowBonus.push_back( (uint64_t) (TC_MAT_AT(rowbonus, i, 0) * 1e8) );
     }
 
     /* column (decisions) outputs */
-    double **firstloading = vote->cvecs[TC_VOTE_FIRST_LOADING]->a;
-    double **decisionsraw = vote->cvecs[TC_VOTE_DECISIONS_RAW]->a;
-    double **consensusrew = vote->cvecs[TC_VOTE_CONSENSUS_REW]->a;
-    double **certain = vote->cvecs[TC_VOTE_CERTAINTY]->a;
-    double **nacol = vote->cvecs[TC_VOTE_NA_COL]->a;
-    double **particcol = vote->cvecs[TC_VOTE_PARTIC_COL]->a;
-    double **authorbonus = vote->cvecs[TC_VOTE_AUTHOR_BONUS]->a;
-    double **decisionsfinal = vote->cvecs[TC_VOTE_DECISIONS_FINAL]->a;
+    const double *firstloading = tc_mat_row(vote->cvecs[TC_VOTE_FIRST_LOADING], 0);
+    const double *decisionsraw = tc_mat_row(vote->cvecs[TC_VOTE_DECISIONS_RAW], 0);
+    const double *consensusrew = tc_mat_row(vote->cvecs[TC_VOTE_CONSENSUS_REW], 0);
+    const double *certain = tc_mat_row(vote->cvecs[TC_VOTE_CERTAINTY], 0);
+    const double *nacol = tc_mat_row(vote->cvecs[TC_VOTE_NA_COL], 0);
+    const double *particcol = tc_mat_row(vote->cvecs[TC_VOTE_PARTIC_COL], 0);
+    const double *authorbonus = tc_mat_row(vote->cvecs[TC_VOTE_AUTHOR_BONUS], 0);
+    const double *decisionsfinal = tc_mat_row(vote->cvecs[TC_VOTE_DECISIONS_FINAL], 0);
     firstLoading.clear();
     decisionsRaw.clear();
     consensusReward.clear();
@@ -508,20 +920,141 @@ int marketOutcome::calc(void)
     authorBonus.clear();
     decisionsFinal.clear();
     for(uint32_t i=0; i < nDecisions; i++) {
-        firstLoading.push_back( (uint64_t) (firstloading[0][i] * 1e8) );
-        decisionsRaw.push_back( (uint64_t) (decisionsraw[0][i] * 1e8) );
-        consensusReward.push_back( (uint64_t) (consensusrew[0][i] * 1e8) );
-        certainty.push_back( (uint64_t) (certain[0][i] * 1e8) );
-        NACol.push_back( (uint64_t) (nacol[0][i] * 1e8) );
-        particCol.push_back( (uint64_t) (particcol[0][i] * 1e8) );
-        authorBonus.push_back( (uint64_t) (authorbonus[0][i] * 1e8) );
-        decisionsFinal.push_back( (uint64_t) (decisionsfinal[0][i] * 1e8) );
+        firstLoading.push_back( (uint64_t) (firstloading[i] * 1e8) );
+        decisionsRaw.push_back( (uint64_t) (decisionsraw[i] * 1e8) );
+        consensusReward.push_back( (uint64_t) (consensusrew[i] * 1e8) );
+        certainty.push_back( (uint64_t) (certain[i] * 1e8) );
+        NACol.push_back( (uint64_t) (nacol[i] * 1e8) );
+        particCol.push_back( (uint64_t) (particcol[i] * 1e8) );
+        authorBonus.push_back( (uint64_t) (authorbonus[i] * 1e8) );
+        decisionsFinal.push_back( (uint64_t) (decisionsfinal[i] * 1e8) );
     }
 
     tc_vote_dtr(vote);
     return 0;
 }
 
+vector<uint64_t> marketOutcome::GetVoteMatrix(void) const
+{
+    if (fLegacyMatrix)
+        return legacyMatrix;
+    vector<uint64_t> voteMatrix((size_t)nVoters * nDecisions, NA);
+    if (!IsVoteMatrixValid())
+        return voteMatrix;
+    for(uint32_t i=0; i < nVoters; i++)
+        for(uint32_t k=voteRows[i]; k < voteRows[i+1]; k++)
+            voteMatrix[(size_t)i*nDecisions + voteCols[k]] = voteValues[k];
+    return voteMatrix;
+}
+
+void marketOutcome::SetVoteMatrix(const vector<uint64_t>& voteMatrix)
+{
+    fLegacyMatrix = false;
+    legacyMatrix.clear();
+    voteRows.assign(1, 0);
+    voteCols.clear();
+    voteValues.clear();
+    for(uint32_t i=0; i < nVoters; i++) {
+        /* only the rows present are walked */
+        const size_t nRow = (size_t)i*nDecisions;
+        for(uint32_t j=0; (j < nDecisions) && (nRow + j < voteMatrix.size()); j++) {
+            if (voteMatrix[nRow + j] == NA)
+                continue;
+            voteCols.push_back(j);
+            voteValues.push_back(voteMatrix[nRow + j]);
+        }
+        voteRows.push_back(voteCols.size());
+    }
+}
+
+bool marketOutcome::IsVoteMatrixValid(void) const
+{
+    if (voteRows.empty())
+        return voteCols.empty() && voteValues.empty();
+    if ((voteRows.size() != (size_t)nVoters + 1) || voteRows[0]
+        || (voteRows.back() != voteCols.size())
+        || (voteCols.size() != voteValues.size()))
+        return false;
+    for(uint32_t i=0; i < nVoters; i++) {
+        if (voteRows[i+1] < voteRows[i])
+            return false;
+        for(uint32_t k=voteRows[i]; k < voteRows[i+1]; k++)
+            if ((voteCols[k] >= nDecisions)
+                || ((k > voteRows[i]) && (voteCols[k] <= voteCols[k-1])))
+                return false;
+    }
+    return true;
+}
+
+marketVoteMatrix::marketVoteMatrix(marketOutcome& outcomeIn)
+    : outcome(outcomeIn)
+{
+    outcome.nVoters = 0;
+    outcome.voterIDs.clear();
+    outcome.fLegacyMatrix = false;
+    outcome.legacyMatrix.clear();
+    outcome.voteRows.assign(1, 0);
+    outcome.voteCols.clear();
+    outcome.voteValues.clear();
+    mapColumn.reserve(outcome.decisionIDs.size());
+    for(uint32_t j=0; j < outcome.decisionIDs.size(); j++)
+        mapColumn.emplace(outcome.decisionIDs[j], j);
+}
+
+void marketVoteMatrix::AddVote(const marketRevealVote& vote)
+{
+    /* the row: the votes on the outcome's decisions, by column, the first
+     * response where a decision is listed twice. Ids and votes that do not
+     * pair up leave the row empty (all NA) */
+    vRow.clear();
+    if (vote.decisionIDs.size() == vote.decisionVotes.size()) {
+        for(size_t k=0; k < vote.decisionIDs.size(); k++) {
+            if (vote.decisionVotes[k] == outcome.NA)
+                continue;
+            unordered_map<uint256, uint32_t, marketIdHasher>::const_iterator c
+                = mapColumn.find(vote.decisionIDs[k]);
+            if (c != mapColumn.end())
+                vRow.emplace_back(c->second, vote.decisionVotes[k]);
+        }
+        typedef pair<uint32_t, uint64_t> vote_t;
+        stable_sort(vRow.begin(), vRow.end(),
+            [](const vote_t& a, const vote_t& b) { return a.first < b.first; });
+        vRow.erase(unique(vRow.begin(), vRow.end(),
+            [](const vote_t& a, const vote_t& b) { return a.first == b.first; }), vRow.end());
+    }
+
+    vector<uint32_t>& rows = outcome.voteRows;
+    map<CKeyID, uint32_t>::const_iterator it = mapRow.find(vote.keyID);
+    uint32_t i;
+    if (it == mapRow.end()) {
+        i = outcome.nVoters++;
+        mapRow.emplace(vote.keyID, i);
+        outcome.voterIDs.push_back(vote.keyID);
+        rows.push_back(rows.back());
+    } else {
+        i = it->second;
+    }
+
+    /* replace the votes of row i, moving the rows after it */
+    const uint32_t begin = rows[i];
+    const uint32_t end = rows[i+1];
+    outcome.voteCols.erase(outcome.voteCols.begin() + begin, outcome.voteCols.begin() + end);
+    outcome.voteValues.erase(outcome.voteValues.begin() + begin, outcome.voteValues.begin() + end);
+    outcome.voteCols.insert(outcome.voteCols.begin() + begin, vRow.size(), 0);
+    outcome.voteValues.insert(outcome.voteValues.begin() + begin, vRow.size(), 0);
+    for(size_t k=0; k < vRow.size(); k++) {
+        outcome.voteCols[begin + k] = vRow[k].first;
+        outcome.voteValues[begin + k] = vRow[k].second;
+    }
+    for(uint32_t r=i+1; r < rows.size(); r++)
+        rows[r] = rows[r] - (end - begin) + vRow.size();
+}
+
+int marketVoteMatrix::Calc(uint32_t nThreads)
+{
+    return outcome.calc(nThreads);
+}
+
 string marketRevealVote::ToString(void) const
 {
     stringstream str;
@@ -9,10 +9,14 @@
 #include <stdint.h>
 
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <amount.h>
 #include <pubkey.h>
 #include <script/script.h>
 #include <serialize.h>
@@ -33,7 +37,18 @@ struct marketObj {
     CScript GetScript(void) const;
     virtual string ToString(void) const;
 };
-marketObj *marketObjCtr(const CScript &);
+/* the market object pushed by a market script, or null if there is none.
+ * Throws if the object does not deserialize */
+shared_ptr<marketObj> marketObjCtr(const CScript &);
+/* peek at the marketop of a market script without constructing the object.
+ * Returns 0 if the script is not a market script. For decisions, markets
+ * and trades the keyID is read from the pushed bytes as well, or is null
+ * if they are too short to hold it. */
+char marketObjPeek(const CScript &, CKeyID *keyID = NULL);
+/* whether the script pushes an outcome that reads in the legacy layout,
+ * as every outcome did before MARKET_OUTCOME_COMPACT. Such an outcome was
+ * a valid market output even if marketObjCtr now refuses it */
+bool marketOutcomeDecodesLegacy(const CScript &);
 
 struct marketDecision : public marketObj {
     CKeyID keyID;
@@ -159,12 +174,81 @@ struct marketMarket : public marketObj {
     string ToString(void) const;
 };
 
+/* aggregate share state of a market, kept up to date as trades are
+ * connected so that pricing does not need to replay every trade */
+struct marketShareState {
+    vector<int64_t> nShares; /* net shares bought in each state */
+    uint64_t nTrades;
+    uint32_t nHeight; /* height of the last trade, 0 if unknown */
+
+    marketShareState(void) : nTrades(0), nHeight(0) { }
+    explicit marketShareState(uint32_t nStates) : nShares(nStates, 0), nTrades(0), nHeight(0) { }
+
+    ADD_SERIALIZE_METHODS
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nShares);
+        READWRITE(nTrades);
+        READWRITE(nHeight);
+    }
+
+    void AddTrade(const marketTrade& trade, uint32_t height);
+};
+
+/* market index undo data of a connected block: the (marketop, objid) of
+ * the objects first indexed by the block, and the share states of the
+ * markets traded on in the block as they were before it. An empty state
+ * (nTrades == 0) means the market had no share state yet. */
+struct marketBlockUndo {
+    vector<pair<char, uint256> > vObj;
+    vector<pair<uint256, marketShareState> > vShareState;
+
+    ADD_SERIALIZE_METHODS
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(vObj);
+        READWRITE(vShareState);
+    }
+};
+
 /* query the number of states in the market */
 uint32_t marketNStates(const marketMarket& market);
 /* query the nShares in each state from the set of trades */
 int marketNShares(const vector<marketTrade> &trades, uint32_t nStates, double *nShares);
+/* query the nShares in each state from the market's share state */
+int marketNShares(const marketShareState &state, uint32_t nStates, double *nShares);
 /* query the account value when given the nshares in each state */
 double marketAccountValue(double maxCommission, double B, uint32_t nStates, const double *nShares);
+/* deterministic Q32.32 fixed-point exp and log, for results that must
+ * agree across nodes. marketFixedExp saturates at INT64_MAX and
+ * marketFixedLog(x <= 0) is INT64_MIN */
+static const int64_t MARKET_FIXED_ONE = (int64_t)1 << 32;
+int64_t marketFixedExp(int64_t x);
+int64_t marketFixedLog(int64_t x);
+/* marketAccountValue on fixed-point math. Shares, B, maxCommission and
+ * the result are in 1e-8 units */
+int64_t marketAccountValueFixed(uint64_t maxCommission, uint64_t B, uint32_t nStates, const int64_t *nShares);
+/* whether a buy of nShares (1e-8 units) at price (satoshis a share) pays
+ * for cost, the change in account value it causes (1e-8 units), with one
+ * satoshi a share of slack for rounded quotes. The price check of trades
+ * in createtrade and in block assembly */
+bool marketPriceCovers(int64_t cost, uint64_t nShares, uint64_t price);
+/* the payout in satoshis of a buy of nShares (1e-8 units) in decisionState
+ * once the decisions of its market are final. A binary decision pays all
+ * or nothing. A scaled one pays the fraction of its [min, max] range that
+ * the final value leaves to the state, rounded down */
+uint64_t marketTradePayout(uint64_t nShares, uint32_t decisionState,
+    const vector<uint64_t>& decisionsFinal, const vector<uint64_t>& isScaled,
+    const vector<uint64_t>& min, const vector<uint64_t>& max);
+/* price nQuotes candidate trades against the nshares in each state, on
+ * the fixed-point account value. Trade j moves state states[j] by
+ * dShares[j] shares (negative to sell), and costs[j] is the change in
+ * account value it causes, exactly as marketAccountValueFixed prices it.
+ * All values in 1e-8 units */
+void marketQuoteTradesFixed(uint64_t maxCommission, uint64_t B, uint32_t nStates, const int64_t *nShares,
+    uint32_t nQuotes, const uint32_t *states, const int64_t *dShares, int64_t *costs);
 
 struct marketRevealVote : public marketObj {
     uint256 branchid;
@@ -236,6 +320,71 @@ struct marketStealVote : public marketObj {
     string ToString(void) const;
 };
 
+/* Encodings of marketOutcome after its header. The fixed-width layout
+ * outcomes were first written in (and are still in on chain) goes on with
+ * nVoters; the others write MARKET_OUTCOME_TAG in its place, a voter count
+ * no outcome reaches, and then a byte naming the encoding */
+static const uint8_t MARKET_OUTCOME_LEGACY = 0;
+static const uint8_t MARKET_OUTCOME_COMPACT = 1;
+static const uint32_t MARKET_OUTCOME_TAG = 0xffffffff;
+
+/* vector<uint64_t> as its size and a VARINT per value */
+template <typename Stream>
+void SerializeVarInts(Stream& s, const vector<uint64_t>& v)
+{
+    WriteCompactSize(s, v.size());
+    for(size_t i=0; i < v.size(); i++)
+        WriteVarInt<Stream, uint64_t>(s, v[i]);
+}
+
+template <typename Stream>
+void UnserializeVarInts(Stream& s, vector<uint64_t>& v)
+{
+    uint64_t n = ReadCompactSize(s);
+    v.clear();
+    for(uint64_t i=0; i < n; i++)
+        v.push_back(ReadVarInt<Stream, uint64_t>(s));
+}
+
+/* vector<uint64_t> of flags as its size and a bit per value (non-zero is
+ * read back as 1), eight to a byte */
+template <typename Stream>
+void SerializeBits(Stream& s, const vector<uint64_t>& v)
+{
+    WriteCompactSize(s, v.size());
+    vector<unsigned char> vBits((v.size() + 7) / 8, 0);
+    for(size_t i=0; i < v.size(); i++)
+        if (v[i])
+            vBits[i / 8] |= 1 << (i % 8);
+    if (!vBits.empty())
+        s.write((const char *) vBits.data(), vBits.size());
+}
+
+template <typename Stream>
+void UnserializeBits(Stream& s, vector<uint64_t>& v)
+{
+    uint64_t n = ReadCompactSize(s);
+    vector<unsigned char> vBits((n + 7) / 8);
+    if (!vBits.empty())
+        s.read((char *) vBits.data(), vBits.size());
+    v.resize(n);
+    for(size_t i=0; i < n; i++)
+        v[i] = (vBits[i / 8] >> (i % 8)) & 1;
+}
+
+/* Two bit code of a vote on a binary decision, 3 if it has none */
+inline unsigned char PackBinaryVote(uint64_t vote)
+{
+    return (vote == 0)? 0: (vote == (uint64_t) COIN)? 1: (vote == (uint64_t) COIN / 2)? 2: 3;
+}
+
+inline uint64_t UnpackBinaryVote(unsigned char code)
+{
+    /* a table rather than branches, as 0 and COIN come in no order */
+    static const uint64_t vote[4] = {0, (uint64_t) COIN, (uint64_t) COIN / 2, 0};
+    return vote[code & 3];
+}
+
 struct marketOutcome : public marketObj {
     uint256 branchid;
     /* size() == nVoters */
@@ -260,50 +409,383 @@ struct marketOutcome : public marketObj {
     vector<uint64_t> particCol; /* output */
     vector<uint64_t> authorBonus; /* output */
     vector<uint64_t> decisionsFinal; /* output */
-    vector<uint64_t> voteMatrix; /* [nVoters][nDecisions] */
+    /* The vote matrix [nVoters][nDecisions], by voter: the votes of voter i
+     * are at [voteRows[i], voteRows[i+1]) of voteCols (the decision index,
+     * increasing) and voteValues. A decision without a vote is NA. */
+    vector<uint32_t> voteRows; /* size() == nVoters + 1, or empty if none */
+    vector<uint32_t> voteCols;
+    vector<uint64_t> voteValues;
     /* params */
     uint64_t NA;
     uint64_t alpha; /* for smoothed rep */
     uint64_t tol;
     CTransaction tx; /* transaction with market payouts and reputation (votecoin) transfers */
-
-    marketOutcome(void) : marketObj() { marketop = 'O'; }
+    /* encoding the outcome was read in and is written back in, so that an
+     * outcome keeps its bytes and its id */
+    uint8_t nEncoding;
+    /* the vote matrix of an outcome read in the legacy layout, as it was
+     * read. Its length need not be nVoters * nDecisions, so it is written
+     * back as is rather than rebuilt from the vote rows. */
+    bool fLegacyMatrix;
+    vector<uint64_t> legacyMatrix;
+
+    marketOutcome(void) : marketObj(), nEncoding(MARKET_OUTCOME_COMPACT), fLegacyMatrix(false) { marketop = 'O'; }
     virtual ~marketOutcome(void) { }
 
-    ADD_SERIALIZE_METHODS
+    /* The outcome after its header is in the compact encoding
+     * MARKET_OUTCOME_COMPACT: counts, reputations and the other output
+     * vectors as VARINTs, isScaled as bits, and the votes as described at
+     * SerializeVotes(). An outcome read in the legacy layout is written
+     * back in it. */
+    template <typename Stream>
+    void Serialize(Stream& s) const {
+        ::Serialize(s, marketop);
+        ::Serialize(s, nHeight);
+        ::Serialize(s, branchid);
+        if (nEncoding == MARKET_OUTCOME_LEGACY) {
+            SerializeLegacy(s);
+            return;
+        }
+        ::Serialize(s, MARKET_OUTCOME_TAG);
+        ::Serialize(s, nEncoding);
+        WriteVarInt<Stream, uint32_t>(s, nVoters);
+        ::Serialize(s, voterIDs);
+        SerializeVarInts(s, oldRep);
+        SerializeVarInts(s, thisRep);
+        SerializeVarInts(s, smoothedRep);
+        SerializeVarInts(s, NARow);
+        SerializeVarInts(s, particRow);
+        SerializeVarInts(s, particRel);
+        SerializeVarInts(s, rowBonus);
+        WriteVarInt<Stream, uint32_t>(s, nDecisions);
+        ::Serialize(s, decisionIDs);
+        SerializeBits(s, isScaled);
+        SerializeVarInts(s, firstLoading);
+        SerializeVarInts(s, decisionsRaw);
+        SerializeVarInts(s, consensusReward);
+        SerializeVarInts(s, certainty);
+        SerializeVarInts(s, NACol);
+        SerializeVarInts(s, particCol);
+        SerializeVarInts(s, authorBonus);
+        SerializeVarInts(s, decisionsFinal);
+        SerializeVotes(s);
+        WriteVarInt<Stream, uint64_t>(s, NA);
+        WriteVarInt<Stream, uint64_t>(s, alpha);
+        WriteVarInt<Stream, uint64_t>(s, tol);
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action) {
-        READWRITE(marketop);
-        READWRITE(nHeight);
-        READWRITE(branchid);
-        READWRITE(nVoters);
-        READWRITE(voterIDs);
-        READWRITE(oldRep);
-        READWRITE(thisRep);
-        READWRITE(smoothedRep);
-        READWRITE(NARow);
-        READWRITE(particRow);
-        READWRITE(particRel);
-        READWRITE(rowBonus);
-        READWRITE(nDecisions);
-        READWRITE(decisionIDs);
-        READWRITE(isScaled);
-        READWRITE(firstLoading);
-        READWRITE(decisionsRaw);
-        READWRITE(consensusReward);
-        READWRITE(certainty);
-        READWRITE(NACol);
-        READWRITE(particCol);
-        READWRITE(authorBonus);
-        READWRITE(decisionsFinal);
-        READWRITE(voteMatrix);
-        READWRITE(NA);
-        READWRITE(alpha);
-        READWRITE(tol);
+    template <typename Stream>
+    void Unserialize(Stream& s) {
+        ::Unserialize(s, marketop);
+        ::Unserialize(s, nHeight);
+        ::Unserialize(s, branchid);
+        uint32_t nTag;
+        ::Unserialize(s, nTag);
+        if (nTag != MARKET_OUTCOME_TAG) {
+            nEncoding = MARKET_OUTCOME_LEGACY;
+            nVoters = nTag;
+            UnserializeLegacy(s);
+            return;
+        }
+        ::Unserialize(s, nEncoding);
+        if (nEncoding != MARKET_OUTCOME_COMPACT)
+            throw std::ios_base::failure("marketOutcome: unknown encoding");
+        fLegacyMatrix = false;
+        legacyMatrix.clear();
+        nVoters = ReadVarInt<Stream, uint32_t>(s);
+        ::Unserialize(s, voterIDs);
+        UnserializeVarInts(s, oldRep);
+        UnserializeVarInts(s, thisRep);
+        UnserializeVarInts(s, smoothedRep);
+        UnserializeVarInts(s, NARow);
+        UnserializeVarInts(s, particRow);
+        UnserializeVarInts(s, particRel);
+        UnserializeVarInts(s, rowBonus);
+        /* consumers index the voter vectors up to nVoters; the outputs are
+         * empty when the outcome was not calculated */
+        if ((nVoters != voterIDs.size())
+            || !IsVectorSize(oldRep, nVoters) || !IsVectorSize(thisRep, nVoters)
+            || !IsVectorSize(smoothedRep, nVoters) || !IsVectorSize(NARow, nVoters)
+            || !IsVectorSize(particRow, nVoters) || !IsVectorSize(particRel, nVoters)
+            || !IsVectorSize(rowBonus, nVoters))
+            throw std::ios_base::failure("marketOutcome: voter vector size mismatch");
+        nDecisions = ReadVarInt<Stream, uint32_t>(s);
+        ::Unserialize(s, decisionIDs);
+        UnserializeBits(s, isScaled);
+        UnserializeVarInts(s, firstLoading);
+        UnserializeVarInts(s, decisionsRaw);
+        UnserializeVarInts(s, consensusReward);
+        UnserializeVarInts(s, certainty);
+        UnserializeVarInts(s, NACol);
+        UnserializeVarInts(s, particCol);
+        UnserializeVarInts(s, authorBonus);
+        UnserializeVarInts(s, decisionsFinal);
+        if ((nDecisions != decisionIDs.size())
+            || !IsVectorSize(isScaled, nDecisions) || !IsVectorSize(firstLoading, nDecisions)
+            || !IsVectorSize(decisionsRaw, nDecisions) || !IsVectorSize(consensusReward, nDecisions)
+            || !IsVectorSize(certainty, nDecisions) || !IsVectorSize(NACol, nDecisions)
+            || !IsVectorSize(particCol, nDecisions) || !IsVectorSize(authorBonus, nDecisions)
+            || !IsVectorSize(decisionsFinal, nDecisions))
+            throw std::ios_base::failure("marketOutcome: decision vector size mismatch");
+        UnserializeVotes(s);
+        NA = ReadVarInt<Stream, uint64_t>(s);
+        alpha = ReadVarInt<Stream, uint64_t>(s);
+        tol = ReadVarInt<Stream, uint64_t>(s);
+    }
+
+    /* The fixed-width layout after nVoters: the vectors at eight bytes a
+     * value and the dense vote matrix [nVoters][nDecisions], NA where no
+     * vote */
+    template <typename Stream>
+    void SerializeLegacy(Stream& s) const {
+        ::Serialize(s, nVoters);
+        ::Serialize(s, voterIDs);
+        ::Serialize(s, oldRep);
+        ::Serialize(s, thisRep);
+        ::Serialize(s, smoothedRep);
+        ::Serialize(s, NARow);
+        ::Serialize(s, particRow);
+        ::Serialize(s, particRel);
+        ::Serialize(s, rowBonus);
+        ::Serialize(s, nDecisions);
+        ::Serialize(s, decisionIDs);
+        ::Serialize(s, isScaled);
+        ::Serialize(s, firstLoading);
+        ::Serialize(s, decisionsRaw);
+        ::Serialize(s, consensusReward);
+        ::Serialize(s, certainty);
+        ::Serialize(s, NACol);
+        ::Serialize(s, particCol);
+        ::Serialize(s, authorBonus);
+        ::Serialize(s, decisionsFinal);
+        if (fLegacyMatrix)
+            ::Serialize(s, legacyMatrix);
+        else
+            ::Serialize(s, GetVoteMatrix());
+        ::Serialize(s, NA);
+        ::Serialize(s, alpha);
+        ::Serialize(s, tol);
+    }
+
+    template <typename Stream>
+    void UnserializeLegacy(Stream& s) {
+        ::Unserialize(s, voterIDs);
+        ::Unserialize(s, oldRep);
+        ::Unserialize(s, thisRep);
+        ::Unserialize(s, smoothedRep);
+        ::Unserialize(s, NARow);
+        ::Unserialize(s, particRow);
+        ::Unserialize(s, particRel);
+        ::Unserialize(s, rowBonus);
+        ::Unserialize(s, nDecisions);
+        ::Unserialize(s, decisionIDs);
+        ::Unserialize(s, isScaled);
+        ::Unserialize(s, firstLoading);
+        ::Unserialize(s, decisionsRaw);
+        ::Unserialize(s, consensusReward);
+        ::Unserialize(s, certainty);
+        ::Unserialize(s, NACol);
+        ::Unserialize(s, particCol);
+        ::Unserialize(s, authorBonus);
+        ::Unserialize(s, decisionsFinal);
+        vector<uint64_t> voteMatrix;
+        ::Unserialize(s, voteMatrix);
+        ::Unserialize(s, NA);
+        ::Unserialize(s, alpha);
+        ::Unserialize(s, tol);
+        /* The miner sized the matrix by the distinct voter keys but counted
+         * every reveal vote in nVoters and voterIDs, so the matrix may hold
+         * fewer rows than nVoters (or a partial one). Outcomes on chain
+         * decoded whatever the length, and still do: the rows present are
+         * expanded and the rest are left NA. The vote rows need a voter id
+         * per row, without which none are kept. */
+        voteRows.clear();
+        voteCols.clear();
+        voteValues.clear();
+        if (nVoters == voterIDs.size())
+            SetVoteMatrix(voteMatrix);
+        legacyMatrix.swap(voteMatrix);
+        fLegacyMatrix = true;
+    }
+
+    /* Per voter the number of votes and the decisions voted on: as a bitmap
+     * of the nDecisions when there are at least nDecisions / 8 votes,
+     * otherwise as the distance of each past the previous one (VARINTs).
+     * Then the votes on binary
+     * decisions, two bits each and four to a byte: 0, COIN, COIN/2, or 3
+     * for any other value. That value follows, in order with the votes on
+     * scaled decisions, as a VARINT. */
+    template <typename Stream>
+    void SerializeVotes(Stream& s) const {
+        if (!IsVoteMatrixValid()
+            || (!voteCols.empty() && (nDecisions > decisionIDs.size())))
+            throw std::ios_base::failure("marketOutcome: invalid vote matrix");
+        for(uint32_t i=0; i < nVoters; i++) {
+            if (voteRows.empty()) {
+                WriteVarInt<Stream, uint32_t>(s, 0);
+                continue;
+            }
+            const uint32_t n = voteRows[i+1] - voteRows[i];
+            WriteVarInt<Stream, uint32_t>(s, n);
+            if (IsVoteBitmap(n)) {
+                vector<unsigned char> vMap((nDecisions + 7) / 8, 0);
+                for(uint32_t k=voteRows[i]; k < voteRows[i+1]; k++)
+                    vMap[voteCols[k] / 8] |= 1 << (voteCols[k] % 8);
+                s.write((const char *) vMap.data(), vMap.size());
+                continue;
+            }
+            for(uint32_t k=voteRows[i]; k < voteRows[i+1]; k++)
+                WriteVarInt<Stream, uint32_t>(s, (k == voteRows[i])? voteCols[k]:
+                    voteCols[k] - voteCols[k-1] - 1);
+        }
+
+        vector<unsigned char> vBits;
+        vector<uint64_t> vValue;
+        uint32_t nBinary = 0;
+        for(size_t k=0; k < voteCols.size(); k++) {
+            if (!IsBinaryVote(voteCols[k])) {
+                vValue.push_back(voteValues[k]);
+                continue;
+            }
+            unsigned char code = PackBinaryVote(voteValues[k]);
+            if (code == 3)
+                vValue.push_back(voteValues[k]);
+            if (nBinary % 4 == 0)
+                vBits.push_back(0);
+            vBits.back() |= code << (2 * (nBinary % 4));
+            nBinary++;
+        }
+        if (!vBits.empty())
+            s.write((const char *) vBits.data(), vBits.size());
+        for(size_t k=0; k < vValue.size(); k++)
+            WriteVarInt<Stream, uint64_t>(s, vValue[k]);
+    }
+
+    template <typename Stream>
+    void UnserializeVotes(Stream& s) {
+        voteRows.assign(1, 0);
+        voteCols.clear();
+        voteValues.clear();
+        /* votes need their decisions, which bounds nDecisions */
+        const uint32_t nMaxVotes = (nDecisions > decisionIDs.size())? 0: nDecisions;
+        /* IsBinaryVote() of each decision, looked up once per vote */
+        vector<unsigned char> vBinary(nMaxVotes);
+        for(uint32_t j=0; j < nMaxVotes; j++)
+            vBinary[j] = IsBinaryVote(j);
+        uint32_t nBinary = 0;
+        vector<unsigned char> vMap((nMaxVotes + 7) / 8);
+        /* nVoters was checked against the voter ids read */
+        voteRows.reserve((size_t)nVoters + 1);
+        for(uint32_t i=0; i < nVoters; i++) {
+            uint32_t n = ReadVarInt<Stream, uint32_t>(s);
+            if (n > nMaxVotes)
+                throw std::ios_base::failure("marketOutcome: too many votes");
+            if (IsVoteBitmap(n)) {
+                s.read((char *) vMap.data(), vMap.size());
+                for(uint32_t b=0; b < vMap.size(); b++) {
+                    /* skip whole bytes of abstentions */
+                    for(uint32_t j = 8 * b, m = vMap[b]; m; j++, m >>= 1) {
+                        if (!(m & 1))
+                            continue;
+                        voteCols.push_back(j);
+                        nBinary += (j < nMaxVotes)? vBinary[j]: 0;
+                    }
+                }
+                /* the columns increase, so only the last can be past the
+                 * end */
+                if (voteCols.size() - voteRows.back() != n)
+                    throw std::ios_base::failure("marketOutcome: vote count mismatch");
+                if (voteCols.back() >= nDecisions)
+                    throw std::ios_base::failure("marketOutcome: vote out of range");
+                voteRows.push_back(voteCols.size());
+                continue;
+            }
+            for(uint32_t k=0; k < n; k++) {
+                uint64_t col = ReadVarInt<Stream, uint32_t>(s);
+                if (k)
+                    col += (uint64_t) voteCols.back() + 1;
+                if (col >= nDecisions)
+                    throw std::ios_base::failure("marketOutcome: vote out of range");
+                voteCols.push_back(col);
+                nBinary += vBinary[col];
+            }
+            voteRows.push_back(voteCols.size());
+        }
+
+        vector<unsigned char> vBits((nBinary + 3) / 4);
+        if (!vBits.empty())
+            s.read((char *) vBits.data(), vBits.size());
+        uint32_t nPacked = 0;
+        voteValues.reserve(voteCols.size());
+        for(size_t k=0; k < voteCols.size(); k++) {
+            if (vBinary[voteCols[k]]) {
+                unsigned char code = (vBits[nPacked / 4] >> (2 * (nPacked % 4))) & 3;
+                nPacked++;
+                if (code != 3) {
+                    voteValues.push_back(UnpackBinaryVote(code));
+                    continue;
+                }
+            }
+            voteValues.push_back(ReadVarInt<Stream, uint64_t>(s));
+        }
+    }
+
+    bool IsVoteBitmap(uint32_t nVotes) const {
+        return nVotes && (nVotes >= nDecisions / 8);
+    }
+
+    bool IsBinaryVote(uint32_t j) const {
+        return (j < isScaled.size()) && !isScaled[j];
+    }
+
+    /* an output vector is either empty or holds one entry per row */
+    template <typename T>
+    static bool IsVectorSize(const vector<T>& v, uint32_t n) {
+        return v.empty() || (v.size() == n);
     }
+
     string ToString(void) const;
-    int calc(void);
+    /* Run the vote, splitting large ballots over nThreads threads. The
+     * result does not depend on nThreads */
+    int calc(uint32_t nThreads = 1);
+    /* The dense vote matrix [nVoters][nDecisions], NA where no vote. For an
+     * outcome read in the legacy layout, the matrix as read. */
+    vector<uint64_t> GetVoteMatrix(void) const;
+    /* Store the dense vote matrix [nVoters][nDecisions], dropping NAs.
+     * Rows past the end of voteMatrix are NA. The outcome no longer keeps
+     * a legacy matrix. */
+    void SetVoteMatrix(const vector<uint64_t>& voteMatrix);
+    /* true if the vote rows, columns and values fit together */
+    bool IsVoteMatrixValid(void) const;
+};
+
+/* hashes ids that are themselves hashes, for unordered containers */
+struct marketIdHasher {
+    size_t operator()(const uint256& id) const { return id.GetCheapHash(); }
+};
+
+/* builds the vote matrix of an outcome from its reveal votes, one row per
+ * voter as the votes come, straight into the sparse rows calc() runs on.
+ * The outcome's decision ids are hashed to their columns once. A voter
+ * revealing again replaces their row. voterIDs, nVoters and the vote rows
+ * of the outcome are kept in step, as they are serialized with it. */
+class marketVoteMatrix {
+public:
+    /* outcome.decisionIDs and NA must be set */
+    explicit marketVoteMatrix(marketOutcome& outcome);
+
+    void AddVote(const marketRevealVote& vote);
+    /* outcome.calc() on the matrix built, once all votes are added */
+    int Calc(uint32_t nThreads = 1);
+
+private:
+    marketOutcome& outcome;
+    unordered_map<uint256, uint32_t, marketIdHasher> mapColumn;
+    map<CKeyID, uint32_t> mapRow;
+    vector<pair<uint32_t, uint64_t> > vRow; /* row being added */
+
+    marketVoteMatrix(const marketVoteMatrix&) = delete;
+    marketVoteMatrix& operator=(const marketVoteMatrix&) = delete;
 };
 
 /* market Branch
@@ -6,6 +6,7 @@
 #include <primitives/transaction.h>
 
 #include <hash.h>
+#include <primitives/market.h>
 #include <tinyformat.h>
 #include <utilstrencodings.h>
 
@@ -83,12 +84,12 @@ CTransaction::CTransaction(CMutableTransaction &&tx) : vin(std::move(tx.vin)), v
 CAmount CTransaction::GetValueOut() const
 {
     CAmount nValueOut = 0;
-    for (const auto& tx_out : vout) {
-        if (tx_out.scriptPubKey.IsMarketScript())
+    for (unsigned int n = 0; n < vout.size(); n++) {
+        if (IsMarketOutput(n))
             continue;
 
-        nValueOut += tx_out.nValue;
-        if (!MoneyRange(tx_out.nValue) || !MoneyRange(nValueOut))
+        nValueOut += vout[n].nValue;
+        if (!MoneyRange(vout[n].nValue) || !MoneyRange(nValueOut))
             throw std::runtime_error(std::string(__func__) + ": value out of range");
     }
     return nValueOut;
@@ -97,18 +98,78 @@ CAmount CTransaction::GetValueOut() const
 CAmount CTransaction::GetValueOutToMarket() const
 {
     CAmount nValueOut = 0;
-    for (std::vector<CTxOut>::const_iterator it(vout.begin()); it != vout.end(); ++it)
-    {
-        std::vector<unsigned char> hashBytes;
-        if (!it->scriptPubKey.IsMarketScript(hashBytes))
+    for (unsigned int n = 0; n < vout.size(); n++) {
+        if (!IsMarketOutput(n))
             continue;
-        nValueOut += it->nValue;
-        if (!MoneyRange(it->nValue) || !MoneyRange(nValueOut))
+        nValueOut += vout[n].nValue;
+        if (!MoneyRange(vout[n].nValue) || !MoneyRange(nValueOut))
             throw std::runtime_error(std::string(__func__) + ": value out of range");
     }
     return nValueOut;
 }
 
+const CTransaction::MarketObjs& CTransaction::DecodeMarketObjs() const
+{
+    std::shared_ptr<const MarketObjs> objs = std::atomic_load(&marketObjs);
+    if (objs)
+        return *objs;
+
+    std::shared_ptr<MarketObjs> decoded = std::make_shared<MarketObjs>();
+    decoded->vMarketOut.assign(vout.size(), false);
+    for (unsigned int n = 0; n < vout.size(); n++) {
+        if (!vout[n].scriptPubKey.IsMarketScript())
+            continue;
+        std::shared_ptr<marketObj> obj;
+        try {
+            obj = marketObjCtr(vout[n].scriptPubKey);
+        } catch (const std::exception&) {
+        }
+        if (!obj) {
+            // An outcome the compact decoder refuses may still read in the
+            // legacy layout, in which case it has always been a valid
+            // market output
+            if (marketOutcomeDecodesLegacy(vout[n].scriptPubKey))
+                decoded->vMarketOut[n] = true;
+            else
+                decoded->fMalformed = true;
+            continue;
+        }
+        obj->txid = hash;
+        decoded->vObj.push_back(obj);
+        decoded->vMarketOut[n] = true;
+    }
+
+    // Keep whichever decoding was stored first if threads raced here
+    objs = decoded;
+    std::shared_ptr<const MarketObjs> expected;
+    if (!std::atomic_compare_exchange_strong(&marketObjs, &expected, objs))
+        return *expected;
+    return *objs;
+}
+
+const std::vector<std::shared_ptr<const marketObj> >& CTransaction::GetMarketObjs() const
+{
+    return DecodeMarketObjs().vObj;
+}
+
+bool CTransaction::IsMarketOutput(unsigned int n) const
+{
+    // Most outputs are told apart by the script alone; only market scripts
+    // need their object decoded
+    if (n >= vout.size() || !vout[n].scriptPubKey.IsMarketScript())
+        return false;
+    return DecodeMarketObjs().vMarketOut[n];
+}
+
+bool CTransaction::HasMalformedMarketOutput() const
+{
+    for (const CTxOut& txout : vout) {
+        if (txout.scriptPubKey.IsMarketScript())
+            return DecodeMarketObjs().fMalformed;
+    }
+    return false;
+}
+
 unsigned int CTransaction::GetTotalSize() const
 {
     return ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
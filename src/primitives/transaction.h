@@ -12,6 +12,11 @@
 #include <serialize.h>
 #include <uint256.h>
 
+#include <memory>
+#include <vector>
+
+struct marketObj;
+
 static const int SERIALIZE_TRANSACTION_NO_WITNESS = 0x40000000;
 
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
@@ -294,7 +299,19 @@ private:
     /** Memory only. */
     const uint256 hash;
 
+    /** Market objects of the outputs and which outputs hold one */
+    struct MarketObjs {
+        std::vector<std::shared_ptr<const marketObj> > vObj;
+        std::vector<bool> vMarketOut;
+        bool fMalformed = false;
+    };
+
+    /** Memory only. Market objects of the outputs, decoded on first use
+     *  and shared by every consumer of the transaction. */
+    mutable std::shared_ptr<const MarketObjs> marketObjs;
+
     uint256 ComputeHash() const;
+    const MarketObjs& DecodeMarketObjs() const;
 
 public:
     /** Construct a CTransaction that qualifies as IsNull() */
@@ -329,6 +346,17 @@ public:
     CAmount GetValueOut() const;
     // Return sum of market txouts.
     CAmount GetValueOutToMarket() const;
+
+    // Return the market objects of the outputs, in output order. Their
+    // txid is set to this transaction's hash.
+    const std::vector<std::shared_ptr<const marketObj> >& GetMarketObjs() const;
+    // Whether output n holds a market object that decodes, or an outcome
+    // that reads in the legacy layout.
+    bool IsMarketOutput(unsigned int n) const;
+    // Whether any output is a market script whose object does not decode
+    // in either. CheckTransaction rejects such transactions, unless they
+    // are the coinbase.
+    bool HasMalformedMarketOutput() const;
     // GetValueIn() is a method on CCoinsViewCache, because
     // inputs must be known to compute value in.
 
@@ -1375,6 +1375,39 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
     return mempoolInfoToJSON();
 }
 
+UniValue getmarketcacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getmarketcacheinfo\n"
+            "\nReturns details on the in-memory cache of the market index.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx,            (numeric) Branches, decisions, markets, share states and index lists cached\n"
+            "  \"usage\": xxxxx,              (numeric) Estimated memory usage of the cache\n"
+            "  \"maxusage\": xxxxx,           (numeric) Maximum memory usage of the cache (-marketcache)\n"
+            "  \"hits\": xxxxx,               (numeric) Lookups answered from the cache\n"
+            "  \"misses\": xxxxx              (numeric) Lookups that went to the database\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmarketcacheinfo", "")
+            + HelpExampleRpc("getmarketcacheinfo", "")
+        );
+
+    if (!pmarkettree)
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Market index not loaded");
+
+    const CMarketCache& cache = pmarkettree->GetCache();
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("entries", (int64_t) cache.Size());
+    ret.pushKV("usage", (int64_t) cache.DynamicMemoryUsage());
+    ret.pushKV("maxusage", (int64_t) cache.GetMaxUsage());
+    ret.pushKV("hits", (int64_t) cache.GetHits());
+    ret.pushKV("misses", (int64_t) cache.GetMisses());
+
+    return ret;
+}
+
 UniValue preciousblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -1604,6 +1637,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  {"txid","verbose"} },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        {"txid"} },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
+    { "blockchain",         "getmarketcacheinfo",     &getmarketcacheinfo,     {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
@@ -151,7 +151,17 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "refreshbmm", 1, "createnew" },
     { "getmainchainblockhash", 0, "height" },
     // Hivemind
+    { "listbranches", 0, "offset" },
+    { "listbranches", 1, "limit" },
+    { "listdecisions", 1, "offset" },
+    { "listdecisions", 2, "limit" },
+    { "listmarkets", 1, "offset" },
+    { "listmarkets", 2, "limit" },
+    { "listoutcomes", 1, "offset" },
+    { "listoutcomes", 2, "limit" },
     { "listvotes", 1, "height" },
+    { "listvotes", 2, "offset" },
+    { "listvotes", 3, "limit" },
     { "createbranch", 2, "baselistingfee" },
     { "createbranch", 3, "freedecisions" },
     { "createbranch", 4, "targetdecisions" },
@@ -184,6 +194,13 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getcreatetradecapitalrequired", 1, "buyorsell" },
     { "getcreatetradecapitalrequired", 2, "numbershares" },
     { "getcreatetradecapitalrequired", 3, "decisionstate" },
+    { "getcreatetradecapitalrequired", 4, "includemempool" },
+    { "getmarket", 1, "includemempool" },
+    { "getmarketquotes", 1, "sizes" },
+    { "getmarketquotes", 2, "includemempool" },
+    { "listtrades", 1, "includemempool" },
+    { "listtrades", 2, "offset" },
+    { "listtrades", 3, "limit" },
 };
 
 class CRPCConvertTable
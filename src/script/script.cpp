@@ -242,67 +242,22 @@ bool CScript::IsWitnessProgram(int& version, std::vector<unsigned char>& program
 
 bool CScript::IsMarketScript(std::vector<unsigned char>& hashBytes) const
 {
-    if (size() < 2)
+    // Some market objects have a KeyID, which is returned to the tx solver.
+    // Peek at it rather than deserializing the whole object.
+    CKeyID keyID;
+    char marketop = marketObjPeek(*this, &keyID);
+    if (!marketop)
        return false;
 
-    if (this->back() != OP_MARKET)
-       return false;
-
-    // Some market objects have a KeyID
-    // We deserialize here so that we can return the KeyID to tx solver
+    if (marketop == 'D' || marketop == 'M' || marketop == 'T')
+       hashBytes = vector<unsigned char> (keyID.begin(), keyID.end());
 
-    marketObj *obj = marketObjCtr(*this);
-    if (!obj)
-       return false;
-
-    if (obj->marketop == 'B') { /* branch */
-       return true;
-    }
-    else
-    if (obj->marketop == 'D') { /* decision */
-       marketDecision *ptr = (marketDecision *) obj;
-       hashBytes = vector<unsigned char> (ptr->keyID.begin(), ptr->keyID.end());
-       delete ptr;
-       return true;
-    }
-    else
-    if (obj->marketop == 'L') { /* steal vote */
-       return true;
-    }
-    else
-    if (obj->marketop == 'M') { /* market */
-       marketMarket *ptr = (marketMarket *) obj;
-       hashBytes = vector<unsigned char> (ptr->keyID.begin(), ptr->keyID.end());
-       delete ptr;
-       return true;
-    }
-    else
-    if (obj->marketop == 'O') { /* outcome */
-        return true;
-    }
-    else
-    if (obj->marketop == 'R') { /* reveal vote */
-        return true;
-    }
-    else
-    if (obj->marketop == 'S') { /* sealed vote */
-        return true;
-    }
-    else
-    if (obj->marketop == 'T') { /* trade */
-        marketTrade *ptr = (marketTrade *) obj;
-        hashBytes = vector<unsigned char> (ptr->keyID.begin(), ptr->keyID.end());
-        delete ptr;
-        return true;
-    }
-
-    return false;
+    return true;
 }
 
 bool CScript::IsMarketScript(void) const
 {
-    std::vector<unsigned char> hashBytes;
-    return IsMarketScript(hashBytes);
+    return marketObjPeek(*this) != 0;
 }
 
 bool CScript::IsWithdrawalBundleFailCommit(uint256& hashWithdrawalBundle) const
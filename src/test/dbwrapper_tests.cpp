@@ -117,6 +117,66 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_prefix_iterator)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (bool obfuscate : {false, true}) {
+        fs::path ph = fs::temp_directory_path() / fs::unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        // Three groups of keys, the middle one is the range we scan
+        for (char op : {'a', 'b', 'c'}) {
+            for (uint32_t x = 0; x < 10; x++)
+                BOOST_CHECK(dbw.Write(std::make_pair(op, x), x));
+        }
+
+        std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+        uint32_t n = 0;
+        for (it->SeekPrefix('b'); it->Valid(); it->Next()) {
+            std::pair<char, uint32_t> key;
+            BOOST_CHECK(it->GetKey(key));
+            BOOST_CHECK_EQUAL(key.first, 'b');
+            BOOST_CHECK_EQUAL(key.second, n);
+            n++;
+        }
+        BOOST_CHECK_EQUAL(n, 10U);
+
+        // The upper bound is exclusive
+        n = 0;
+        it->SetUpperBound(std::make_pair('b', (uint32_t)4));
+        for (it->SeekPrefix('b'); it->Valid(); it->Next())
+            n++;
+        BOOST_CHECK_EQUAL(n, 4U);
+
+        // Without bounds the scan continues into the next prefix
+        n = 0;
+        it.reset(dbw.NewIterator());
+        for (it->Seek(std::make_pair('b', (uint32_t)0)); it->Valid(); it->Next())
+            n++;
+        BOOST_CHECK_EQUAL(n, 20U);
+
+        std::vector<uint32_t> vValue;
+        dbw.ReadPrefix('c', vValue);
+        BOOST_CHECK_EQUAL(vValue.size(), 10U);
+        BOOST_CHECK_EQUAL(vValue.front(), 0U);
+        BOOST_CHECK_EQUAL(vValue.back(), 9U);
+
+        vValue.clear();
+        dbw.ReadPrefix('c', vValue, 3, 5);
+        BOOST_CHECK_EQUAL(vValue.size(), 5U);
+        BOOST_CHECK_EQUAL(vValue.front(), 3U);
+        BOOST_CHECK_EQUAL(vValue.back(), 7U);
+
+        vValue.clear();
+        dbw.ReadPrefix('c', vValue, 8, 5);
+        BOOST_CHECK_EQUAL(vValue.size(), 2U);
+
+        vValue.clear();
+        dbw.ReadPrefix('d', vValue);
+        BOOST_CHECK(vValue.empty());
+    }
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
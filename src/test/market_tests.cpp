@@ -0,0 +1,2111 @@
+// Copyright (c) 2015-2023 The Hivemind Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <clientversion.h>
+#include <consensus/tx_verify.h>
+#include <consensus/validation.h>
+#include <hash.h>
+#include <miner.h>
+#include <outcomecache.h>
+#include <primitives/market.h>
+#include <random.h>
+#include <streams.h>
+#include <test/test_bitcoin.h>
+#include <txdb.h>
+#include <txmempool.h>
+#include <validation.h>
+#include <version.h>
+
+#include <tc_mat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(market_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(market_vote_index_height)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+    const uint256 branchid = InsecureRand256();
+    const uint256 otherid = InsecureRand256();
+
+    // Heights whose little-endian encodings sort differently from their values
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    std::vector<marketRevealVote> vVote(6);
+    const uint32_t heights[] = {10, 256, 10, 1 << 24, 256, 10};
+    for (size_t i = 0; i < vVote.size(); i++) {
+        vVote[i].branchid = (i == 5) ? otherid : branchid;
+        vVote[i].height = heights[i];
+        vVote[i].NA = i;
+        vObj.push_back(std::make_pair(vVote[i].GetHash(), &vVote[i]));
+    }
+    BOOST_CHECK(db.WriteMarketIndex(vObj));
+
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 10).size(), 2U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 256).size(), 2U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 1 << 24).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 20).size(), 0U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(otherid, 10).size(), 1U);
+    for (const marketRevealVote& vote : db.GetRevealVotes(branchid, 256))
+        BOOST_CHECK_EQUAL(vote.height, 256U);
+}
+
+BOOST_AUTO_TEST_CASE(market_vote_index_upgrade)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+    const uint256 branchid = InsecureRand256();
+
+    // Write the vote indexes in the old little-endian height layout
+    CDBBatch batch(db);
+    marketRevealVote reveal;
+    reveal.branchid = branchid;
+    reveal.height = 300;
+    batch.Write(std::make_pair(std::make_pair(std::make_pair('r', branchid), reveal.height), reveal.GetHash()), std::make_pair(reveal, uint256()));
+    marketSealedVote sealed;
+    sealed.branchid = branchid;
+    sealed.height = 300;
+    batch.Write(std::make_pair(std::make_pair(std::make_pair('s', branchid), sealed.height), sealed.GetHash()), std::make_pair(sealed, uint256()));
+    marketStealVote steal;
+    steal.branchid = branchid;
+    steal.height = 600;
+    batch.Write(std::make_pair(std::make_pair(std::make_pair('l', branchid), steal.height), steal.GetHash()), std::make_pair(steal, uint256()));
+    // Last block file shares the steal vote op byte and must survive
+    batch.Write('l', 7);
+    // The votes themselves, which the index entries point to
+    batch.Write(std::make_pair('R', reveal.GetHash()), std::make_pair(reveal, uint256()));
+    batch.Write(std::make_pair('S', sealed.GetHash()), std::make_pair(sealed, uint256()));
+    batch.Write(std::make_pair('L', steal.GetHash()), std::make_pair(steal, uint256()));
+    BOOST_CHECK(db.WriteBatch(batch));
+
+    BOOST_CHECK(db.GetRevealVotes(branchid, 300).empty());
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 300).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetSealedVotes(branchid, 300).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetStealVotes(branchid, 600).size(), 1U);
+    BOOST_CHECK(db.GetStealVotes(branchid, 300).empty());
+
+    int nFile = 0;
+    BOOST_CHECK(db.ReadLastBlockFile(nFile));
+    BOOST_CHECK_EQUAL(nFile, 7);
+
+    // A second run is a no-op
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 300).size(), 1U);
+}
+
+static marketDecision MakeDecision(const uint256& branchid, uint32_t eventOverBy)
+{
+    marketDecision decision;
+    decision.branchid = branchid;
+    decision.prompt = "?";
+    decision.eventOverBy = eventOverBy;
+    decision.isScaled = 0;
+    decision.min = 0;
+    decision.max = COIN;
+    decision.answerOptionality = 0;
+    return decision;
+}
+
+BOOST_AUTO_TEST_CASE(market_decision_index_range)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+    const uint256 branchid = InsecureRand256();
+    const uint256 otherid = InsecureRand256();
+
+    std::vector<marketDecision> vDecision;
+    for (uint32_t height : {1U, 9U, 10U, 11U, 20U, 21U, 300U, 0xffffffffU})
+        vDecision.push_back(MakeDecision(branchid, height));
+    vDecision.push_back(MakeDecision(otherid, 15));
+
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    for (const marketDecision& decision : vDecision)
+        vObj.push_back(std::make_pair(decision.GetHash(), &decision));
+    BOOST_CHECK(db.WriteMarketIndex(vObj));
+
+    std::vector<marketDecision> vRange = db.GetDecisionsInRange(branchid, 10, 20);
+    BOOST_CHECK_EQUAL(vRange.size(), 3U);
+    for (const marketDecision& decision : vRange) {
+        BOOST_CHECK(decision.branchid == branchid);
+        BOOST_CHECK(decision.eventOverBy >= 10 && decision.eventOverBy <= 20);
+    }
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 12, 19).size(), 0U);
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 20, 10).size(), 0U);
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 0, 0xffffffff).size(), 8U);
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 301, 0xffffffff).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(otherid, 0, 0xffffffff).size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(market_decision_index_upgrade)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+    const uint256 branchid = InsecureRand256();
+
+    // Decisions written before the height index existed
+    CDBBatch batch(db);
+    for (uint32_t height : {5, 10, 15}) {
+        marketDecision decision = MakeDecision(branchid, height);
+        std::pair<marketDecision, uint256> value = std::make_pair(decision, uint256());
+        batch.Write(std::make_pair('D', decision.GetHash()), value);
+        batch.Write(std::make_pair(std::make_pair('d', branchid), decision.GetHash()), value);
+    }
+    BOOST_CHECK(db.WriteBatch(batch));
+    BOOST_CHECK(db.GetDecisionsInRange(branchid, 0, 20).empty());
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 0, 20).size(), 3U);
+    BOOST_CHECK_EQUAL(db.GetDecisionsInRange(branchid, 6, 15).size(), 2U);
+    BOOST_CHECK_EQUAL(db.GetDecisions(branchid).size(), 3U);
+
+    // Pages of the cached index follow its order
+    std::vector<marketDecision> vDecision = db.GetDecisions(branchid);
+    std::vector<marketDecision> vPage = db.GetDecisions(branchid, 1, 1);
+    BOOST_CHECK_EQUAL(vPage.size(), 1U);
+    BOOST_CHECK(vPage[0].GetHash() == vDecision[1].GetHash());
+    BOOST_CHECK_EQUAL(db.GetDecisions(branchid, 2).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetDecisions(branchid, 0, 5).size(), 3U);
+    BOOST_CHECK(db.GetDecisions(branchid, 4, 1).empty());
+
+    // Ids of the index without their decision (sorting first here) count
+    // towards neither the offset nor the limit
+    const uint256 otherid = InsecureRand256();
+    CDBBatch batchDangling(db);
+    batchDangling.WriteKey(std::make_pair(std::make_pair('d', otherid), uint256()));
+    for (uint32_t height : {5, 10}) {
+        marketDecision decision = MakeDecision(otherid, height);
+        std::pair<marketDecision, uint256> value = std::make_pair(decision, uint256());
+        batchDangling.Write(std::make_pair('D', decision.GetHash()), value);
+        batchDangling.WriteKey(std::make_pair(std::make_pair('d', otherid), decision.GetHash()));
+    }
+    BOOST_CHECK(db.WriteBatch(batchDangling));
+    vDecision = db.GetDecisions(otherid);
+    BOOST_REQUIRE_EQUAL(vDecision.size(), 2U);
+    vPage = db.GetDecisions(otherid, 1, 1);
+    BOOST_REQUIRE_EQUAL(vPage.size(), 1U);
+    BOOST_CHECK(vPage[0].GetHash() == vDecision[1].GetHash());
+    BOOST_CHECK_EQUAL(db.GetDecisions(otherid, 0, 1).size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(market_maturation_index)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+
+    std::vector<marketMarket> vMarket;
+    for (uint32_t maturation : {5U, 10U, 15U, 20U, 0xffffffffU}) {
+        marketMarket market;
+        market.title = "t";
+        market.B = COIN;
+        market.tradingFee = 0;
+        market.maxCommission = 0;
+        market.maturation = maturation;
+        market.txPoWh = 0;
+        market.txPoWd = 0;
+        market.decisionIDs.push_back(InsecureRand256());
+        vMarket.push_back(market);
+    }
+
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    for (const marketMarket& market : vMarket)
+        vObj.push_back(std::make_pair(market.GetHash(), &market));
+    uint256 hash = InsecureRand256();
+    CBlockIndex index;
+    index.nHeight = 1;
+    index.phashBlock = &hash;
+    BOOST_CHECK(db.WriteMarketIndex(vObj, &index));
+
+    std::vector<marketMarket> vRange = db.GetMarketsInRange(6, 15);
+    BOOST_CHECK_EQUAL(vRange.size(), 2U);
+    for (const marketMarket& market : vRange)
+        BOOST_CHECK(market.maturation >= 6 && market.maturation <= 15);
+    BOOST_CHECK(db.GetMarketsInRange(16, 19).empty());
+    BOOST_CHECK(db.GetMarketsInRange(15, 10).empty());
+    BOOST_CHECK_EQUAL(db.GetMarketsInRange(0, 0xffffffff).size(), 5U);
+    BOOST_CHECK_EQUAL(db.GetMarketsInRange(21, 0xffffffff).size(), 1U);
+
+    // Markets written before the maturation index are indexed by the
+    // upgrade. The keys are erased as read; the byte order of the height
+    // does not matter for that.
+    CDBBatch batch(db);
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekPrefix('h'); pcursor->Valid(); pcursor->Next()) {
+        std::pair<std::pair<char, uint256>, std::pair<uint32_t, uint256> > key;
+        BOOST_CHECK(pcursor->GetKey(key));
+        batch.Erase(key);
+    }
+    BOOST_CHECK(db.WriteBatch(batch));
+    BOOST_CHECK(db.GetMarketsInRange(0, 0xffffffff).empty());
+    db.WriteFlag("marketheightindex", false);
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.GetMarketsInRange(6, 15).size(), 2U);
+    BOOST_CHECK_EQUAL(db.GetMarketsInRange(0, 0xffffffff).size(), 5U);
+
+    // Disconnecting the block removes the entries
+    BOOST_CHECK(db.DisconnectMarketIndex(&index));
+    BOOST_CHECK(db.GetMarketsInRange(0, 0xffffffff).empty());
+}
+
+static marketTrade MakeTrade(const uint256& marketid, bool isBuy, uint64_t nShares, uint32_t decisionState, uint32_t nonce)
+{
+    marketTrade trade;
+    trade.marketid = marketid;
+    trade.isBuy = isBuy;
+    trade.nShares = nShares;
+    trade.price = COIN;
+    trade.decisionState = decisionState;
+    trade.nonce = nonce;
+    return trade;
+}
+
+BOOST_AUTO_TEST_CASE(market_share_state)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+
+    marketMarket market;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 100;
+    market.decisionIDs.push_back(InsecureRand256());
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+    const uint256 marketid = market.GetHash();
+    BOOST_CHECK_EQUAL(marketNStates(market), 2U);
+
+    // Block 1 creates the market and trades on it
+    uint256 hash1 = InsecureRand256();
+    CBlockIndex index1;
+    index1.nHeight = 1;
+    index1.phashBlock = &hash1;
+    marketTrade buy0 = MakeTrade(marketid, true, 5 * COIN, 0, 0);
+    marketTrade buy1 = MakeTrade(marketid, true, 3 * COIN, 1, 1);
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    vObj.push_back(std::make_pair(buy0.GetHash(), &buy0));
+    vObj.push_back(std::make_pair(marketid, &market));
+    vObj.push_back(std::make_pair(buy1.GetHash(), &buy1));
+    BOOST_CHECK(db.WriteMarketIndex(vObj, &index1));
+
+    marketShareState state;
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 2U);
+    BOOST_CHECK_EQUAL(state.nHeight, 1U);
+    BOOST_CHECK_EQUAL(state.nShares.size(), 2U);
+    BOOST_CHECK_EQUAL(state.nShares[0], 5 * COIN);
+    BOOST_CHECK_EQUAL(state.nShares[1], 3 * COIN);
+
+    // Block 2 sells some shares; out of range states only count as trades
+    uint256 hash2 = InsecureRand256();
+    CBlockIndex index2;
+    index2.nHeight = 2;
+    index2.phashBlock = &hash2;
+    marketTrade sell0 = MakeTrade(marketid, false, 2 * COIN, 0, 2);
+    marketTrade bad = MakeTrade(marketid, true, COIN, 7, 3);
+    vObj.clear();
+    vObj.push_back(std::make_pair(sell0.GetHash(), &sell0));
+    vObj.push_back(std::make_pair(bad.GetHash(), &bad));
+    BOOST_CHECK(db.WriteMarketIndex(vObj, &index2));
+
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 4U);
+    BOOST_CHECK_EQUAL(state.nHeight, 2U);
+    BOOST_CHECK_EQUAL(state.nShares[0], 3 * COIN);
+
+    // The aggregate prices the same as replaying every trade
+    double nSharesAgg[2], nSharesTrades[2];
+    BOOST_CHECK_EQUAL(marketNShares(state, 2, nSharesAgg), 0);
+    BOOST_CHECK_EQUAL(marketNShares(db.GetTrades(marketid), 2, nSharesTrades), 0);
+    BOOST_CHECK_EQUAL(nSharesAgg[0], 3.0);
+    BOOST_CHECK_EQUAL(nSharesAgg[1], 3.0);
+    BOOST_CHECK_EQUAL(nSharesAgg[0], nSharesTrades[0]);
+    BOOST_CHECK_EQUAL(nSharesAgg[1], nSharesTrades[1]);
+
+    // Connecting block 2 again (-reindex-chainstate, VerifyDB) counts none
+    // of its trades twice
+    BOOST_CHECK(db.WriteMarketIndex(vObj, &index2));
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 4U);
+    BOOST_CHECK_EQUAL(state.nHeight, 2U);
+    BOOST_CHECK_EQUAL(state.nShares[0], 3 * COIN);
+    BOOST_CHECK_EQUAL(state.nShares[1], 3 * COIN);
+
+    // Block 3 repeats a trade and adds one; only the new one counts
+    uint256 hash3 = InsecureRand256();
+    CBlockIndex index3;
+    index3.nHeight = 3;
+    index3.phashBlock = &hash3;
+    marketTrade buy2 = MakeTrade(marketid, true, COIN, 1, 4);
+    vObj.clear();
+    vObj.push_back(std::make_pair(sell0.GetHash(), &sell0));
+    vObj.push_back(std::make_pair(buy2.GetHash(), &buy2));
+    vObj.push_back(std::make_pair(buy2.GetHash(), &buy2));
+    BOOST_CHECK(db.WriteMarketIndex(vObj, &index3));
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 5U);
+    BOOST_CHECK_EQUAL(state.nHeight, 3U);
+    BOOST_CHECK_EQUAL(state.nShares[0], 3 * COIN);
+    BOOST_CHECK_EQUAL(state.nShares[1], 4 * COIN);
+
+    // Its undo data restores block 2's state and keeps the repeated trade
+    BOOST_CHECK(db.DisconnectMarketIndex(&index3));
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 4U);
+    BOOST_CHECK_EQUAL(state.nHeight, 2U);
+    BOOST_CHECK_EQUAL(state.nShares[1], 3 * COIN);
+    BOOST_CHECK_EQUAL(db.GetTrades(marketid).size(), 4U);
+
+    // Pages of the trade index follow its order
+    std::vector<marketTrade> vTrade = db.GetTrades(marketid);
+    std::vector<marketTrade> vPage = db.GetTrades(marketid, 1, 2);
+    BOOST_CHECK_EQUAL(vPage.size(), 2U);
+    BOOST_CHECK(vPage[0].GetHash() == vTrade[1].GetHash());
+    BOOST_CHECK(vPage[1].GetHash() == vTrade[2].GetHash());
+    BOOST_CHECK_EQUAL(db.GetTrades(marketid, 3, 5).size(), 1U);
+    BOOST_CHECK(db.GetTrades(marketid, 4).empty());
+
+    // An index entry without its object, sorting first, is not counted
+    CDBBatch batchDangling(db);
+    batchDangling.WriteKey(std::make_pair(std::make_pair('t', marketid), uint256()));
+    BOOST_CHECK(db.WriteBatch(batchDangling));
+    BOOST_CHECK_EQUAL(db.GetTrades(marketid).size(), 4U);
+    vPage = db.GetTrades(marketid, 1, 2);
+    BOOST_REQUIRE_EQUAL(vPage.size(), 2U);
+    BOOST_CHECK(vPage[0].GetHash() == vTrade[1].GetHash());
+    BOOST_CHECK(vPage[1].GetHash() == vTrade[2].GetHash());
+    BOOST_CHECK(db.GetTrades(marketid, 4).empty());
+    CDBBatch batchErase(db);
+    batchErase.Erase(std::make_pair(std::make_pair('t', marketid), uint256()));
+    BOOST_CHECK(db.WriteBatch(batchErase));
+
+    // Disconnecting block 2 then block 1 restores the earlier states
+    BOOST_CHECK(db.DisconnectMarketIndex(&index2));
+    BOOST_CHECK(db.GetMarketShareState(marketid, state));
+    BOOST_CHECK_EQUAL(state.nTrades, 2U);
+    BOOST_CHECK_EQUAL(state.nHeight, 1U);
+    BOOST_CHECK_EQUAL(state.nShares[0], 5 * COIN);
+
+    BOOST_CHECK(db.DisconnectMarketIndex(&index1));
+    BOOST_CHECK(!db.GetMarketShareState(marketid, state));
+
+    // A block without market undo data is a no-op
+    BOOST_CHECK(db.DisconnectMarketIndex(&index1));
+}
+
+BOOST_AUTO_TEST_CASE(market_script_peek)
+{
+    const uint256 rand = InsecureRand256();
+    const CKeyID keyID(uint160(std::vector<unsigned char>(rand.begin(), rand.begin() + 20)));
+
+    marketDecision decision = MakeDecision(InsecureRand256(), 10);
+    decision.keyID = keyID;
+    marketTrade trade = MakeTrade(InsecureRand256(), true, COIN, 0, 0);
+    trade.keyID = keyID;
+    marketSealedVote sealed;
+    sealed.branchid = InsecureRand256();
+    sealed.height = 10;
+    sealed.voteid = InsecureRand256();
+
+    for (const marketObj *obj : std::vector<const marketObj *>{&decision, &trade, &sealed}) {
+        CScript script = obj->GetScript();
+        CKeyID peeked;
+        BOOST_CHECK_EQUAL(marketObjPeek(script, &peeked), obj->marketop);
+        BOOST_CHECK(script.IsMarketScript());
+
+        std::vector<unsigned char> hashBytes;
+        BOOST_CHECK(script.IsMarketScript(hashBytes));
+        if (obj->marketop == 'S') {
+            BOOST_CHECK(hashBytes.empty());
+        } else {
+            BOOST_CHECK(peeked == keyID);
+            BOOST_CHECK(hashBytes == std::vector<unsigned char>(keyID.begin(), keyID.end()));
+        }
+
+        std::shared_ptr<marketObj> parsed = marketObjCtr(script);
+        BOOST_REQUIRE(parsed);
+        BOOST_CHECK_EQUAL(parsed->marketop, obj->marketop);
+    }
+
+    // Not market scripts
+    BOOST_CHECK(!marketObjPeek(CScript() << OP_MARKET));
+    BOOST_CHECK(!marketObjPeek(CScript() << std::vector<unsigned char>(1, 'X') << OP_MARKET));
+    BOOST_CHECK(!marketObjPeek(CScript() << std::vector<unsigned char>(1, 'S')));
+    CScript truncated;
+    truncated << OP_PUSHDATA1 << OP_MARKET;
+    BOOST_CHECK(!marketObjPeek(truncated));
+    const std::vector<unsigned char> vOverrun = {6, 'S', 'S', 'S', 'S', OP_MARKET};
+    BOOST_CHECK(!marketObjPeek(CScript(vOverrun.begin(), vOverrun.end())));
+
+    // Market scripts as GetOp reads them, whether or not the object decodes:
+    // a trade too short for its keyID, and a push running over the trailing
+    // OP_MARKET
+    CKeyID peeked = keyID;
+    BOOST_CHECK_EQUAL(marketObjPeek(CScript() << std::vector<unsigned char>(10, 'T') << OP_MARKET, &peeked), 'T');
+    BOOST_CHECK(peeked.IsNull());
+    const std::vector<unsigned char> vSwallowed = {5, 'S', 'S', 'S', 'S', OP_MARKET};
+    BOOST_CHECK_EQUAL(marketObjPeek(CScript(vSwallowed.begin(), vSwallowed.end())), 'S');
+    const std::vector<unsigned char> vPushed = {4, 'S', 'S', 'S', 'S', OP_MARKET};
+    BOOST_CHECK_EQUAL(marketObjPeek(CScript(vPushed.begin(), vPushed.end())), 'S');
+}
+
+BOOST_AUTO_TEST_CASE(market_tx_objs)
+{
+    marketDecision decision = MakeDecision(InsecureRand256(), 10);
+    marketTrade trade = MakeTrade(InsecureRand256(), true, COIN, 0, 0);
+
+    CMutableTransaction mtx;
+    mtx.vout.resize(4);
+    mtx.vout[0].scriptPubKey = decision.GetScript();
+    mtx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    mtx.vout[2].scriptPubKey = trade.GetScript();
+    // Truncated trade: classified as a market output but not decodable
+    mtx.vout[3].scriptPubKey = CScript() << std::vector<unsigned char>(30, 'T') << OP_MARKET;
+    for (size_t i = 0; i < mtx.vout.size(); i++)
+        mtx.vout[i].nValue = (i + 1) * COIN;
+    CTransactionRef tx = MakeTransactionRef(mtx);
+
+    const std::vector<std::shared_ptr<const marketObj> >& vObj = tx->GetMarketObjs();
+    BOOST_REQUIRE_EQUAL(vObj.size(), 2U);
+    BOOST_CHECK_EQUAL(vObj[0]->marketop, 'D');
+    BOOST_CHECK(vObj[0]->GetHash() == decision.GetHash());
+    BOOST_CHECK(vObj[0]->txid == tx->GetHash());
+    BOOST_CHECK_EQUAL(vObj[1]->marketop, 'T');
+    BOOST_CHECK(vObj[1]->GetHash() == trade.GetHash());
+    // The truncated trade throws from the decoder, and is dropped above
+    BOOST_CHECK_THROW(marketObjCtr(mtx.vout[3].scriptPubKey), std::ios_base::failure);
+
+    BOOST_CHECK(mtx.vout[3].scriptPubKey.IsMarketScript());
+    BOOST_CHECK(tx->IsMarketOutput(0) && tx->IsMarketOutput(2));
+    BOOST_CHECK(!tx->IsMarketOutput(1) && !tx->IsMarketOutput(3));
+
+    // A market script whose object does not decode invalidates the
+    // transaction rather than counting as an ordinary output
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+    CValidationState state;
+    BOOST_CHECK(tx->HasMalformedMarketOutput());
+    BOOST_CHECK(!CheckTransaction(CTransaction(mtx), state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-market-malformed");
+    CMutableTransaction mtxGood(mtx);
+    mtxGood.vout.pop_back();
+    CValidationState stateGood;
+    BOOST_CHECK(!CTransaction(mtxGood).HasMalformedMarketOutput());
+    BOOST_CHECK(CheckTransaction(CTransaction(mtxGood), stateGood));
+
+    // The coinbase is not refused for it
+    CMutableTransaction mtxCoinbase(mtx);
+    mtxCoinbase.vin[0].prevout.SetNull();
+    mtxCoinbase.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    CValidationState stateCoinbase;
+    BOOST_CHECK(CTransaction(mtxCoinbase).IsCoinBase());
+    BOOST_CHECK(CTransaction(mtxCoinbase).HasMalformedMarketOutput());
+    BOOST_CHECK(CheckTransaction(CTransaction(mtxCoinbase), stateCoinbase));
+
+    // Decoded once, then shared
+    BOOST_CHECK(&tx->GetMarketObjs() == &vObj);
+    BOOST_CHECK(tx->GetMarketObjs()[1] == vObj[1]);
+
+    CTransaction txPlain(CMutableTransaction{});
+    BOOST_CHECK(txPlain.GetMarketObjs().empty());
+}
+
+BOOST_AUTO_TEST_CASE(market_mempool_trades)
+{
+    const uint256 marketid = InsecureRand256();
+    const uint256 otherid = InsecureRand256();
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    // Two trades on the market in one transaction, one on another market
+    CMutableTransaction mtx1;
+    mtx1.vin.resize(1);
+    mtx1.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+    mtx1.vout.resize(3);
+    mtx1.vout[0].scriptPubKey = MakeTrade(marketid, true, 3 * COIN, 0, 1).GetScript();
+    mtx1.vout[1].scriptPubKey = MakeTrade(otherid, true, COIN, 1, 2).GetScript();
+    mtx1.vout[2].scriptPubKey = MakeTrade(marketid, false, COIN, 1, 3).GetScript();
+    CTransactionRef tx1 = MakeTransactionRef(mtx1);
+
+    // and a child spending it with one more
+    CMutableTransaction mtx2;
+    mtx2.vin.resize(1);
+    mtx2.vin[0].prevout = COutPoint(tx1->GetHash(), 0);
+    mtx2.vout.resize(1);
+    mtx2.vout[0].scriptPubKey = MakeTrade(marketid, true, 2 * COIN, 1, 4).GetScript();
+    CTransactionRef tx2 = MakeTransactionRef(mtx2);
+
+    pool.addUnchecked(tx1->GetHash(), entry.FromTx(*tx1));
+    pool.addUnchecked(tx2->GetHash(), entry.FromTx(*tx2));
+    BOOST_CHECK_EQUAL(pool.GetMarketTrades(marketid).size(), 3U);
+    BOOST_CHECK_EQUAL(pool.GetMarketTrades(otherid).size(), 1U);
+    BOOST_CHECK(pool.GetMarketTrades(InsecureRand256()).empty());
+
+    marketShareState state(2);
+    for (const marketTrade& trade : pool.GetMarketTrades(marketid))
+        state.AddTrade(trade, 0);
+    BOOST_CHECK_EQUAL(state.nShares[0], 3 * COIN);
+    BOOST_CHECK_EQUAL(state.nShares[1], COIN);
+
+    // Mining the child drops its trade only
+    std::vector<CTransactionRef> vtx(1, tx2);
+    pool.removeForBlock(vtx, 1);
+    BOOST_CHECK_EQUAL(pool.GetMarketTrades(marketid).size(), 2U);
+
+    // Removing the parent with its descendants drops the rest
+    pool.addUnchecked(tx2->GetHash(), entry.FromTx(*tx2));
+    pool.removeRecursive(*tx1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.GetMarketTrades(marketid).empty());
+    BOOST_CHECK(pool.GetMarketTrades(otherid).empty());
+}
+
+/** Reads the remainder of a key or value stream as raw bytes */
+struct RawEntry {
+    std::string data;
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        data.resize(s.size());
+        if (!data.empty())
+            s.read(&data[0], data.size());
+    }
+};
+
+static std::vector<std::pair<std::string, std::string> > DumpDB(CDBWrapper& db)
+{
+    std::vector<std::pair<std::string, std::string> > vEntry;
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        RawEntry key, value;
+        BOOST_REQUIRE(pcursor->GetKey(key) && pcursor->GetValue(value));
+        vEntry.push_back(std::make_pair(key.data, value.data));
+    }
+    return vEntry;
+}
+
+/** A block of market objects for the reorg test */
+struct MarketTestBlock {
+    uint256 hash;
+    int nHeight;
+    std::vector<std::shared_ptr<marketObj> > vObj;
+
+    explicit MarketTestBlock(int nHeightIn) : hash(InsecureRand256()), nHeight(nHeightIn) {}
+
+    void Add(marketObj *obj) { vObj.push_back(std::shared_ptr<marketObj>(obj)); }
+
+    CBlockIndex GetIndex() const {
+        CBlockIndex index;
+        index.nHeight = nHeight;
+        index.phashBlock = &hash;
+        return index;
+    }
+
+    bool Connect(CMarketTreeDB& db) const {
+        std::vector<std::pair<uint256, const marketObj *> > v;
+        for (const std::shared_ptr<marketObj>& obj : vObj)
+            v.push_back(std::make_pair(obj->GetHash(), obj.get()));
+        CBlockIndex index = GetIndex();
+        return db.WriteMarketIndex(v, &index);
+    }
+
+    bool Disconnect(CMarketTreeDB& db) const {
+        CBlockIndex index = GetIndex();
+        return db.DisconnectMarketIndex(&index);
+    }
+};
+
+/** Build a block at nHeight with a decision, votes for the period ending
+ *  at nHeight and trades on market */
+static MarketTestBlock MakeBlock(int nHeight, const uint256& branchid, const marketMarket& market, uint32_t tau, uint32_t nonce)
+{
+    MarketTestBlock block(nHeight);
+    block.Add(new marketDecision(MakeDecision(branchid, nHeight + 2 * tau)));
+
+    uint32_t height = tau * ((nHeight + tau - 1) / tau);
+    marketSealedVote *sealed = new marketSealedVote;
+    sealed->branchid = branchid;
+    sealed->height = height;
+    sealed->voteid = InsecureRand256();
+    block.Add(sealed);
+    marketRevealVote *reveal = new marketRevealVote;
+    reveal->branchid = branchid;
+    reveal->height = height;
+    reveal->voteid = sealed->GetHash();
+    reveal->NA = nonce;
+    block.Add(reveal);
+
+    block.Add(new marketTrade(MakeTrade(market.GetHash(), nonce % 2, (nonce + 1) * COIN, nonce % 2, nonce)));
+    if (nHeight % tau == 0) {
+        marketOutcome *outcome = new marketOutcome;
+        outcome->nHeight = nHeight;
+        outcome->branchid = branchid;
+        outcome->nVoters = 0;
+        outcome->nDecisions = 0;
+        outcome->NA = nonce;
+        outcome->alpha = 0;
+        outcome->tol = 0;
+        block.Add(outcome);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(market_index_reorg)
+{
+    const uint32_t tau = 5;
+    const uint256 branchid = InsecureRand256();
+
+    marketMarket market;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 100;
+    market.decisionIDs.push_back(InsecureRand256());
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+
+    // Common history: heights 1..3, the first block creates the market
+    std::vector<MarketTestBlock> vCommon;
+    for (int h = 1; h <= 3; h++)
+        vCommon.push_back(MakeBlock(h, branchid, market, tau, h));
+    vCommon[0].Add(new marketMarket(market));
+
+    // Two forks crossing the tau boundary at height 5
+    std::vector<MarketTestBlock> vForkA, vForkB;
+    for (int h = 4; h <= 7; h++)
+        vForkA.push_back(MakeBlock(h, branchid, market, tau, 100 + h));
+    for (int h = 4; h <= 8; h++)
+        vForkB.push_back(MakeBlock(h, branchid, market, tau, 200 + h));
+    // Fork A repeats a trade of the common history, which must survive
+    // the disconnect of fork A
+    vForkA[0].Add(new marketTrade(MakeTrade(market.GetHash(), true, 2 * COIN, 1, 1)));
+
+    // The share state expected after each connect, counting each trade
+    // the first time it is indexed
+    std::set<uint256> setTraded;
+    marketShareState expected(marketNStates(market));
+    auto ConnectAndCheck = [&](CMarketTreeDB& dbIn, const MarketTestBlock& block) {
+        BOOST_CHECK(block.Connect(dbIn));
+        for (const std::shared_ptr<marketObj>& obj : block.vObj) {
+            if (obj->marketop == 'T' && setTraded.insert(obj->GetHash()).second)
+                expected.AddTrade(*(const marketTrade *) obj.get(), block.nHeight);
+        }
+        marketShareState state;
+        BOOST_CHECK(dbIn.GetMarketShareState(market.GetHash(), state));
+        BOOST_CHECK_EQUAL(state.nTrades, expected.nTrades);
+        BOOST_CHECK_EQUAL(state.nHeight, expected.nHeight);
+        BOOST_CHECK(state.nShares == expected.nShares);
+    };
+
+    CMarketTreeDB db(1 << 20, true, true);
+    for (const MarketTestBlock& block : vCommon)
+        ConnectAndCheck(db, block);
+    std::vector<std::pair<std::string, std::string> > vCommonDump = DumpDB(db);
+    const std::set<uint256> setCommonTraded = setTraded;
+    const marketShareState commonState = expected;
+
+    std::vector<marketShareState> vStateA;
+    for (const MarketTestBlock& block : vForkA) {
+        vStateA.push_back(expected);
+        ConnectAndCheck(db, block);
+    }
+    BOOST_CHECK_EQUAL(db.GetOutcomes(branchid).size(), 1U);
+    // The repeated trade is not counted again
+    BOOST_CHECK_EQUAL(expected.nTrades, vCommon.size() + vForkA.size());
+
+    // Each disconnect restores the share state from before the block
+    for (size_t i = vForkA.size(); i-- > 0; ) {
+        BOOST_CHECK(vForkA[i].Disconnect(db));
+        marketShareState state;
+        BOOST_CHECK(db.GetMarketShareState(market.GetHash(), state));
+        BOOST_CHECK_EQUAL(state.nTrades, vStateA[i].nTrades);
+        BOOST_CHECK_EQUAL(state.nHeight, vStateA[i].nHeight);
+        BOOST_CHECK(state.nShares == vStateA[i].nShares);
+    }
+    BOOST_CHECK(DumpDB(db) == vCommonDump);
+
+    setTraded = setCommonTraded;
+    expected = commonState;
+    for (const MarketTestBlock& block : vForkB)
+        ConnectAndCheck(db, block);
+
+    // The reorged index matches one built from scratch on fork B
+    CMarketTreeDB dbFresh(1 << 20, true, true);
+    for (const MarketTestBlock& block : vCommon)
+        BOOST_CHECK(block.Connect(dbFresh));
+    for (const MarketTestBlock& block : vForkB)
+        BOOST_CHECK(block.Connect(dbFresh));
+    BOOST_CHECK(DumpDB(db) == DumpDB(dbFresh));
+
+    BOOST_CHECK_EQUAL(db.GetOutcomes(branchid).size(), 1U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 5).size(), 5U);
+    BOOST_CHECK_EQUAL(db.GetRevealVotes(branchid, 10).size(), 3U);
+    marketShareState state;
+    BOOST_CHECK(db.GetMarketShareState(market.GetHash(), state));
+    BOOST_CHECK_EQUAL(state.nTrades, 8U);
+    BOOST_CHECK_EQUAL(state.nHeight, 8U);
+}
+
+BOOST_AUTO_TEST_CASE(market_index_key_only)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+
+    marketMarket market;
+    market.title = std::string(200, 't');
+    market.description = std::string(2000, 'd');
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 100;
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+    for (int i = 0; i < 3; i++)
+        market.decisionIDs.push_back(InsecureRand256());
+    marketTrade trade = MakeTrade(market.GetHash(), true, COIN, 1, 1);
+
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    vObj.push_back(std::make_pair(market.GetHash(), &market));
+    vObj.push_back(std::make_pair(trade.GetHash(), &trade));
+    BOOST_CHECK(db.WriteMarketIndex(vObj));
+
+    // The object is stored once, the secondary entries are only keys
+    for (char op : {'m', 't'}) {
+        std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+        size_t nEntries = 0;
+        for (pcursor->SeekPrefix(op); pcursor->Valid(); pcursor->Next(), nEntries++)
+            BOOST_CHECK_EQUAL(pcursor->GetValueSize(), 0U);
+        BOOST_CHECK_EQUAL(nEntries, (op == 'm') ? 3U : 1U);
+    }
+    for (const uint256& decisionid : market.decisionIDs) {
+        std::vector<marketMarket> vMarket = db.GetMarkets(decisionid);
+        BOOST_CHECK_EQUAL(vMarket.size(), 1U);
+        BOOST_CHECK(vMarket.size() && vMarket[0].description == market.description);
+    }
+    BOOST_CHECK_EQUAL(db.GetTrades(market.GetHash()).size(), 1U);
+
+    // Entries written with a copy of the object are trimmed by the upgrade
+    CDBBatch batch(db);
+    batch.Write(std::make_pair(std::make_pair('m', market.decisionIDs[0]), market.GetHash()), std::make_pair(market, uint256()));
+    BOOST_CHECK(db.WriteBatch(batch));
+    db.WriteFlag("keyonlyindex", false);
+    BOOST_CHECK(db.Upgrade());
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekPrefix('m'); pcursor->Valid(); pcursor->Next())
+        BOOST_CHECK_EQUAL(pcursor->GetValueSize(), 0U);
+    BOOST_CHECK_EQUAL(db.GetMarkets(market.decisionIDs[0]).size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(market_cache)
+{
+    CMarketTreeDB db(1 << 20, true, true);
+    CMarketCache& cache = db.GetCache();
+    const uint256 branchid = InsecureRand256();
+    const marketDecision decision = MakeDecision(branchid, 10);
+
+    marketMarket market;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 100;
+    market.decisionIDs.push_back(decision.GetHash());
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+    marketMarket marketOther = market;
+    marketOther.title = "other";
+
+    MarketTestBlock block1(1);
+    block1.Add(new marketDecision(decision));
+    block1.Add(new marketMarket(market));
+    BOOST_CHECK(block1.Connect(db));
+
+    // A miss fills the cache, the same read again is all hits
+    BOOST_CHECK_EQUAL(db.GetMarkets(decision.GetHash()).size(), 1U);
+    uint64_t nMisses = cache.GetMisses();
+    uint64_t nHits = cache.GetHits();
+    BOOST_CHECK_EQUAL(db.GetMarkets(decision.GetHash()).size(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), nMisses);
+    BOOST_CHECK_EQUAL(cache.GetHits(), nHits + 2);
+    BOOST_CHECK_EQUAL(db.GetDecisions(branchid).size(), 1U);
+    BOOST_CHECK(cache.Size() > 0);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= cache.GetMaxUsage());
+
+    // Connecting a block updates the lists and share states it touches
+    MarketTestBlock block2(2);
+    block2.Add(new marketMarket(marketOther));
+    block2.Add(new marketTrade(MakeTrade(market.GetHash(), true, COIN, 1, 1)));
+    BOOST_CHECK(block2.Connect(db));
+    BOOST_CHECK_EQUAL(db.GetMarkets(decision.GetHash()).size(), 2U);
+    marketShareState state;
+    nMisses = cache.GetMisses();
+    BOOST_CHECK(db.GetMarketShareState(market.GetHash(), state));
+    BOOST_CHECK_EQUAL(cache.GetMisses(), nMisses);
+    BOOST_CHECK_EQUAL(state.nTrades, 1U);
+
+    // Disconnecting it leaves nothing of it behind
+    BOOST_CHECK(block2.Disconnect(db));
+    BOOST_CHECK_EQUAL(db.GetMarkets(decision.GetHash()).size(), 1U);
+    BOOST_CHECK(!db.GetMarket(marketOther.GetHash(), marketOther));
+    BOOST_CHECK(!db.GetMarketShareState(market.GetHash(), state));
+
+    // Entries are evicted to stay within the limit
+    cache.SetMaxUsage(1);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    BOOST_CHECK_EQUAL(db.GetMarkets(decision.GetHash()).size(), 1U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0U);
+
+    // A zero sized cache holds nothing
+    CMarketTreeDB dbNoCache(1 << 20, true, true, 0);
+    BOOST_CHECK(block1.Connect(dbNoCache));
+    BOOST_CHECK_EQUAL(dbNoCache.GetMarkets(decision.GetHash()).size(), 1U);
+    BOOST_CHECK_EQUAL(dbNoCache.GetCache().Size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(market_index_batch)
+{
+    const uint32_t tau = 5;
+    const uint256 branchid = InsecureRand256();
+
+    marketMarket market;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 100;
+    market.decisionIDs.push_back(InsecureRand256());
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+
+    // The market is created after the first trades on it are seen, and
+    // traded on again over several blocks
+    std::vector<MarketTestBlock> vBlock;
+    for (int h = 1; h <= 12; h++)
+        vBlock.push_back(MakeBlock(h, branchid, market, tau, h));
+    vBlock[2].Add(new marketMarket(market));
+
+    CMarketTreeDB db(1 << 20, true, true);
+    for (const MarketTestBlock& block : vBlock)
+        BOOST_CHECK(block.Connect(db));
+
+    // One batch of all the blocks leaves the same index, undo data included
+    CMarketTreeDB dbBatch(1 << 20, true, true);
+    CMarketIndexBatch batch(dbBatch);
+    std::vector<CBlockIndex> vIndex;
+    for (const MarketTestBlock& block : vBlock)
+        vIndex.push_back(block.GetIndex());
+    for (size_t i = 0; i < vBlock.size(); i++) {
+        std::vector<std::pair<uint256, const marketObj *> > v;
+        for (const std::shared_ptr<marketObj>& obj : vBlock[i].vObj)
+            v.push_back(std::make_pair(obj->GetHash(), obj.get()));
+        batch.Add(v, &vIndex[i]);
+    }
+    BOOST_CHECK(batch.Write());
+    BOOST_CHECK(DumpDB(db) == DumpDB(dbBatch));
+
+    // and disconnects the same way
+    for (auto it = vBlock.rbegin(); it != vBlock.rbegin() + 6; it++) {
+        BOOST_CHECK(it->Disconnect(db));
+        BOOST_CHECK(it->Disconnect(dbBatch));
+    }
+    BOOST_CHECK(DumpDB(db) == DumpDB(dbBatch));
+    marketShareState state;
+    BOOST_CHECK(dbBatch.GetMarketShareState(market.GetHash(), state));
+    BOOST_CHECK_EQUAL(state.nHeight, 6U);
+}
+
+BOOST_AUTO_TEST_CASE(market_block_trade_selection)
+{
+    marketMarket market;
+    market.B = COIN;
+    market.maxCommission = 0;
+    market.decisionIDs.push_back(InsecureRand256());
+    const uint256 marketid = market.GetHash();
+
+    // Priced at the cost of one share on the empty market, plus a satoshi
+    int64_t nShares[2] = {0, 0};
+    int64_t curr = marketAccountValueFixed(0, COIN, 2, nShares);
+    nShares[1] = COIN;
+    uint64_t price = marketAccountValueFixed(0, COIN, 2, nShares) - curr + 1;
+
+    marketTrade buy = MakeTrade(marketid, true, COIN, 1, 1);
+    buy.price = price;
+    marketTrade buy2 = buy;
+    buy2.nonce = 2;
+    marketTrade sell = MakeTrade(marketid, false, COIN, 1, 3);
+    sell.price = 0;
+    marketTrade badState = MakeTrade(marketid, true, COIN, 2, 4);
+    marketTrade unknown = MakeTrade(InsecureRand256(), true, COIN, 7, 5);
+    unknown.price = 0;
+
+    BlockMarketState state;
+    BOOST_CHECK(!state.HasMarket(marketid));
+    state.SetMarket(marketid, &market, marketShareState());
+    state.SetMarket(unknown.marketid, nullptr, marketShareState());
+    BOOST_CHECK(state.HasMarket(marketid));
+
+    // The first buy meets its price, the same buy after it does not
+    BOOST_CHECK(state.AddTrades(std::vector<const marketTrade*>(1, &buy)));
+    BOOST_CHECK(!state.AddTrades(std::vector<const marketTrade*>(1, &buy2)));
+    // unless a sell before it in its package brings the price back down
+    std::vector<const marketTrade*> vPackage = {&sell, &buy2};
+    BOOST_CHECK(state.AddTrades(vPackage));
+
+    // A refused package leaves the state as it was: the sell is not added
+    vPackage = {&sell, &badState};
+    BOOST_CHECK(!state.AddTrades(vPackage));
+    BOOST_CHECK(!state.AddTrades(std::vector<const marketTrade*>(1, &buy)));
+    BOOST_CHECK_EQUAL(state.GetSkipped(), 3U);
+
+    // Trades on markets without a state are not priced
+    BOOST_CHECK(state.AddTrades(std::vector<const marketTrade*>(1, &unknown)));
+
+    state.Clear();
+    BOOST_CHECK(!state.HasMarket(marketid));
+    BOOST_CHECK_EQUAL(state.GetSkipped(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(market_account_value)
+{
+    const uint32_t nStates = 4;
+    const double B = 2.5;
+
+    // No shares: B log N, LS or not
+    BOOST_CHECK_CLOSE(marketAccountValue(0.0, B, nStates, NULL), B * std::log(4.0), 1e-9);
+    std::vector<double> zero(nStates, 0.0);
+    BOOST_CHECK_CLOSE(marketAccountValue(0.0, B, nStates, zero.data()), B * std::log(4.0), 1e-9);
+
+    // Shares far beyond exp's range stay finite: the largest state dominates
+    std::vector<double> big = {1e6, 2e6, 3e6, 3e6};
+    double value = marketAccountValue(0.0, B, nStates, big.data());
+    BOOST_CHECK(std::isfinite(value));
+    BOOST_CHECK_CLOSE(value, 3e6 + B * std::log(2.0), 1e-9);
+
+    // Batch quotes price exactly as pairwise fixed-point account values,
+    // whether a trade leaves the largest state in place, ties it, or moves it
+    const uint64_t nB = 250000000;
+    const std::vector<std::vector<int64_t> > vShares = {
+        {300000000, 0, 12000000000, 750000000},
+        {12000000000, 0, 12000000000, 750000000},
+    };
+    for (uint64_t maxCommission : {(uint64_t)0, (uint64_t)5000000}) {
+        for (const std::vector<int64_t>& nShares : vShares) {
+            std::vector<uint32_t> states;
+            std::vector<int64_t> dShares;
+            for (uint32_t s = 0; s <= nStates; s++) {
+                for (int64_t d : {100000000LL, -100000000LL, 5000000000LL, 1LL, -2000000000LL}) {
+                    states.push_back(s);
+                    dShares.push_back(d);
+                }
+            }
+            std::vector<int64_t> costs(states.size());
+            marketQuoteTradesFixed(maxCommission, nB, nStates, nShares.data(), states.size(),
+                states.data(), dShares.data(), costs.data());
+
+            int64_t curr = marketAccountValueFixed(maxCommission, nB, nStates, nShares.data());
+            for (size_t j = 0; j < states.size(); j++) {
+                // States past the end are not priced
+                if (states[j] >= nStates) {
+                    BOOST_CHECK_EQUAL(costs[j], 0);
+                    continue;
+                }
+                std::vector<int64_t> next = nShares;
+                next[states[j]] += dShares[j];
+                BOOST_CHECK_EQUAL(costs[j], marketAccountValueFixed(maxCommission, nB, nStates, next.data()) - curr);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(market_fixed_exp_log)
+{
+    const int64_t ONE = MARKET_FIXED_ONE;
+
+    // Pinned results: these are consensus values and must never change
+    BOOST_CHECK_EQUAL(marketFixedExp(0), ONE);
+    BOOST_CHECK_EQUAL(marketFixedExp(-ONE), 1580030168);
+    BOOST_CHECK_EQUAL(marketFixedExp(-5 * ONE / 2), 352552384);
+    BOOST_CHECK_EQUAL(marketFixedExp(20 * ONE), 2083768644340285440);
+    BOOST_CHECK_EQUAL(marketFixedExp(31 * ONE), INT64_MAX);
+    BOOST_CHECK_EQUAL(marketFixedExp(-30 * ONE), 0);
+    BOOST_CHECK_EQUAL(marketFixedLog(ONE), 0);
+    BOOST_CHECK_EQUAL(marketFixedLog(2 * ONE), 2977044472);
+    BOOST_CHECK_EQUAL(marketFixedLog(10 * ONE), 9889527671);
+    BOOST_CHECK_EQUAL(marketFixedLog(1000000 * ONE), 59337166027);
+    BOOST_CHECK_EQUAL(marketFixedLog(ONE / 3), -4718503852);
+    BOOST_CHECK_EQUAL(marketFixedLog(0), INT64_MIN);
+
+    int64_t q[4] = {300000000, 0, 400000000, 750000000};
+    BOOST_CHECK_EQUAL(marketAccountValueFixed(0, 250000000, 4, q), 844897114);
+    BOOST_CHECK_EQUAL(marketAccountValueFixed(5000000, 250000000, 4, q), 750000000);
+    BOOST_CHECK_EQUAL(marketAccountValueFixed(0, 250000000, 4, NULL), 346573590);
+
+    // Within a few units of the last place of libm
+    for (int64_t x = -22 * ONE; x < 21 * ONE; x += ONE / 7 + 12345) {
+        double expected = std::exp((double)x / ONE);
+        double err = std::fabs(marketFixedExp(x) - expected * ONE) / ONE;
+        BOOST_CHECK_SMALL(err / std::max(1.0, expected), 4e-9);
+    }
+    for (int64_t x = ONE / 1000; x < ((int64_t)1 << 62); x += x / 5 + 1) {
+        double expected = std::log((double)x / ONE);
+        BOOST_CHECK_SMALL((double)marketFixedLog(x) / ONE - expected, 4e-9);
+    }
+
+    // And within a unit of the floating point account value
+    double qd[4] = {3.0, 0.0, 4.0, 7.5};
+    BOOST_CHECK_SMALL(1e-8 * marketAccountValueFixed(0, 250000000, 4, q)
+        - marketAccountValue(0.0, 2.5, 4, qd), 2e-8);
+
+    // A buy pays for its cost at its price a share, plus a satoshi
+    BOOST_CHECK(marketPriceCovers(150, COIN, 149));
+    BOOST_CHECK(!marketPriceCovers(151, COIN, 149));
+    BOOST_CHECK(marketPriceCovers(75, COIN / 2, 149));
+    BOOST_CHECK(!marketPriceCovers(76, COIN / 2, 149));
+    BOOST_CHECK(marketPriceCovers(-5, 0, 0));
+    BOOST_CHECK(!marketPriceCovers(1, 0, 5));
+    // without overflowing
+    BOOST_CHECK(marketPriceCovers(INT64_MAX, UINT64_MAX / 2, UINT64_MAX / 2));
+    BOOST_CHECK(marketPriceCovers(INT64_MAX, UINT64_MAX, UINT64_MAX));
+    BOOST_CHECK(!marketPriceCovers(INT64_MAX, 3 * COIN, 3 * COIN));
+}
+
+BOOST_AUTO_TEST_CASE(market_trade_payout)
+{
+    // A binary decision pays the state it resolved to in full
+    const std::vector<uint64_t> binary = {0}, zero = {0}, one = {COIN};
+    BOOST_CHECK_EQUAL(marketTradePayout(3 * COIN, 1, one, binary, zero, one), 3 * COIN);
+    BOOST_CHECK_EQUAL(marketTradePayout(3 * COIN, 0, one, binary, zero, one), 0U);
+    BOOST_CHECK_EQUAL(marketTradePayout(3 * COIN, 0, zero, binary, zero, one), 3 * COIN);
+    BOOST_CHECK_EQUAL(marketTradePayout(3 * COIN, 1, zero, binary, zero, one), 0U);
+
+    // A scaled decision on [0, 300] that resolved to 100 pays a third of the
+    // shares to the high state and two thirds to the low one, in satoshis
+    const std::vector<uint64_t> scaled = {1}, mins = {0}, maxs = {300}, finals = {100};
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 1, finals, scaled, mins, maxs), 33333333U);
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 0, finals, scaled, mins, maxs), 66666666U);
+    BOOST_CHECK_EQUAL(marketTradePayout(3, 1, finals, scaled, mins, maxs), 1U);
+    // without overflowing the product
+    BOOST_CHECK_EQUAL(marketTradePayout(UINT64_MAX / 3 * 3, 0, finals, scaled, mins, maxs), UINT64_MAX / 3 * 2);
+    // and a final value past the range pays as its end
+    const std::vector<uint64_t> past = {400};
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 1, past, scaled, mins, maxs), (uint64_t)COIN);
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 0, past, scaled, mins, maxs), 0U);
+
+    // Decisions multiply: the scaled fraction, then the binary all or nothing
+    const std::vector<uint64_t> finals2 = {100, COIN}, scaled2 = {1, 0}, mins2 = {0, 0}, maxs2 = {300, COIN};
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 3, finals2, scaled2, mins2, maxs2), 33333333U);
+    BOOST_CHECK_EQUAL(marketTradePayout(COIN, 1, finals2, scaled2, mins2, maxs2), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(market_outcome_cache)
+{
+    // The outcome code reads the global market index
+    pmarkettree.reset(new CMarketTreeDB(1 << 20, true, true));
+    outcomeCache.Clear();
+
+    marketBranch branch;
+    branch.name = "branch";
+    branch.description = "";
+    branch.baseListingFee = 0;
+    branch.freeDecisions = 0;
+    branch.targetDecisions = 0;
+    branch.maxDecisions = 0;
+    branch.minTradingFee = 0;
+    branch.tau = 10;
+    branch.ballotTime = 0;
+    branch.unsealTime = 0;
+    branch.consensusThreshold = 0;
+    branch.alpha = 0;
+    branch.tol = 0;
+    const uint256 branchid = branch.GetHash();
+
+    marketDecision decision = MakeDecision(branchid, 20);
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    vObj.push_back(std::make_pair(decision.GetHash(), &decision));
+    BOOST_CHECK(pmarkettree->WriteMarketIndex(vObj));
+
+    // Outcomes are keyed by the tip the block builds on
+    uint256 hash14 = InsecureRand256(), hash19 = InsecureRand256(), hash19b = InsecureRand256();
+    CBlockIndex index14, index19, index19b;
+    index14.nHeight = 14;
+    index14.phashBlock = &hash14;
+    index19.nHeight = 19;
+    index19.phashBlock = &hash19;
+    index19b.nHeight = 19;
+    index19b.phashBlock = &hash19b;
+
+    LOCK(cs_main);
+
+    // Nothing is due off the tau boundaries
+    chainActive.SetTip(&index14);
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index14).empty());
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 0U);
+
+    // A miss computes the same outputs as the miner would, a hit reuses them
+    chainActive.SetTip(&index19);
+    std::vector<CTxOut> vDirect;
+    getBranchOutcome(vDirect, branch, 20);
+    BOOST_CHECK(!vDirect.empty());
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 1U);
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 1U);
+
+    // A block built on anything but the tip is not served from the cache
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19b) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 1U);
+
+    // A different tip at the same height does not reuse the entry
+    chainActive.SetTip(&index19b);
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19b) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 2U);
+
+    // A reveal vote comes with a new block, so a new tip and a new entry
+    uint256 hash19c = InsecureRand256();
+    CBlockIndex index19c;
+    index19c.nHeight = 19;
+    index19c.phashBlock = &hash19c;
+    marketRevealVote vote;
+    vote.branchid = branchid;
+    vote.height = 20;
+    vote.decisionIDs.push_back(decision.GetHash());
+    vote.decisionVotes.push_back(COIN);
+    vote.NA = 2016;
+    vObj.clear();
+    vObj.push_back(std::make_pair(vote.GetHash(), &vote));
+    BOOST_CHECK(pmarkettree->WriteMarketIndex(vObj));
+    chainActive.SetTip(&index19c);
+
+    vDirect.clear();
+    getBranchOutcome(vDirect, branch, 20);
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19c) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 3U);
+
+    // Every write to the index is counted
+    const uint64_t nWriteCount = pmarkettree->GetWriteCount();
+    vObj.clear();
+    vObj.push_back(std::make_pair(branchid, &branch));
+    BOOST_CHECK(pmarkettree->WriteMarketIndex(vObj));
+    BOOST_CHECK_EQUAL(pmarkettree->GetWriteCount(), nWriteCount + 1);
+
+    // Precomputing only fills the cache for the active tip
+    outcomeCache.Clear();
+    outcomeCache.Precompute(&index19b);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 0U);
+    outcomeCache.Precompute(&index19c);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 1U);
+    BOOST_CHECK(outcomeCache.GetOutcomeOutputs(branch, &index19c) == vDirect);
+    BOOST_CHECK_EQUAL(outcomeCache.Size(), 1U);
+
+    chainActive.SetTip(nullptr);
+    outcomeCache.Clear();
+    pmarkettree.reset();
+}
+
+BOOST_AUTO_TEST_CASE(market_outcome_payouts)
+{
+    pmarkettree.reset(new CMarketTreeDB(1 << 20, true, true));
+
+    marketBranch branch;
+    branch.name = "payouts";
+    branch.description = "";
+    branch.baseListingFee = 0;
+    branch.freeDecisions = 0;
+    branch.targetDecisions = 0;
+    branch.maxDecisions = 0;
+    branch.minTradingFee = 0;
+    branch.tau = 10;
+    branch.ballotTime = 0;
+    branch.unsealTime = 0;
+    branch.consensusThreshold = 0;
+    branch.alpha = 0;
+    branch.tol = 0;
+    const uint256 branchid = branch.GetHash();
+
+    // A decision of this period, and a market on it that ends with it
+    marketDecision decision = MakeDecision(branchid, 20);
+    marketMarket market;
+    market.B = COIN;
+    market.tradingFee = 0;
+    market.maxCommission = 0;
+    market.maturation = 20;
+    market.branchid = branchid;
+    market.decisionIDs.push_back(decision.GetHash());
+    market.txPoWh = 0;
+    market.txPoWd = 0;
+    const uint256 marketid = market.GetHash();
+
+    // Buys of either state, and three voters who all vote yes
+    const CKeyID keyYes(uint160(insecure_rand_ctx.randbytes(20)));
+    const CKeyID keyNo(uint160(insecure_rand_ctx.randbytes(20)));
+    marketTrade tradeYes = MakeTrade(marketid, true, 3 * COIN, 1, 0);
+    tradeYes.keyID = keyYes;
+    marketTrade tradeNo = MakeTrade(marketid, true, 2 * COIN, 0, 1);
+    tradeNo.keyID = keyNo;
+    std::vector<marketRevealVote> votes(3);
+    for (marketRevealVote& vote : votes) {
+        vote.branchid = branchid;
+        vote.height = 20;
+        vote.voteid = InsecureRand256();
+        vote.decisionIDs.push_back(decision.GetHash());
+        vote.decisionVotes.push_back(COIN);
+        vote.NA = 2016;
+        vote.keyID = CKeyID(uint160(insecure_rand_ctx.randbytes(20)));
+    }
+
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    vObj.push_back(std::make_pair(decision.GetHash(), &decision));
+    vObj.push_back(std::make_pair(marketid, &market));
+    vObj.push_back(std::make_pair(tradeYes.GetHash(), &tradeYes));
+    vObj.push_back(std::make_pair(tradeNo.GetHash(), &tradeNo));
+    for (const marketRevealVote& vote : votes)
+        vObj.push_back(std::make_pair(vote.GetHash(), &vote));
+    BOOST_CHECK(pmarkettree->WriteMarketIndex(vObj));
+
+    // The market's decision is found in the outcome of this height, so the
+    // winning buy is paid its shares and the losing one nothing
+    std::vector<CTxOut> vout;
+    getBranchOutcome(vout, branch, 20);
+    const CScript scriptYes = CScript() << OP_DUP << OP_HASH160 << ToByteVector(keyYes) << OP_EQUALVERIFY << OP_CHECKSIG;
+    const CScript scriptNo = CScript() << OP_DUP << OP_HASH160 << ToByteVector(keyNo) << OP_EQUALVERIFY << OP_CHECKSIG;
+    int nYes = 0;
+    for (const CTxOut& txout : vout) {
+        BOOST_CHECK(txout.scriptPubKey != scriptNo);
+        if (txout.scriptPubKey == scriptYes) {
+            BOOST_CHECK_EQUAL(txout.nValue, 3 * COIN);
+            nYes++;
+        }
+    }
+    BOOST_CHECK_EQUAL(nYes, 1);
+    BOOST_REQUIRE(!vout.empty());
+    BOOST_CHECK_EQUAL(marketObjPeek(vout.back().scriptPubKey), 'O');
+
+    pmarkettree.reset();
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_mat_storage)
+{
+    // Rows are padded to whole cache lines and start aligned
+    struct tc_mat *A = tc_mat_ctr(3, 5);
+    BOOST_CHECK_EQUAL(A->stride, 8U);
+    for (uint32_t i = 0; i < A->nr; i++) {
+        BOOST_CHECK_EQUAL((uintptr_t)tc_mat_row(A, i) % TC_MAT_ALIGN, 0U);
+        for (uint32_t j = 0; j < A->nc; j++)
+            TC_MAT_AT(A, i, j) = 10.0 * i + j;
+    }
+
+    struct tc_mat *B = tc_mat_ctr(0, 0);
+    tc_mat_transpose(B, A);
+    BOOST_CHECK_EQUAL(B->nr, 5U);
+    BOOST_CHECK_EQUAL(B->nc, 3U);
+    BOOST_CHECK_EQUAL(TC_MAT_AT(B, 4, 2), 24.0);
+    tc_mat_transpose(B, B);
+    for (uint32_t i = 0; i < A->nr; i++)
+        for (uint32_t j = 0; j < A->nc; j++)
+            BOOST_CHECK_EQUAL(TC_MAT_AT(B, i, j), TC_MAT_AT(A, i, j));
+    tc_mat_dtr(B);
+    tc_mat_dtr(A);
+
+    // Every voter gets their own reputation row back from the outcome
+    marketOutcome outcome;
+    outcome.nVoters = 4;
+    outcome.nDecisions = 3;
+    outcome.NA = 2016;
+    // calc() takes alpha and tol unscaled
+    outcome.alpha = 1;
+    outcome.tol = 0;
+    outcome.oldRep.assign(outcome.nVoters, COIN / outcome.nVoters);
+    outcome.isScaled.assign(outcome.nDecisions, 0);
+    uint64_t votes[4][3] = {{COIN, COIN, 0}, {COIN, COIN, 0}, {COIN, COIN, 0}, {0, 0, COIN}};
+    std::vector<uint64_t> voteMatrix;
+    for (uint32_t i = 0; i < outcome.nVoters; i++)
+        for (uint32_t j = 0; j < outcome.nDecisions; j++)
+            voteMatrix.push_back(votes[i][j]);
+    outcome.SetVoteMatrix(voteMatrix);
+    BOOST_CHECK_EQUAL(outcome.calc(), 0);
+    BOOST_CHECK_EQUAL(outcome.smoothedRep.size(), 4U);
+    uint64_t sumRep = 0;
+    for (uint64_t rep : outcome.smoothedRep)
+        sumRep += rep;
+    BOOST_CHECK(sumRep > COIN - 10 && sumRep <= COIN);
+    BOOST_CHECK(outcome.smoothedRep[0] == outcome.smoothedRep[1]);
+    BOOST_CHECK(outcome.smoothedRep[3] < outcome.smoothedRep[0]);
+    BOOST_CHECK_EQUAL(outcome.decisionsFinal[0], (uint64_t)COIN);
+    BOOST_CHECK_EQUAL(outcome.decisionsFinal[2], 0U);
+}
+
+static marketRevealVote MakeRevealVote(const uint256& branchid, uint8_t nKey,
+    const std::vector<uint256>& vDecision, const std::vector<uint64_t>& vVote)
+{
+    marketRevealVote vote;
+    vote.branchid = branchid;
+    vote.height = 20;
+    vote.decisionIDs = vDecision;
+    vote.decisionVotes = vVote;
+    vote.NA = 2016;
+    std::vector<unsigned char> vKey(20, nKey);
+    vote.keyID = CKeyID(uint160(vKey));
+    return vote;
+}
+
+BOOST_AUTO_TEST_CASE(market_vote_matrix)
+{
+    const uint256 branchid = InsecureRand256();
+    const uint256 d0 = InsecureRand256(), d1 = InsecureRand256(), d2 = InsecureRand256();
+
+    marketOutcome outcome;
+    outcome.decisionIDs = {d0, d1, d2};
+    outcome.nDecisions = 3;
+    outcome.isScaled.assign(3, 0);
+    outcome.NA = 2016;
+    outcome.alpha = 1;
+    outcome.tol = 0;
+
+    // Written to the index and read back through the cursor, in key order
+    std::vector<marketRevealVote> vVote;
+    // Decisions in any order
+    vVote.push_back(MakeRevealVote(branchid, 1, {d2, d0, d1}, {0, COIN, COIN}));
+    // A missing decision is NA, an unknown one is ignored
+    vVote.push_back(MakeRevealVote(branchid, 2, {d1, InsecureRand256(), d0}, {COIN, 0, COIN}));
+    // Ids and votes that do not pair up leave the row NA
+    vVote.push_back(MakeRevealVote(branchid, 3, {d0, d1}, {COIN}));
+    vVote.push_back(MakeRevealVote(branchid, 4, {d0, d1, d2}, {0, 0, COIN}));
+    vVote.push_back(MakeRevealVote(branchid, 5, {d0, d1, d2}, {COIN, COIN, 0}));
+    CMarketTreeDB db(1 << 20, true, true);
+    std::vector<std::pair<uint256, const marketObj *> > vObj;
+    for (const marketRevealVote& vote : vVote)
+        vObj.push_back(std::make_pair(vote.GetHash(), &vote));
+    BOOST_CHECK(db.WriteMarketIndex(vObj));
+
+    marketVoteMatrix voteMatrix(outcome);
+    size_t nRead = 0;
+    db.ForEachRevealVote(branchid, 20, [&](const marketRevealVote& vote) {
+        voteMatrix.AddVote(vote);
+        nRead++;
+    });
+    BOOST_CHECK_EQUAL(nRead, vVote.size());
+    BOOST_CHECK_EQUAL(outcome.nVoters, vVote.size());
+    BOOST_CHECK(outcome.IsVoteMatrixValid());
+    // Only the votes are kept: 3 + 2 + 0 + 3 + 3
+    BOOST_CHECK_EQUAL(outcome.voteValues.size(), 11U);
+    std::vector<uint64_t> vDense = outcome.GetVoteMatrix();
+    BOOST_CHECK_EQUAL(vDense.size(), vVote.size() * 3);
+
+    std::map<CKeyID, std::vector<uint64_t> > mapExpected;
+    mapExpected[vVote[0].keyID] = {COIN, COIN, 0};
+    mapExpected[vVote[1].keyID] = {COIN, COIN, 2016};
+    mapExpected[vVote[2].keyID] = {2016, 2016, 2016};
+    mapExpected[vVote[3].keyID] = {0, 0, COIN};
+    mapExpected[vVote[4].keyID] = {COIN, COIN, 0};
+    for (uint32_t i = 0; i < outcome.nVoters; i++) {
+        std::vector<uint64_t> vRow(vDense.begin() + i * 3, vDense.begin() + (i + 1) * 3);
+        BOOST_CHECK(vRow == mapExpected[outcome.voterIDs[i]]);
+    }
+
+    // Revealing again replaces the voter's row
+    voteMatrix.AddVote(MakeRevealVote(branchid, 3, {d0, d1, d2}, {0, 0, COIN}));
+    mapExpected[vVote[2].keyID] = {0, 0, COIN};
+    BOOST_CHECK_EQUAL(outcome.nVoters, vVote.size());
+    BOOST_CHECK(outcome.IsVoteMatrixValid());
+    vDense = outcome.GetVoteMatrix();
+    for (uint32_t i = 0; i < outcome.nVoters; i++) {
+        std::vector<uint64_t> vRow(vDense.begin() + i * 3, vDense.begin() + (i + 1) * 3);
+        BOOST_CHECK(vRow == mapExpected[outcome.voterIDs[i]]);
+    }
+
+    // The matrix built gives the outcome of the same votes set densely
+    outcome.oldRep.assign(outcome.nVoters, COIN / outcome.nVoters);
+    marketOutcome outcomeVector = outcome;
+    outcomeVector.SetVoteMatrix(vDense);
+    BOOST_CHECK(outcomeVector.voteRows == outcome.voteRows);
+    BOOST_CHECK(outcomeVector.voteCols == outcome.voteCols);
+    BOOST_CHECK(outcomeVector.voteValues == outcome.voteValues);
+    BOOST_CHECK_EQUAL(voteMatrix.Calc(), 0);
+    BOOST_CHECK_EQUAL(outcomeVector.calc(), 0);
+    BOOST_CHECK(outcome.smoothedRep == outcomeVector.smoothedRep);
+    BOOST_CHECK(outcome.firstLoading == outcomeVector.firstLoading);
+    BOOST_CHECK(outcome.decisionsFinal == outcomeVector.decisionsFinal);
+    BOOST_CHECK(outcome.certainty == outcomeVector.certainty);
+}
+
+static struct tc_mat *RandMat(uint32_t nr, uint32_t nc)
+{
+    struct tc_mat *A = tc_mat_ctr(nr, nc);
+    for (uint32_t i = 0; i < nr; i++)
+        for (uint32_t j = 0; j < nc; j++)
+            TC_MAT_AT(A, i, j) = InsecureRandRange(2001) / 1000.0 - 1.0;
+    return A;
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_mat_mult)
+{
+    // Sizes on both sides of the block edges, plus vector shapes
+    const uint32_t dims[][3] = {{1, 300, 270}, {300, 270, 1}, {5, 7, 3},
+        {140, 130, 300}, {129, 257, 259}};
+    for (const auto& d : dims) {
+        struct tc_mat *A = RandMat(d[0], d[1]);
+        struct tc_mat *B = RandMat(d[1], d[2]);
+        struct tc_mat *C = tc_mat_ctr(0, 0);
+        BOOST_CHECK_EQUAL(tc_mat_mult(C, A, B), 0);
+        BOOST_CHECK_EQUAL(C->nr, d[0]);
+        BOOST_CHECK_EQUAL(C->nc, d[2]);
+
+        // Bit for bit the textbook triple loop
+        bool fSame = true;
+        for (uint32_t i = 0; i < d[0]; i++) {
+            for (uint32_t j = 0; j < d[2]; j++) {
+                double sum = 0.0;
+                for (uint32_t k = 0; k < d[1]; k++)
+                    sum += TC_MAT_AT(A, i, k) * TC_MAT_AT(B, k, j);
+                fSame &= sum == TC_MAT_AT(C, i, j);
+            }
+        }
+        BOOST_CHECK(fSame);
+
+        // A^T without the transpose
+        struct tc_mat *AT = tc_mat_ctr(0, 0);
+        tc_mat_transpose(AT, A);
+        struct tc_mat *D = tc_mat_ctr(0, 0);
+        BOOST_CHECK_EQUAL(tc_mat_mult_tn(D, AT, B), 0);
+        fSame = (D->nr == C->nr) && (D->nc == C->nc);
+        for (uint32_t i = 0; fSame && i < d[0]; i++)
+            fSame &= memcmp(tc_mat_row(C, i), tc_mat_row(D, i), sizeof(double) * d[2]) == 0;
+        BOOST_CHECK(fSame);
+
+        tc_mat_dtr(D);
+        tc_mat_dtr(AT);
+        tc_mat_dtr(C);
+        tc_mat_dtr(B);
+        tc_mat_dtr(A);
+    }
+
+    // Aliased output takes the product's shape
+    struct tc_mat *A = RandMat(3, 4);
+    struct tc_mat *B = RandMat(4, 6);
+    BOOST_CHECK_EQUAL(tc_mat_mult(A, A, B), 0);
+    BOOST_CHECK_EQUAL(A->nr, 3U);
+    BOOST_CHECK_EQUAL(A->nc, 6U);
+    tc_mat_dtr(B);
+    tc_mat_dtr(A);
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_prin_comp)
+{
+    // Two camps of voters with some noise, one random ballot, a unanimous
+    // ballot whose covariance is zero (SVD fallback), and two camps without
+    // noise, whose loadings all tie in magnitude
+    for (int nCase = 0; nCase < 4; nCase++) {
+        const uint32_t nr = 60, nc = 20;
+        struct tc_mat *M = RandMat(nr, nc);
+        for (uint32_t i = 0; i < nr; i++) {
+            for (uint32_t j = 0; j < nc; j++) {
+                double& m = TC_MAT_AT(M, i, j);
+                if (nCase == 0)
+                    m = ((i % 3 == 0) == (j % 2 == 0) ? 1.0 : 0.0) + 0.1 * m;
+                else if (nCase == 2)
+                    m = j % 2;
+                else if (nCase == 3)
+                    m = ((i % 2 == 0) == (j % 2 == 0)) ? 1.0 : 0.0;
+            }
+        }
+        struct tc_mat *wgt = tc_mat_ctr(nr, 1);
+        for (uint32_t i = 0; i < nr; i++)
+            TC_MAT_AT(wgt, i, 0) = 1 + InsecureRandRange(100);
+        tc_wgt_normalize(wgt);
+
+        struct tc_mat *loadings = tc_mat_ctr(0, 0);
+        struct tc_mat *scores = tc_mat_ctr(0, 0);
+        struct tc_mat *svdLoadings = tc_mat_ctr(0, 0);
+        struct tc_mat *svdScores = tc_mat_ctr(0, 0);
+        BOOST_CHECK_EQUAL(tc_wgt_prin_comp(wgt, M, loadings, scores), 0);
+        BOOST_CHECK_EQUAL(tc_wgt_prin_comp_svd(wgt, M, svdLoadings, svdScores), 0);
+        BOOST_CHECK_EQUAL(loadings->nr, nc);
+        BOOST_CHECK_EQUAL(scores->nr, nr);
+
+        // Both paths use the same sign convention: the first entry within a
+        // relative 1e-9 of the largest magnitude is positive
+        double maxDiff = 0.0, maxAbs = 0.0;
+        for (uint32_t j = 0; j < nc; j++) {
+            maxDiff = std::max(maxDiff, std::fabs(TC_MAT_AT(loadings, j, 0) - TC_MAT_AT(svdLoadings, j, 0)));
+            maxAbs = std::max(maxAbs, std::fabs(TC_MAT_AT(loadings, j, 0)));
+        }
+        uint32_t imax = 0;
+        while (std::fabs(TC_MAT_AT(loadings, imax, 0)) < (1.0 - 1e-9) * maxAbs)
+            imax++;
+        for (uint32_t i = 0; i < nr; i++)
+            maxDiff = std::max(maxDiff, std::fabs(TC_MAT_AT(scores, i, 0) - TC_MAT_AT(svdScores, i, 0)));
+        BOOST_CHECK_SMALL(maxDiff, 1e-9);
+        BOOST_CHECK(TC_MAT_AT(loadings, imax, 0) > 0.0);
+
+        tc_mat_dtr(svdScores);
+        tc_mat_dtr(svdLoadings);
+        tc_mat_dtr(scores);
+        tc_mat_dtr(loadings);
+        tc_mat_dtr(wgt);
+        tc_mat_dtr(M);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_vote_threads)
+{
+    // A ballot above TC_VOTE_MT_MIN_CELLS with NA votes and scaled decisions
+    const uint32_t nr = 300, nc = 250;
+    BOOST_CHECK(nr * nc >= TC_VOTE_MT_MIN_CELLS);
+    struct tc_vote *votes[3];
+    const uint32_t nThreads[3] = {1, 3, 8};
+    for (int k = 0; k < 3; k++) {
+        struct tc_vote *vote = tc_vote_ctr(nr, nc);
+        vote->NA = 2016.0;
+        vote->alpha = 0.1;
+        vote->tol = 0.1;
+        vote->nthreads = nThreads[k];
+        votes[k] = vote;
+    }
+    for (uint32_t i = 0; i < nr; i++) {
+        double rep = 1 + InsecureRandRange(100);
+        for (int k = 0; k < 3; k++)
+            TC_MAT_AT(votes[k]->rvecs[TC_VOTE_OLD_REP], i, 0) = rep;
+    }
+    for (uint32_t j = 0; j < nc; j++)
+        for (int k = 0; k < 3; k++)
+            TC_MAT_AT(votes[k]->cvecs[TC_VOTE_IS_BINARY], 0, j) = (j % 3)? 1.0: 0.0;
+    for (uint32_t i = 0; i < nr; i++) {
+        for (uint32_t j = 0; j < nc; j++) {
+            uint64_t r = InsecureRandRange(100);
+            double m = (r < 5)? 2016.0: (j % 3)? ((r < 70)? 1.0: 0.0): r / 100.0;
+            for (int k = 0; k < 3; k++)
+                TC_MAT_AT(votes[k]->M, i, j) = m;
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        tc_wgt_normalize(votes[k]->rvecs[TC_VOTE_OLD_REP]);
+        BOOST_CHECK_EQUAL(tc_vote_proc(votes[k]), 0);
+    }
+
+    // Bit for bit the serial result
+    for (int k = 1; k < 3; k++) {
+        bool fSame = true;
+        for (int n = 0; n < TC_VOTE_NROWS; n++)
+            for (uint32_t i = 0; i < nr; i++)
+                fSame &= TC_MAT_AT(votes[k]->rvecs[n], i, 0) == TC_MAT_AT(votes[0]->rvecs[n], i, 0);
+        for (int n = 0; n < TC_VOTE_NCOLS; n++)
+            for (uint32_t j = 0; j < nc; j++)
+                fSame &= TC_MAT_AT(votes[k]->cvecs[n], 0, j) == TC_MAT_AT(votes[0]->cvecs[n], 0, j);
+        BOOST_CHECK(fSame);
+    }
+    for (int k = 0; k < 3; k++)
+        tc_vote_dtr(votes[k]);
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_vote_sparse)
+{
+    // A mostly unanswered ballot, large enough to be split over threads,
+    // run densely and from its sparse votes (serially and threaded)
+    const uint32_t nr = 300, nc = 250;
+    struct tc_vote *dense = tc_vote_ctr(nr, nc);
+    std::vector<uint32_t> vRow(1, 0), vCol;
+    std::vector<double> vValue;
+    for (uint32_t i = 0; i < nr; i++) {
+        for (uint32_t j = 0; j < nc; j++) {
+            uint64_t r = InsecureRandRange(100);
+            double m = (r < 80)? 2016.0: (j % 3)? ((r < 94)? 1.0: 0.0): r / 100.0;
+            TC_MAT_AT(dense->M, i, j) = m;
+            if (m == 2016.0)
+                continue;
+            vCol.push_back(j);
+            vValue.push_back(m);
+        }
+        vRow.push_back(vCol.size());
+    }
+    struct tc_vote *votes[3] = {dense,
+        tc_vote_ctr_sparse(tc_spmat_ctr_rows(nr, nc, vRow.data(), vCol.data(), vValue.data())),
+        tc_vote_ctr_sparse(tc_spmat_ctr_rows(nr, nc, vRow.data(), vCol.data(), vValue.data()))};
+    votes[2]->nthreads = 4;
+
+    // Filled back in, the sparse votes are the dense matrix
+    struct tc_mat *F = tc_mat_ctr(0, 0);
+    tc_spmat_fill(F, votes[1]->S, 2016.0);
+    bool fSame = (F->nr == nr) && (F->nc == nc);
+    for (uint32_t i = 0; fSame && i < nr; i++)
+        fSame &= memcmp(tc_mat_row(F, i), tc_mat_row(dense->M, i), sizeof(double) * nc) == 0;
+    BOOST_CHECK(fSame);
+    tc_mat_dtr(F);
+
+    for (uint32_t i = 0; i < nr; i++) {
+        double rep = 1 + InsecureRandRange(100);
+        for (int k = 0; k < 3; k++)
+            TC_MAT_AT(votes[k]->rvecs[TC_VOTE_OLD_REP], i, 0) = rep;
+    }
+    for (int k = 0; k < 3; k++) {
+        votes[k]->NA = 2016.0;
+        votes[k]->alpha = 0.1;
+        votes[k]->tol = 0.1;
+        for (uint32_t j = 0; j < nc; j++)
+            TC_MAT_AT(votes[k]->cvecs[TC_VOTE_IS_BINARY], 0, j) = (j % 3)? 1.0: 0.0;
+        tc_wgt_normalize(votes[k]->rvecs[TC_VOTE_OLD_REP]);
+        BOOST_CHECK_EQUAL(tc_vote_proc(votes[k]), 0);
+    }
+
+    // Bit for bit the dense result
+    for (int k = 1; k < 3; k++) {
+        fSame = true;
+        for (int n = 0; n < TC_VOTE_NROWS; n++)
+            for (uint32_t i = 0; i < nr; i++)
+                fSame &= TC_MAT_AT(votes[k]->rvecs[n], i, 0) == TC_MAT_AT(votes[0]->rvecs[n], i, 0);
+        for (int n = 0; n < TC_VOTE_NCOLS; n++)
+            for (uint32_t j = 0; j < nc; j++)
+                fSame &= TC_MAT_AT(votes[k]->cvecs[n], 0, j) == TC_MAT_AT(votes[0]->cvecs[n], 0, j);
+        BOOST_CHECK(fSame);
+    }
+    for (int k = 0; k < 3; k++)
+        tc_vote_dtr(votes[k]);
+
+    // An outcome keeps only the votes, on disk and on the wire
+    marketOutcome outcome;
+    outcome.nVoters = nr;
+    outcome.nDecisions = nc;
+    outcome.NA = 2016;
+    for (uint32_t i = 0; i < nr; i++)
+        outcome.voterIDs.push_back(CKeyID(uint160(insecure_rand_ctx.randbytes(20))));
+    for (uint32_t j = 0; j < nc; j++)
+        outcome.decisionIDs.push_back(InsecureRand256());
+    std::vector<uint64_t> voteMatrix((size_t)nr * nc, 2016);
+    for (size_t k = 0; k < voteMatrix.size(); k += 7)
+        voteMatrix[k] = COIN;
+    outcome.SetVoteMatrix(voteMatrix);
+    BOOST_CHECK(outcome.GetVoteMatrix() == voteMatrix);
+    BOOST_CHECK(GetSerializeSize(outcome, SER_NETWORK, PROTOCOL_VERSION)
+        < GetSerializeSize(voteMatrix, SER_NETWORK, PROTOCOL_VERSION) / 4);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << outcome;
+    marketOutcome outcomeRead;
+    ss >> outcomeRead;
+    BOOST_CHECK(outcomeRead.IsVoteMatrixValid());
+    BOOST_CHECK(outcomeRead.GetVoteMatrix() == voteMatrix);
+}
+
+BOOST_AUTO_TEST_CASE(market_outcome_compact)
+{
+    // Binary votes pack into two bits unless they need an escape, scaled
+    // votes and abstentions round trip as they are
+    marketOutcome outcome;
+    outcome.nHeight = 40;
+    outcome.branchid = InsecureRand256();
+    outcome.nVoters = 3;
+    outcome.nDecisions = 3;
+    outcome.NA = 2016;
+    outcome.alpha = 1;
+    for (uint32_t i = 0; i < outcome.nVoters; i++) {
+        outcome.voterIDs.push_back(CKeyID(uint160(insecure_rand_ctx.randbytes(20))));
+        outcome.oldRep.push_back(COIN / 3);
+    }
+    for (uint32_t j = 0; j < outcome.nDecisions; j++)
+        outcome.decisionIDs.push_back(InsecureRand256());
+    outcome.isScaled = {0, 0, 1};
+    const std::vector<uint64_t> voteMatrix = {
+        COIN, 0, COIN / 3,
+        COIN / 2, 2016, 2016,
+        7, COIN, 0};
+    outcome.SetVoteMatrix(voteMatrix);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << outcome;
+    CDataStream ssCopy(ss);
+    marketOutcome outcomeRead;
+    ss >> outcomeRead;
+    BOOST_CHECK(outcomeRead.GetVoteMatrix() == voteMatrix);
+    BOOST_CHECK(outcomeRead.isScaled == outcome.isScaled);
+    BOOST_CHECK(outcomeRead.oldRep == outcome.oldRep);
+    BOOST_CHECK(outcomeRead.GetHash() == outcome.GetHash());
+
+    // A bitmap vote past the last decision is refused. The first voter's
+    // row starts the votes, ahead of the binary codes, the scaled votes,
+    // NA, alpha and tol.
+    CDataStream ssVotes(SER_DISK, CLIENT_VERSION);
+    outcome.SerializeVotes(ssVotes);
+    WriteVarInt<CDataStream, uint64_t>(ssVotes, outcome.NA);
+    WriteVarInt<CDataStream, uint64_t>(ssVotes, outcome.alpha);
+    WriteVarInt<CDataStream, uint64_t>(ssVotes, outcome.tol);
+    CDataStream ssRange(ssCopy);
+    size_t nVotes = ssRange.size() - ssVotes.size();
+    BOOST_CHECK_EQUAL(ssRange[nVotes], 3);
+    BOOST_CHECK_EQUAL(ssRange[nVotes + 1], 0x07);
+    ssRange[nVotes + 1] = 0x0b;
+    BOOST_CHECK_THROW(ssRange >> outcomeRead, std::ios_base::failure);
+
+    // An unknown encoding is refused (after marketop, nHeight, branchid and
+    // the tag)
+    ssCopy[1 + 4 + 32 + 4] = MARKET_OUTCOME_COMPACT + 1;
+    BOOST_CHECK_THROW(ssCopy >> outcomeRead, std::ios_base::failure);
+
+    // Counts that do not match the vectors they size are refused, outputs
+    // may be empty but not short
+    marketOutcome outcomeVoters(outcome);
+    outcomeVoters.voterIDs.pop_back();
+    CDataStream ssVoters(SER_DISK, CLIENT_VERSION);
+    ssVoters << outcomeVoters;
+    BOOST_CHECK_THROW(ssVoters >> outcomeRead, std::ios_base::failure);
+    marketOutcome outcomeRep(outcome);
+    outcomeRep.thisRep.assign(outcome.nVoters - 1, COIN / 3);
+    CDataStream ssRep(SER_DISK, CLIENT_VERSION);
+    ssRep << outcomeRep;
+    BOOST_CHECK_THROW(ssRep >> outcomeRead, std::ios_base::failure);
+    marketOutcome outcomeFinal(outcome);
+    outcomeFinal.decisionsFinal.assign(outcome.nDecisions + 1, COIN);
+    CDataStream ssFinal(SER_DISK, CLIENT_VERSION);
+    ssFinal << outcomeFinal;
+    BOOST_CHECK_THROW(ssFinal >> outcomeRead, std::ios_base::failure);
+
+    // Votes cannot be written without the decisions they are on
+    outcome.decisionIDs.pop_back();
+    CDataStream ssShort(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(ssShort << outcome, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(market_outcome_legacy)
+{
+    // An outcome script as the miner wrote it before the compact encoding:
+    // every field fixed width and the whole vote matrix
+    const uint256 branchid = InsecureRand256();
+    const uint32_t nVoters = 1, nDecisions = 2;
+    const std::vector<CKeyID> voterIDs(1, CKeyID(uint160(insecure_rand_ctx.randbytes(20))));
+    const std::vector<uint256> decisionIDs = {InsecureRand256(), InsecureRand256()};
+    const std::vector<uint64_t> oldRep(1, 25000), isScaled = {0, 1}, noOutput;
+    const std::vector<uint64_t> voteMatrix = {COIN, 2016};
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << 'O' << (uint32_t)40 << branchid << nVoters << voterIDs << oldRep;
+    for (int i = 0; i < 6; i++)
+        ss << noOutput;
+    ss << nDecisions << decisionIDs << isScaled;
+    for (int i = 0; i < 8; i++)
+        ss << noOutput;
+    ss << voteMatrix << (uint64_t)2016 << (uint64_t)COIN / 10 << (uint64_t)COIN / 10;
+    const std::vector<unsigned char> vch(ss.begin(), ss.end());
+    const CScript script = CScript() << vch << OP_MARKET;
+
+    BOOST_CHECK_EQUAL(marketObjPeek(script), 'O');
+    std::shared_ptr<marketObj> obj = marketObjCtr(script);
+    BOOST_REQUIRE(obj && obj->marketop == 'O');
+    const marketOutcome& outcome = *(const marketOutcome *) obj.get();
+    BOOST_CHECK_EQUAL(outcome.nEncoding, MARKET_OUTCOME_LEGACY);
+    BOOST_CHECK_EQUAL(outcome.nHeight, 40U);
+    BOOST_CHECK(outcome.branchid == branchid);
+    BOOST_CHECK_EQUAL(outcome.nVoters, nVoters);
+    BOOST_CHECK(outcome.voterIDs == voterIDs);
+    BOOST_CHECK(outcome.decisionIDs == decisionIDs);
+    BOOST_CHECK(outcome.isScaled == isScaled);
+    BOOST_CHECK_EQUAL(outcome.voteCols.size(), 1U);
+    BOOST_CHECK(outcome.GetVoteMatrix() == voteMatrix);
+    BOOST_CHECK_EQUAL(outcome.NA, 2016U);
+    BOOST_CHECK_EQUAL(outcome.tol, (uint64_t)COIN / 10);
+
+    // It is written back as it was read, so its id is the one on chain
+    BOOST_CHECK(outcome.GetScript() == script);
+    BOOST_CHECK(outcome.GetHash() == Hash(vch.begin(), vch.end()));
+    CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+    ssIndex << outcome;
+    marketOutcome outcomeRead;
+    ssIndex >> outcomeRead;
+    BOOST_CHECK(outcomeRead.GetHash() == outcome.GetHash());
+
+    // The miner counted every reveal vote in nVoters and voterIDs but gave
+    // the matrix a row per distinct key. Three reveals that read back with
+    // the same (null) key left one row: such an outcome decodes, expands
+    // the row it has and is written back as it was.
+    const std::vector<CKeyID> voterIDs3(3, CKeyID());
+    const std::vector<uint64_t> oldRep3(3, 25000), isScaled2 = {0, 0};
+    const std::vector<uint64_t> voteMatrix1 = {2016, COIN};
+    CDataStream ssRows(SER_DISK, CLIENT_VERSION);
+    ssRows << 'O' << (uint32_t)80 << branchid << (uint32_t)3 << voterIDs3 << oldRep3;
+    for (int i = 0; i < 6; i++)
+        ssRows << noOutput;
+    ssRows << nDecisions << decisionIDs << isScaled2;
+    for (int i = 0; i < 8; i++)
+        ssRows << noOutput;
+    ssRows << voteMatrix1 << (uint64_t)2016 << (uint64_t)COIN / 10 << (uint64_t)COIN / 10;
+    const std::vector<unsigned char> vchRows(ssRows.begin(), ssRows.end());
+    ssRows >> outcomeRead;
+    BOOST_CHECK(ssRows.empty());
+    BOOST_CHECK_EQUAL(outcomeRead.nVoters, 3U);
+    BOOST_CHECK(outcomeRead.IsVoteMatrixValid());
+    BOOST_CHECK(outcomeRead.voteRows == std::vector<uint32_t>({0, 1, 1, 1}));
+    BOOST_CHECK(outcomeRead.voteCols == std::vector<uint32_t>(1, 1));
+    BOOST_CHECK(outcomeRead.GetVoteMatrix() == voteMatrix1);
+    CDataStream ssRowsOut(SER_DISK, CLIENT_VERSION);
+    ssRowsOut << outcomeRead;
+    BOOST_CHECK(std::vector<unsigned char>(ssRowsOut.begin(), ssRowsOut.end()) == vchRows);
+
+    // So does one whose nVoters does not match its voter ids; it keeps no
+    // vote rows
+    CDataStream ssVoters(SER_DISK, CLIENT_VERSION);
+    ssVoters.write((const char *) vch.data(), 1 + 4 + 32);
+    ssVoters << (uint32_t)2;
+    ssVoters.write((const char *) vch.data() + 1 + 4 + 32 + 4, vch.size() - (1 + 4 + 32 + 4));
+    const std::vector<unsigned char> vchVoters(ssVoters.begin(), ssVoters.end());
+    ssVoters >> outcomeRead;
+    BOOST_CHECK(outcomeRead.voteRows.empty());
+    BOOST_CHECK(outcomeRead.GetVoteMatrix() == voteMatrix);
+    CDataStream ssVotersOut(SER_DISK, CLIENT_VERSION);
+    ssVotersOut << outcomeRead;
+    BOOST_CHECK(std::vector<unsigned char>(ssVotersOut.begin(), ssVotersOut.end()) == vchVoters);
+
+    // An outcome whose nVoters is MARKET_OUTCOME_TAG but which goes on in
+    // the legacy layout. The compact decoder refuses it; it was valid before
+    CDataStream ssTag(SER_DISK, CLIENT_VERSION);
+    ssTag << 'O' << (uint32_t)120 << branchid << MARKET_OUTCOME_TAG << std::vector<CKeyID>();
+    for (int i = 0; i < 7; i++)
+        ssTag << noOutput;
+    ssTag << (uint32_t)0 << std::vector<uint256>();
+    for (int i = 0; i < 10; i++)
+        ssTag << noOutput;
+    ssTag << (uint64_t)2016 << (uint64_t)COIN / 10 << (uint64_t)COIN / 10;
+    const CScript scriptTag = CScript() << std::vector<unsigned char>(ssTag.begin(), ssTag.end()) << OP_MARKET;
+    BOOST_CHECK_THROW(marketObjCtr(scriptTag), std::ios_base::failure);
+    BOOST_CHECK(marketOutcomeDecodesLegacy(scriptTag));
+    BOOST_CHECK(marketOutcomeDecodesLegacy(script));
+    BOOST_CHECK(!marketOutcomeDecodesLegacy(CScript() << std::vector<unsigned char>(10, 'O') << OP_MARKET));
+
+    // Transactions holding outcomes as the baseline miner wrote them are
+    // valid and value them as market outputs, in the coinbase or not
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+    for (const CScript& scriptOutcome : {script, CScript() << vchRows << OP_MARKET, CScript() << vchVoters << OP_MARKET, scriptTag})
+        mtx.vout.push_back(CTxOut(COIN, scriptOutcome));
+    for (int fCoinbase = 0; fCoinbase < 2; fCoinbase++) {
+        if (fCoinbase) {
+            mtx.vin[0].prevout.SetNull();
+            mtx.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        }
+        const CTransaction tx(mtx);
+        BOOST_CHECK_EQUAL(tx.IsCoinBase(), fCoinbase == 1);
+        BOOST_CHECK(!tx.HasMalformedMarketOutput());
+        for (unsigned int n = 0; n < tx.vout.size(); n++)
+            BOOST_CHECK(tx.IsMarketOutput(n));
+        BOOST_CHECK_EQUAL(tx.GetMarketObjs().size(), 3U);
+        BOOST_CHECK_EQUAL(tx.GetValueOut(), 0);
+        BOOST_CHECK_EQUAL(tx.GetValueOutToMarket(), 4 * COIN);
+        CValidationState state;
+        BOOST_CHECK(CheckTransaction(tx, state));
+    }
+}
+
+// Weighted median by sorting (by value, then weight): iterate through the
+// sorted values until half the weight is passed, and average with the next
+// value if within 8 decimal places of half
+static double SortedWgtMedian(const struct tc_mat *wgt, const struct tc_mat *A, double NA)
+{
+    std::vector<std::pair<double, double> > v;
+    double sum_wgts = 0.0;
+    for (uint32_t i = 0; i < A->nr; i++) {
+        if (TC_MAT_AT(A, i, 0) == NA)
+            continue;
+        v.push_back(std::make_pair(TC_MAT_AT(A, i, 0), TC_MAT_AT(wgt, i, 0)));
+        sum_wgts += TC_MAT_AT(wgt, i, 0);
+    }
+    if (v.empty())
+        return 0.0;
+    std::sort(v.begin(), v.end());
+    double mid_wgts = sum_wgts / 2.0;
+    double median = v[0].first;
+    double sum = v[0].second;
+    size_t i;
+    for (i = 1; i < v.size() && sum < mid_wgts; i++) {
+        median = v[i].first;
+        sum += v[i].second;
+    }
+    if (i < v.size() && std::fabs(sum - mid_wgts) < 1e-8)
+        median = 0.5 * (median + v[i].first);
+    return median;
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_wgt_median)
+{
+    const double NA = 2016.0;
+
+    // Equal weights, even count: the average of the two middle values
+    struct tc_mat *A = tc_mat_ctr(4, 1);
+    struct tc_mat *wgt = tc_mat_ctr(4, 1);
+    const double vals[4] = {0.875, 0.125, 0.75, 0.25};
+    for (uint32_t i = 0; i < 4; i++) {
+        TC_MAT_AT(A, i, 0) = vals[i];
+        TC_MAT_AT(wgt, i, 0) = 0.25;
+    }
+    BOOST_CHECK_EQUAL(tc_wgt_median(wgt, A, 0, NA), 0.5);
+    TC_MAT_AT(wgt, 0, 0) = 0.5;
+    BOOST_CHECK_EQUAL(tc_wgt_median(wgt, A, 0, NA), 0.75);
+    for (uint32_t i = 0; i < 4; i++)
+        TC_MAT_AT(A, i, 0) = NA;
+    BOOST_CHECK_EQUAL(tc_wgt_median(wgt, A, 0, NA), 0.0);
+    tc_mat_dtr(wgt);
+    tc_mat_dtr(A);
+
+    // Random columns with ties, NA votes and zero or equal weights, one
+    // scratch buffer for all of them
+    std::vector<struct tc_wgt_value> scratch(1000);
+    for (int nCase = 0; nCase < 400; nCase++) {
+        uint32_t nr = 1 + InsecureRandRange(nCase < 200? 40: 1000);
+        int mode = nCase % 4;
+        A = tc_mat_ctr(nr, 1);
+        wgt = tc_mat_ctr(nr, 1);
+        for (uint32_t i = 0; i < nr; i++) {
+            TC_MAT_AT(wgt, i, 0) = (mode == 0)? 1.0: InsecureRandRange(8);
+            if (InsecureRandRange(10) == 0)
+                TC_MAT_AT(A, i, 0) = NA;
+            else if (mode == 2)
+                TC_MAT_AT(A, i, 0) = InsecureRandRange(5) / 4.0;
+            else
+                TC_MAT_AT(A, i, 0) = InsecureRandRange(1000) / 999.0;
+        }
+        if (mode != 3)
+            tc_wgt_normalize(wgt);
+        BOOST_CHECK_EQUAL(tc_wgt_median_scratch(wgt, A, 0, NA, scratch.data()),
+            SortedWgtMedian(wgt, A, NA));
+        tc_mat_dtr(wgt);
+        tc_mat_dtr(A);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(market_tc_ws)
+{
+    // Workspace matrices: growing, shrinking and aliased products match
+    // the heap ones, and released space is handed out again
+    struct tc_ws *ws = tc_ws_ctr(0);
+    struct tc_mat *A = RandMat(20, 30);
+    struct tc_mat *B = RandMat(30, 30);
+    struct tc_mat *C = tc_mat_ctr(0, 0);
+    tc_mat_mult(C, A, B);
+    tc_mat_mult(C, C, B);
+    size_t mark = tc_ws_mark(ws);
+    struct tc_mat *wC = tc_ws_mat(ws, 3, 3);
+    tc_mat_copy(wC, A);
+    // wC keeps its size, so the aliased products give their temporaries back
+    size_t markCopy = tc_ws_mark(ws);
+    tc_mat_mult(wC, wC, B);
+    tc_mat_mult(wC, wC, B);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), markCopy);
+    BOOST_CHECK(wC->ws == ws);
+    BOOST_CHECK_EQUAL(wC->nr, C->nr);
+    BOOST_CHECK_EQUAL(wC->nc, C->nc);
+    for (uint32_t i = 0; i < C->nr; i++)
+        for (uint32_t j = 0; j < C->nc; j++)
+            BOOST_CHECK_EQUAL(TC_MAT_AT(wC, i, j), TC_MAT_AT(C, i, j));
+    tc_mat_dtr(wC);
+    tc_ws_release(ws, mark);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), mark);
+    // Past the first block
+    void *p = tc_ws_alloc(ws, 1 << 20);
+    BOOST_CHECK(p != NULL);
+    BOOST_CHECK_EQUAL((uintptr_t) p % TC_MAT_ALIGN, 0U);
+    memset(p, 0, 1 << 20);
+    BOOST_CHECK(tc_ws_peak(ws) >= (1U << 20));
+    tc_ws_release(ws, mark);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), mark);
+    // SVD with its temporaries in the workspace
+    struct tc_mat *U = tc_mat_ctr(0, 0), *D = tc_mat_ctr(0, 0), *V = tc_mat_ctr(0, 0);
+    struct tc_mat *wU = tc_ws_mat(ws, 0, 0), *wD = tc_ws_mat(ws, 0, 0), *wV = tc_ws_mat(ws, 0, 0);
+    tc_mat_transpose(C, A);
+    BOOST_CHECK_EQUAL(tc_mat_svd(C, U, D, V), 0);
+    BOOST_CHECK_EQUAL(tc_mat_svd(C, wU, wD, wV), 0);
+    bool fSame = true;
+    for (uint32_t i = 0; i < U->nr; i++)
+        for (uint32_t j = 0; j < U->nc; j++)
+            fSame &= TC_MAT_AT(wU, i, j) == TC_MAT_AT(U, i, j);
+    for (uint32_t i = 0; i < D->nr; i++)
+        for (uint32_t j = 0; j < D->nc; j++)
+            fSame &= (TC_MAT_AT(wD, i, j) == TC_MAT_AT(D, i, j)) && (TC_MAT_AT(wV, i, j) == TC_MAT_AT(V, i, j));
+    BOOST_CHECK(fSame);
+    tc_mat_dtr(V);
+    tc_mat_dtr(D);
+    tc_mat_dtr(U);
+    tc_mat_dtr(C);
+    tc_mat_dtr(B);
+    tc_mat_dtr(A);
+    tc_ws_dtr(ws);
+
+    // tc_vote_proc_ws() with a workspace of tc_vote_ws_bytes() stays within
+    // that size, whichever path finds the first component, gives
+    // everything back, and matches tc_vote_proc() (as does a workspace
+    // that has to chain blocks)
+    const uint32_t nr = 120, nc = 45;
+    struct tc_vote *votes[3];
+    for (int k = 0; k < 3; k++) {
+        struct tc_vote *vote = tc_vote_ctr(nr, nc);
+        vote->NA = 2016.0;
+        vote->alpha = 0.1;
+        vote->tol = 0.1;
+        votes[k] = vote;
+    }
+    for (uint32_t i = 0; i < nr; i++) {
+        double rep = 1 + InsecureRandRange(100);
+        for (int k = 0; k < 3; k++)
+            TC_MAT_AT(votes[k]->rvecs[TC_VOTE_OLD_REP], i, 0) = rep;
+    }
+    for (uint32_t j = 0; j < nc; j++)
+        for (int k = 0; k < 3; k++)
+            TC_MAT_AT(votes[k]->cvecs[TC_VOTE_IS_BINARY], 0, j) = (j % 3)? 1.0: 0.0;
+    for (uint32_t i = 0; i < nr; i++) {
+        for (uint32_t j = 0; j < nc; j++) {
+            uint64_t r = InsecureRandRange(100);
+            double m = (r < 5)? 2016.0: (j % 3)? ((r < 70)? 1.0: 0.0): r / 100.0;
+            for (int k = 0; k < 3; k++)
+                TC_MAT_AT(votes[k]->M, i, j) = m;
+        }
+    }
+    for (int k = 0; k < 3; k++)
+        tc_wgt_normalize(votes[k]->rvecs[TC_VOTE_OLD_REP]);
+    BOOST_CHECK_EQUAL(tc_vote_proc(votes[0]), 0);
+
+    const size_t nBytes = tc_vote_ws_bytes(nr, nc, 1);
+    ws = tc_ws_ctr(nBytes);
+    BOOST_CHECK_EQUAL(tc_vote_proc_ws(votes[1], ws), 0);
+    const size_t nPeak = tc_ws_peak(ws);
+    BOOST_CHECK(nPeak <= nBytes);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), 0U);
+    BOOST_CHECK_EQUAL(tc_vote_proc_ws(votes[1], ws), 0);
+    BOOST_CHECK_EQUAL(tc_ws_peak(ws), nPeak);
+    tc_ws_dtr(ws);
+
+    // The bound covers the nc x nc temporaries of the SVD fallback, which
+    // a unanimous ballot (zero covariance) takes
+    BOOST_CHECK(nBytes >= 9 * sizeof(double) * nc * nc);
+    struct tc_vote *unanimous = tc_vote_ctr(nr, nc);
+    unanimous->NA = 2016.0;
+    unanimous->alpha = 0.1;
+    unanimous->tol = 0.1;
+    for (uint32_t i = 0; i < nr; i++) {
+        TC_MAT_AT(unanimous->rvecs[TC_VOTE_OLD_REP], i, 0) = 1.0;
+        for (uint32_t j = 0; j < nc; j++)
+            TC_MAT_AT(unanimous->M, i, j) = 1.0;
+    }
+    for (uint32_t j = 0; j < nc; j++)
+        TC_MAT_AT(unanimous->cvecs[TC_VOTE_IS_BINARY], 0, j) = 1.0;
+    tc_wgt_normalize(unanimous->rvecs[TC_VOTE_OLD_REP]);
+    ws = tc_ws_ctr(nBytes);
+    BOOST_CHECK_EQUAL(tc_vote_proc_ws(unanimous, ws), 0);
+    BOOST_CHECK(tc_ws_peak(ws) <= nBytes);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), 0U);
+    tc_ws_dtr(ws);
+    tc_vote_dtr(unanimous);
+
+    ws = tc_ws_ctr(nBytes / 16);
+    BOOST_CHECK_EQUAL(tc_vote_proc_ws(votes[2], ws), 0);
+    BOOST_CHECK_EQUAL(tc_ws_mark(ws), 0U);
+    tc_ws_dtr(ws);
+
+    for (int k = 1; k < 3; k++) {
+        fSame = true;
+        for (int n = 0; n < TC_VOTE_NROWS; n++)
+            for (uint32_t i = 0; i < nr; i++)
+                fSame &= TC_MAT_AT(votes[k]->rvecs[n], i, 0) == TC_MAT_AT(votes[0]->rvecs[n], i, 0);
+        for (int n = 0; n < TC_VOTE_NCOLS; n++)
+            for (uint32_t j = 0; j < nc; j++)
+                fSame &= TC_MAT_AT(votes[k]->cvecs[n], 0, j) == TC_MAT_AT(votes[0]->cvecs[n], 0, j);
+        BOOST_CHECK(fSame);
+    }
+    for (int k = 0; k < 3; k++)
+        tc_vote_dtr(votes[k]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
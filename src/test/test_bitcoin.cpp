@@ -13,6 +13,7 @@
 #include <net_processing.h>
 #include <ui_interface.h>
 #include <streams.h>
+#include <txdb.h>
 #include <rpc/server.h>
 #include <rpc/register.h>
 #include <script/sigcache.h>
@@ -81,6 +82,7 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         pblocktree.reset(new CBlockTreeDB(1 << 20, true));
         pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
         psidechaintree.reset(new CSidechainTreeDB(1 << 20, true));
+        pmarkettree.reset(new CMarketTreeDB(1 << 20, true));
         pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
         if (!LoadGenesisBlock(chainparams)) {
             throw std::runtime_error("LoadGenesisBlock failed.");
@@ -112,6 +114,7 @@ TestingSetup::~TestingSetup()
         pcoinsdbview.reset();
         pblocktree.reset();
         psidechaintree.reset();
+        pmarkettree.reset();
         fs::remove_all(pathTemp);
 }
 
@@ -170,7 +173,7 @@ CBlock hivemind100Setup::CreateAndProcessBlock(const std::vector<CMutableTransac
     CBlock block;
 
     std::string strError = "";
-    BlockAssembler(chainparams).GenerateBMMBlock(block, strError, nullptr, std::vector<CMutableTransaction>(), uint256(), scriptPubKey);
+    BlockAssembler(chainparams).GenerateBMMBlock(block, strError, nullptr, vtx, uint256(), scriptPubKey);
 
     std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(block);
     ProcessNewBlock(chainparams, shared_pblock, true, nullptr, true /* fUnitTest */);
@@ -15,6 +15,7 @@
 #include <ui_interface.h>
 #include <init.h>
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -58,6 +59,68 @@ struct CoinEntry {
     }
 };
 
+/** Secondary index key of the market objects looked up by height: the
+ *  reveal, sealed and steal votes of a branch by voting period, the
+ *  decisions of a branch by eventOverBy and the markets by maturation.
+ *  Markets are not tied to one branch, so theirs is left null. Followed by
+ *  the object id. The height is stored big-endian so that the entries of
+ *  a branch sort by height and a period or a height range is a single
+ *  contiguous scan. */
+struct MarketHeightEntry {
+    char op;
+    uint256 branchid;
+    uint32_t height;
+    MarketHeightEntry() : op(0), height(0) {}
+    MarketHeightEntry(char opIn, const uint256& branchidIn, uint32_t heightIn)
+        : op(opIn), branchid(branchidIn), height(heightIn) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << op;
+        s << branchid;
+        ser_writedata32be(s, height);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> op;
+        s >> branchid;
+        height = ser_readdata32be(s);
+    }
+};
+
+/** Call fn on each object of a market secondary index. The entries under
+ *  prefix are keyed (K, objid) and hold no value; the object is read from
+ *  its primary entry (op, objid). The first nOffset objects are skipped
+ *  and fn is called at most nLimit times (0 = no limit). As in ReadPrefix,
+ *  entries whose object is missing or does not deserialize are skipped
+ *  and count towards neither. */
+template <typename K, typename V, typename P, typename F>
+void ForEachMarketIndexed(CDBWrapper& db, char op, const P& prefix, F fn, size_t nOffset = 0, size_t nLimit = 0)
+{
+    V value;
+    size_t nRead = 0;
+    unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekPrefix(prefix); pcursor->Valid(); pcursor->Next()) {
+        pair<K, uint256> key;
+        if (!pcursor->GetKey(key) || !db.ReadSidechain(make_pair(op, key.second), value))
+            continue;
+        if (nOffset) {
+            nOffset--;
+            continue;
+        }
+        fn(value);
+        if (nLimit && ++nRead >= nLimit)
+            break;
+    }
+}
+
+template <typename K, typename V, typename P>
+void ReadMarketIndexed(CDBWrapper& db, char op, const P& prefix, vector<V>& vValue, size_t nOffset = 0, size_t nLimit = 0)
+{
+    ForEachMarketIndexed<K, V>(db, op, prefix, [&vValue](const V& value) { vValue.push_back(value); }, nOffset, nLimit);
+}
+
 }
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true)
@@ -441,101 +504,58 @@ bool CSidechainTreeDB::GetDeposit(const uint256& objid, SidechainDeposit& deposi
 
 vector<SidechainWithdrawal> CSidechainTreeDB::GetWithdrawals(const uint8_t& nSidechain)
 {
-    const char sidechainop = DB_SIDECHAIN_WITHDRAWAL_OP;
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(sidechainop, nSidechain), uint256()));
-
     vector<SidechainWithdrawal> vWT;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<char, uint256> key;
-        SidechainWithdrawal wt;
-        if (pcursor->GetKey(key) && key.first == sidechainop) {
-            if (pcursor->GetSidechainValue(wt))
-                vWT.push_back(wt);
-        }
-
-        pcursor->Next();
-    }
-
+    ReadPrefix(DB_SIDECHAIN_WITHDRAWAL_OP, vWT);
     return vWT;
 }
 
 vector<SidechainWithdrawalBundle> CSidechainTreeDB::GetWithdrawalBundles(const uint8_t& nSidechain)
 {
-    const char sidechainop = DB_SIDECHAIN_WITHDRAWAL_BUNDLE_OP;
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(sidechainop, nSidechain), uint256()));
-
     vector<SidechainWithdrawalBundle> vWithdrawalBundle;
 
     unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
+    for (pcursor->SeekPrefix(DB_SIDECHAIN_WITHDRAWAL_BUNDLE_OP); pcursor->Valid(); pcursor->Next()) {
         boost::this_thread::interruption_point();
 
         pair<char, uint256> key;
         SidechainWithdrawalBundle withdrawalBundle;
-        if (pcursor->GetKey(key) && key.first == sidechainop) {
-            if (pcursor->GetSidechainValue(withdrawalBundle)) {
-                // Only return the WithdrawalBundle(s) indexed by ID
-                if (key.second == withdrawalBundle.GetID())
-                    vWithdrawalBundle.push_back(withdrawalBundle);
-            }
+        if (pcursor->GetKey(key) && pcursor->GetValue(withdrawalBundle)) {
+            // Only return the WithdrawalBundle(s) indexed by ID
+            if (key.second == withdrawalBundle.GetID())
+                vWithdrawalBundle.push_back(withdrawalBundle);
         }
-
-        pcursor->Next();
     }
     return vWithdrawalBundle;
 }
 
 vector<SidechainDeposit> CSidechainTreeDB::GetDeposits(const uint8_t& nSidechain)
 {
-    const char sidechainop = DB_SIDECHAIN_DEPOSIT_OP;
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(sidechainop, nSidechain), uint256()));
-
     vector<SidechainDeposit> vDeposit;
 
     unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
+    for (pcursor->SeekPrefix(DB_SIDECHAIN_DEPOSIT_OP); pcursor->Valid(); pcursor->Next()) {
         boost::this_thread::interruption_point();
 
         pair<char, uint256> key;
         SidechainDeposit deposit;
-        if (pcursor->GetKey(key) && key.first == sidechainop) {
-            if (pcursor->GetSidechainValue(deposit))
-                // Only return the deposits(s) indexed by ID
-                if (key.second == deposit.GetID())
-                    vDeposit.push_back(deposit);
+        if (pcursor->GetKey(key) && pcursor->GetValue(deposit)) {
+            // Only return the deposits(s) indexed by ID
+            if (key.second == deposit.GetID())
+                vDeposit.push_back(deposit);
         }
-
-        pcursor->Next();
     }
     return vDeposit;
 }
 
 bool CSidechainTreeDB::HaveDeposits()
 {
-    const char sidechainop = DB_SIDECHAIN_DEPOSIT_OP;
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(sidechainop, DB_SIDECHAIN_DEPOSIT_OP), uint256()));
-
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    if (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        pair<char, uint256> key;
+    pcursor->SeekPrefix(DB_SIDECHAIN_DEPOSIT_OP);
+    while (pcursor->Valid()) {
         SidechainDeposit d;
-        if (pcursor->GetKey(key) && key.first == sidechainop) {
-            if (pcursor->GetSidechainValue(d))
-                return true;
-        }
+        if (pcursor->GetValue(d))
+            return true;
+        pcursor->Next();
     }
     return false;
 }
@@ -707,8 +727,8 @@ bool CCoinsViewDB::Upgrade() {
 
 /* Hivemind market database */
 
-CMarketTreeDB::CMarketTreeDB(size_t nCacheSize, bool fMemory, bool fWipe)
-  : CDBWrapper(GetDataDir() / "blocks" / "market", nCacheSize, fMemory, fWipe) {
+CMarketTreeDB::CMarketTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nMarketCacheSize)
+  : CDBWrapper(GetDataDir() / "blocks" / "market", nCacheSize, fMemory, fWipe), cache(nMarketCacheSize), nWriteCount(0) {
 }
 
 bool CMarketTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -740,9 +760,34 @@ bool CMarketTreeDB::WriteBatchSync(const vector<pair<int, const CBlockFileInfo*>
     return WriteBatch(batch, true);
 }
 
-bool CMarketTreeDB::WriteMarketIndex(const vector<pair<uint256, const marketObj *> >&vect)
+/** Write the market objects of a block to the index, see
+ *  CMarketIndexBatch::Add. */
+bool CMarketTreeDB::WriteMarketIndex(const vector<pair<uint256, const marketObj *> >&vect, const CBlockIndex *pindex)
 {
-    CDBBatch batch(*this);
+    CMarketIndexBatch batch(*this);
+    batch.Add(vect, pindex);
+    return batch.Write();
+}
+
+CMarketIndexBatch::CMarketIndexBatch(CMarketTreeDB& dbIn) : db(dbIn), batch(dbIn) {
+}
+
+/** Each object is serialized once, under its primary key (op, objid); the
+ *  secondary index entries are keys ending in objid with no value. Trades
+ *  new to the index also update the share state of their market; one
+ *  already indexed (a block connected again, or a trade repeated) is not
+ *  counted twice. */
+void CMarketIndexBatch::Add(const vector<pair<uint256, const marketObj *> >&vect, const CBlockIndex *pindex)
+{
+    const uint32_t nHeight = pindex ? pindex->nHeight : 0;
+    marketBlockUndo undo;
+    set<uint256> setTraded;
+
+    // A trade may come before its market in the block
+    for (size_t i = 0; i < vect.size(); i++) {
+        if (vect[i].second->marketop == 'M')
+            mapMarketStates[vect[i].first] = marketNStates(*(const marketMarket *) vect[i].second);
+    }
 
     vector<pair<uint256,const marketObj *> >::const_iterator it;
     for (it=vect.begin(); it != vect.end(); it++) {
@@ -750,63 +795,232 @@ bool CMarketTreeDB::WriteMarketIndex(const vector<pair<uint256, const marketObj
         const marketObj *obj = it->second;
         pair<char,uint256> key = make_pair(obj->marketop, objid);
 
+        const bool fNew = setObj.insert(key).second && !db.Exists(key);
+        if (fNew && pindex)
+            undo.vObj.push_back(key);
+
         if (obj->marketop == 'B') {
            const marketBranch *ptr = (const marketBranch *) obj;
-           pair<marketBranch,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketBranch&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
+           setStale.insert(make_pair('b', uint256()));
         }
         else
         if (obj->marketop == 'D') {
            const marketDecision *ptr = (const marketDecision *) obj;
-           pair<marketDecision,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketDecision&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair('d',ptr->branchid),objid), value);
+           batch.WriteKey(make_pair(make_pair('d',ptr->branchid),objid));
+           batch.WriteKey(make_pair(MarketHeightEntry('e',ptr->branchid,ptr->eventOverBy),objid));
+           setStale.insert(make_pair('d', ptr->branchid));
         }
         else
         if (obj->marketop == 'L') {
            const marketStealVote *ptr = (const marketStealVote *) obj;
-           pair<marketStealVote,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketStealVote&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair(make_pair('l',ptr->branchid),ptr->height),objid), value);
+           batch.WriteKey(make_pair(MarketHeightEntry('l',ptr->branchid,ptr->height),objid));
         }
         else
         if (obj->marketop == 'M') {
            const marketMarket *ptr = (const marketMarket *) obj;
-           pair<marketMarket,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketMarket&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           for(size_t i=0; i < ptr->decisionIDs.size(); i++)
-               batch.Write(make_pair(make_pair('m',ptr->decisionIDs[i]),objid), value);
+           batch.WriteKey(make_pair(MarketHeightEntry('h',uint256(),ptr->maturation),objid));
+           for(size_t i=0; i < ptr->decisionIDs.size(); i++) {
+               batch.WriteKey(make_pair(make_pair('m',ptr->decisionIDs[i]),objid));
+               setStale.insert(make_pair('m', ptr->decisionIDs[i]));
+           }
         }
         else
         if (obj->marketop == 'O') {
            const marketOutcome *ptr = (const marketOutcome *) obj;
-           pair<marketOutcome,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketOutcome&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair('o',ptr->branchid),objid), value);
+           batch.WriteKey(make_pair(make_pair('o',ptr->branchid),objid));
         }
         else
         if (obj->marketop == 'R') {
            const marketRevealVote *ptr = (const marketRevealVote *) obj;
-           pair<marketRevealVote,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketRevealVote&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair(make_pair('r',ptr->branchid),ptr->height),objid), value);
+           batch.WriteKey(make_pair(MarketHeightEntry('r',ptr->branchid,ptr->height),objid));
         }
         else
         if (obj->marketop == 'S') {
            const marketSealedVote *ptr = (const marketSealedVote *) obj;
-           pair<marketSealedVote,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketSealedVote&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair(make_pair('s',ptr->branchid),ptr->height),objid), value);
+           batch.WriteKey(make_pair(MarketHeightEntry('s',ptr->branchid,ptr->height),objid));
         }
         else
         if (obj->marketop == 'T') {
            const marketTrade *ptr = (const marketTrade *) obj;
-           pair<marketTrade,uint256> value = make_pair(*ptr, obj->txid);
+           pair<const marketTrade&,const uint256&> value(*ptr, obj->txid);
            batch.Write(key, value);
-           batch.Write(make_pair(make_pair('t',ptr->marketid),objid), value);
+           batch.WriteKey(make_pair(make_pair('t',ptr->marketid),objid));
+           if (!fNew)
+               continue;
+
+           map<uint256, marketShareState>::iterator mi = mapShareState.find(ptr->marketid);
+           if (!setTraded.count(ptr->marketid)) {
+               // First trade on the market in this block
+               if (mi == mapShareState.end()) {
+                   marketShareState state;
+                   if (!db.GetMarketShareState(ptr->marketid, state)) {
+                       // First trade on the market; it may have been
+                       // created in this batch.
+                       map<uint256, uint32_t>::const_iterator ni = mapMarketStates.find(ptr->marketid);
+                       marketMarket market;
+                       if (ni != mapMarketStates.end())
+                           state = marketShareState(ni->second);
+                       else if (db.GetMarket(ptr->marketid, market))
+                           state = marketShareState(marketNStates(market));
+                       else
+                           continue;
+                       undo.vShareState.push_back(make_pair(ptr->marketid, marketShareState()));
+                   } else {
+                       undo.vShareState.push_back(make_pair(ptr->marketid, state));
+                   }
+                   mi = mapShareState.insert(make_pair(ptr->marketid, state)).first;
+               } else {
+                   undo.vShareState.push_back(*mi);
+               }
+               setTraded.insert(ptr->marketid);
+           }
+           mi->second.AddTrade(*ptr, nHeight);
         }
     }
-    return WriteBatch(batch);
+
+    if (pindex && (!undo.vObj.empty() || !undo.vShareState.empty()))
+        batch.Write(make_pair('U', pindex->GetBlockHash()), undo);
+}
+
+bool CMarketIndexBatch::Write(bool fSync)
+{
+    for (const auto& item : mapShareState)
+        batch.Write(make_pair('a', item.first), item.second);
+
+    if (!db.WriteIndexBatch(batch, fSync))
+        return false;
+
+    // The objects cannot change under their ids, but the index lists they
+    // join and the share states of the markets traded on do
+    CMarketCache& cache = db.GetCache();
+    for (const CMarketCache::Key& key : setStale)
+        cache.Erase(key);
+    for (const auto& item : mapShareState)
+        cache.Erase(make_pair('a', item.first));
+    uint64_t nGeneration = cache.GetGeneration();
+    for (const auto& item : mapShareState)
+        cache.PutShareState(item.first, item.second, nGeneration);
+
+    batch.Clear();
+    setObj.clear();
+    mapMarketStates.clear();
+    mapShareState.clear();
+    setStale.clear();
+    return true;
+}
+
+/** Erase a market object and its secondary index entries, the reverse of
+ *  WriteMarketIndex. */
+bool CMarketTreeDB::EraseMarketObj(CDBBatch& batch, char op, const uint256& objid)
+{
+    pair<char,uint256> key = make_pair(op, objid);
+
+    if (op == 'D') {
+        marketDecision decision;
+        if (!GetDecision(objid, decision))
+            return false;
+        batch.Erase(make_pair(make_pair('d',decision.branchid),objid));
+        batch.Erase(make_pair(MarketHeightEntry('e',decision.branchid,decision.eventOverBy),objid));
+    }
+    else
+    if (op == 'L') {
+        marketStealVote vote;
+        if (!GetStealVote(objid, vote))
+            return false;
+        batch.Erase(make_pair(MarketHeightEntry('l',vote.branchid,vote.height),objid));
+    }
+    else
+    if (op == 'M') {
+        marketMarket market;
+        if (!GetMarket(objid, market))
+            return false;
+        batch.Erase(make_pair(MarketHeightEntry('h',uint256(),market.maturation),objid));
+        for(size_t i=0; i < market.decisionIDs.size(); i++)
+            batch.Erase(make_pair(make_pair('m',market.decisionIDs[i]),objid));
+    }
+    else
+    if (op == 'O') {
+        marketOutcome outcome;
+        if (!GetOutcome(objid, outcome))
+            return false;
+        batch.Erase(make_pair(make_pair('o',outcome.branchid),objid));
+    }
+    else
+    if (op == 'R') {
+        marketRevealVote vote;
+        if (!GetRevealVote(objid, vote))
+            return false;
+        batch.Erase(make_pair(MarketHeightEntry('r',vote.branchid,vote.height),objid));
+    }
+    else
+    if (op == 'S') {
+        marketSealedVote vote;
+        if (!GetSealedVote(objid, vote))
+            return false;
+        batch.Erase(make_pair(MarketHeightEntry('s',vote.branchid,vote.height),objid));
+    }
+    else
+    if (op == 'T') {
+        marketTrade trade;
+        if (!GetTrade(objid, trade))
+            return false;
+        batch.Erase(make_pair(make_pair('t',trade.marketid),objid));
+    }
+    else
+    if (op != 'B')
+        return false;
+
+    batch.Erase(key);
+    return true;
+}
+
+bool CMarketTreeDB::DisconnectMarketIndex(const CBlockIndex *pindex)
+{
+    marketBlockUndo undo;
+    if (!Read(make_pair('U', pindex->GetBlockHash()), undo))
+        return true; // Nothing to roll back
+
+    CDBBatch batch(*this);
+    for (vector<pair<char, uint256> >::const_reverse_iterator it = undo.vObj.rbegin(); it != undo.vObj.rend(); it++) {
+        if (!EraseMarketObj(batch, it->first, it->second))
+            return error("%s: cannot erase market object %c %s", __func__, it->first, it->second.ToString());
+    }
+    for (const pair<uint256, marketShareState>& item : undo.vShareState) {
+        if (item.second.nTrades)
+            batch.Write(make_pair('a', item.first), item.second);
+        else
+            batch.Erase(make_pair('a', item.first));
+    }
+    batch.Erase(make_pair('U', pindex->GetBlockHash()));
+
+    if (!WriteIndexBatch(batch))
+        return false;
+
+    // Disconnects are rare, start the cache over
+    cache.Clear();
+    return true;
+}
+
+bool CMarketTreeDB::WriteIndexBatch(CDBBatch& batch, bool fSync)
+{
+    if (!WriteBatch(batch, fSync))
+        return false;
+    nWriteCount++;
+    return true;
 }
 
 bool CMarketTreeDB::WriteFlag(const string &name, bool fValue) {
@@ -821,27 +1035,224 @@ bool CMarketTreeDB::ReadFlag(const string &name, bool &fValue) {
     return true;
 }
 
+/** Rewrite the old vote index entries of one op, keyed
+ *  (((op, branchid), height), voteid) with a little-endian height, to
+ *  MarketHeightEntry keys. */
+static bool UpgradeMarketVoteIndex(CDBWrapper& db, CDBBatch& batch, char op, int64_t& count)
+{
+    unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekPrefix(op); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+
+        // Other single-letter keys share the op byte (e.g. 'l', the last
+        // block file); they are too short to decode as a vote key.
+        pair<pair<pair<char, uint256>, uint32_t>, uint256> key;
+        if (!pcursor->GetKey(key))
+            continue;
+
+        batch.Erase(key);
+        batch.WriteKey(make_pair(MarketHeightEntry(op, key.first.first.second, key.first.second), key.second));
+        count++;
+    }
+    return true;
+}
+
+/** Drop the copy of the object held by each secondary index entry of one
+ *  op, keyed (K, objid), leaving the key. */
+template <typename K>
+static void TrimMarketIndex(CDBWrapper& db, CDBBatch& batch, char op, int64_t& count)
+{
+    unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->SeekPrefix(op); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+
+        pair<K, uint256> key;
+        if (!pcursor->GetKey(key) || !pcursor->GetValueSize())
+            continue;
+
+        batch.WriteKey(key);
+        count++;
+    }
+}
+
+/** Upgrade the market database from older formats.
+ *
+ * Currently implemented: vote indexes keyed by big-endian height, the
+ * decision index keyed by eventOverBy, the per-market share state,
+ * secondary index entries without a copy of the object and the market
+ * index keyed by maturation.
+ */
+bool CMarketTreeDB::Upgrade()
+{
+    bool fUpgraded = false;
+    if (!ReadFlag("voteheightindex", fUpgraded) || !fUpgraded) {
+        // The whole rewrite goes out in one batch so an interrupted upgrade
+        // leaves the old index intact and is simply retried on next start.
+        CDBBatch batch(*this);
+        int64_t count = 0;
+        if (!UpgradeMarketVoteIndex(*this, batch, 'r', count)
+                || !UpgradeMarketVoteIndex(*this, batch, 's', count)
+                || !UpgradeMarketVoteIndex(*this, batch, 'l', count))
+            return false;
+
+        if (count)
+            LogPrintf("Upgraded %d market vote index entries\n", count);
+
+        batch.Write(make_pair('F', string("voteheightindex")), '1');
+        if (!WriteBatch(batch, true))
+            return false;
+    }
+
+    fUpgraded = false;
+    if (!ReadFlag("decisionheightindex", fUpgraded) || !fUpgraded) {
+        CDBBatch batch(*this);
+        int64_t count = 0;
+        unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix('D'); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+
+            pair<char, uint256> key;
+            pair<marketDecision, uint256> value;
+            if (!pcursor->GetKey(key) || !pcursor->GetValue(value))
+                return error("%s: cannot parse decision record", __func__);
+
+            batch.WriteKey(make_pair(MarketHeightEntry('e', value.first.branchid, value.first.eventOverBy), key.second));
+            count++;
+        }
+
+        if (count)
+            LogPrintf("Indexed %d market decisions by height\n", count);
+
+        batch.Write(make_pair('F', string("decisionheightindex")), '1');
+        if (!WriteBatch(batch, true))
+            return false;
+    }
+
+    fUpgraded = false;
+    if (!ReadFlag("sharestate", fUpgraded) || !fUpgraded) {
+        // Build the share state of every market from its trades. The height
+        // of the trades is not part of the index, so it is left unknown.
+        map<uint256, marketShareState> mapShareState;
+        unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix('T'); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+
+            pair<marketTrade, uint256> value;
+            if (!pcursor->GetValue(value))
+                return error("%s: cannot parse trade record", __func__);
+            const marketTrade& trade = value.first;
+
+            map<uint256, marketShareState>::iterator mi = mapShareState.find(trade.marketid);
+            if (mi == mapShareState.end()) {
+                marketMarket market;
+                if (!GetMarket(trade.marketid, market))
+                    continue;
+                mi = mapShareState.insert(make_pair(trade.marketid, marketShareState(marketNStates(market)))).first;
+            }
+            mi->second.AddTrade(trade, 0);
+        }
+
+        CDBBatch batch(*this);
+        for (const auto& item : mapShareState)
+            batch.Write(make_pair('a', item.first), item.second);
+
+        if (!mapShareState.empty())
+            LogPrintf("Built share state of %d markets\n", mapShareState.size());
+
+        batch.Write(make_pair('F', string("sharestate")), '1');
+        if (!WriteBatch(batch, true))
+            return false;
+    }
+
+    fUpgraded = false;
+    if (!ReadFlag("keyonlyindex", fUpgraded) || !fUpgraded) {
+        CDBBatch batch(*this);
+        int64_t count = 0;
+        TrimMarketIndex<pair<char, uint256> >(*this, batch, 'd', count);
+        TrimMarketIndex<pair<char, uint256> >(*this, batch, 'm', count);
+        TrimMarketIndex<pair<char, uint256> >(*this, batch, 'o', count);
+        TrimMarketIndex<pair<char, uint256> >(*this, batch, 't', count);
+        TrimMarketIndex<MarketHeightEntry>(*this, batch, 'e', count);
+        TrimMarketIndex<MarketHeightEntry>(*this, batch, 'l', count);
+        TrimMarketIndex<MarketHeightEntry>(*this, batch, 'r', count);
+        TrimMarketIndex<MarketHeightEntry>(*this, batch, 's', count);
+
+        if (count)
+            LogPrintf("Trimmed %d market index entries\n", count);
+
+        batch.Write(make_pair('F', string("keyonlyindex")), '1');
+        if (!WriteBatch(batch, true))
+            return false;
+    }
+
+    fUpgraded = false;
+    if (!ReadFlag("marketheightindex", fUpgraded) || !fUpgraded) {
+        CDBBatch batch(*this);
+        int64_t count = 0;
+        unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix('M'); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+
+            pair<char, uint256> key;
+            pair<marketMarket, uint256> value;
+            if (!pcursor->GetKey(key) || !pcursor->GetValue(value))
+                return error("%s: cannot parse market record", __func__);
+
+            batch.WriteKey(make_pair(MarketHeightEntry('h', uint256(), value.first.maturation), key.second));
+            count++;
+        }
+
+        if (count)
+            LogPrintf("Indexed %d markets by maturation\n", count);
+
+        batch.Write(make_pair('F', string("marketheightindex")), '1');
+        if (!WriteBatch(batch, true))
+            return false;
+    }
+
+    cache.Clear();
+    return true;
+}
+
 bool CMarketTreeDB::GetBranch(const uint256 &objid, marketBranch& branch)
 {
-    if (ReadSidechain(make_pair('B', objid), branch))
+    if (cache.GetBranch(objid, branch))
+        return true;
+
+    uint64_t nGeneration = cache.GetGeneration();
+    if (ReadSidechain(make_pair('B', objid), branch)) {
+        cache.PutBranch(objid, branch, nGeneration);
         return true;
+    }
 
     return false;
 }
 
 bool CMarketTreeDB::GetDecision(const uint256 &objid, marketDecision& decision)
 {
-    if (ReadSidechain(make_pair('D', objid), decision))
+    if (cache.GetDecision(objid, decision))
+        return true;
+
+    uint64_t nGeneration = cache.GetGeneration();
+    if (ReadSidechain(make_pair('D', objid), decision)) {
+        cache.PutDecision(objid, decision, nGeneration);
         return true;
+    }
 
     return false;
 }
 
 bool CMarketTreeDB::GetMarket(const uint256 &objid, marketMarket& market)
 {
-    if (ReadSidechain(make_pair('M', objid), market))
+    if (cache.GetMarket(objid, market))
         return true;
 
+    uint64_t nGeneration = cache.GetGeneration();
+    if (ReadSidechain(make_pair('M', objid), market)) {
+        cache.PutMarket(objid, market, nGeneration);
+        return true;
+    }
+
     return false;
 }
 
@@ -885,213 +1296,162 @@ bool CMarketTreeDB::GetTrade(const uint256 &objid, marketTrade& trade)
     return false;
 }
 
-vector<marketBranch>
-CMarketTreeDB::GetBranches(void)
+bool CMarketTreeDB::GetMarketShareState(const uint256 &marketid, marketShareState& state)
 {
-    const char op = 'B';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(op, uint256()));
+    if (cache.GetShareState(marketid, state))
+        return true;
 
-    vector<marketBranch> vBranch;
+    uint64_t nGeneration = cache.GetGeneration();
+    if (Read(make_pair('a', marketid), state)) {
+        cache.PutShareState(marketid, state, nGeneration);
+        return true;
+    }
 
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+    return false;
+}
 
-        pair<char, uint256> key;
-        marketBranch branch;
-        if (pcursor->GetKey(key) && key.first == op) {
-            if (pcursor->GetSidechainValue(branch))
-                vBranch.push_back(branch);
+/** Read the objects listed by a market index: the ids of the entries under
+ *  prefix, keyed (K, objid), are cached as key and each object is read
+ *  with fnGet, from the cache when it holds it. Only the ids from nOffset
+ *  on, at most nLimit of them (0 = no limit), are read. */
+template <typename K, typename V, typename P>
+vector<V> CMarketTreeDB::ReadCachedIndex(const CMarketCache::Key& key, const P& prefix, bool (CMarketTreeDB::*fnGet)(const uint256&, V&), size_t nOffset, size_t nLimit)
+{
+    vector<uint256> vId;
+    if (!cache.GetIndex(key, vId)) {
+        uint64_t nGeneration = cache.GetGeneration();
+        unique_ptr<CDBIterator> pcursor(NewIterator());
+        for (pcursor->SeekPrefix(prefix); pcursor->Valid(); pcursor->Next()) {
+            pair<K, uint256> entry;
+            if (pcursor->GetKey(entry))
+                vId.push_back(entry.second);
         }
+        cache.PutIndex(key, vId, nGeneration);
+    }
 
-        pcursor->Next();
+    vector<V> vValue;
+    V value;
+    for (size_t i = 0; i < vId.size(); i++) {
+        if (!(this->*fnGet)(vId[i], value))
+            continue;
+        if (nOffset) {
+            nOffset--;
+            continue;
+        }
+        vValue.push_back(value);
+        if (nLimit && vValue.size() >= nLimit)
+            break;
     }
-    return vBranch;
+    return vValue;
+}
+
+vector<marketBranch>
+CMarketTreeDB::GetBranches(size_t nOffset, size_t nLimit)
+{
+    return ReadCachedIndex<char>(make_pair('b', uint256()), 'B', &CMarketTreeDB::GetBranch, nOffset, nLimit);
 }
 
 vector<marketDecision>
-CMarketTreeDB::GetDecisions(const uint256& id /* branch id */)
+CMarketTreeDB::GetDecisions(const uint256& id /* branch id */, size_t nOffset, size_t nLimit)
 {
-    const char op = 'd';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
+    return ReadCachedIndex<pair<char, uint256> >(make_pair('d', id), make_pair('d', id), &CMarketTreeDB::GetDecision, nOffset, nLimit);
+}
 
+vector<marketDecision>
+CMarketTreeDB::GetDecisionsInRange(const uint256& id /* branch id */, uint32_t minHeight, uint32_t maxHeight)
+{
     vector<marketDecision> vDecision;
+    if (minHeight > maxHeight)
+        return vDecision;
 
     unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
+    pcursor->SeekPrefix(make_pair('e', id));
+    if (maxHeight < std::numeric_limits<uint32_t>::max())
+        pcursor->SetUpperBound(MarketHeightEntry('e', id, maxHeight + 1));
+    for (pcursor->Seek(MarketHeightEntry('e', id, minHeight)); pcursor->Valid(); pcursor->Next()) {
         boost::this_thread::interruption_point();
 
-        pair<char, uint256> key;
+        pair<MarketHeightEntry, uint256> key;
         marketDecision decision;
-        if (pcursor->GetKey(key) && key.first == op && key.second == id) {
-            if (pcursor->GetSidechainValue(decision))
-                vDecision.push_back(decision);
-        }
-
-        pcursor->Next();
+        if (pcursor->GetKey(key) && GetDecision(key.second, decision))
+            vDecision.push_back(decision);
     }
+
     return vDecision;
 }
 
 vector<marketMarket>
-CMarketTreeDB::GetMarkets(const uint256& id /* branch id */)
+CMarketTreeDB::GetMarkets(const uint256& id /* decision id */, size_t nOffset, size_t nLimit)
 {
-    const char op = 'm';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
+    return ReadCachedIndex<pair<char, uint256> >(make_pair('m', id), make_pair('m', id), &CMarketTreeDB::GetMarket, nOffset, nLimit);
+}
 
+vector<marketMarket>
+CMarketTreeDB::GetMarketsInRange(uint32_t minHeight, uint32_t maxHeight)
+{
     vector<marketMarket> vMarket;
+    if (minHeight > maxHeight)
+        return vMarket;
 
     unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
+    pcursor->SeekPrefix(make_pair('h', uint256()));
+    if (maxHeight < std::numeric_limits<uint32_t>::max())
+        pcursor->SetUpperBound(MarketHeightEntry('h', uint256(), maxHeight + 1));
+    for (pcursor->Seek(MarketHeightEntry('h', uint256(), minHeight)); pcursor->Valid(); pcursor->Next()) {
         boost::this_thread::interruption_point();
 
-        pair<char, uint256> key;
+        pair<MarketHeightEntry, uint256> key;
         marketMarket market;
-        if (pcursor->GetKey(key) && key.first == op && key.second == id) {
-            if (pcursor->GetSidechainValue(market))
-                vMarket.push_back(market);
-        }
-
-        pcursor->Next();
+        if (pcursor->GetKey(key) && GetMarket(key.second, market))
+            vMarket.push_back(market);
     }
+
     return vMarket;
 }
 
 vector<marketOutcome>
-CMarketTreeDB::GetOutcomes(const uint256& id /* branchid */)
+CMarketTreeDB::GetOutcomes(const uint256& id /* branchid */, size_t nOffset, size_t nLimit)
 {
-    const char op = 'o';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
-
     vector<marketOutcome> vOutcome;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<char, uint256> key;
-        marketOutcome outcome;
-        if (pcursor->GetKey(key) && key.first == op && key.second == id) {
-            if (pcursor->GetSidechainValue(outcome))
-                vOutcome.push_back(outcome);
-        }
-
-        pcursor->Next();
-    }
+    ReadMarketIndexed<pair<char, uint256> >(*this, 'O', make_pair('o', id), vOutcome, nOffset, nLimit);
     return vOutcome;
 }
 
 vector<marketRevealVote>
-CMarketTreeDB::GetRevealVotes(const uint256 & /* branchid */ id, uint32_t height)
+CMarketTreeDB::GetRevealVotes(const uint256 & /* branchid */ id, uint32_t height, size_t nOffset, size_t nLimit)
 {
-    const char op = 'r';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
-
     vector<marketRevealVote> vVote;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<pair<char, uint256>, uint32_t> key;
-        marketRevealVote vote;
-        if (pcursor->GetKey(key) && key.first.first == op &&
-                key.first.second == id && key.second == height) {
-            vVote.push_back(vote);
-        }
-
-        pcursor->Next();
-    }
-
+    ReadMarketIndexed<MarketHeightEntry>(*this, 'R', MarketHeightEntry('r', id, height), vVote, nOffset, nLimit);
     return vVote;
 }
 
-vector<marketSealedVote>
-CMarketTreeDB::GetSealedVotes(const uint256 & /* branchid */ id, uint32_t height)
+void
+CMarketTreeDB::ForEachRevealVote(const uint256 & /* branchid */ id, uint32_t height,
+    const std::function<void(const marketRevealVote&)>& fn)
 {
-    const char op = 's';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
+    ForEachMarketIndexed<MarketHeightEntry, marketRevealVote>(*this, 'R', MarketHeightEntry('r', id, height), fn);
+}
 
+vector<marketSealedVote>
+CMarketTreeDB::GetSealedVotes(const uint256 & /* branchid */ id, uint32_t height, size_t nOffset, size_t nLimit)
+{
     vector<marketSealedVote> vVote;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<pair<char, uint256>, uint32_t> key;
-        marketSealedVote vote;
-        if (pcursor->GetKey(key) && key.first.first == op
-                && key.first.second == id && key.second == height) {
-            vVote.push_back(vote);
-        }
-
-        pcursor->Next();
-    }
-
+    ReadMarketIndexed<MarketHeightEntry>(*this, 'S', MarketHeightEntry('s', id, height), vVote, nOffset, nLimit);
     return vVote;
 }
 
 vector<marketStealVote>
-CMarketTreeDB::GetStealVotes(const uint256 & /* branchid */ id, uint32_t height)
+CMarketTreeDB::GetStealVotes(const uint256 & /* branchid */ id, uint32_t height, size_t nOffset, size_t nLimit)
 {
-    const char op = 'l';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
-
     vector<marketStealVote> vVote;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<pair<char, uint256>, uint32_t> key;
-        marketStealVote vote;
-        if (pcursor->GetKey(key) && key.first.first == op
-                && key.first.second == id && key.second == height) {
-            vVote.push_back(vote);
-        }
-
-        pcursor->Next();
-    }
-
+    ReadMarketIndexed<MarketHeightEntry>(*this, 'L', MarketHeightEntry('l', id, height), vVote, nOffset, nLimit);
     return vVote;
 }
 
 vector<marketTrade>
-CMarketTreeDB::GetTrades(const uint256 & /* marketid */ id)
+CMarketTreeDB::GetTrades(const uint256 & /* marketid */ id, size_t nOffset, size_t nLimit)
 {
-    const char op = 't';
-    ostringstream ss;
-    ::Serialize(ss, make_pair(make_pair(op, id), uint256()));
-
     vector<marketTrade> vTrade;
-
-    unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(ss.str());
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-
-        pair<char, uint256> key;
-        marketTrade trade;
-        if (pcursor->GetKey(key) && key.first == op && key.second == id) {
-            if (pcursor->GetSidechainValue(trade))
-                vTrade.push_back(trade);
-        }
-
-        pcursor->Next();
-    }
+    ReadMarketIndexed<pair<char, uint256> >(*this, 'T', make_pair('t', id), vTrade, nOffset, nLimit);
     return vTrade;
 }
@@ -9,9 +9,13 @@
 #include <coins.h>
 #include <dbwrapper.h>
 #include <chain.h>
+#include <marketcache.h>
 #include <primitives/market.h>
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -161,15 +165,19 @@ public:
 class CMarketTreeDB : public CDBWrapper
 {
 public:
-    CMarketTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CMarketTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, size_t nMarketCacheSize = DEFAULT_MARKET_CACHE << 20);
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
-    bool WriteMarketIndex(const std::vector<std::pair<uint256, const marketObj *> > &list);
+    bool WriteMarketIndex(const std::vector<std::pair<uint256, const marketObj *> > &list, const CBlockIndex *pindex = nullptr);
+    //! Roll back the market index entries written by the block at pindex
+    bool DisconnectMarketIndex(const CBlockIndex *pindex);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! Attempt to update from an older database format. Returns false if an error occurred.
+    bool Upgrade();
 
     bool GetBranch(const uint256 &, marketBranch& branch);
     bool GetDecision(const uint256 &, marketDecision& decision);
@@ -179,15 +187,77 @@ public:
     bool GetSealedVote(const uint256 &, marketSealedVote& vote);
     bool GetStealVote(const uint256 &, marketStealVote& vote);
     bool GetTrade(const uint256 &, marketTrade& trade);
+    bool GetMarketShareState(const uint256 &, marketShareState& state);
+
+    //! The list getters skip the first nOffset objects and return at most
+    //! nLimit of them (0 = no limit), in index order
+    vector<marketBranch> GetBranches(size_t nOffset = 0, size_t nLimit = 0);
+    vector<marketDecision> GetDecisions(const uint256 &, size_t nOffset = 0, size_t nLimit = 0);
+    //! Decisions of a branch with minHeight <= eventOverBy <= maxHeight
+    vector<marketDecision> GetDecisionsInRange(const uint256 &, uint32_t minHeight, uint32_t maxHeight);
+    vector<marketMarket> GetMarkets(const uint256 &, size_t nOffset = 0, size_t nLimit = 0);
+    //! Markets with minHeight <= maturation <= maxHeight, on any branch
+    vector<marketMarket> GetMarketsInRange(uint32_t minHeight, uint32_t maxHeight);
+    vector<marketOutcome> GetOutcomes(const uint256 &, size_t nOffset = 0, size_t nLimit = 0);
+    vector<marketRevealVote> GetRevealVotes(const uint256 &, uint32_t, size_t nOffset = 0, size_t nLimit = 0);
+    //! Call fn on each reveal vote of a branch at a height, in index order
+    void ForEachRevealVote(const uint256 &, uint32_t, const std::function<void(const marketRevealVote&)>& fn);
+    vector<marketSealedVote> GetSealedVotes(const uint256 &, uint32_t, size_t nOffset = 0, size_t nLimit = 0);
+    vector<marketStealVote> GetStealVotes(const uint256 &, uint32_t, size_t nOffset = 0, size_t nLimit = 0);
+    vector<marketTrade> GetTrades(const uint256 &, size_t nOffset = 0, size_t nLimit = 0);
+
+    //! Branches, decisions, markets and share states read through the cache
+    CMarketCache& GetCache() { return cache; }
+
+    //! Write a batch of market index entries and count the write
+    bool WriteIndexBatch(CDBBatch& batch, bool fSync = false);
+    //! Number of writes to the market index so far, to tell whether reads
+    //! that span several calls saw a single state of the index
+    uint64_t GetWriteCount() const { return nWriteCount; }
+
+private:
+    bool EraseMarketObj(CDBBatch& batch, char op, const uint256& objid);
+
+    //! The objects of an index, by their ids cached under key. Ids whose
+    //! object cannot be read count towards neither nOffset nor nLimit
+    template <typename K, typename V, typename P>
+    vector<V> ReadCachedIndex(const CMarketCache::Key& key, const P& prefix, bool (CMarketTreeDB::*fnGet)(const uint256&, V&), size_t nOffset, size_t nLimit);
+
+    CMarketCache cache;
+    std::atomic<uint64_t> nWriteCount;
+};
+
+/** Market index entries of consecutive blocks gathered into one batch.
+ *  Each Add() sees the objects and share states of the blocks added before
+ *  it, so writing the batch leaves the index as writing the blocks one at a
+ *  time would, with a single LevelDB write and each share state written
+ *  once. */
+class CMarketIndexBatch
+{
+public:
+    explicit CMarketIndexBatch(CMarketTreeDB& dbIn);
 
-    vector<marketBranch> GetBranches(void);
-    vector<marketDecision> GetDecisions(const uint256 &);
-    vector<marketMarket> GetMarkets(const uint256 &);
-    vector<marketOutcome> GetOutcomes(const uint256 &);
-    vector<marketRevealVote> GetRevealVotes(const uint256 &, uint32_t);
-    vector<marketSealedVote> GetSealedVotes(const uint256 &, uint32_t);
-    vector<marketStealVote> GetStealVotes(const uint256 &, uint32_t);
-    vector<marketTrade> GetTrades(const uint256 &);
+    /** Add the market objects of a block. When pindex is given, the objects
+     *  new to the index and the previous share states are recorded as the
+     *  block's market undo data. */
+    void Add(const std::vector<std::pair<uint256, const marketObj *> > &list, const CBlockIndex *pindex = nullptr);
+
+    size_t SizeEstimate() const { return batch.SizeEstimate(); }
+
+    /** Write what was added and start over */
+    bool Write(bool fSync = false);
+
+private:
+    CMarketTreeDB& db;
+    CDBBatch batch;
+    //! (marketop, objid) of the objects added
+    std::set<std::pair<char, uint256> > setObj;
+    //! Number of states of the markets added
+    std::map<uint256, uint32_t> mapMarketStates;
+    //! Share states of the markets traded on, as of the last block added
+    std::map<uint256, marketShareState> mapShareState;
+    //! Cache entries the batch makes stale
+    std::set<CMarketCache::Key> setStale;
 };
 
 #endif // BITCOIN_TXDB_H
@@ -11,6 +11,7 @@
 #include <validation.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <primitives/market.h>
 #include <reverse_iterator.h>
 #include <streams.h>
 #include <timedata.h>
@@ -418,6 +419,17 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
         setWithdrawalRefund.insert(entry.GetWITHDRAWALID());
     }
 
+    // Index the market trades of the transaction by market
+    std::map<uint256, std::vector<std::shared_ptr<const marketObj> > > mapTrades;
+    for (const std::shared_ptr<const marketObj>& obj : tx.GetMarketObjs()) {
+        if (obj->marketop == 'T')
+            mapTrades[((const marketTrade *)obj.get())->marketid].push_back(obj);
+    }
+    for (std::pair<const uint256, std::vector<std::shared_ptr<const marketObj> > >& item : mapTrades) {
+        cachedInnerUsage += memusage::DynamicUsage(item.second);
+        mapMarketTrades[std::make_pair(item.first, hash)].swap(item.second);
+    }
+
     return true;
 }
 
@@ -443,6 +455,16 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
         setWithdrawalRefund.erase(it->GetWITHDRAWALID());
     }
 
+    for (const std::shared_ptr<const marketObj>& obj : it->GetTx().GetMarketObjs()) {
+        if (obj->marketop != 'T')
+            continue;
+        marketTradeMap::iterator mi = mapMarketTrades.find(std::make_pair(((const marketTrade *)obj.get())->marketid, hash));
+        if (mi != mapMarketTrades.end()) {
+            cachedInnerUsage -= memusage::DynamicUsage(mi->second);
+            mapMarketTrades.erase(mi);
+        }
+    }
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
@@ -604,6 +626,7 @@ void CTxMemPool::_clear()
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapMarketTrades.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     lastRollingFeeUpdate = GetTime();
@@ -744,6 +767,12 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(it2 != mapTx.end());
         assert(&tx == it->second);
     }
+    for (marketTradeMap::const_iterator it = mapMarketTrades.begin(); it != mapMarketTrades.end(); it++) {
+        assert(mapTx.count(it->first.second));
+        for (const std::shared_ptr<const marketObj>& obj : it->second)
+            assert(obj->marketop == 'T' && ((const marketTrade *)obj.get())->marketid == it->first.first);
+        innerUsage += memusage::DynamicUsage(it->second);
+    }
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
@@ -825,6 +854,18 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
+std::vector<marketTrade> CTxMemPool::GetMarketTrades(const uint256& marketid) const
+{
+    LOCK(cs);
+    std::vector<marketTrade> vTrade;
+    for (marketTradeMap::const_iterator mi = mapMarketTrades.lower_bound(std::make_pair(marketid, uint256()));
+            mi != mapMarketTrades.end() && mi->first.first == marketid; mi++) {
+        for (const std::shared_ptr<const marketObj>& obj : mi->second)
+            vTrade.push_back(*(const marketTrade *)obj.get());
+    }
+    return vTrade;
+}
+
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -918,7 +959,7 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + memusage::DynamicUsage(mapMarketTrades) + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
@@ -28,6 +28,7 @@
 #include <boost/signals2/signal.hpp>
 
 class CBlockIndex;
+struct marketTrade;
 
 /** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const uint32_t MEMPOOL_HEIGHT = 0x7FFFFFFF;
@@ -523,6 +524,11 @@ private:
     // refunds for the same Withdrawalinto the mempool.
     std::set<uint256> setWithdrawalRefund;
 
+    // The market trades of the transactions in the mempool, by (marketid,
+    // txid), so that quotes can include the trades not mined yet.
+    typedef std::map<std::pair<uint256, uint256>, std::vector<std::shared_ptr<const marketObj> > > marketTradeMap;
+    marketTradeMap mapMarketTrades;
+
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
@@ -655,6 +661,9 @@ public:
         return setWithdrawalRefund.count(wtid);
     }
 
+    /** The trades on a market in the mempool */
+    std::vector<marketTrade> GetMarketTrades(const uint256& marketid) const;
+
     CTransactionRef get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
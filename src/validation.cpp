@@ -2549,27 +2549,14 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
             /* vMarketObj is a vector of all market objects in the block */
             std::vector<std::pair<uint256, const marketObj *> > vMarketObj;
             for (const CTransactionRef& tx : block.vtx) {
-                for (const CTxOut& txout : tx->vout) {
-                    const CScript& scriptPubKey = txout.scriptPubKey;
-                    size_t script_sz = scriptPubKey.size();
-                    if ((script_sz < 2) ||
-                    (scriptPubKey[script_sz-1] != OP_MARKET))
-                        continue;
-                    marketObj *obj = marketObjCtr(scriptPubKey);
-                    if (!obj)
-                        continue;
-                    obj->txid = tx->GetHash();
-                    vMarketObj.push_back(std::make_pair(obj->GetHash(), obj));
-                }
+                for (const std::shared_ptr<const marketObj>& obj : tx->GetMarketObjs())
+                    vMarketObj.push_back(std::make_pair(obj->GetHash(), obj.get()));
             }
             /* write vMarketObj to tx db */
             if (vMarketObj.size()) {
-                bool ret = pmarkettree->WriteMarketIndex(vMarketObj);
+                bool ret = pmarkettree->WriteMarketIndex(vMarketObj, pindex);
                 if (!ret)
                     return AbortNode(state, "Failed to write market index");
-                for (size_t i=0; i < vMarketObj.size(); i++) {
-                    delete vMarketObj[i].second;
-                }
             }
         }
     }
@@ -2807,6 +2794,10 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         bool flushed = view.Flush();
         assert(flushed);
+        // Roll back the market index here rather than in DisconnectBlock,
+        // which is also used by VerifyDB on a throwaway view.
+        if (fMarketIndex && !pmarkettree->DisconnectMarketIndex(pindexDelete))
+            return AbortNode(state, "Failed to roll back market index");
     }
     LogPrint(BCLog::BENCH, "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * MILLI);
     // Write the chain state to disk, if necessary.
@@ -4042,6 +4042,49 @@ UniValue getaddressinfo(const JSONRPCRequest& request)
     return ret;
 }
 
+/* add the trades on the market waiting in the mempool to its share state */
+static void AddMempoolTrades(const uint256& marketid, uint32_t nStates, marketShareState& state)
+{
+    if (state.nShares.size() < nStates)
+        state.nShares.resize(nStates, 0);
+    for (const marketTrade& trade : mempool.GetMarketTrades(marketid))
+        state.AddTrade(trade, state.nHeight);
+}
+
+/* the change in account value (1e-8 units) moving dShares (1e-8 units) in
+ * decisionState causes, on the fixed-point account value the miner prices
+ * trades with */
+static int64_t MarketTradeCost(const marketMarket& market, uint32_t nStates,
+    const marketShareState& state, uint32_t decisionState, int64_t dShares)
+{
+    std::vector<int64_t> nShares = state.nShares;
+    nShares.resize(nStates, 0);
+    int64_t cost;
+    marketQuoteTradesFixed(market.maxCommission, market.B, nStates, nShares.data(), 1,
+        &decisionState, &dShares, &cost);
+    return cost;
+}
+
+/** Read the optional offset and limit arguments of a market list RPC at
+ *  params[nIndex] and params[nIndex + 1]. A limit of 0 lists everything. */
+static void ParseListRange(const UniValue& params, size_t nIndex, size_t& nOffset, size_t& nLimit)
+{
+    nOffset = 0;
+    nLimit = 0;
+    if (params.size() > nIndex && !params[nIndex].isNull()) {
+        int n = params[nIndex].get_int();
+        if (n < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative offset");
+        nOffset = n;
+    }
+    if (params.size() > nIndex + 1 && !params[nIndex + 1].isNull()) {
+        int n = params[nIndex + 1].get_int();
+        if (n < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative limit");
+        nLimit = n;
+    }
+}
+
 UniValue listbranches(const JSONRPCRequest& request)
 {
     CWallet * const pwallet = GetWalletForJSONRPCRequest(request);
@@ -4049,12 +4092,14 @@ UniValue listbranches(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size())
+    if (request.fHelp || request.params.size() > 2)
         throw std::runtime_error(
-            "listbranches\n"
+            "listbranches ( offset limit )\n"
             "\nReturns an array of all branches.\n"
             + HelpRequiringPassphrase(pwallet) +
-            "\nArguments: None\n"
+            "\nArguments:\n"
+            "\n1. offset        (numeric, optional, default=0) the number of branches to skip"
+            "\n2. limit         (numeric, optional, default=0) the most branches to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4067,7 +4112,10 @@ UniValue listbranches(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
     }
 
-    std::vector<marketBranch> vBranch = pmarkettree->GetBranches();
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 0, nOffset, nLimit);
+
+    std::vector<marketBranch> vBranch = pmarkettree->GetBranches(nOffset, nLimit);
 
     UniValue response(UniValue::VARR);
 
@@ -4103,13 +4151,15 @@ UniValue listdecisions(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
         throw std::runtime_error(
-            "listdecisions\n"
+            "listdecisions \"branchid\" ( offset limit )\n"
             "\nReturns an array of all decisions.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1. branchid     (uint256 string)"
+            "\n2. offset       (numeric, optional, default=0) the number of decisions to skip"
+            "\n3. limit        (numeric, optional, default=0) the most decisions to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4126,7 +4176,10 @@ UniValue listdecisions(const JSONRPCRequest& request)
     branchid.SetHex(request.params[0].get_str());
     // TODO obj.pushKV("branchid", branchid.ToString()));
 
-    std::vector<marketDecision> vDecision = pmarkettree->GetDecisions(branchid);
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 1, nOffset, nLimit);
+
+    std::vector<marketDecision> vDecision = pmarkettree->GetDecisions(branchid, nOffset, nLimit);
 
     UniValue response(UniValue::VARR);
 
@@ -4161,13 +4214,15 @@ UniValue listmarkets(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
         throw std::runtime_error(
-            "listmarkets\n"
+            "listmarkets \"decisionid\" ( offset limit )\n"
             "\nReturns an array of all markets depending on decision.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1. decisionid      (uint256 string)"
+            "\n2. offset          (numeric, optional, default=0) the number of markets to skip"
+            "\n3. limit           (numeric, optional, default=0) the most markets to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4183,7 +4238,10 @@ UniValue listmarkets(const JSONRPCRequest& request)
     uint256 decisionid;
     decisionid.SetHex(request.params[0].get_str());
 
-    std::vector<marketMarket> vMarket = pmarkettree->GetMarkets(decisionid);
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 1, nOffset, nLimit);
+
+    std::vector<marketMarket> vMarket = pmarkettree->GetMarkets(decisionid, nOffset, nLimit);
 
     UniValue response(UniValue::VARR);
 
@@ -4221,13 +4279,15 @@ UniValue listoutcomes(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
         throw std::runtime_error(
-            "listoutcomes\n"
+            "listoutcomes \"branchid\" ( offset limit )\n"
             "\nReturns an array of all outcomes in a branch.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1.branchid      (uint256 string)"
+            "\n2. offset       (numeric, optional, default=0) the number of outcomes to skip"
+            "\n3. limit        (numeric, optional, default=0) the most outcomes to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4243,7 +4303,10 @@ UniValue listoutcomes(const JSONRPCRequest& request)
     uint256 branchid;
     branchid.SetHex(request.params[0].get_str());
 
-    std::vector<marketOutcome> vOutcome = pmarkettree->GetOutcomes(branchid);
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 1, nOffset, nLimit);
+
+    std::vector<marketOutcome> vOutcome = pmarkettree->GetOutcomes(branchid, nOffset, nLimit);
 
     UniValue response(UniValue::VARR);
 
@@ -4264,13 +4327,16 @@ UniValue listtrades(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 4)
         throw std::runtime_error(
-            "listtrades\n"
+            "listtrades \"marketid\" ( includemempool offset limit )\n"
             "\nReturns an array of all trades for the market.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1. marketid      (uint256 string)"
+            "\n2. includemempool (boolean, optional, default=false) also list the trades in the mempool"
+            "\n3. offset        (numeric, optional, default=0) the number of confirmed trades to skip"
+            "\n4. limit         (numeric, optional, default=0) the most confirmed trades to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4287,11 +4353,20 @@ UniValue listtrades(const JSONRPCRequest& request)
     marketid.SetHex(request.params[0].get_str());
 
 
-    std::vector<marketTrade> vTrade = pmarkettree->GetTrades(marketid);
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 2, nOffset, nLimit);
+
+    std::vector<marketTrade> vTrade = pmarkettree->GetTrades(marketid, nOffset, nLimit);
+    size_t nConfirmed = vTrade.size();
+    if (request.params.size() > 1 && !request.params[1].isNull() && request.params[1].get_bool()) {
+        std::vector<marketTrade> vPending = mempool.GetMarketTrades(marketid);
+        vTrade.insert(vTrade.end(), vPending.begin(), vPending.end());
+    }
 
     UniValue response(UniValue::VARR);
 
-    for (const marketTrade& trade : vTrade) {
+    for (size_t i = 0; i < vTrade.size(); i++) {
+        const marketTrade& trade = vTrade[i];
         UniValue obj(UniValue::VOBJ);
 
         obj.pushKV("tradeid", trade.GetHash().ToString());
@@ -4306,6 +4381,7 @@ UniValue listtrades(const JSONRPCRequest& request)
         obj.pushKV("price", ValueFromAmount(trade.price));
         obj.pushKV("decision_state", (int)trade.decisionState);
         obj.pushKV("nonce", (int)trade.nonce);
+        obj.pushKV("confirmed", i < nConfirmed);
         response.push_back(obj);
     }
 
@@ -4319,14 +4395,16 @@ UniValue listvotes(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 2)
+    if (request.fHelp || request.params.size() < 2 || request.params.size() > 4)
         throw std::runtime_error(
-            "listtrades\n"
+            "listvotes \"branchid\" height ( offset limit )\n"
             "\nReturns an array of all votes for the ballot.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1. branchid      (uint256 string)"
             "\n2. height        (numeric)"
+            "\n3. offset        (numeric, optional, default=0) the number of votes to skip"
+            "\n4. limit         (numeric, optional, default=0) the most votes to return, 0 for all"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -4344,7 +4422,10 @@ UniValue listvotes(const JSONRPCRequest& request)
 
     uint32_t nHeight = request.params[1].get_int();
 
-    std::vector<marketRevealVote> vVote = pmarkettree->GetRevealVotes(branchid, nHeight);
+    size_t nOffset, nLimit;
+    ParseListRange(request.params, 2, nOffset, nLimit);
+
+    std::vector<marketRevealVote> vVote = pmarkettree->GetRevealVotes(branchid, nHeight, nOffset, nLimit);
 
     UniValue response(UniValue::VARR);
 
@@ -4690,9 +4771,6 @@ UniValue createmarket(const JSONRPCRequest& request)
     market.txPoWh = (uint32_t)request.params[9].get_int();
     market.txPoWd = (uint32_t)request.params[10].get_int();
 
-    // TODO use this???
-    double capitalrequired = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, NULL);
-
     // Check if market already exists
     marketMarket tmpMarket;
     if (pmarkettree->GetMarket(market.GetHash(), tmpMarket)) {
@@ -4861,28 +4939,25 @@ UniValue createtrade(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
     }
 
-    /* trades of the market */
-    vector<marketTrade> vTrades = pmarkettree->GetTrades(market.GetHash());
+    /* share state of the market, after the trades in the mempool that will
+     * likely be mined before this one */
+    marketShareState shareState;
+    pmarkettree->GetMarketShareState(market.GetHash(), shareState);
+    AddMempoolTrades(trade.marketid, nStates, shareState);
 
-    /* current shares of the market */
-    double *nShares = new double [nStates];
-    marketNShares(vTrades, nStates, nShares);
-    double currAccount = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, nShares);
-
-    /* new shares to be added to the market */
-    nShares[trade.decisionState] += (trade.isBuy)? 1e-8*trade.nShares: -1e-8*trade.nShares;
-    double nextAccount = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, nShares);
+    /* the change in account value the trade causes */
+    int64_t cost = MarketTradeCost(market, nStates, shareState, trade.decisionState,
+        (trade.isBuy)? (int64_t)trade.nShares: -(int64_t)trade.nShares);
 
     /* the price difference to move from the current to the new */
-    double price = (trade.isBuy)? (nextAccount - currAccount) / (1e-8 * trade.nShares)
-        : (currAccount - nextAccount) / (1e-8 * trade.nShares);
-
-    // TODO use ???
-    double totalCost = price * (1e-8 * trade.nShares);
+    double price = (trade.isBuy)? (double)cost / trade.nShares
+        : (double)-cost / trade.nShares;
 
-    if ((trade.isBuy) && (1e-8*price > 1e-8*trade.price)) {
+    /* trade.price is in satoshis per share; the miner leaves out buys
+     * priced below their cost the same way (BlockMarketState) */
+    if (trade.isBuy && !marketPriceCovers(cost, trade.nShares, trade.price)) {
         string strError = std::string("Error: price needs to be at least ")
-            + FormatMoney(price);
+            + FormatMoney((CAmount)ceil(price * COIN));
         throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
     }
 
@@ -4918,12 +4993,10 @@ UniValue createtrade(const JSONRPCRequest& request)
     obj.pushKV("tradeid", trade.GetHash().ToString());
     obj.pushKV("B", 1e-8*market.B);
     obj.pushKV("buy_or_sell", buy_or_sell);
-    obj.pushKV("nShares", nShares);
+    obj.pushKV("nShares", 1e-8 * trade.nShares);
     obj.pushKV("price", price);
     obj.pushKV("total", ((1e-8 * trade.nShares))*price);
 
-    delete nShares;
-
     return obj;
 }
 
@@ -5352,13 +5425,14 @@ UniValue getmarket(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
         throw std::runtime_error(
             "getmarket\n"
             "\nReturns the market.\n"
             + HelpRequiringPassphrase(pwallet) +
             "\nArguments:\n"
             "\n1. marketid          (u256 string)"
+            "\n2. includemempool    (boolean, optional, default=false) add the shares of the trades in the mempool"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -5379,16 +5453,20 @@ UniValue getmarket(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_WALLET_ERROR, "Market not found!\n");
     }
 
-    // Get market trades
-    std::vector<marketTrade> vTrade = pmarkettree->GetTrades(market.GetHash());
+    // Get market share state
+    marketShareState shareState;
+    pmarkettree->GetMarketShareState(market.GetHash(), shareState);
 
     /* current shares of the market */
     uint32_t nStates = marketNStates(market);
-    double *nShares = new double [nStates];
-    marketNShares(vTrade, nStates, nShares);
+    if (request.params.size() > 1 && !request.params[1].isNull() && request.params[1].get_bool())
+        AddMempoolTrades(marketid, nStates, shareState);
+    std::vector<int64_t> nShares = shareState.nShares;
+    nShares.resize(nStates, 0);
 
-    /* current account value */
-    double currAccount = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, nShares);
+    /* current account value, on the fixed-point account value the miner
+     * prices trades with */
+    int64_t currAccount = marketAccountValueFixed(market.maxCommission, market.B, nStates, nShares.data());
 
     UniValue obj(UniValue::VOBJ);
     obj.pushKV("marketid", marketid.ToString());
@@ -5420,12 +5498,10 @@ UniValue getmarket(const JSONRPCRequest& request)
     for(uint32_t i=0; i < nStates; i++) {
         char tmp[32];
         snprintf(tmp, sizeof(tmp), "nShares%u", i);
-        obj.pushKV(tmp, nShares[i]);
+        obj.pushKV(tmp, ValueFromAmount(nShares[i]));
     }
 
-    obj.pushKV("currAccount", currAccount);
-
-    delete nShares;
+    obj.pushKV("currAccount", ValueFromAmount(currAccount));
 
     return obj;
 }
@@ -5474,8 +5550,9 @@ UniValue getoutcome(const JSONRPCRequest& request)
     obj.pushKV("alpha", ValueFromAmount(outcome.alpha));
 
     UniValue arrayVote(UniValue::VARR);
-    for(uint32_t i=0; i < outcome.voteMatrix.size(); i++)
-        arrayVote.pushKV(std::to_string(i), ValueFromAmount(outcome.voteMatrix[i]));
+    const std::vector<uint64_t> voteMatrix = outcome.GetVoteMatrix();
+    for(uint32_t i=0; i < voteMatrix.size(); i++)
+        arrayVote.pushKV(std::to_string(i), ValueFromAmount(voteMatrix[i]));
     obj.pushKV("voteMatrix", arrayVote);
 
         /* Voter Vectors */
@@ -5811,13 +5888,9 @@ UniValue getballot(const JSONRPCRequest& request)
     obj.pushKV("maxblock", (int)maxblock);
 
     UniValue array(UniValue::VARR);
-    std::vector<marketDecision> vec = pmarkettree->GetDecisions(branchid);
+    std::vector<marketDecision> vec = pmarkettree->GetDecisionsInRange(branchid, minblock, maxblock);
     for(size_t i=0; i < vec.size(); i++) {
-        const marketDecision obj = vec[i];
-        if ((obj.eventOverBy < minblock)
-            || (obj.eventOverBy > maxblock))
-            continue;
-
+        const marketDecision& obj = vec[i];
         UniValue item(UniValue::VOBJ);
         item.pushKV("decisionid", obj.GetHash().ToString());
         item.pushKV("txid", obj.txid.ToString());
@@ -5899,7 +5972,7 @@ UniValue getcreatetradecapitalrequired(const JSONRPCRequest& request)
         return NullUniValue;
     }
 
-    if (request.fHelp || request.params.size() != 4)
+    if (request.fHelp || request.params.size() < 4 || request.params.size() > 5)
         throw std::runtime_error(
             "getcreatetradecapitalrequired\n"
             "\nReturns the capital required to trade.\n"
@@ -5909,6 +5982,7 @@ UniValue getcreatetradecapitalrequired(const JSONRPCRequest& request)
             "\n1. buyorsell         (string)"
             "\n1. numbershares      (numeric)"
             "\n1. decisionstate     (string)"
+            "\n5. includemempool    (boolean, optional, default=false) price after the trades in the mempool"
             "\nResult:\n"
             "\"\"                  (string) .\n"
             "\nExamples:\n"
@@ -5964,23 +6038,19 @@ UniValue getcreatetradecapitalrequired(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
     }
 
-    /* trades of the market */
-    std::vector<marketTrade> vTrade = pmarkettree->GetTrades(marketid);
+    /* share state of the market */
+    marketShareState shareState;
+    pmarkettree->GetMarketShareState(marketid, shareState);
+    if (request.params.size() > 4 && !request.params[4].isNull() && request.params[4].get_bool())
+        AddMempoolTrades(marketid, nStates, shareState);
 
-    /* current share totals of the market */
-    double *nShares = new double [nStates];
-    marketNShares(vTrade, nStates, nShares);
-
-    /* current account value */
-    double currAccount = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, nShares);
-
-    /* new shares to be added to the market */
-    nShares[decisionState] += (isBuy)? 1e-8*dnShares: -1e-8*dnShares;
-    double nextAccount = marketAccountValue(market.maxCommission, 1e-8*market.B, nStates, nShares);
+    /* the change in account value the trade causes, priced as createtrade
+     * and the miner price it */
+    int64_t cost = MarketTradeCost(market, nStates, shareState, decisionState,
+        (isBuy)? (int64_t)dnShares: -(int64_t)dnShares);
 
     /* the price difference to move from the current to the new */
-    double price = (isBuy)? (nextAccount - currAccount) / (1e-8*dnShares)
-        : (currAccount - nextAccount) / (1e-8*dnShares);
+    double price = (isBuy)? (double)cost / dnShares: (double)-cost / dnShares;
 
     /* round up because returing value is shown as a string */
     price += 1e-8;
@@ -5993,7 +6063,130 @@ UniValue getcreatetradecapitalrequired(const JSONRPCRequest& request)
     obj.pushKV("price", price);
     obj.pushKV("total", (1e-8*dnShares)*price);
 
-    delete nShares;
+    return obj;
+}
+
+UniValue getmarketquotes(const JSONRPCRequest& request)
+{
+    CWallet * const pwallet = GetWalletForJSONRPCRequest(request);
+    if (!EnsureWalletIsAvailable(pwallet, request.fHelp)) {
+        return NullUniValue;
+    }
+
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw std::runtime_error(
+            "getmarketquotes\n"
+            "\nReturns the buy and sell prices of every state of a market\n"
+            "for each of the given trade sizes.\n"
+            + HelpRequiringPassphrase(pwallet) +
+            "\nArguments:\n"
+            "\n1. marketid          (u256 string)"
+            "\n2. sizes             (array, optional) number of shares, default [1, 10, 100]"
+            "\n3. includemempool    (boolean, optional, default=false) quote after the trades in the mempool"
+            "\nResult:\n"
+            "{\n"
+            "  \"marketid\" : \"hash\",\n"
+            "  \"B\" : n,\n"
+            "  \"nStates\" : n,\n"
+            "  \"quotes\" : [\n"
+            "    {\n"
+            "      \"state\" : n,\n"
+            "      \"nShares\" : n,\n"
+            "      \"buyprice\" : n,\n"
+            "      \"buytotal\" : n,\n"
+            "      \"sellprice\" : n,\n"
+            "      \"selltotal\" : n\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmarketquotes", "\"marketid\" \"[1, 10]\"")
+            + HelpExampleCli("getmarketquotes", "\"marketid\" \"[1, 10]\" true")
+            + HelpExampleRpc("getmarketquotes", "\"marketid\", [1, 10]")
+        );
+
+    if (!pmarkettree) {
+        string strError = std::string("Error: NULL pmarkettree!");
+        throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
+    }
+
+    uint256 marketid;
+    marketid.SetHex(request.params[0].get_str());
+
+    /* double-check sizes, in 1e-8 units */
+    vector<int64_t> vSize;
+    if (request.params.size() > 1 && !request.params[1].isNull()) {
+        const UniValue& sizes = request.params[1].get_array();
+        for(size_t i=0; i < sizes.size(); i++) {
+            double size = sizes[i].get_real();
+            if (size <= 0.0) {
+                char tmp[32];
+                snprintf(tmp, sizeof(tmp), "%.8f", size);
+                string strError = std::string("Error: number of shares ")
+                    + tmp + " must be positive!";
+                throw JSONRPCError(RPC_WALLET_ERROR, strError.c_str());
+            }
+            vSize.push_back(AmountFromValue(sizes[i]));
+        }
+    } else {
+        vSize.push_back(1 * COIN);
+        vSize.push_back(10 * COIN);
+        vSize.push_back(100 * COIN);
+    }
+
+    marketMarket market;
+    if (!pmarkettree->GetMarket(marketid, market)) {
+        throw JSONRPCError(RPC_WALLET_ERROR, "Market not found!\n");
+    }
+
+    uint32_t nStates = marketNStates(market);
+
+    /* share state of the market */
+    marketShareState shareState;
+    pmarkettree->GetMarketShareState(marketid, shareState);
+    if (request.params.size() > 2 && !request.params[2].isNull() && request.params[2].get_bool())
+        AddMempoolTrades(marketid, nStates, shareState);
+
+    /* one buy and one sell per state and size, priced in one batch
+     * against the same share totals as createtrade and the miner price
+     * them */
+    std::vector<int64_t> nShares = shareState.nShares;
+    nShares.resize(nStates, 0);
+    std::vector<uint32_t> vState;
+    std::vector<int64_t> vShares;
+    for(uint32_t state=0; state < nStates; state++) {
+        for(size_t k=0; k < vSize.size(); k++) {
+            vState.push_back(state);
+            vShares.push_back(vSize[k]);
+            vState.push_back(state);
+            vShares.push_back(-vSize[k]);
+        }
+    }
+    std::vector<int64_t> vCost(vState.size());
+    marketQuoteTradesFixed(market.maxCommission, market.B, nStates, nShares.data(),
+        vState.size(), vState.data(), vShares.data(), vCost.data());
+
+    UniValue quotes(UniValue::VARR);
+    for(size_t j=0; j < vState.size(); j += 2) {
+        double size = 1e-8*vShares[j];
+        double buyTotal = 1e-8*vCost[j];
+        double sellTotal = -1e-8*vCost[j+1];
+
+        UniValue quote(UniValue::VOBJ);
+        quote.pushKV("state", (uint64_t)vState[j]);
+        quote.pushKV("nShares", size);
+        quote.pushKV("buyprice", buyTotal / size);
+        quote.pushKV("buytotal", buyTotal);
+        quote.pushKV("sellprice", sellTotal / size);
+        quote.pushKV("selltotal", sellTotal);
+        quotes.push_back(quote);
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("marketid", marketid.ToString());
+    obj.pushKV("B", 1e-8*market.B);
+    obj.pushKV("nStates", (uint64_t)nStates);
+    obj.pushKV("quotes", quotes);
 
     return obj;
 }
@@ -6072,12 +6265,12 @@ static const CRPCCommand commands[] =
     { "sidechain",          "createwithdrawalrefundrequest",    &createwithdrawalrefundrequest,         {"id"} },
     { "sidechain",          "refundallwithdrawals",             &refundallwithdrawals,                  {} },
 
-    { "hivemind",           "listbranches",                     &listbranches,                  {} },
-    { "hivemind",           "listdecisions",                    &listdecisions,             {"branchid"} },
-    { "hivemind",           "listmarkets",                      &listmarkets,                   {"decisionid"} },
-    { "hivemind",           "listoutcomes",                     &listoutcomes,                  {"branchid"} },
-    { "hivemind",           "listtrades",                       &listtrades,                    {"marketid"} },
-    { "hivemind",           "listvotes",                        &listvotes,                     {"branchid", "height"} },
+    { "hivemind",           "listbranches",                     &listbranches,                  {"offset", "limit"} },
+    { "hivemind",           "listdecisions",                    &listdecisions,             {"branchid", "offset", "limit"} },
+    { "hivemind",           "listmarkets",                      &listmarkets,                   {"decisionid", "offset", "limit"} },
+    { "hivemind",           "listoutcomes",                     &listoutcomes,                  {"branchid", "offset", "limit"} },
+    { "hivemind",           "listtrades",                       &listtrades,                    {"marketid","includemempool", "offset", "limit"} },
+    { "hivemind",           "listvotes",                        &listvotes,                     {"branchid", "height", "offset", "limit"} },
 
     { "hivemind",           "createbranch",                     &createbranch,                  {"name","description","baselistingfee","freedecisions","targetdecisions","maxdecisions","mintradingfee","tau","ballottime","unsealtime","consensusthreshold","alpha","tol"} },
     { "hivemind",           "createdecision",                   &createdecision,                {"address","branchid","prompt","eventoverby","answeroptionality","isscaled","scaledmin","scaledmax"} },
@@ -6089,7 +6282,7 @@ static const CRPCCommand commands[] =
 
     { "hivemind",           "getbranch",                        &getbranch,                     {"branchid"} },
     { "hivemind",           "getdecision",                      &getdecision,                   {"decisionid"} },
-    { "hivemind",           "getmarket",                        &getmarket,                     {"marketid"} },
+    { "hivemind",           "getmarket",                        &getmarket,                     {"marketid","includemempool"} },
     { "hivemind",           "getoutcome",                       &getoutcome,                    {"outcomeid"} },
     { "hivemind",           "gettrade",                         &gettrade,                      {"tradeid"} },
     { "hivemind",           "getsealedvote",                    &getsealedvote,                 {"voteid"} },
@@ -6098,7 +6291,8 @@ static const CRPCCommand commands[] =
     { "hivemind",           "getballot",                        &getballot,                     {"branchid", "height"} },
     { "hivemind",           "getnewvotecoinaddress",            &getnewvotecoinaddress,         {"account"} },
 
-    { "hivemind",           "getcreatetradecapitalrequired",    &getcreatetradecapitalrequired, {"marketid","buyorsell","numbershares","decisionstate"} },
+    { "hivemind",           "getcreatetradecapitalrequired",    &getcreatetradecapitalrequired, {"marketid","buyorsell","numbershares","decisionstate","includemempool"} },
+    { "hivemind",           "getmarketquotes",                  &getmarketquotes,               {"marketid","sizes","includemempool"} },
 
 
 };
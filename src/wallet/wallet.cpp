@@ -2227,7 +2227,7 @@ void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlySafe, const
         // TODO
         // Old hivemind code used the accounts system to list market txs
         // if a branchid account is selected
-        bool fMarketTx = pcoin->tx->vout[0].scriptPubKey.IsMarketScript();
+        bool fMarketTx = pcoin->tx->IsMarketOutput(0);
         if (fMarketTx)
             continue;
 
@@ -20,3 +20,8 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyMarketObj(const uint256 &/*hashBlock*/, const uint256 &/*objid*/, const marketObj &/*obj*/, bool /*fConnected*/)
+{
+    return true;
+}
@@ -9,6 +9,8 @@
 
 class CBlockIndex;
 class CZMQAbstractNotifier;
+class uint256;
+struct marketObj;
 
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
@@ -34,6 +36,8 @@ public:
 
     virtual bool NotifyBlock(const CBlockIndex *pindex);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    /** A market object of block hashBlock was connected (or disconnected) */
+    virtual bool NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected);
 
 protected:
     void *psocket;
@@ -5,11 +5,14 @@
 #include <zmq/zmqnotificationinterface.h>
 #include <zmq/zmqpublishnotifier.h>
 
+#include <primitives/market.h>
 #include <version.h>
 #include <validation.h>
 #include <streams.h>
 #include <util.h>
 
+#include <algorithm>
+
 void zmqError(const char *str)
 {
     LogPrint(BCLog::ZMQ, "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
@@ -39,6 +42,10 @@ CZMQNotificationInterface* CZMQNotificationInterface::Create()
     factories["pubhashtx"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionNotifier>;
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
+    factories["pubmarkettrade"] = CZMQAbstractNotifier::Create<CZMQPublishMarketTradeNotifier>;
+    factories["pubmarketvote"] = CZMQAbstractNotifier::Create<CZMQPublishMarketVoteNotifier>;
+    factories["pubmarketoutcome"] = CZMQAbstractNotifier::Create<CZMQPublishMarketOutcomeNotifier>;
+    factories["pubmarketcreated"] = CZMQAbstractNotifier::Create<CZMQPublishMarketCreatedNotifier>;
 
     for (const auto& entry : factories)
     {
@@ -171,6 +178,7 @@ void CZMQNotificationInterface::BlockConnected(const std::shared_ptr<const CBloc
         // Do a normal notify for each transaction added in the block
         TransactionAddedToMempool(ptx);
     }
+    NotifyMarketObjs(*pblock, true);
 }
 
 void CZMQNotificationInterface::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock)
@@ -179,4 +187,39 @@ void CZMQNotificationInterface::BlockDisconnected(const std::shared_ptr<const CB
         // Do a normal notify for each transaction removed in block disconnection
         TransactionAddedToMempool(ptx);
     }
+    NotifyMarketObjs(*pblock, false);
+}
+
+// The market objects ConnectBlock adds to the market index, in block order
+// when connected and in reverse when disconnected, so that subscribers can
+// apply and undo them as they arrive
+void CZMQNotificationInterface::NotifyMarketObjs(const CBlock& block, bool fConnected)
+{
+    std::vector<std::pair<uint256, const marketObj *> > vMarketObj;
+    for (const CTransactionRef& tx : block.vtx) {
+        for (const std::shared_ptr<const marketObj>& obj : tx->GetMarketObjs())
+            vMarketObj.push_back(std::make_pair(obj->GetHash(), obj.get()));
+    }
+    if (vMarketObj.empty())
+        return;
+    if (!fConnected)
+        std::reverse(vMarketObj.begin(), vMarketObj.end());
+
+    const uint256 hashBlock = block.GetHash();
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        bool fOk = true;
+        for (size_t j = 0; fOk && j < vMarketObj.size(); j++)
+            fOk = notifier->NotifyMarketObj(hashBlock, vMarketObj[j].first, *vMarketObj[j].second, fConnected);
+        if (fOk)
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
 }
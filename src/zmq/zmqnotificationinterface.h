@@ -33,6 +33,8 @@ protected:
 private:
     CZMQNotificationInterface();
 
+    void NotifyMarketObjs(const CBlock& block, bool fConnected);
+
     void *pcontext;
     std::list<CZMQAbstractNotifier*> notifiers;
 };
@@ -4,6 +4,7 @@
 
 #include <chain.h>
 #include <chainparams.h>
+#include <primitives/market.h>
 #include <streams.h>
 #include <zmq/zmqpublishnotifier.h>
 #include <validation.h>
@@ -16,6 +17,10 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_MARKETTRADE   = "markettrade";
+static const char *MSG_MARKETVOTE    = "marketvote";
+static const char *MSG_MARKETOUTCOME = "marketoutcome";
+static const char *MSG_MARKETCREATED = "marketcreated";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -195,3 +200,66 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQAbstractPublishMarketNotifier::SendMarketObj(const char *command, const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected)
+{
+    LogPrint(BCLog::ZMQ, "zmq: Publish %s %s\n", command, objid.GetHex());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    for (unsigned int i = 0; i < 32; i++)
+        ss << hashBlock.begin()[31 - i];
+    for (unsigned int i = 0; i < 32; i++)
+        ss << objid.begin()[31 - i];
+    ss << (uint8_t)fConnected;
+    if (obj.marketop == 'B')
+        ss << (const marketBranch &)obj;
+    else
+    if (obj.marketop == 'D')
+        ss << (const marketDecision &)obj;
+    else
+    if (obj.marketop == 'L')
+        ss << (const marketStealVote &)obj;
+    else
+    if (obj.marketop == 'M')
+        ss << (const marketMarket &)obj;
+    else
+    if (obj.marketop == 'O')
+        ss << (const marketOutcome &)obj;
+    else
+    if (obj.marketop == 'R')
+        ss << (const marketRevealVote &)obj;
+    else
+    if (obj.marketop == 'S')
+        ss << (const marketSealedVote &)obj;
+    else
+    if (obj.marketop == 'T')
+        ss << (const marketTrade &)obj;
+    return SendMessage(command, &(*ss.begin()), ss.size());
+}
+
+bool CZMQPublishMarketTradeNotifier::NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected)
+{
+    if (obj.marketop != 'T')
+        return true;
+    return SendMarketObj(MSG_MARKETTRADE, hashBlock, objid, obj, fConnected);
+}
+
+bool CZMQPublishMarketVoteNotifier::NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected)
+{
+    if (obj.marketop != 'S' && obj.marketop != 'R' && obj.marketop != 'L')
+        return true;
+    return SendMarketObj(MSG_MARKETVOTE, hashBlock, objid, obj, fConnected);
+}
+
+bool CZMQPublishMarketOutcomeNotifier::NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected)
+{
+    if (obj.marketop != 'O')
+        return true;
+    return SendMarketObj(MSG_MARKETOUTCOME, hashBlock, objid, obj, fConnected);
+}
+
+bool CZMQPublishMarketCreatedNotifier::NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected)
+{
+    if (obj.marketop != 'B' && obj.marketop != 'D' && obj.marketop != 'M')
+        return true;
+    return SendMarketObj(MSG_MARKETCREATED, hashBlock, objid, obj, fConnected);
+}
@@ -15,6 +15,7 @@ private:
     uint32_t nSequence; //!< upcounting per message sequence number
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0U) { }
 
     /* send zmq multipart message
        parts:
@@ -52,4 +53,44 @@ public:
     bool NotifyTransaction(const CTransaction &transaction) override;
 };
 
+class CZMQAbstractPublishMarketNotifier : public CZMQAbstractPublishNotifier
+{
+protected:
+    /* send a market object as
+          * block hash (32 bytes, as hashblock)
+          * object id (32 bytes, as hashblock)
+          * 1 if connected, 0 if disconnected (1 byte)
+          * the object, serialized as in its market script
+    */
+    bool SendMarketObj(const char *command, const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected);
+};
+
+/** Trades */
+class CZMQPublishMarketTradeNotifier : public CZMQAbstractPublishMarketNotifier
+{
+public:
+    bool NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected) override;
+};
+
+/** Sealed, revealed and stolen votes */
+class CZMQPublishMarketVoteNotifier : public CZMQAbstractPublishMarketNotifier
+{
+public:
+    bool NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected) override;
+};
+
+/** Outcomes */
+class CZMQPublishMarketOutcomeNotifier : public CZMQAbstractPublishMarketNotifier
+{
+public:
+    bool NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected) override;
+};
+
+/** New branches, decisions and markets */
+class CZMQPublishMarketCreatedNotifier : public CZMQAbstractPublishMarketNotifier
+{
+public:
+    bool NotifyMarketObj(const uint256 &hashBlock, const uint256 &objid, const marketObj &obj, bool fConnected) override;
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H